@@ -518,10 +518,17 @@ p11_attr_hash (const void *data)
 	uint32_t hash = 0;
 
 	if (attr != NULL) {
+#ifdef WITH_DICT_HASH_MURMUR3
 		p11_hash_murmur3 (&hash,
 		                  &attr->type, sizeof (attr->type),
 		                  attr->pValue, (size_t)attr->ulValueLen,
 		                  NULL);
+#else
+		/* The attribute type seeds the hash of the value */
+		hash = (uint32_t)p11_hash_xxh3 (attr->pValue,
+		                                attr->pValue ? (size_t)attr->ulValueLen : 0,
+		                                attr->type);
+#endif
 	}
 
 	return hash;
@@ -733,6 +740,7 @@ attribute_is_sensitive (const CK_ATTRIBUTE *attr,
 	X (CKA_X_PEER)
 	X (CKA_X_DISTRUSTED)
 	X (CKA_X_CRITICAL)
+	X (CKA_X_CERT_SHA256_HASH)
 	X (CKA_PUBLIC_KEY_INFO)
 	X (CKA_NSS_URL)
 	X (CKA_NSS_EMAIL)
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2026, Red Hat Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "config.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dict.h"
+#include "hash.h"
+#include "pkcs11.h"
+
+/*
+ * Compares the hash functions, and times the hash tables with keys like
+ * the ones the modules keep. Not run as part of the tests, as the numbers
+ * are only useful when compared with other runs on the same machine.
+ */
+
+#define HASH_ROUNDS 200000
+
+static void
+fill_input (unsigned char *input,
+            size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		input[i] = ((i * 131 + 17) >> 3) & 0xff;
+}
+
+static void
+bench_hash (const char *label,
+            const unsigned char *input,
+            size_t length)
+{
+	uint64_t start, murmur3, xxh3;
+	uint64_t sink = 0;
+	uint32_t hash;
+	int i;
+
+	start = p11_test_time_usec ();
+	for (i = 0; i < HASH_ROUNDS; i++) {
+		p11_hash_murmur3 (&hash, input, length, NULL);
+		sink += hash;
+	}
+	murmur3 = p11_test_time_usec () - start;
+
+	start = p11_test_time_usec ();
+	for (i = 0; i < HASH_ROUNDS; i++)
+		sink += p11_hash_xxh3 (input, length, 0);
+	xxh3 = p11_test_time_usec () - start;
+
+	printf ("%s: murmur3 %llu usec, xxh3 %llu usec (%d rounds, %llx)\n",
+	        label, (unsigned long long)murmur3, (unsigned long long)xxh3,
+	        HASH_ROUNDS, (unsigned long long)(sink & 0xf));
+}
+
+/* Each run inserts this many keys in total, over several rounds */
+#define DICT_KEYS 1000000
+
+static uint64_t
+bench_ulongs (unsigned long count)
+{
+	unsigned long *keys;
+	p11_dict *map;
+	p11_dictiter iter;
+	uint64_t start;
+	unsigned long i;
+	unsigned long round;
+
+	keys = calloc (count, sizeof (unsigned long));
+	assert (keys != NULL);
+
+	/* Handles are allocated sequentially, like p11_module_next_id() */
+	for (i = 0; i < count; i++)
+		keys[i] = 0x80000000UL + i;
+
+	start = p11_test_time_usec ();
+	for (round = 0; round < DICT_KEYS / count; round++) {
+		map = p11_dict_new (p11_dict_ulongptr_hash, p11_dict_ulongptr_equal, NULL, NULL);
+		for (i = 0; i < count; i++)
+			p11_dict_set (map, keys + i, keys + i);
+		for (i = 0; i < count * 4; i++)
+			assert (p11_dict_get (map, keys + ((i * 7919) % count)) != NULL);
+		p11_dict_iterate (map, &iter);
+		while (p11_dict_next (&iter, NULL, NULL));
+		for (i = 0; i < count; i++)
+			p11_dict_remove (map, keys + i);
+		p11_dict_free (map);
+	}
+
+	free (keys);
+	return p11_test_time_usec () - start;
+}
+
+static uint64_t
+bench_strings (unsigned long count)
+{
+	char **keys;
+	p11_dict *map;
+	p11_dictiter iter;
+	uint64_t start;
+	unsigned long i;
+	unsigned long round;
+
+	keys = calloc (count, sizeof (char *));
+	assert (keys != NULL);
+
+	/* Like the file paths that the trust module loads */
+	for (i = 0; i < count; i++) {
+		keys[i] = malloc (64);
+		assert (keys[i] != NULL);
+		snprintf (keys[i], 64, "/usr/share/ca-certificates/trust-source/anchor-%lu.pem", i);
+	}
+
+	start = p11_test_time_usec ();
+	for (round = 0; round < DICT_KEYS / count; round++) {
+		map = p11_dict_new (p11_dict_str_hash, p11_dict_str_equal, NULL, NULL);
+		for (i = 0; i < count; i++)
+			p11_dict_set (map, keys[i], keys[i]);
+		for (i = 0; i < count * 4; i++)
+			assert (p11_dict_get (map, keys[(i * 7919) % count]) != NULL);
+		p11_dict_iterate (map, &iter);
+		while (p11_dict_next (&iter, NULL, NULL));
+		p11_dict_free (map);
+	}
+
+	for (i = 0; i < count; i++)
+		free (keys[i]);
+	free (keys);
+	return p11_test_time_usec () - start;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	unsigned char input[1536];
+	CK_ULONG ulong = 0x80000001UL;
+
+	if (argc != 1) {
+		fprintf (stderr, "usage: bench-hash\n");
+		return 2;
+	}
+
+	fill_input (input, sizeof (input));
+
+	bench_hash ("CK_ULONG", (unsigned char *)&ulong, sizeof (ulong));
+	bench_hash ("20 byte id", input, 20);
+	bench_hash ("1536 byte value", input, sizeof (input));
+
+	printf ("sessions (64 ulong keys): %llu usec\n",
+	        (unsigned long long)bench_ulongs (64));
+	printf ("objects (50000 ulong keys): %llu usec\n",
+	        (unsigned long long)bench_ulongs (50000));
+	printf ("loaded files (5000 string keys): %llu usec\n",
+	        (unsigned long long)bench_strings (5000));
+	return 0;
+}
@@ -206,6 +206,7 @@ const p11_constant p11_constant_types[] = {
 	CT (CKA_X_PEER, "x-peer")
 	CT (CKA_X_DISTRUSTED, "x-distrusted")
 	CT (CKA_X_CRITICAL, "x-critical")
+	CT (CKA_X_CERT_SHA256_HASH, "x-cert-sha256-hash")
 	{ CKA_INVALID },
 };
 
@@ -44,106 +44,171 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * The dict is an open addressing hash table with linear probing, stored
+ * in a single array of slots. Each slot holds the key's hash and a
+ * control byte, which is either EMPTY, DELETED, or FULL. Probing only
+ * calls the equal function when the hash matches, and stops at the first
+ * EMPTY slot. The control byte fits in the padding after the hash, so
+ * probing doesn't need to look anywhere other than the slot itself.
+ *
+ * Removing an entry leaves a DELETED slot behind, so that removing the
+ * current entry while iterating doesn't move any other entries. The
+ * DELETED slots are dropped the next time the table is rehashed.
+ */
+
+#define CTRL_EMPTY      0
+#define CTRL_DELETED    1
+#define CTRL_FULL       2
+
+#define MIN_SLOTS       9
+
+typedef struct _p11_dictbucket {
+	void *key;
+	void *value;
+	unsigned int hashed;
+	unsigned char ctrl;
+} dictbucket;
+
 struct _p11_dict {
 	p11_dict_hasher hash_func;
 	p11_dict_equals equal_func;
 	p11_destroyer key_destroy_func;
 	p11_destroyer value_destroy_func;
 
-	struct _p11_dictbucket **buckets;
+	dictbucket *slots;
 	unsigned int num_items;
-	unsigned int num_buckets;
+	unsigned int num_deleted;
+	unsigned int num_slots;
 };
 
-typedef struct _p11_dictbucket {
-	void *key;
-	unsigned int hashed;
-	void *value;
-	struct _p11_dictbucket *next;
-} dictbucket;
-
-static dictbucket *
-next_entry (p11_dictiter *iter)
+/*
+ * Many of the hash functions just return the key itself. An odd number
+ * of slots spreads out aligned pointers, while sequential handles stay
+ * in neighbouring slots in the order they were allocated.
+ */
+static inline unsigned int
+first_slot (p11_dict *dict,
+            unsigned int hash)
 {
-	dictbucket *bucket = iter->next;
-	while (!bucket) {
-		if (iter->index >= iter->dict->num_buckets)
-			return NULL;
-		bucket = iter->dict->buckets[iter->index++];
-	}
-	iter->next = bucket->next;
-	return bucket;
+	return hash % dict->num_slots;
 }
 
+static inline unsigned int
+next_slot (p11_dict *dict,
+           unsigned int i)
+{
+	return (i + 1 == dict->num_slots) ? 0 : i + 1;
+}
 
-bool
-p11_dict_next (p11_dictiter *iter,
-               void **key,
-               void **value)
+/* Keep at least a quarter of the slots EMPTY so that probes stay short */
+static inline unsigned int
+max_load (unsigned int num_slots)
 {
-	dictbucket *bucket = next_entry (iter);
-	if (bucket == NULL)
-		return false;
-	if (key)
-		*key = bucket->key;
-	if (value)
-		*value = bucket->value;
-	return true;
+	return num_slots - (num_slots / 4);
 }
 
-void
-p11_dict_iterate (p11_dict *dict,
-                  p11_dictiter *iter)
+static unsigned int
+find_slot (p11_dict *dict,
+           const void *key,
+           unsigned int hash,
+           bool *found)
 {
-	iter->dict = dict;
-	iter->index = 0;
-	iter->next = NULL;
+	unsigned int insert = dict->num_slots;
+	dictbucket *slot;
+	unsigned int i;
+
+	for (i = first_slot (dict, hash); ; i = next_slot (dict, i)) {
+		slot = dict->slots + i;
+		if (slot->ctrl == CTRL_FULL) {
+			if (slot->hashed == hash && dict->equal_func (slot->key, key)) {
+				*found = true;
+				return i;
+			}
+
+		} else if (slot->ctrl == CTRL_DELETED) {
+			if (insert == dict->num_slots)
+				insert = i;
+
+		} else {
+			*found = false;
+			return insert == dict->num_slots ? i : insert;
+		}
+	}
 }
 
-static dictbucket **
-lookup_or_create_bucket (p11_dict *dict,
-                         const void *key,
-                         bool create)
+static bool
+rehash (p11_dict *dict,
+        unsigned int num_slots)
 {
-	dictbucket **bucketp;
-	unsigned int hash;
+	dictbucket *old_slots;
+	unsigned int old_num;
+	unsigned int i, j;
 
-	/* Perform the hashing */
-	hash = dict->hash_func (key);
+	old_slots = dict->slots;
+	old_num = dict->num_slots;
+
+	dict->slots = calloc (num_slots, sizeof (dictbucket));
+	if (dict->slots == NULL) {
+		dict->slots = old_slots;
+		return false;
+	}
+
+	dict->num_slots = num_slots;
+	dict->num_deleted = 0;
 
-	/* scan linked list */
-	for (bucketp = &dict->buckets[hash % dict->num_buckets];
-	     *bucketp != NULL; bucketp = &(*bucketp)->next) {
-		if((*bucketp)->hashed == hash && dict->equal_func ((*bucketp)->key, key))
-			break;
+	for (i = 0; i < old_num; i++) {
+		if (old_slots[i].ctrl != CTRL_FULL)
+			continue;
+		for (j = first_slot (dict, old_slots[i].hashed);
+		     dict->slots[j].ctrl != CTRL_EMPTY; j = next_slot (dict, j));
+		dict->slots[j] = old_slots[i];
 	}
 
-	if ((*bucketp) != NULL || !create)
-		return bucketp;
+	free (old_slots);
+	return true;
+}
 
-	/* add a new entry for non-NULL val */
-	(*bucketp) = calloc (1, sizeof (dictbucket));
+bool
+p11_dict_next (p11_dictiter *iter,
+               void **key,
+               void **value)
+{
+	p11_dict *dict = iter->dict;
+	unsigned int i;
 
-	if (*bucketp != NULL) {
-		(*bucketp)->key = (void*)key;
-		(*bucketp)->hashed = hash;
-		dict->num_items++;
+	for (i = iter->index; i < dict->num_slots; i++) {
+		if (dict->slots[i].ctrl == CTRL_FULL) {
+			iter->index = i + 1;
+			if (key)
+				*key = dict->slots[i].key;
+			if (value)
+				*value = dict->slots[i].value;
+			return true;
+		}
 	}
 
-	return bucketp;
+	iter->index = i;
+	return false;
+}
+
+void
+p11_dict_iterate (p11_dict *dict,
+                  p11_dictiter *iter)
+{
+	iter->dict = dict;
+	iter->index = 0;
 }
 
 void *
 p11_dict_get (p11_dict *dict,
               const void *key)
 {
-	dictbucket **bucketp;
+	unsigned int i;
+	bool found;
 
-	bucketp = lookup_or_create_bucket (dict, key, false);
-	if (bucketp && *bucketp)
-		return (void*)((*bucketp)->value);
-	else
-		return NULL;
+	i = find_slot (dict, key, dict->hash_func (key), &found);
+	return found ? dict->slots[i].value : NULL;
 }
 
 bool
@@ -151,51 +216,62 @@ p11_dict_set (p11_dict *dict,
               void *key,
               void *val)
 {
-	dictbucket **bucketp;
-	p11_dictiter iter;
-	dictbucket *bucket;
-	dictbucket **new_buckets;
-	unsigned int num_buckets;
+	dictbucket *slot;
+	unsigned int num_slots;
+	unsigned int hash;
+	unsigned int i;
+	bool found;
+
+	hash = dict->hash_func (key);
+	i = find_slot (dict, key, hash, &found);
+	slot = dict->slots + i;
 
-	bucketp = lookup_or_create_bucket (dict, key, true);
-	if(bucketp && *bucketp) {
+	if (found) {
 
 		/* Destroy the previous key */
-		if ((*bucketp)->key && (*bucketp)->key != key && dict->key_destroy_func)
-			dict->key_destroy_func ((*bucketp)->key);
+		if (slot->key && slot->key != key && dict->key_destroy_func)
+			dict->key_destroy_func (slot->key);
 
 		/* Destroy the previous value */
-		if ((*bucketp)->value && (*bucketp)->value != val && dict->value_destroy_func)
-			dict->value_destroy_func ((*bucketp)->value);
+		if (slot->value && slot->value != val && dict->value_destroy_func)
+			dict->value_destroy_func (slot->value);
 
 		/* replace entry */
-		(*bucketp)->key = key;
-		(*bucketp)->value = val;
-
-		/* check that the collision rate isn't too high */
-		if (dict->num_items > dict->num_buckets) {
-			num_buckets = dict->num_buckets * 2 + 1;
-			new_buckets = (dictbucket **)calloc (num_buckets, sizeof (dictbucket *));
-
-			/* Ignore failures, maybe we can expand later */
-			if(new_buckets) {
-				p11_dict_iterate (dict, &iter);
-				while ((bucket = next_entry (&iter)) != NULL) {
-					unsigned int i = bucket->hashed % num_buckets;
-					bucket->next = new_buckets[i];
-					new_buckets[i] = bucket;
-				}
-
-				free (dict->buckets);
-				dict->buckets = new_buckets;
-				dict->num_buckets = num_buckets;
-			}
-		}
-
+		slot->key = key;
+		slot->value = val;
 		return true;
 	}
 
-	return_val_if_reached (false);
+	/* Reusing a DELETED slot doesn't use up any more of the table */
+	if (slot->ctrl == CTRL_EMPTY &&
+	    dict->num_items + dict->num_deleted + 1 > max_load (dict->num_slots)) {
+
+		/* Grow, unless it's mostly DELETED slots that are taking up space */
+		num_slots = dict->num_slots;
+		if (dict->num_items + 1 > num_slots / 2)
+			num_slots = num_slots * 2 + 1;
+
+		/*
+		 * Ignore failures, maybe we can expand later. But probes need
+		 * at least one EMPTY slot to stop at.
+		 */
+		if (rehash (dict, num_slots)) {
+			i = find_slot (dict, key, hash, &found);
+			slot = dict->slots + i;
+		} else if (dict->num_items + dict->num_deleted + 1 >= dict->num_slots) {
+			return_val_if_reached (false);
+		}
+	}
+
+	if (slot->ctrl == CTRL_DELETED)
+		dict->num_deleted--;
+
+	slot->key = key;
+	slot->value = val;
+	slot->hashed = hash;
+	slot->ctrl = CTRL_FULL;
+	dict->num_items++;
+	return true;
 }
 
 bool
@@ -204,23 +280,32 @@ p11_dict_steal (p11_dict *dict,
                 void **stolen_key,
                 void **stolen_value)
 {
-	dictbucket **bucketp;
-
-	bucketp = lookup_or_create_bucket (dict, key, false);
-	if (bucketp && *bucketp) {
-		dictbucket *old = *bucketp;
-		*bucketp = (*bucketp)->next;
-		--dict->num_items;
-		if (stolen_key)
-			*stolen_key = old->key;
-		if (stolen_value)
-			*stolen_value = old->value;
-		free (old);
-		return true;
-	}
+	dictbucket *slot;
+	unsigned int i;
+	bool found;
 
-	return false;
+	i = find_slot (dict, key, dict->hash_func (key), &found);
+	if (!found)
+		return false;
 
+	slot = dict->slots + i;
+	if (stolen_key)
+		*stolen_key = slot->key;
+	if (stolen_value)
+		*stolen_value = slot->value;
+
+	/* No probe continues past this slot if the next one is EMPTY */
+	if (dict->slots[next_slot (dict, i)].ctrl == CTRL_EMPTY) {
+		slot->ctrl = CTRL_EMPTY;
+	} else {
+		slot->ctrl = CTRL_DELETED;
+		dict->num_deleted++;
+	}
+
+	slot->key = NULL;
+	slot->value = NULL;
+	dict->num_items--;
+	return true;
 }
 
 bool
@@ -240,28 +325,29 @@ p11_dict_remove (p11_dict *dict,
 	return true;
 }
 
-void
-p11_dict_clear (p11_dict *dict)
+static void
+destroy_all (p11_dict *dict)
 {
-	dictbucket *bucket, *next;
 	unsigned int i;
 
-	/* Free all entries in the array */
-	for (i = 0; i < dict->num_buckets; ++i) {
-		bucket = dict->buckets[i];
-		while (bucket != NULL) {
-			next = bucket->next;
-			if (dict->key_destroy_func)
-				dict->key_destroy_func (bucket->key);
-			if (dict->value_destroy_func)
-				dict->value_destroy_func (bucket->value);
-			free (bucket);
-			bucket = next;
-		}
+	for (i = 0; i < dict->num_slots; i++) {
+		if (dict->slots[i].ctrl != CTRL_FULL)
+			continue;
+		if (dict->key_destroy_func)
+			dict->key_destroy_func (dict->slots[i].key);
+		if (dict->value_destroy_func)
+			dict->value_destroy_func (dict->slots[i].value);
 	}
+}
+
+void
+p11_dict_clear (p11_dict *dict)
+{
+	destroy_all (dict);
 
-	memset (dict->buckets, 0, dict->num_buckets * sizeof (dictbucket *));
+	memset (dict->slots, 0, dict->num_slots * sizeof (dictbucket));
 	dict->num_items = 0;
+	dict->num_deleted = 0;
 }
 
 p11_dict *
@@ -282,14 +368,15 @@ p11_dict_new (p11_dict_hasher hash_func,
 		dict->key_destroy_func = key_destroy_func;
 		dict->value_destroy_func = value_destroy_func;
 
-		dict->num_buckets = 9;
-		dict->buckets = (dictbucket **)calloc (dict->num_buckets, sizeof (dictbucket *));
-		if (!dict->buckets) {
+		dict->num_slots = MIN_SLOTS;
+		dict->slots = calloc (dict->num_slots, sizeof (dictbucket));
+		if (!dict->slots) {
 			free (dict);
 			return NULL;
 		}
 
 		dict->num_items = 0;
+		dict->num_deleted = 0;
 	}
 
 	return dict;
@@ -298,24 +385,12 @@ p11_dict_new (p11_dict_hasher hash_func,
 void
 p11_dict_free (p11_dict *dict)
 {
-	dictbucket *bucket;
-	p11_dictiter iter;
-
 	if (!dict)
 		return;
 
-	p11_dict_iterate (dict, &iter);
-	while ((bucket = next_entry (&iter)) != NULL) {
-		if (dict->key_destroy_func)
-			dict->key_destroy_func (bucket->key);
-		if (dict->value_destroy_func)
-			dict->value_destroy_func (bucket->value);
-		free (bucket);
-	}
-
-	if (dict->buckets)
-		free (dict->buckets);
+	destroy_all (dict);
 
+	free (dict->slots);
 	free (dict);
 }
 
@@ -328,9 +403,13 @@ p11_dict_size (p11_dict *dict)
 unsigned int
 p11_dict_str_hash (const void *string)
 {
+#ifdef WITH_DICT_HASH_MURMUR3
 	uint32_t hash;
 	p11_hash_murmur3 (&hash, string, strlen (string), NULL);
 	return hash;
+#else
+	return (unsigned int)p11_hash_xxh3 (string, strlen (string), 0);
+#endif
 }
 
 bool
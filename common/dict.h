@@ -58,7 +58,6 @@ typedef struct _p11_dict p11_dict;
 /* Type for scanning hash tables.  */
 typedef struct _p11_dictiter {
 	p11_dict *dict;
-	struct _p11_dictbucket *next;
 	unsigned int index;
 } p11_dictiter;
 
@@ -108,6 +107,7 @@ void*               p11_dict_get               (p11_dict *dict,
 /*
  *  p11_dict_set: Set a value in the hash table
  * - returns true if the entry was added properly
+ * - if the table can't grow, the entry is still added while there is room
  */
 bool                p11_dict_set               (p11_dict *dict,
                                                 void *key,
@@ -172,3 +172,360 @@ p11_hash_murmur3 (void *hash,
 	assert (sizeof (h1) == P11_HASH_MURMUR3_LEN);
 	memcpy (hash, &h1, sizeof (h1));
 }
+
+/* This code follows the 64 bit XXH3 hash from Yann Collet's xxHash:
+ * https://github.com/Cyan4973/xxHash
+ *
+ * Values are identical to XXH3_64bits_withSeed(). Inputs longer than 240
+ * bytes are consumed in 64 byte stripes, using SSE2 where available.
+ */
+
+#define XXH_PRIME32_1   0x9E3779B1U
+#define XXH_PRIME32_2   0x85EBCA77U
+#define XXH_PRIME32_3   0xC2B2AE3DU
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1   0x165667919E3779F9ULL
+#define XXH_PRIME_MX2   0x9FB21C651E98DF25ULL
+
+#define XXH_SECRET_SIZE        192
+#define XXH_STRIPE_LEN         64
+#define XXH_STRIPES_PER_BLOCK  ((XXH_SECRET_SIZE - XXH_STRIPE_LEN) / 8)
+#define XXH_BLOCK_LEN          (XXH_STRIPE_LEN * XXH_STRIPES_PER_BLOCK)
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define WITH_XXH3_SSE2 1
+#endif
+
+static const uint8_t xxh3_secret[XXH_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+	0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+	0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+	0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+	0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+	0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+	0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+	0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+	0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+/*
+ * The compiler turns these into single loads on little endian machines
+ */
+
+GNUC_INLINE static inline uint32_t
+read32 (const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+GNUC_INLINE static inline uint64_t
+read64 (const uint8_t *p)
+{
+	return (uint64_t)read32 (p) | (uint64_t)read32 (p + 4) << 32;
+}
+
+GNUC_INLINE static inline void
+write64 (uint8_t *p,
+         uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (i * 8));
+}
+
+GNUC_INLINE static inline uint64_t
+rotl64 (uint64_t x,
+        int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+GNUC_INLINE static inline uint64_t
+swap64 (uint64_t x)
+{
+	x = ((x << 8) & 0xff00ff00ff00ff00ULL) | ((x >> 8) & 0x00ff00ff00ff00ffULL);
+	x = ((x << 16) & 0xffff0000ffff0000ULL) | ((x >> 16) & 0x0000ffff0000ffffULL);
+	return (x << 32) | (x >> 32);
+}
+
+GNUC_INLINE static inline uint64_t
+mul128_fold64 (uint64_t lhs,
+               uint64_t rhs)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t)lhs * rhs;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+	uint64_t lo_lo = (lhs & 0xffffffff) * (rhs & 0xffffffff);
+	uint64_t hi_lo = (lhs >> 32) * (rhs & 0xffffffff);
+	uint64_t lo_hi = (lhs & 0xffffffff) * (rhs >> 32);
+	uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+	uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	uint64_t lower = (cross << 32) | (lo_lo & 0xffffffff);
+	return lower ^ upper;
+#endif
+}
+
+GNUC_INLINE static inline uint64_t
+xxh64_avalanche (uint64_t h)
+{
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+GNUC_INLINE static inline uint64_t
+xxh3_avalanche (uint64_t h)
+{
+	h ^= h >> 37;
+	h *= XXH_PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+}
+
+GNUC_INLINE static inline uint64_t
+xxh3_rrmxmx (uint64_t h,
+             uint64_t len)
+{
+	h ^= rotl64 (h, 49) ^ rotl64 (h, 24);
+	h *= XXH_PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= XXH_PRIME_MX2;
+	return h ^ (h >> 28);
+}
+
+GNUC_INLINE static inline uint64_t
+xxh3_mix16 (const uint8_t *input,
+            const uint8_t *secret,
+            uint64_t seed)
+{
+	return mul128_fold64 (read64 (input) ^ (read64 (secret) + seed),
+	                      read64 (input + 8) ^ (read64 (secret + 8) - seed));
+}
+
+static uint64_t
+xxh3_len_0to16 (const uint8_t *input,
+                size_t len,
+                uint64_t seed)
+{
+	const uint8_t *secret = xxh3_secret;
+	uint64_t lo, hi;
+	uint32_t combined;
+
+	if (len > 8) {
+		lo = read64 (input) ^ ((read64 (secret + 24) ^ read64 (secret + 32)) + seed);
+		hi = read64 (input + len - 8) ^ ((read64 (secret + 40) ^ read64 (secret + 48)) - seed);
+		return xxh3_avalanche (len + swap64 (lo) + hi + mul128_fold64 (lo, hi));
+
+	} else if (len >= 4) {
+		seed ^= swap64 (seed & 0xffffffff);
+		lo = read32 (input + len - 4) + ((uint64_t)read32 (input) << 32);
+		hi = (read64 (secret + 8) ^ read64 (secret + 16)) - seed;
+		return xxh3_rrmxmx (lo ^ hi, len);
+
+	} else if (len > 0) {
+		combined = ((uint32_t)input[0] << 16) | ((uint32_t)input[len >> 1] << 24) |
+		           ((uint32_t)input[len - 1]) | ((uint32_t)len << 8);
+		hi = (read32 (secret) ^ read32 (secret + 4)) + seed;
+		return xxh64_avalanche ((uint64_t)combined ^ hi);
+
+	} else {
+		return xxh64_avalanche (seed ^ read64 (secret + 56) ^ read64 (secret + 64));
+	}
+}
+
+static uint64_t
+xxh3_len_17to240 (const uint8_t *input,
+                  size_t len,
+                  uint64_t seed)
+{
+	const uint8_t *secret = xxh3_secret;
+	uint64_t acc = len * XXH_PRIME64_1;
+	size_t rounds;
+	size_t i;
+
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += xxh3_mix16 (input + 48, secret + 96, seed);
+					acc += xxh3_mix16 (input + len - 64, secret + 112, seed);
+				}
+				acc += xxh3_mix16 (input + 32, secret + 64, seed);
+				acc += xxh3_mix16 (input + len - 48, secret + 80, seed);
+			}
+			acc += xxh3_mix16 (input + 16, secret + 32, seed);
+			acc += xxh3_mix16 (input + len - 32, secret + 48, seed);
+		}
+		acc += xxh3_mix16 (input, secret, seed);
+		acc += xxh3_mix16 (input + len - 16, secret + 16, seed);
+		return xxh3_avalanche (acc);
+	}
+
+	rounds = len / 16;
+	for (i = 0; i < 8; i++)
+		acc += xxh3_mix16 (input + 16 * i, secret + 16 * i, seed);
+	acc = xxh3_avalanche (acc);
+	for (i = 8; i < rounds; i++)
+		acc += xxh3_mix16 (input + 16 * i, secret + 16 * (i - 8) + 3, seed);
+	acc += xxh3_mix16 (input + len - 16, secret + 136 - 17, seed);
+	return xxh3_avalanche (acc);
+}
+
+/*
+ * Mix one 64 byte stripe into the eight accumulators
+ */
+
+static inline void
+xxh3_accumulate_512 (uint64_t *acc,
+                     const uint8_t *input,
+                     const uint8_t *secret)
+{
+#ifdef WITH_XXH3_SSE2
+	__m128i *xacc = (__m128i *)acc;
+	__m128i data, key, mixed, product;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		data = _mm_loadu_si128 ((const __m128i *)(input + 16 * i));
+		key = _mm_loadu_si128 ((const __m128i *)(secret + 16 * i));
+		mixed = _mm_xor_si128 (data, key);
+		product = _mm_mul_epu32 (mixed, _mm_shuffle_epi32 (mixed, _MM_SHUFFLE (0, 3, 0, 1)));
+		data = _mm_shuffle_epi32 (data, _MM_SHUFFLE (1, 0, 3, 2));
+		_mm_storeu_si128 (xacc + i, _mm_add_epi64 (product,
+		                  _mm_add_epi64 (_mm_loadu_si128 (xacc + i), data)));
+	}
+#else
+	uint64_t data, key;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		data = read64 (input + 8 * i);
+		key = data ^ read64 (secret + 8 * i);
+		acc[i ^ 1] += data;
+		acc[i] += (key & 0xffffffff) * (key >> 32);
+	}
+#endif
+}
+
+static inline void
+xxh3_scramble (uint64_t *acc,
+               const uint8_t *secret)
+{
+#ifdef WITH_XXH3_SSE2
+	__m128i *xacc = (__m128i *)acc;
+	const __m128i prime = _mm_set1_epi32 ((int)XXH_PRIME32_1);
+	__m128i value, lo, hi;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		value = _mm_loadu_si128 (xacc + i);
+		value = _mm_xor_si128 (value, _mm_srli_epi64 (value, 47));
+		value = _mm_xor_si128 (value, _mm_loadu_si128 ((const __m128i *)(secret + 16 * i)));
+		lo = _mm_mul_epu32 (value, prime);
+		hi = _mm_mul_epu32 (_mm_shuffle_epi32 (value, _MM_SHUFFLE (0, 3, 0, 1)), prime);
+		_mm_storeu_si128 (xacc + i, _mm_add_epi64 (lo, _mm_slli_epi64 (hi, 32)));
+	}
+#else
+	uint64_t value;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		value = acc[i];
+		value ^= value >> 47;
+		value ^= read64 (secret + 8 * i);
+		acc[i] = value * XXH_PRIME32_1;
+	}
+#endif
+}
+
+static uint64_t
+xxh3_len_long (const uint8_t *input,
+               size_t len,
+               uint64_t seed)
+{
+	uint64_t acc[8] = {
+		XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+		XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1,
+	};
+	uint8_t custom[XXH_SECRET_SIZE];
+	const uint8_t *secret;
+	size_t blocks;
+	size_t stripes;
+	uint64_t result;
+	size_t n, i;
+
+	/* A seed is folded into a derived copy of the secret */
+	if (seed == 0) {
+		secret = xxh3_secret;
+	} else {
+		for (i = 0; i < XXH_SECRET_SIZE; i += 16) {
+			write64 (custom + i, read64 (xxh3_secret + i) + seed);
+			write64 (custom + i + 8, read64 (xxh3_secret + i + 8) - seed);
+		}
+		secret = custom;
+	}
+
+	blocks = (len - 1) / XXH_BLOCK_LEN;
+	for (n = 0; n < blocks; n++) {
+		for (i = 0; i < XXH_STRIPES_PER_BLOCK; i++) {
+			xxh3_accumulate_512 (acc, input + n * XXH_BLOCK_LEN + i * XXH_STRIPE_LEN,
+			                     secret + i * 8);
+		}
+		xxh3_scramble (acc, secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+	}
+
+	stripes = ((len - 1) - blocks * XXH_BLOCK_LEN) / XXH_STRIPE_LEN;
+	for (i = 0; i < stripes; i++) {
+		xxh3_accumulate_512 (acc, input + blocks * XXH_BLOCK_LEN + i * XXH_STRIPE_LEN,
+		                     secret + i * 8);
+	}
+	xxh3_accumulate_512 (acc, input + len - XXH_STRIPE_LEN,
+	                     secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7);
+
+	result = len * XXH_PRIME64_1;
+	for (i = 0; i < 4; i++) {
+		result += mul128_fold64 (acc[2 * i] ^ read64 (secret + 11 + 16 * i),
+		                         acc[2 * i + 1] ^ read64 (secret + 11 + 16 * i + 8));
+	}
+	return xxh3_avalanche (result);
+}
+
+uint64_t
+p11_hash_xxh3 (const void *input,
+               size_t len,
+               uint64_t seed)
+{
+	if (len <= 16)
+		return xxh3_len_0to16 (input, len, seed);
+	else if (len <= 240)
+		return xxh3_len_17to240 (input, len, seed);
+	else
+		return xxh3_len_long (input, len, seed);
+}
@@ -37,11 +37,23 @@
 
 #include "compat.h"
 
+#include <stdint.h>
+
 #define P11_HASH_MURMUR3_LEN 4
 
+#define P11_HASH_XXH3_LEN 8
+
 void     p11_hash_murmur3   (void *hash,
                              const void *input,
                              size_t length,
                              ...) GNUC_NULL_TERMINATED;
 
+/*
+ * Used for p11_dict keys and attribute lookups unless the build selects
+ * murmur3 with --with-dict-hash, which keeps hash values stable.
+ */
+uint64_t p11_hash_xxh3      (const void *input,
+                             size_t length,
+                             uint64_t seed);
+
 #endif /* P11_HASH_H_ */
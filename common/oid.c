@@ -65,12 +65,18 @@ p11_oid_simple (const unsigned char *oid,
 unsigned int
 p11_oid_hash (const void *oid)
 {
+#ifdef WITH_DICT_HASH_MURMUR3
 	uint32_t hash;
+#endif
 	int len;
 
 	len = p11_oid_length (oid);
+#ifdef WITH_DICT_HASH_MURMUR3
 	p11_hash_murmur3 (&hash, oid, len, NULL);
 	return hash;
+#else
+	return (unsigned int)p11_hash_xxh3 (oid, len, 0);
+#endif
 }
 
 bool
@@ -138,6 +138,15 @@ typedef CK_ULONG                        CK_TRUST;
 
 #define CKO_X_CERTIFICATE_EXTENSION                  (CKO_X_VENDOR + 200)
 
+/* -------------------------------------------------------------------
+ * FINGERPRINTS
+ *
+ * The SHA-256 digest of a certificate's DER encoding. This is indexed
+ * so certificates can be looked up by fingerprint.
+ */
+
+#define CKA_X_CERT_SHA256_HASH                       (CKA_X_VENDOR + 300)
+
 /* From the 2.40 draft */
 #ifndef CKA_PUBLIC_KEY_INFO
 #define CKA_PUBLIC_KEY_INFO                          0x00000129UL
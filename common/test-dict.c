@@ -474,6 +474,42 @@ test_hash_count (void)
 	p11_dict_free (map);
 }
 
+static void
+test_hash_churn (void)
+{
+	p11_dict *map;
+	unsigned long *value;
+	unsigned long key;
+	unsigned long i;
+
+	map = p11_dict_new (p11_dict_ulongptr_hash, p11_dict_ulongptr_equal, NULL, free);
+
+	/* Keep a handful of items, while removed slots pile up behind them */
+	for (i = 0; i < 20000; ++i) {
+		value = malloc (sizeof (unsigned long));
+		assert (value != NULL);
+		*value = i;
+		if (!p11_dict_set (map, value, value))
+			assert_not_reached ();
+		if (i >= 10) {
+			key = i - 10;
+			if (!p11_dict_remove (map, &key))
+				assert_not_reached ();
+		}
+		assert_num_eq (i < 10 ? i + 1 : 10, p11_dict_size (map));
+	}
+
+	for (i = 0; i < 20000; ++i) {
+		value = p11_dict_get (map, &i);
+		if (i < 19990)
+			assert_ptr_eq (NULL, value);
+		else
+			assert_num_eq (i, *value);
+	}
+
+	p11_dict_free (map);
+}
+
 static void
 test_hash_ulongptr (void)
 {
@@ -518,5 +554,6 @@ main (int argc,
 	p11_test (test_hash_add_check_lots_and_collisions, "/dict/add-check-lots-and-collisions");
 	p11_test (test_hash_count, "/dict/count");
 	p11_test (test_hash_ulongptr, "/dict/ulongptr");
+	p11_test (test_hash_churn, "/dict/churn");
 	return p11_test_run (argc, argv);
 }
@@ -96,11 +96,104 @@ test_murmur3_incr (void)
 	assert_num_eq (first, second);
 }
 
+static void
+fill_input (unsigned char *input,
+            size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		input[i] = ((i * 131 + 17) >> 3) & 0xff;
+}
+
+static void
+test_xxh3 (void)
+{
+	/* Reference values from the xxHash library, XXH3_64bits_withSeed() */
+	struct {
+		size_t length;
+		uint64_t seed;
+		uint64_t hash;
+	} fixtures[] = {
+		{    0, 0x0ULL, 0x2d06800538d394c2ULL },
+		{    1, 0x0ULL, 0xc9f42e6c9e93dfffULL },
+		{    3, 0x0ULL, 0x839db353356f2e22ULL },
+		{    4, 0x0ULL, 0x558aeadc340c1c27ULL },
+		{    8, 0x0ULL, 0x1da051411f1ce442ULL },
+		{    9, 0x0ULL, 0x3f3f23374eedb939ULL },
+		{   16, 0x0ULL, 0x3861404f7196d6e2ULL },
+		{   17, 0x0ULL, 0x95af1dc28b8fd717ULL },
+		{   64, 0x0ULL, 0x214632c8ae44979fULL },
+		{   96, 0x0ULL, 0x1f1971303877cfd9ULL },
+		{  128, 0x0ULL, 0xcd687fe5d250b43cULL },
+		{  129, 0x0ULL, 0x5a8c58b76222d568ULL },
+		{  200, 0x0ULL, 0x7ca68e2f5c55177cULL },
+		{  240, 0x0ULL, 0x81a2a43c357e85d3ULL },
+		{  241, 0x0ULL, 0x179af252ea15f774ULL },
+		{ 1024, 0x0ULL, 0x9c7da7831f79dae3ULL },
+		{ 1025, 0x0ULL, 0x9e382fbb4824728fULL },
+		{ 2048, 0x0ULL, 0x6af6845f1a7224f3ULL },
+		{ 4096, 0x0ULL, 0x20393eaf8cca2773ULL },
+		{    0, 0x165667b1ULL, 0xd567417c05c9d34bULL },
+		{    1, 0x165667b1ULL, 0x12788b0b8ad30f89ULL },
+		{    3, 0x165667b1ULL, 0x21a495e5dd970ba3ULL },
+		{    4, 0x165667b1ULL, 0x2e7c8b54d6ae0064ULL },
+		{    8, 0x165667b1ULL, 0x8e1d81a11f34b5ddULL },
+		{    9, 0x165667b1ULL, 0x0a692347ab7d6a21ULL },
+		{   16, 0x165667b1ULL, 0xe2349e971f42ea8fULL },
+		{   17, 0x165667b1ULL, 0x56bede71f699fae4ULL },
+		{   64, 0x165667b1ULL, 0x181b27bf3051eecbULL },
+		{   96, 0x165667b1ULL, 0xdc435331c70987c2ULL },
+		{  128, 0x165667b1ULL, 0xfdbdab54181736a5ULL },
+		{  129, 0x165667b1ULL, 0x8ee6cdfbfc64fff3ULL },
+		{  200, 0x165667b1ULL, 0x6442ff996e6a4154ULL },
+		{  240, 0x165667b1ULL, 0xf4f25892413c24b8ULL },
+		{  241, 0x165667b1ULL, 0x95308674b302a629ULL },
+		{ 1024, 0x165667b1ULL, 0x20733555bd6b5611ULL },
+		{ 1025, 0x165667b1ULL, 0xcf260600dc982bebULL },
+		{ 2048, 0x165667b1ULL, 0x3015d715bf312be5ULL },
+		{ 4096, 0x165667b1ULL, 0x9c586db503cc6724ULL },
+	};
+
+	unsigned char input[4096];
+	uint64_t hash;
+	size_t i;
+
+	assert (sizeof (hash) == P11_HASH_XXH3_LEN);
+
+	fill_input (input, sizeof (input));
+
+	for (i = 0; i < sizeof (fixtures) / sizeof (fixtures[0]); i++) {
+		hash = p11_hash_xxh3 (input, fixtures[i].length, fixtures[i].seed);
+		assert_num_eq (fixtures[i].hash, hash);
+	}
+}
+
+static void
+test_xxh3_unaligned (void)
+{
+	unsigned char input[2048 + 8];
+	uint64_t aligned;
+	uint64_t hash;
+	int offset;
+
+	fill_input (input + 8, 2048);
+	aligned = p11_hash_xxh3 (input + 8, 2048, 0);
+
+	for (offset = 1; offset < 8; offset++) {
+		fill_input (input + offset, 2048);
+		hash = p11_hash_xxh3 (input + offset, 2048, 0);
+		assert_num_eq (aligned, hash);
+	}
+}
+
 int
 main (int argc,
       char *argv[])
 {
 	p11_test (test_murmur3, "/hash/murmur3");
 	p11_test (test_murmur3_incr, "/hash/murmur3-incr");
+	p11_test (test_xxh3, "/hash/xxh3");
+	p11_test (test_xxh3_unaligned, "/hash/xxh3-unaligned");
 	return p11_test_run (argc, argv);
 }
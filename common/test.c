@@ -49,6 +49,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef OS_UNIX
@@ -319,7 +320,8 @@ p11_test_run (int argc,
 	test_item *next;
 	int count;
 	int ret = 0;
-	int setup;
+	/* Changed between setjmp() and longjmp(), so not kept in a register */
+	volatile int setup;
 	int opt;
 
 	/* p11-kit specific stuff */
@@ -550,6 +552,29 @@ p11_test_directory_delete (const char *directory)
 }
 
 
+uint64_t
+p11_test_time_usec (void)
+{
+#ifdef OS_UNIX
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		assert_not_reached ();
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+#else /* OS_WIN32 */
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	QueryPerformanceFrequency (&frequency);
+	QueryPerformanceCounter (&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+	       (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+
+#endif /* OS_WIN32 */
+}
+
+
 #ifdef OS_UNIX
 
 static void
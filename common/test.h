@@ -37,8 +37,11 @@
 #ifndef P11_TEST_H_
 #define P11_TEST_H_
 
+#include <stdint.h>
+
 #ifndef P11_TEST_SOURCE
 
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef assert_not_reached
@@ -170,6 +173,9 @@ void        p11_test_file_write     (const char *directory,
 void        p11_test_file_delete    (const char *directory,
                                      const char *name);
 
+/* Monotonic clock for benchmarks, in microseconds */
+uint64_t    p11_test_time_usec      (void);
+
 #ifdef OS_UNIX
 
 char *      p11_test_copy_setgid    (const char *path,
@@ -23,6 +23,7 @@
 #include "library.h"
 #include "mock.h"
 #include "p11-kit/rpc.h"
+#include "p11-kit/rpc-message.h"
 
 #include <assert.h>
 
@@ -34,23 +35,29 @@ extern "C"
 int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 {
     p11_buffer buffer;
+    int i;
 
-    mock_module_init ();
-    p11_library_init ();
+    /* Each input is tried with fixed size integers, then with varints */
+    for (i = 0; i < 2; i++) {
+        mock_module_init ();
+        p11_library_init ();
 
-    p11_buffer_init (&buffer, 0);
+        p11_buffer_init (&buffer, 0);
+        if (i == 1)
+            buffer.flags |= P11_RPC_BUFFER_COMPACT;
 
-    p11_virtual_init (&base, &p11_virtual_base, &mock_module_no_slots, NULL);
-    base.funcs.C_Initialize (&base.funcs, NULL);
+        p11_virtual_init (&base, &p11_virtual_base, &mock_module_no_slots, NULL);
+        base.funcs.C_Initialize (&base.funcs, NULL);
 
-    p11_buffer_add (&buffer, data, size);
-    assert (!p11_buffer_failed (&buffer));
+        p11_buffer_add (&buffer, data, size);
+        assert (!p11_buffer_failed (&buffer));
 
-    p11_rpc_server_handle (&base.funcs, &buffer, &buffer);
+        p11_rpc_server_handle (&base.funcs, &buffer, &buffer);
 
-    p11_buffer_uninit (&buffer);
-    mock_module_reset ();
-    p11_library_uninit ();
+        p11_buffer_uninit (&buffer);
+        mock_module_reset ();
+        p11_library_uninit ();
+    }
 
     return 0;
 }
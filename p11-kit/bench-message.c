@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2026, Red Hat Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "config.h"
+
+#include "compat.h"
+#include "debug.h"
+#include "library.h"
+#include "rpc-message.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Measures how long RPC messages take to encode and decode, without
+ * a transport in between. Not run as part of the tests, as the numbers
+ * are only useful when compared with other runs on the same machine.
+ */
+
+#define ELEMS(x) (sizeof (x) / sizeof (x[0]))
+
+#define BENCHMARK_CALLS 100000
+
+static void
+check (bool ok,
+       const char *what)
+{
+	if (ok)
+		return;
+	fprintf (stderr, "bench-message: couldn't decode %s\n", what);
+	exit (1);
+}
+
+static void
+encode_get_session_info (p11_rpc_message *msg)
+{
+	p11_rpc_message_write_ulong (msg, 1);
+	p11_rpc_message_write_ulong (msg, CKS_RO_PUBLIC_SESSION);
+	p11_rpc_message_write_ulong (msg, CKF_SERIAL_SESSION);
+	p11_rpc_message_write_ulong (msg, 0);
+}
+
+static void
+decode_get_session_info (p11_rpc_message *msg)
+{
+	CK_SESSION_INFO info;
+	CK_ULONG error;
+
+	check (p11_rpc_message_read_ulong (msg, &info.slotID) &&
+	       p11_rpc_message_read_ulong (msg, &info.state) &&
+	       p11_rpc_message_read_ulong (msg, &info.flags) &&
+	       p11_rpc_message_read_ulong (msg, &error), "C_GetSessionInfo");
+}
+
+static void
+encode_get_token_info (p11_rpc_message *msg)
+{
+	CK_VERSION version = { 1, 2 };
+	CK_UTF8CHAR label[32];
+	int i;
+
+	memset (label, ' ', sizeof (label));
+	for (i = 0; i < 4; i++)
+		p11_rpc_message_write_space_string (msg, label, i == 3 ? 16 : 32);
+	for (i = 0; i < 11; i++)
+		p11_rpc_message_write_ulong (msg, i);
+	p11_rpc_message_write_version (msg, &version);
+	p11_rpc_message_write_version (msg, &version);
+	p11_rpc_message_write_space_string (msg, label, 16);
+}
+
+static void
+decode_get_token_info (p11_rpc_message *msg)
+{
+	CK_VERSION version;
+	CK_UTF8CHAR label[32];
+	CK_ULONG value;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		check (p11_rpc_message_read_space_string (msg, label, i == 3 ? 16 : 32), "C_GetTokenInfo");
+	for (i = 0; i < 11; i++)
+		check (p11_rpc_message_read_ulong (msg, &value), "C_GetTokenInfo");
+	check (p11_rpc_message_read_version (msg, &version) &&
+	       p11_rpc_message_read_version (msg, &version) &&
+	       p11_rpc_message_read_space_string (msg, label, 16), "C_GetTokenInfo");
+}
+
+static void
+encode_encrypt (p11_rpc_message *msg)
+{
+	unsigned char data[64];
+
+	memset (data, 'a', sizeof (data));
+	p11_rpc_message_write_ulong (msg, 1);
+	p11_rpc_message_write_byte_array (msg, data, sizeof (data));
+	p11_rpc_message_write_byte_buffer (msg, sizeof (data));
+}
+
+static void
+decode_encrypt (p11_rpc_message *msg)
+{
+	const unsigned char *data;
+	unsigned char valid;
+	CK_ULONG session;
+	size_t len;
+
+	check (p11_rpc_message_read_ulong (msg, &session) &&
+	       p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &valid) && valid &&
+	       p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &data, &len), "C_Encrypt");
+}
+
+static void
+encode_get_attribute_value (p11_rpc_message *msg)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, NULL, sizeof (CK_OBJECT_CLASS) },
+		{ CKA_LABEL, NULL, 32 },
+		{ CKA_ID, NULL, 20 },
+		{ CKA_VALUE, NULL, 1024 },
+	};
+
+	p11_rpc_message_write_ulong (msg, 1);
+	p11_rpc_message_write_ulong (msg, 2);
+	p11_rpc_message_write_attribute_buffer (msg, attrs, ELEMS (attrs));
+}
+
+static void
+decode_get_attribute_value (p11_rpc_message *msg)
+{
+	CK_ULONG session;
+	CK_ULONG object;
+
+	check (p11_rpc_message_read_ulong (msg, &session) &&
+	       p11_rpc_message_read_ulong (msg, &object), "C_GetAttributeValue");
+}
+
+static void
+bench_messages (void)
+{
+	struct {
+		int call_id;
+		p11_rpc_message_type type;
+		void (* encode) (p11_rpc_message *);
+		void (* decode) (p11_rpc_message *);
+	} calls[] = {
+		{ P11_RPC_CALL_C_GetSessionInfo, P11_RPC_RESPONSE, encode_get_session_info, decode_get_session_info },
+		{ P11_RPC_CALL_C_GetTokenInfo, P11_RPC_RESPONSE, encode_get_token_info, decode_get_token_info },
+		{ P11_RPC_CALL_C_Encrypt, P11_RPC_REQUEST, encode_encrypt, decode_encrypt },
+		{ P11_RPC_CALL_C_GetAttributeValue, P11_RPC_REQUEST, encode_get_attribute_value, decode_get_attribute_value },
+	};
+	p11_rpc_message msg;
+	p11_buffer buffer;
+	uint64_t start;
+	uint64_t elapsed;
+	int compact;
+	size_t i;
+	int j;
+
+	if (!p11_buffer_init (&buffer, 0))
+		assert_not_reached ();
+
+	/* Each message is encoded, then parsed and decoded from the same buffer */
+	for (compact = 0; compact < 2; compact++) {
+		if (compact)
+			buffer.flags |= P11_RPC_BUFFER_COMPACT;
+
+		for (i = 0; i < ELEMS (calls); i++) {
+			start = p11_test_time_usec ();
+			for (j = 0; j < BENCHMARK_CALLS; j++) {
+				p11_rpc_message_init (&msg, &buffer, &buffer);
+				if (!p11_rpc_message_prep (&msg, calls[i].call_id, calls[i].type))
+					assert_not_reached ();
+				calls[i].encode (&msg);
+				assert (!p11_buffer_failed (&buffer));
+
+				if (!p11_rpc_message_parse (&msg, calls[i].type))
+					assert_not_reached ();
+				calls[i].decode (&msg);
+				p11_rpc_message_clear (&msg);
+			}
+			elapsed = p11_test_time_usec () - start;
+
+			printf ("%s %s%s: %.0f ns per message (%lu bytes)\n",
+			        p11_rpc_calls[calls[i].call_id].name,
+			        calls[i].type == P11_RPC_REQUEST ? "request" : "response",
+			        compact ? ", compact" : "",
+			        (double)elapsed * 1000 / BENCHMARK_CALLS,
+			        (unsigned long)buffer.len);
+		}
+	}
+
+	p11_buffer_uninit (&buffer);
+}
+
+static unsigned int allocations = 0;
+
+static void *
+counting_realloc (void *data,
+                  size_t size)
+{
+	if (data == NULL)
+		allocations++;
+	return realloc (data, size);
+}
+
+#define ARENA_ATTRIBUTES 20
+
+static void
+decode_create_object (p11_rpc_message *msg)
+{
+	CK_ATTRIBUTE *attrs;
+	CK_ULONG session;
+	uint32_t count;
+	uint32_t i;
+
+	/* As the server reads a template */
+	check (p11_rpc_message_read_ulong (msg, &session) &&
+	       p11_rpc_buffer_get_uint32 (msg->input, &msg->parsed, &count), "C_CreateObject");
+	attrs = p11_rpc_message_alloc_extra_array (msg, count, sizeof (CK_ATTRIBUTE));
+	check (attrs != NULL, "C_CreateObject");
+	for (i = 0; i < count; i++)
+		check (p11_rpc_message_get_attribute (msg, msg->input, &msg->parsed, attrs + i), "C_CreateObject");
+}
+
+static void
+bench_arena (void)
+{
+	CK_ATTRIBUTE attrs[ARENA_ATTRIBUTES];
+	unsigned char value[64];
+	p11_rpc_message msg;
+	p11_rpc_arena arena;
+	p11_buffer buffer;
+	uint64_t start;
+	uint64_t elapsed;
+	int reuse;
+	int i;
+
+	memset (value, 'v', sizeof (value));
+	for (i = 0; i < ARENA_ATTRIBUTES; i++) {
+		attrs[i].type = CKA_VENDOR_DEFINED + i;
+		attrs[i].pValue = value;
+		attrs[i].ulValueLen = 8 + i * 2;
+	}
+
+	p11_buffer_init_full (&buffer, NULL, 0, 0, counting_realloc, free);
+	p11_rpc_message_init (&msg, &buffer, &buffer);
+	if (!p11_rpc_message_prep (&msg, P11_RPC_CALL_C_CreateObject, P11_RPC_REQUEST) ||
+	    !p11_rpc_message_write_ulong (&msg, 1) ||
+	    !p11_rpc_message_write_attribute_array (&msg, attrs, ARENA_ATTRIBUTES))
+		assert_not_reached ();
+	p11_rpc_message_clear (&msg);
+
+	/* First with memory only for each message, then kept between them */
+	p11_rpc_arena_init (&arena, 64 * 1024, counting_realloc, free);
+	for (reuse = 0; reuse < 2; reuse++) {
+		allocations = 0;
+		start = p11_test_time_usec ();
+		for (i = 0; i < BENCHMARK_CALLS; i++) {
+			p11_rpc_message_init (&msg, &buffer, &buffer);
+			if (reuse)
+				msg.arena = &arena;
+			if (!p11_rpc_message_parse (&msg, P11_RPC_REQUEST))
+				assert_not_reached ();
+			decode_create_object (&msg);
+			p11_rpc_message_clear (&msg);
+			p11_rpc_arena_reset (&arena);
+		}
+		elapsed = p11_test_time_usec () - start;
+
+		printf ("C_CreateObject request of %d attributes%s: %.0f ns, %.2f allocations per message\n",
+		        ARENA_ATTRIBUTES, reuse ? ", reused arena" : "",
+		        (double)elapsed * 1000 / BENCHMARK_CALLS,
+		        (double)allocations / BENCHMARK_CALLS);
+	}
+	p11_rpc_arena_uninit (&arena);
+
+	p11_buffer_uninit (&buffer);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	if (argc != 1) {
+		fprintf (stderr, "usage: bench-message\n");
+		return 2;
+	}
+
+	p11_library_init ();
+
+	bench_messages ();
+	bench_arena ();
+	return 0;
+}
@@ -0,0 +1,736 @@
+/*
+ * Copyright (c) 2026, Red Hat Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "config.h"
+
+#include "compat.h"
+#include "library.h"
+#include "mock.h"
+#include "p11-kit.h"
+#include "path.h"
+#include "remote.h"
+#include "rpc.h"
+#include "test.h"
+#include "virtual.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Measures the throughput and latency of calls to the mock module over
+ * the RPC transports. Not run as part of the tests, as the numbers are
+ * only useful when compared with other runs on the same machine:
+ *
+ *   $ ./bench-rpc --transport=unix,socketpair --threads=1,8
+ *
+ * Writes a line for each transport, workload and number of threads,
+ * with tab separated fields named by the first line. Latencies are of
+ * a whole operation, which may take several calls, in nanoseconds.
+ */
+
+enum {
+	WORKLOAD_FIND,
+	WORKLOAD_ATTRIBUTES,
+	WORKLOAD_SIGN,
+	WORKLOAD_DIGEST,
+	WORKLOAD_PING,
+	WORKLOAD_ENCRYPT,
+	WORKLOADS
+};
+
+static const char *workload_names[WORKLOADS] = {
+	"find",
+	"attributes",
+	"sign",
+	"digest",
+	"ping",
+	"encrypt",
+};
+
+static CK_MECHANISM_TYPE mechanisms[] = {
+	CKM_MOCK_CAPITALIZE,
+	CKM_MOCK_PREFIX,
+	CKM_MOCK_COUNT,
+	0,
+};
+
+#define MAX_THREADS 256
+#define FIND_WINDOW 64
+
+static struct {
+	unsigned long calls;
+	unsigned long objects;
+	unsigned long parts;
+	unsigned long size;
+	const char *program;
+} config = {
+	1000,
+	256,
+	4,
+	1024,
+	NULL,
+};
+
+typedef struct {
+	CK_X_FUNCTION_LIST *funcs;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	int workload;
+	uint64_t *latencies;
+	CK_BYTE *data;
+	CK_BYTE *output;
+} Worker;
+
+static void
+check (CK_RV rv,
+       const char *what)
+{
+	if (rv == CKR_OK)
+		return;
+	fprintf (stderr, "bench-rpc: %s failed: %s\n", what, p11_kit_strerror (rv));
+	exit (1);
+}
+
+static uint64_t
+now_nsec (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		assert_not_reached ();
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* -------------------------------------------------------------------
+ * The server side
+ */
+
+/* The data objects that the find workload sweeps through */
+static CK_RV
+bench_C_Initialize (CK_VOID_PTR init_args)
+{
+	CK_OBJECT_CLASS klass = CKO_DATA;
+	CK_BBOOL token = CK_TRUE;
+	CK_BYTE value[32];
+	char label[32];
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_TOKEN, &token, sizeof (token) },
+		{ CKA_LABEL, label, 0 },
+		{ CKA_VALUE, value, sizeof (value) },
+	};
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	unsigned long i;
+	CK_RV rv;
+
+	rv = mock_C_Initialize (init_args);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = mock_C_OpenSession (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+	                         NULL, NULL, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	memset (value, 'v', sizeof (value));
+	for (i = 0; rv == CKR_OK && i < config.objects; i++) {
+		attrs[2].ulValueLen = snprintf (label, sizeof (label), "bench-%lu", i);
+		rv = mock_C_CreateObject (session, attrs, 4, &object);
+	}
+
+	mock_C_CloseSession (session);
+	return rv;
+}
+
+static int
+serve (int in_fd,
+       int out_fd)
+{
+	CK_FUNCTION_LIST module;
+
+	memcpy (&module, &mock_module, sizeof (CK_FUNCTION_LIST));
+	module.C_Initialize = bench_C_Initialize;
+
+	return p11_kit_remote_serve_module (&module, in_fd, out_fd);
+}
+
+/* Each connection gets a process, and so a module, of its own */
+static pid_t
+launch_listener (const char *path)
+{
+	struct sockaddr_un sa;
+	pid_t pid;
+	int fd;
+	int cfd;
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (sa.sun_path)) {
+		fprintf (stderr, "bench-rpc: socket path too long: %s\n", path);
+		exit (1);
+	}
+	strncpy (sa.sun_path, path, sizeof (sa.sun_path) - 1);
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 ||
+	    bind (fd, (struct sockaddr *)&sa, SUN_LEN (&sa)) < 0 ||
+	    listen (fd, 1024) < 0) {
+		fprintf (stderr, "bench-rpc: couldn't listen on %s: %s\n", path, strerror (errno));
+		exit (1);
+	}
+
+	pid = fork ();
+	if (pid < 0) {
+		fprintf (stderr, "bench-rpc: couldn't fork: %s\n", strerror (errno));
+		exit (1);
+	} else if (pid > 0) {
+		close (fd);
+		return pid;
+	}
+
+	signal (SIGCHLD, SIG_IGN);
+	for (;;) {
+		cfd = accept (fd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit (1);
+		}
+
+		pid = fork ();
+		if (pid == 0) {
+			close (fd);
+			_exit (serve (cfd, cfd));
+		}
+		close (cfd);
+	}
+}
+
+/* -------------------------------------------------------------------
+ * The workloads
+ */
+
+static void
+run_find (Worker *worker)
+{
+	CK_X_FUNCTION_LIST *funcs = worker->funcs;
+	CK_OBJECT_CLASS klass = CKO_DATA;
+	CK_ATTRIBUTE attr = { CKA_CLASS, &klass, sizeof (klass) };
+	CK_OBJECT_HANDLE objects[FIND_WINDOW];
+	CK_ULONG found = 0;
+	CK_ULONG count;
+
+	check ((funcs->C_FindObjectsInit) (funcs, worker->session, &attr, 1), "C_FindObjectsInit");
+	do {
+		check ((funcs->C_FindObjects) (funcs, worker->session, objects, FIND_WINDOW, &count), "C_FindObjects");
+		found += count;
+	} while (count == FIND_WINDOW);
+	check ((funcs->C_FindObjectsFinal) (funcs, worker->session), "C_FindObjectsFinal");
+
+	if (found < config.objects)
+		check (CKR_GENERAL_ERROR, "finding all the objects");
+}
+
+static void
+run_attributes (Worker *worker)
+{
+	CK_X_FUNCTION_LIST *funcs = worker->funcs;
+	CK_OBJECT_CLASS klass;
+	char label[64];
+	CK_BYTE value[64];
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_LABEL, label, sizeof (label) },
+		{ CKA_VALUE, value, sizeof (value) },
+	};
+
+	check ((funcs->C_GetAttributeValue) (funcs, worker->session, worker->object, attrs, 3),
+	       "C_GetAttributeValue");
+}
+
+static void
+run_sign (Worker *worker)
+{
+	CK_X_FUNCTION_LIST *funcs = worker->funcs;
+	CK_MECHANISM mech = { CKM_MOCK_PREFIX, "prefix:", 7 };
+	CK_BYTE signature[256];
+	CK_ULONG length = sizeof (signature);
+	CK_ULONG size = config.size < 128 ? config.size : 128;
+
+	check ((funcs->C_SignInit) (funcs, worker->session, &mech, MOCK_PRIVATE_KEY_PREFIX), "C_SignInit");
+	check ((funcs->C_Login) (funcs, worker->session, CKU_CONTEXT_SPECIFIC, (CK_BYTE_PTR)"booo", 4),
+	       "C_Login");
+	check ((funcs->C_Sign) (funcs, worker->session, worker->data, size, signature, &length), "C_Sign");
+
+	check ((funcs->C_VerifyInit) (funcs, worker->session, &mech, MOCK_PUBLIC_KEY_PREFIX), "C_VerifyInit");
+	check ((funcs->C_Verify) (funcs, worker->session, worker->data, size, signature, length), "C_Verify");
+}
+
+static void
+run_digest (Worker *worker)
+{
+	CK_X_FUNCTION_LIST *funcs = worker->funcs;
+	CK_MECHANISM mech = { CKM_MOCK_COUNT, NULL, 0 };
+	CK_BYTE digest[32];
+	CK_ULONG length = sizeof (digest);
+	unsigned long i;
+
+	check ((funcs->C_DigestInit) (funcs, worker->session, &mech), "C_DigestInit");
+	for (i = 0; i < config.parts; i++)
+		check ((funcs->C_DigestUpdate) (funcs, worker->session, worker->data, config.size), "C_DigestUpdate");
+	check ((funcs->C_DigestFinal) (funcs, worker->session, digest, &length), "C_DigestFinal");
+}
+
+/* A small request and response */
+static void
+run_ping (Worker *worker)
+{
+	CK_X_FUNCTION_LIST *funcs = worker->funcs;
+	CK_SLOT_INFO info;
+
+	check ((funcs->C_GetSlotInfo) (funcs, MOCK_SLOT_ONE_ID, &info), "C_GetSlotInfo");
+}
+
+/* Sends --size bytes to the server and gets as many back */
+static void
+run_encrypt (Worker *worker)
+{
+	CK_X_FUNCTION_LIST *funcs = worker->funcs;
+	CK_MECHANISM mech = { CKM_MOCK_CAPITALIZE, NULL, 0 };
+	CK_ULONG length = config.size;
+
+	check ((funcs->C_EncryptInit) (funcs, worker->session, &mech, MOCK_PUBLIC_KEY_CAPITALIZE),
+	       "C_EncryptInit");
+	check ((funcs->C_Encrypt) (funcs, worker->session, worker->data, config.size,
+	                           worker->output, &length), "C_Encrypt");
+	if (length != config.size || worker->output[0] != 'D')
+		check (CKR_GENERAL_ERROR, "encrypting the data");
+}
+
+static void
+run_once (Worker *worker)
+{
+	switch (worker->workload) {
+	case WORKLOAD_FIND:
+		run_find (worker);
+		break;
+	case WORKLOAD_ATTRIBUTES:
+		run_attributes (worker);
+		break;
+	case WORKLOAD_SIGN:
+		run_sign (worker);
+		break;
+	case WORKLOAD_DIGEST:
+		run_digest (worker);
+		break;
+	case WORKLOAD_PING:
+		run_ping (worker);
+		break;
+	case WORKLOAD_ENCRYPT:
+		run_encrypt (worker);
+		break;
+	default:
+		assert_not_reached ();
+	}
+}
+
+static void *
+run_worker (void *data)
+{
+	Worker *worker = data;
+	uint64_t start;
+	unsigned long i;
+
+	for (i = 0; i < config.calls; i++) {
+		start = now_nsec ();
+		run_once (worker);
+		worker->latencies[i] = now_nsec () - start;
+	}
+
+	return NULL;
+}
+
+static int
+compar_latency (const void *one,
+                const void *two)
+{
+	uint64_t a = *(const uint64_t *)one;
+	uint64_t b = *(const uint64_t *)two;
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static uint64_t
+percentile (uint64_t *sorted,
+            size_t count,
+            unsigned int percent)
+{
+	size_t index = (count * percent + 99) / 100;
+	return sorted[index > 0 ? index - 1 : 0];
+}
+
+static void
+run_workload (const char *transport,
+              Worker *workers,
+              int workload,
+              int threads)
+{
+	p11_thread_t thread[MAX_THREADS];
+	uint64_t *latencies;
+	uint64_t elapsed;
+	uint64_t start;
+	size_t total;
+	int i;
+
+	total = config.calls * threads;
+	latencies = calloc (total, sizeof (uint64_t));
+	assert (latencies != NULL);
+
+	for (i = 0; i < threads; i++) {
+		workers[i].workload = workload;
+		workers[i].latencies = latencies + config.calls * i;
+
+		/* Warm up the connection and the caches */
+		run_once (workers + i);
+	}
+
+	start = now_nsec ();
+	for (i = 0; i < threads; i++) {
+		if (p11_thread_create (thread + i, run_worker, workers + i) != 0) {
+			fprintf (stderr, "bench-rpc: couldn't create thread: %s\n", strerror (errno));
+			exit (1);
+		}
+	}
+	for (i = 0; i < threads; i++)
+		p11_thread_join (thread[i]);
+	elapsed = now_nsec () - start;
+
+	qsort (latencies, total, sizeof (uint64_t), compar_latency);
+	printf ("%s\t%s\t%d\t%lu\t%llu\t%.1f\t%llu\t%llu\n",
+	        transport, workload_names[workload], threads,
+	        (unsigned long)total, (unsigned long long)elapsed,
+	        elapsed ? (double)total * 1000000000.0 / elapsed : 0.0,
+	        (unsigned long long)percentile (latencies, total, 50),
+	        (unsigned long long)percentile (latencies, total, 99));
+	fflush (stdout);
+
+	free (latencies);
+}
+
+/* -------------------------------------------------------------------
+ * The client side
+ */
+
+static CK_OBJECT_HANDLE
+find_object (CK_X_FUNCTION_LIST *funcs,
+             CK_SESSION_HANDLE session)
+{
+	CK_ATTRIBUTE attr = { CKA_LABEL, "bench-0", 7 };
+	CK_OBJECT_HANDLE object;
+	CK_ULONG count;
+
+	check ((funcs->C_FindObjectsInit) (funcs, session, &attr, 1), "C_FindObjectsInit");
+	check ((funcs->C_FindObjects) (funcs, session, &object, 1, &count), "C_FindObjects");
+	check ((funcs->C_FindObjectsFinal) (funcs, session), "C_FindObjectsFinal");
+	if (count != 1)
+		check (CKR_GENERAL_ERROR, "finding the object to read");
+
+	return object;
+}
+
+static void
+run_transport (const char *transport,
+               bool *workloads,
+               int *threads,
+               int n_threads)
+{
+	Worker workers[MAX_THREADS];
+	CK_X_FUNCTION_LIST *funcs;
+	p11_rpc_transport *rpc;
+	p11_virtual virt;
+	char *directory = NULL;
+	char *remote = NULL;
+	char *path;
+	pid_t pid = 0;
+	int max_threads = 0;
+	int i;
+	int j;
+
+	if (strcmp (transport, "socketpair") == 0) {
+		/* The exec transport talks to its child over a socketpair */
+		if (asprintf (&remote, "|%s --serve --objects=%lu", config.program, config.objects) < 0)
+			assert_not_reached ();
+	} else if (strcmp (transport, "unix") == 0 ||
+	           strcmp (transport, "shm") == 0) {
+		directory = p11_test_directory ("bench-rpc");
+		path = p11_path_build (directory, "pkcs11", NULL);
+		assert (path != NULL);
+		pid = launch_listener (path);
+		if (asprintf (&remote, "%s:path=%s", transport, path) < 0)
+			assert_not_reached ();
+		free (path);
+	} else {
+		fprintf (stderr, "bench-rpc: unknown transport: %s\n", transport);
+		exit (2);
+	}
+
+	rpc = p11_rpc_transport_new (&virt, remote, "bench");
+	if (rpc == NULL) {
+		fprintf (stderr, "bench-rpc: couldn't set up transport: %s\n", remote);
+		exit (1);
+	}
+
+	funcs = &virt.funcs;
+	check ((funcs->C_Initialize) (funcs, NULL), "C_Initialize");
+
+	for (i = 0; i < n_threads; i++)
+		max_threads = threads[i] > max_threads ? threads[i] : max_threads;
+
+	/* Sessions are opened before hand, the mock module isn't thread safe for that */
+	for (i = 0; i < max_threads; i++) {
+		workers[i].funcs = funcs;
+		check ((funcs->C_OpenSession) (funcs, MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION,
+		                               NULL, NULL, &workers[i].session), "C_OpenSession");
+		workers[i].data = malloc (config.size);
+		assert (workers[i].data != NULL);
+		memset (workers[i].data, 'd', config.size);
+		workers[i].output = malloc (config.size);
+		assert (workers[i].output != NULL);
+	}
+
+	check ((funcs->C_Login) (funcs, workers[0].session, CKU_USER, (CK_BYTE_PTR)"booo", 4), "C_Login");
+	for (i = 0; i < max_threads; i++)
+		workers[i].object = find_object (funcs, workers[i].session);
+
+	for (i = 0; i < WORKLOADS; i++) {
+		if (!workloads[i])
+			continue;
+		for (j = 0; j < n_threads; j++)
+			run_workload (transport, workers, i, threads[j]);
+	}
+
+	for (i = 0; i < max_threads; i++) {
+		check ((funcs->C_CloseSession) (funcs, workers[i].session), "C_CloseSession");
+		free (workers[i].data);
+		free (workers[i].output);
+	}
+
+	check ((funcs->C_Finalize) (funcs, NULL), "C_Finalize");
+	p11_virtual_uninit (&virt);
+	p11_rpc_transport_free (rpc);
+
+	if (pid > 0) {
+		kill (pid, SIGTERM);
+		waitpid (pid, NULL, 0);
+	}
+	if (directory) {
+		p11_test_directory_delete (directory);
+		free (directory);
+	}
+	free (remote);
+}
+
+static unsigned long
+parse_number (const char *arg,
+              const char *option,
+              unsigned long max)
+{
+	unsigned long value;
+	char *end;
+
+	value = strtoul (arg, &end, 10);
+	if (end == arg || *end != '\0' || value == 0 || value > max) {
+		fprintf (stderr, "bench-rpc: invalid --%s: %s\n", option, arg);
+		exit (2);
+	}
+
+	return value;
+}
+
+static void
+usage (void)
+{
+	fprintf (stderr,
+	         "usage: bench-rpc [--transport=socketpair,unix,shm]\n"
+	         "                 [--workload=find,attributes,sign,digest,ping,encrypt]\n"
+	         "                 [--threads=1,4] [--calls=N] [--objects=N]\n"
+	         "                 [--parts=N] [--size=N]\n");
+	exit (2);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	const char *transports = "socketpair,unix";
+	const char *workload_list = NULL;
+	bool workloads[WORKLOADS];
+	int threads[MAX_THREADS];
+	int n_threads = 0;
+	bool serving = false;
+	char *list;
+	char *item;
+	char *next;
+	int opt;
+	int i;
+
+	enum {
+		opt_serve = 256,
+	};
+
+	struct option options[] = {
+		{ "transport", required_argument, NULL, 't' },
+		{ "workload", required_argument, NULL, 'w' },
+		{ "threads", required_argument, NULL, 'j' },
+		{ "calls", required_argument, NULL, 'n' },
+		{ "objects", required_argument, NULL, 'o' },
+		{ "parts", required_argument, NULL, 'p' },
+		{ "size", required_argument, NULL, 's' },
+		{ "serve", no_argument, NULL, opt_serve },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long (argc, argv, "t:w:j:n:o:p:s:", options, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			transports = optarg;
+			break;
+		case 'w':
+			workload_list = optarg;
+			break;
+		case 'j':
+			list = strdup (optarg);
+			assert (list != NULL);
+			for (item = list; item != NULL; item = next) {
+				next = strchr (item, ',');
+				if (next)
+					*(next++) = '\0';
+				if (n_threads == MAX_THREADS)
+					usage ();
+				threads[n_threads++] = parse_number (item, "threads", MAX_THREADS);
+			}
+			free (list);
+			break;
+		case 'n':
+			config.calls = parse_number (optarg, "calls", 100000000);
+			break;
+		case 'o':
+			config.objects = parse_number (optarg, "objects", 1000000);
+			break;
+		case 'p':
+			config.parts = parse_number (optarg, "parts", 1000000);
+			break;
+		case 's':
+			config.size = parse_number (optarg, "size", 16 * 1024 * 1024);
+			break;
+		case opt_serve:
+			serving = true;
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind != argc)
+		usage ();
+
+	p11_library_init ();
+	mock_module_init ();
+
+	/* The RPC only passes mechanisms it knows the parameters of */
+	p11_rpc_mechanisms_override_supported = mechanisms;
+
+	if (serving)
+		return serve (STDIN_FILENO, STDOUT_FILENO);
+
+	for (i = 0; i < WORKLOADS; i++)
+		workloads[i] = (workload_list == NULL);
+	if (workload_list) {
+		list = strdup (workload_list);
+		assert (list != NULL);
+		for (item = list; item != NULL; item = next) {
+			next = strchr (item, ',');
+			if (next)
+				*(next++) = '\0';
+			for (i = 0; i < WORKLOADS; i++) {
+				if (strcmp (item, workload_names[i]) == 0)
+					break;
+			}
+			if (i == WORKLOADS) {
+				fprintf (stderr, "bench-rpc: unknown workload: %s\n", item);
+				exit (2);
+			}
+			workloads[i] = true;
+		}
+		free (list);
+	}
+
+	if (n_threads == 0) {
+		threads[n_threads++] = 1;
+		threads[n_threads++] = 4;
+	}
+
+	/* The transport runs this same program to serve the module */
+	config.program = argv[0];
+
+	/* A client that goes away shouldn't take us with it */
+	signal (SIGPIPE, SIG_IGN);
+
+	printf ("#transport\tworkload\tthreads\tops\telapsed_ns\tops_per_sec\tp50_ns\tp99_ns\n");
+
+	list = strdup (transports);
+	assert (list != NULL);
+	for (item = list; item != NULL; item = next) {
+		next = strchr (item, ',');
+		if (next)
+			*(next++) = '\0';
+		run_transport (item, workloads, threads, n_threads);
+	}
+	free (list);
+
+	return 0;
+}
@@ -39,6 +39,7 @@
 
 #include "client.h"
 #include "pkcs11.h"
+#include "rpc-stats.h"
 
 /* p11_proxy_module_check() is defined as a weak symbol in modules.c */
 #ifndef __GNUC__
@@ -53,5 +54,5 @@ p11_proxy_module_check (CK_FUNCTION_LIST_PTR module)
 
 #define INIT _p11_kit_init
 #define FINI _p11_kit_fini
-#define CLEANUP p11_client_module_cleanup ()
+#define CLEANUP p11_client_module_cleanup (); p11_rpc_stats_dump ()
 #include "init.h"
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+
+"""
+SPDX-License-Identifier: BSD-3-Clause
+"""
+
+import re
+import sys
+
+INDENT = "        "
+
+ENUM_PATTERN = re.compile(r"^\s*(P11_RPC_CALL_\w+)\s*(?:=\s*0\s*)?,", re.M)
+CALL_PATTERN = re.compile(
+    r'^\s*\{\s*(P11_RPC_CALL_\w+),\s*"(\w+)",\s*'
+    r'(NULL|"[a-zA-Z]*"),\s*(NULL|"[a-zA-Z]*")\s*\},', re.M)
+
+
+def parse_calls(infile):
+    """Returns the rows of the p11_rpc_calls table, in call id order"""
+    contents = infile.read()
+    enum = contents[contents.index("enum {"):contents.index("P11_RPC_CALL_MAX")]
+    table = contents[contents.index("p11_rpc_calls[] = {"):]
+    table = table[:table.index("};")]
+
+    ids = ENUM_PATTERN.findall(enum)
+    calls = [
+        {
+            "id": match[0],
+            "name": match[1],
+            "request": None if match[2] == "NULL" else match[2].strip('"'),
+            "response": None if match[3] == "NULL" else match[3].strip('"'),
+        }
+        for match in CALL_PATTERN.findall(table)
+    ]
+
+    if [call["id"] for call in calls] != ids:
+        raise ValueError("p11_rpc_calls is not in sync with the call ids")
+    return calls
+
+
+def encode_varint(value):
+    """Encodes a value as the compact encoding of protocol version 5"""
+    data = b""
+    while value >= 0x80:
+        data += bytes([(value & 0x7f) | 0x80])
+        value >>= 7
+    return data + bytes([value])
+
+
+def encode_header(call_id, signature, compact):
+    """The call id and the signature, as p11_rpc_message_prep() writes them"""
+    if compact:
+        data = encode_varint(call_id)
+        data += encode_varint(len(signature))
+    else:
+        data = call_id.to_bytes(4, "big")
+        data += len(signature).to_bytes(4, "big")
+    data += signature.encode("ascii")
+    return data
+
+
+def emit_header(output, variable, call_id, signature, compact):
+    data = encode_header(call_id, signature, compact)
+    values = ", ".join(f"0x{byte:02x}" for byte in data)
+    output.write(f"static const unsigned char {variable}[] = {{ {values} }};\n")
+    return len(data)
+
+
+def write_table(output, calls, table, compact):
+    entries = []
+    for call_id, call in enumerate(calls):
+        entry = []
+        for kind in ("request", "response"):
+            signature = call[kind]
+            if signature is None:
+                entry.append("{ NULL, 0 }")
+                continue
+            variable = f"{table}_{call['name']}_{kind}"
+            length = emit_header(output, variable, call_id, signature, compact)
+            entry.append(f"{{ {variable}, {length} }}")
+        entries.append(f"{INDENT}/* {call['id']} */\n"
+                       f"{INDENT}{{ {', '.join(entry)} }}")
+
+    entries_concatenated = ",\n".join(entries)
+    output.write(f"""
+/* Indexed by the call id, then by the message type less P11_RPC_REQUEST */
+static const p11_rpc_header {table}s[P11_RPC_CALL_MAX][2] = {{
+{entries_concatenated}
+}};
+
+""")
+
+
+def write_headers(output, calls):
+    output.write("""\
+/* This file is generated by gen-rpc-calls.py from p11_rpc_calls, do not edit */
+
+typedef struct {
+        const unsigned char *data;
+        size_t length;
+} p11_rpc_header;
+
+""")
+    write_table(output, calls, "p11_rpc_header", False)
+    write_table(output, calls, "p11_rpc_compact_header", True)
+
+
+if __name__ == "__main__":
+    import argparse
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--infile", type=argparse.FileType("r"),
+                        required=True)
+    parser.add_argument("--outfile", type=argparse.FileType("w"),
+                        default=sys.stdout)
+    args = parser.parse_args()
+
+    write_headers(args.outfile, parse_calls(args.infile))
@@ -698,12 +698,22 @@ p11_get_paths_from_env (void)
 }
 #endif
 
+static int
+compar_names_descending (const void *one,
+                         const void *two)
+{
+	return strcmp (*((const char **)two), *((const char **)one));
+}
+
 static CK_RV
 load_registered_modules_unlocked (int flags)
 {
 	p11_dictiter iter;
 	p11_dict *configs;
 	void *key;
+	char **names;
+	unsigned int count;
+	unsigned int i;
 	char *name;
 	p11_dict *config;
 	int mode;
@@ -738,13 +748,29 @@ load_registered_modules_unlocked (int flags)
 	assert (gl.config == NULL);
 	gl.config = config;
 
+	/*
+	 * When the same module is configured more than once, the last config
+	 * loaded takes over. Load them in descending order of name, so that
+	 * the first name wins, rather than depending on the order of the dict.
+	 */
+	names = calloc (p11_dict_size (configs) + 1, sizeof (char *));
+	if (names == NULL) {
+		p11_dict_free (configs);
+		return_val_if_reached (CKR_HOST_MEMORY);
+	}
+
+	count = 0;
+	p11_dict_iterate (configs, &iter);
+	while (p11_dict_next (&iter, &key, NULL))
+		names[count++] = key;
+	qsort (names, count, sizeof (char *), compar_names_descending);
+
 	/*
 	 * Now go through each config and turn it into a module. As we iterate
 	 * we steal the values of the config.
 	 */
-	p11_dict_iterate (configs, &iter);
-	while (p11_dict_next (&iter, &key, NULL)) {
-		if (!p11_dict_steal (configs, key, (void**)&name, (void**)&config))
+	for (i = 0; i < count; i++) {
+		if (!p11_dict_steal (configs, names[i], (void**)&name, (void**)&config))
 			assert_not_reached ();
 
 		/* Is this a critical module, should abort loading of others? */
@@ -762,6 +788,7 @@ load_registered_modules_unlocked (int flags)
 			p11_message (_("aborting initialization because module '%s' was marked as critical"),
 			             name);
 			p11_dict_free (configs);
+			free (names);
 			free (name);
 			return rv;
 		}
@@ -770,6 +797,7 @@ load_registered_modules_unlocked (int flags)
 	}
 
 	p11_dict_free (configs);
+	free (names);
 	return CKR_OK;
 }
 
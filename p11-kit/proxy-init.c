@@ -40,8 +40,9 @@
 #include "library.h"
 #include "p11-kit.h"
 #include "proxy.h"
+#include "rpc-stats.h"
 
 #define INIT _p11_kit_init
 #define FINI _p11_kit_fini
-#define CLEANUP p11_proxy_module_cleanup ()
+#define CLEANUP p11_proxy_module_cleanup (); p11_rpc_stats_dump ()
 #include "init.h"
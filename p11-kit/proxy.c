@@ -947,6 +947,17 @@ p11_proxy_module_check (CK_FUNCTION_LIST_PTR module)
 	return ret;
 }
 
+static void
+proxy_state_free (void *data)
+{
+	State *state = data;
+
+	/* Finalize whatever the caller left initialized */
+	proxy_free (state->px, PROXY_VALID (state->px));
+	free (state->loaded);
+	free (state);
+}
+
 CK_RV
 p11_proxy_module_create (CK_FUNCTION_LIST_PTR *module,
 			 CK_FUNCTION_LIST_PTR *modules)
@@ -964,9 +975,9 @@ p11_proxy_module_create (CK_FUNCTION_LIST_PTR *module,
 	p11_virtual_init (&state->virt, &proxy_functions, state, NULL);
 	state->last_handle = FIRST_HANDLE;
 	state->loaded = modules_dup (modules);
-	state->wrapped.pFunctionList = p11_virtual_wrap (&state->virt, (p11_destroyer)p11_virtual_uninit);
+	state->wrapped.pFunctionList = p11_virtual_wrap (&state->virt, proxy_state_free);
 	if (state->wrapped.pFunctionList == NULL) {
-		p11_kit_modules_release (state->loaded);
+		free (state->loaded);
 		free (state);
 		return CKR_GENERAL_ERROR;
 	}
@@ -50,6 +50,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef OS_UNIX
+#include <sys/socket.h>
+#endif
+
 #ifdef ENABLE_NLS
 #include <libintl.h>
 #define _(x) dgettext(PACKAGE_NAME, x)
@@ -57,23 +61,76 @@
 #define _(x) (x)
 #endif
 
+#ifdef OS_UNIX
+
+static int
+receive_connection (int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (sizeof (int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned char byte;
+	int received = -1;
+	ssize_t ret;
+
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof (control.buf);
+
+	do {
+		ret = recvmsg (fd, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		p11_message_err (errno, _("couldn't receive connection"));
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN (sizeof (int)))
+			memcpy (&received, CMSG_DATA (cmsg), sizeof (int));
+	}
+
+	return received;
+}
+
+#endif /* OS_UNIX */
+
 int
 main (int argc,
       char *argv[])
 {
 	int opt;
 	char *provider = NULL;
+	bool worker = false;
+	CK_FUNCTION_LIST *warm = NULL;
+	CK_FUNCTION_LIST **warm_modules = NULL;
+	int in_fd = STDIN_FILENO;
+	int out_fd = STDOUT_FILENO;
+	int ret;
 
 	enum {
 		opt_verbose = 'v',
 		opt_help = 'h',
-		opt_provider = 'p'
+		opt_provider = 'p',
+		opt_worker = 1000,
 	};
 
 	struct option options[] = {
 		{ "verbose", no_argument, NULL, opt_verbose },
 		{ "help", no_argument, NULL, opt_help },
 		{ "provider", required_argument, NULL, opt_provider },
+		{ "worker", no_argument, NULL, opt_worker },
 		{ 0 },
 	};
 
@@ -81,6 +138,7 @@ main (int argc,
 		{ 0, "usage: p11-kit remote <module>\n"
 		     "       p11-kit remote [-p <provider>] <token> ..." },
 		{ opt_provider, "specify the module to use" },
+		{ opt_worker, "receive the connection to serve over standard input" },
 		{ 0 },
 	};
 
@@ -96,6 +154,9 @@ main (int argc,
 		case opt_provider:
 			provider = optarg;
 			break;
+		case opt_worker:
+			worker = true;
+			break;
 		default:
 			assert_not_reached ();
 			break;
@@ -120,40 +181,78 @@ main (int argc,
 	_setmode (_fileno (stdout), _O_BINARY);
 #endif
 
+	if (worker) {
+#ifdef OS_UNIX
+		/* Have the module ready before a connection arrives, and
+		 * keep it initialized until it is served */
+		if (provider || strncmp (argv[0], "pkcs11:", 7) != 0) {
+			warm = p11_kit_module_load (provider ? provider : argv[0], 0);
+			if (warm == NULL)
+				return 1;
+			if (p11_kit_module_initialize (warm) != CKR_OK) {
+				p11_kit_module_release (warm);
+				return 1;
+			}
+		} else {
+			warm_modules = p11_kit_modules_load_and_initialize (0);
+			if (warm_modules == NULL)
+				return 1;
+		}
+
+		in_fd = out_fd = receive_connection (STDIN_FILENO);
+		if (in_fd < 0) {
+			ret = 1;
+			goto out;
+		}
+#else
+		p11_message (_("workers are not supported on this platform"));
+		return 2;
+#endif
+	}
+
 	if (strncmp (argv[0], "pkcs11:", 7) == 0) {
 		CK_FUNCTION_LIST *module = NULL;
-		int ret;
 
 		if (provider) {
 			module = p11_kit_module_load (provider, 0);
-			if (module == NULL)
-				return 1;
+			if (module == NULL) {
+				ret = 1;
+				goto out;
+			}
 		}
 
 		ret = p11_kit_remote_serve_tokens ((const char **)argv, argc,
 						   module,
-						   STDIN_FILENO, STDOUT_FILENO);
+						   in_fd, out_fd);
 		if (module)
 			p11_kit_module_release (module);
-
-		return ret;
 	} else {
 		CK_FUNCTION_LIST *module;
-		int ret;
 
 		if (argc != 1) {
 			p11_message (_("only one module can be specified"));
-			return 2;
+			ret = 2;
+			goto out;
 		}
 
 		module = p11_kit_module_load (argv[0], 0);
-		if (module == NULL)
-			return 1;
+		if (module == NULL) {
+			ret = 1;
+			goto out;
+		}
 
 		ret = p11_kit_remote_serve_module (module,
-						   STDIN_FILENO, STDOUT_FILENO);
+						   in_fd, out_fd);
 		p11_kit_module_release (module);
+	}
 
-		return ret;
+ out:
+	if (warm) {
+		p11_kit_module_finalize (warm);
+		p11_kit_module_release (warm);
 	}
+	if (warm_modules)
+		p11_kit_modules_finalize_and_release (warm_modules);
+
+	return ret;
 }
@@ -35,9 +35,11 @@
 
 #include "config.h"
 
+#include "array.h"
 #include "attrs.h"
 #define P11_DEBUG_FLAG P11_DEBUG_RPC
 #include "debug.h"
+#include "dict.h"
 #include "pkcs11.h"
 #include "pkcs11x.h"
 #include "library.h"
@@ -48,7 +50,9 @@
 #include "virtual.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef ENABLE_NLS
@@ -58,15 +62,120 @@
 #define _(x) (x)
 #endif
 
+#define ELEMS(x) (sizeof (x) / sizeof (x[0]))
+
 /* The error used by us when parsing of rpc message fails */
 #define PARSE_ERROR   CKR_DEVICE_ERROR
 
+/* Number of handles first asked for ahead of the caller */
+#define FIND_PREFETCH 32
+
+/* The most handles asked for at once, unless P11_KIT_RPC_PREFETCH says */
+#define FIND_PREFETCH_MAX 1024
+
+/* How many buffers are kept, by how large they have grown */
+static const struct {
+	size_t size;
+	unsigned int keep;
+} buffer_classes[] = {
+	{ 4096, 8 },
+	{ 64 * 1024, 2 },
+};
+
+/* Room kept in each class, at least the largest number kept */
+#define BUFFER_CLASSES ELEMS (buffer_classes)
+#define BUFFER_CLASS_KEEP 8
+
+/* Handles found ahead of the caller asking for them */
+typedef struct {
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE *objects;
+	CK_ULONG num;
+	CK_ULONG at;
+	CK_ULONG window;
+	/* Only set once the server returned no handles at all */
+	bool done;
+} rpc_find;
+
+/* Attribute values that came along with their lengths */
+typedef struct {
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CK_ATTRIBUTE *attrs;
+	CK_ULONG count;
+	CK_RV rv;
+	/* Whether the values came along, or only the lengths */
+	bool fetched;
+	/* Whether to ask for the values along with the lengths */
+	bool wanted;
+} rpc_values;
+
+/* Information about a mechanism of a slot */
+typedef struct {
+	CK_MECHANISM_TYPE type;
+	CK_MECHANISM_INFO info;
+} rpc_mechanism;
+
+/*
+ * What is known about a slot, when P11_KIT_RPC_CACHE_TTL is set. Slot
+ * and token information is not kept, as it tells whether a token is
+ * present, how many sessions are open and the state of the PINs.
+ */
+typedef struct {
+	CK_SLOT_ID slot;
+	CK_MECHANISM_TYPE *mechanisms;
+	CK_ULONG n_mechanisms;
+	p11_array *mechanism_infos;
+} rpc_slot;
+
+/* Object handles are only known to be the same object within a slot */
+typedef struct {
+	CK_SLOT_ID slot;
+	CK_OBJECT_HANDLE object;
+} rpc_object_id;
+
+/* Attributes of a token object that can't change */
+typedef struct _rpc_object {
+	rpc_object_id id;
+	bool cacheable;
+	CK_ATTRIBUTE *attrs;
+	size_t size;
+	struct _rpc_object *prev;
+	struct _rpc_object *next;
+} rpc_object;
+
+/* The slot of an open session, to know where its objects live */
+typedef struct {
+	CK_SESSION_HANDLE session;
+	CK_SLOT_ID slot;
+} rpc_session;
+
 typedef struct {
 	p11_mutex_t mutex;
 	p11_rpc_client_vtable *vtable;
 	unsigned int initialized_forkid;
 	bool initialize_done;
 	uint8_t version;
+	p11_dict *finds;
+	p11_dict *values;
+	CK_ULONG find_prefetch;
+	p11_dict *slots;
+	CK_SLOT_ID *slot_list;
+	CK_ULONG n_slot_list;
+	unsigned int slots_generation;
+	time_t cache_ttl;
+	time_t cache_expires;
+	p11_dict *sessions;
+	p11_dict *objects;
+	rpc_object *objects_first;
+	rpc_object *objects_last;
+	size_t objects_size;
+	size_t objects_max;
+
+	/* Buffers of calls that are done, kept for later calls */
+	p11_mutex_t buffers_mutex;
+	p11_buffer *buffers[BUFFER_CLASSES][BUFFER_CLASS_KEEP];
+	unsigned int n_buffers[BUFFER_CLASSES];
 } rpc_client;
 
 /* Allocator for call session buffers */
@@ -79,6 +188,68 @@ log_allocator (void *pointer,
 	return result;
 }
 
+/*
+ * Calls usually take a buffer that an earlier call has grown large
+ * enough already, so that they don't allocate any memory.
+ */
+static p11_buffer *
+buffer_take (rpc_client *module)
+{
+	p11_buffer *buffer = NULL;
+	size_t i;
+
+	p11_mutex_lock (&module->buffers_mutex);
+	for (i = 0; buffer == NULL && i < BUFFER_CLASSES; i++) {
+		if (module->n_buffers[i] > 0)
+			buffer = module->buffers[i][--module->n_buffers[i]];
+	}
+	p11_mutex_unlock (&module->buffers_mutex);
+
+	if (buffer == NULL)
+		buffer = p11_rpc_buffer_new_full (64, log_allocator, free);
+	return buffer;
+}
+
+static void
+buffer_give (rpc_client *module,
+             p11_buffer *buffer)
+{
+	size_t i;
+
+	/* Those that failed or grew larger than any class are freed */
+	if (!p11_buffer_failed (buffer)) {
+		/* Nothing of this call, such as a PIN, is left for the next one */
+		memset (buffer->data, 0, buffer->size);
+
+		p11_mutex_lock (&module->buffers_mutex);
+		for (i = 0; i < BUFFER_CLASSES; i++) {
+			if (buffer->size > buffer_classes[i].size)
+				continue;
+			if (module->n_buffers[i] < buffer_classes[i].keep &&
+			    module->n_buffers[i] < ELEMS (module->buffers[i])) {
+				module->buffers[i][module->n_buffers[i]++] = buffer;
+				buffer = NULL;
+			}
+			break;
+		}
+		p11_mutex_unlock (&module->buffers_mutex);
+	}
+
+	if (buffer != NULL)
+		p11_rpc_buffer_free (buffer);
+}
+
+static void
+buffers_free (rpc_client *module)
+{
+	size_t i;
+
+	for (i = 0; i < BUFFER_CLASSES; i++) {
+		while (module->n_buffers[i] > 0)
+			p11_rpc_buffer_free (module->buffers[i][--module->n_buffers[i]]);
+	}
+}
+
 static CK_RV
 call_prepare (rpc_client *module,
               p11_rpc_message *msg,
@@ -94,9 +265,15 @@ call_prepare (rpc_client *module,
 	if (!module->initialize_done)
 		return CKR_DEVICE_REMOVED;
 
-	buffer = p11_rpc_buffer_new_full (64, log_allocator, free);
+	buffer = buffer_take (module);
 	return_val_if_fail (buffer != NULL, CKR_GENERAL_ERROR);
 
+	/* Integers are sent as varints since version 5 */
+	if (module->version >= 5)
+		buffer->flags |= P11_RPC_BUFFER_COMPACT;
+	else
+		buffer->flags &= ~P11_RPC_BUFFER_COMPACT;
+
 	/* We use the same buffer for reading and writing */
 	p11_rpc_message_init (msg, buffer, buffer);
 
@@ -104,17 +281,90 @@ call_prepare (rpc_client *module,
 	if (!p11_rpc_message_prep (msg, call_id, P11_RPC_REQUEST))
 		return_val_if_reached (CKR_HOST_MEMORY);
 
+	/* The only time the call looks at whether statistics are collected */
+	if (p11_rpc_client_stats) {
+		msg->probe = calloc (1, sizeof (p11_rpc_probe));
+		if (msg->probe)
+			p11_rpc_probe_start (msg->probe, call_id);
+	}
+
 	p11_debug ("prepared call: %d", call_id);
 	return CKR_OK;
 }
 
+static CK_RV
+call_parse (rpc_client *module,
+            p11_rpc_message *msg,
+            int call_id)
+{
+	CK_ULONG ckerr;
+
+	if (!p11_rpc_message_parse (msg, P11_RPC_RESPONSE))
+		return CKR_DEVICE_ERROR;
+
+	/* If it's an error code then return it */
+	if (msg->call_id == P11_RPC_CALL_ERROR) {
+		if (!p11_rpc_message_read_ulong (msg, &ckerr)) {
+			p11_message (_("invalid rpc error response: too short"));
+			return CKR_DEVICE_ERROR;
+		}
+
+		if (ckerr <= CKR_OK) {
+			p11_message (_("invalid rpc error response: bad error code"));
+			return CKR_DEVICE_ERROR;
+		}
+
+		/* An error code from the other side */
+		return (CK_RV)ckerr;
+	}
+
+	/* Make sure other side answered the right call */
+	if (call_id != msg->call_id) {
+		p11_message (_("invalid rpc response: call mismatch"));
+		return CKR_DEVICE_ERROR;
+	}
+
+	assert (!p11_buffer_failed (msg->input));
+
+	p11_debug ("parsing response values");
+	return CKR_OK;
+}
+
+/* Only called for a call with a probe */
+static void
+call_sent (p11_rpc_message *msg)
+{
+	p11_rpc_probe_lap (msg->probe, P11_RPC_STATS_SERIALIZE);
+	msg->probe->sent = msg->output->len;
+}
+
+static void
+call_received (p11_rpc_message *msg)
+{
+	p11_rpc_probe_lap (msg->probe, P11_RPC_STATS_TRANSPORT);
+	msg->probe->received = msg->input->len;
+}
+
+static CK_RV
+call_transport_probed (rpc_client *module,
+                       p11_rpc_message *msg)
+{
+	CK_RV ret;
+
+	call_sent (msg);
+	ret = (module->vtable->transport) (module->vtable,
+	                                   msg->output,
+	                                   msg->input);
+	call_received (msg);
+
+	return ret;
+}
+
 static CK_RV
 call_run (rpc_client *module,
           p11_rpc_message *msg)
 {
 	CK_RV ret = CKR_OK;
-	CK_ULONG ckerr;
-
 	int call_id;
 
 	assert (module != NULL);
@@ -130,72 +380,838 @@ call_run (rpc_client *module,
 
 	/* Do the transport send and receive */
 	assert (module->vtable->transport != NULL);
-	ret = (module->vtable->transport) (module->vtable,
-	                                   msg->output,
-	                                   msg->input);
+	if (msg->probe) {
+		ret = call_transport_probed (module, msg);
+	} else {
+		ret = (module->vtable->transport) (module->vtable,
+		                                   msg->output,
+		                                   msg->input);
+	}
+
+	if (ret != CKR_OK)
+		return ret;
+
+	return call_parse (module, msg, call_id);
+}
+
+static CK_RV
+call_done (rpc_client *module,
+           p11_rpc_message *msg,
+           CK_RV ret)
+{
+	p11_buffer *buf;
+
+	assert (module != NULL);
+	assert (msg != NULL);
+
+	/* Check for parsing errors that were not caught elsewhere */
+	if (ret == CKR_OK) {
+		if (p11_buffer_failed (msg->input)) {
+			p11_message (_("invalid rpc response: bad argument data"));
+			ret = CKR_GENERAL_ERROR;
+		} else {
+			/* Double check that the signature matched our decoding */
+			assert (p11_rpc_message_is_verified (msg));
+		}
+	}
+
+	if (msg->probe) {
+		p11_rpc_probe_lap (msg->probe, P11_RPC_STATS_SERIALIZE);
+		p11_rpc_stats_record (p11_rpc_client_stats, msg->probe);
+		free (msg->probe);
+	}
+
+	/* We used the same buffer for input/output, so this is both */
+	assert (msg->input == msg->output);
+	buf = msg->input;
+	p11_rpc_message_clear (msg);
+	buffer_give (module, buf);
+
+	return ret;
+}
+
+/*
+ * Prepares @msg as a batch of several calls prepared on the same
+ * session. When this fails, @msg is already done with.
+ */
+static CK_RV
+call_prepare_batch (rpc_client *module,
+                    CK_SESSION_HANDLE session,
+                    p11_rpc_message *msgs,
+                    CK_ULONG count,
+                    p11_rpc_message *msg)
+{
+	p11_buffer *requests;
+	CK_ULONG i;
+	CK_RV ret;
+
+	requests = buffer_take (module);
+	if (requests == NULL)
+		return_val_if_reached (CKR_HOST_MEMORY);
+	p11_buffer_reset (requests, 0);
+	requests->flags &= ~P11_RPC_BUFFER_COMPACT;
+	for (i = 0; i < count; i++) {
+		if (p11_buffer_failed (msgs[i].output))
+			p11_buffer_fail (requests);
+		assert (p11_rpc_message_is_verified (&msgs[i]));
+		p11_rpc_buffer_add_byte_array (requests, msgs[i].output->data,
+		                               msgs[i].output->len);
+	}
+
+	ret = call_prepare (module, msg, P11_RPC_CALL_BATCH);
+	if (ret == CKR_OK) {
+		if (p11_buffer_failed (requests) ||
+		    !p11_rpc_message_write_ulong (msg, session) ||
+		    !p11_rpc_message_write_byte_array (msg, requests->data, requests->len))
+			ret = call_done (module, msg, CKR_HOST_MEMORY);
+	}
+
+	buffer_give (module, requests);
+	return ret;
+}
+
+/*
+ * Hands each response in the answer to a batch to the message of its
+ * call, and is done with @msg.
+ */
+static CK_RV
+call_parse_batch (rpc_client *module,
+                  p11_rpc_message *msg,
+                  p11_rpc_message *msgs,
+                  CK_RV *rvs,
+                  CK_ULONG count,
+                  CK_RV ret)
+{
+	const unsigned char *data;
+	p11_buffer responses;
+	unsigned char valid;
+	size_t offset;
+	size_t len;
+	CK_ULONG i;
+
+	if (ret == CKR_OK) {
+		if (!P11_RPC_MESSAGE_VERIFY_PART (msg, "ay") ||
+		    !p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &valid) || !valid ||
+		    !p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &data, &len))
+			ret = PARSE_ERROR;
+	}
+
+	if (ret == CKR_OK) {
+		p11_buffer_init_full (&responses, (void *)data, len, 0, NULL, NULL);
+		offset = 0;
+
+		for (i = 0; i < count && offset < responses.len; i++) {
+			if (!p11_rpc_buffer_get_byte_array (&responses, &offset, &data, &len) ||
+			    data == NULL || !p11_buffer_reset (msgs[i].input, len)) {
+				ret = PARSE_ERROR;
+				break;
+			}
+
+			p11_buffer_add (msgs[i].input, data, len);
+			rvs[i] = call_parse (module, &msgs[i], msgs[i].call_id);
+		}
+	}
+
+	return call_done (module, msg, ret);
+}
+
+/*
+ * Runs several calls prepared on the same session in one round trip,
+ * when the server supports it. The calls are run in order until one
+ * fails, and the result of each goes in @rvs. Calls that didn't run
+ * get CKR_FUNCTION_CANCELED.
+ */
+static CK_RV
+call_run_batch (rpc_client *module,
+                CK_SESSION_HANDLE session,
+                p11_rpc_message *msgs,
+                CK_RV *rvs,
+                CK_ULONG count)
+{
+	p11_rpc_message msg;
+	CK_ULONG i;
+	CK_RV ret;
+
+	assert (module != NULL);
+	assert (msgs != NULL);
+	assert (rvs != NULL);
+
+	for (i = 0; i < count; i++)
+		rvs[i] = CKR_FUNCTION_CANCELED;
+
+	/* Older servers get the calls one at a time */
+	if (module->version < 2) {
+		for (i = 0; i < count; i++) {
+			rvs[i] = call_run (module, &msgs[i]);
+			if (rvs[i] != CKR_OK)
+				break;
+		}
+		return CKR_OK;
+	}
+
+	ret = call_prepare_batch (module, session, msgs, count, &msg);
+	if (ret != CKR_OK)
+		return ret;
+
+	ret = call_run (module, &msg);
+	return call_parse_batch (module, &msg, msgs, rvs, count, ret);
+}
+
+static rpc_find *
+find_new (CK_SESSION_HANDLE session,
+          CK_ULONG window)
+{
+	rpc_find *find;
+
+	find = calloc (1, sizeof (rpc_find));
+	return_val_if_fail (find != NULL, NULL);
+
+	find->objects = calloc (window, sizeof (CK_OBJECT_HANDLE));
+	if (find->objects == NULL) {
+		free (find);
+		return_val_if_reached (NULL);
+	}
+
+	find->session = session;
+	find->window = window;
+	return find;
+}
+
+static void
+find_free (void *data)
+{
+	rpc_find *find = data;
+	free (find->objects);
+	free (find);
+}
+
+/* Number of handles to ask for next, or zero when not asking ahead */
+static CK_ULONG
+find_window (rpc_client *module,
+             rpc_find *find)
+{
+	CK_ULONG window;
+
+	if (module->find_prefetch <= 1)
+		return 0;
+
+	/* Ask for more each time, as the search is evidently a long one */
+	window = find ? find->window * 2 : FIND_PREFETCH;
+	return window < module->find_prefetch ? window : module->find_prefetch;
+}
+
+/* Keeps the handles the caller didn't ask for yet, or frees them */
+static bool
+find_keep (rpc_client *module,
+           rpc_find *find)
+{
+	bool ret;
+
+	p11_mutex_lock (&module->mutex);
+	p11_dict_remove (module->finds, &find->session);
+	ret = p11_dict_set (module->finds, &find->session, find);
+	p11_mutex_unlock (&module->mutex);
+
+	if (!ret)
+		find_free (find);
+	return ret;
+}
+
+/* Forgets the handles found ahead for a session */
+static void
+find_drop (rpc_client *module,
+           CK_SESSION_HANDLE session)
+{
+	p11_mutex_lock (&module->mutex);
+	p11_dict_remove (module->finds, &session);
+	p11_mutex_unlock (&module->mutex);
+}
+
+/* The values may be secret, so they are wiped */
+static void
+values_clear (rpc_values *values)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < values->count; i++) {
+		if (values->attrs[i].pValue) {
+			memset (values->attrs[i].pValue, 0, values->attrs[i].ulValueLen);
+			free (values->attrs[i].pValue);
+		}
+	}
+	free (values->attrs);
+	values->attrs = NULL;
+	values->count = 0;
+	values->object = 0;
+	values->fetched = false;
+}
+
+static void
+values_free (void *data)
+{
+	rpc_values *values = data;
+
+	values_clear (values);
+	free (values);
+}
+
+/* Forgets the attribute values of an object, kept for any session */
+static void
+values_forget (rpc_client *module,
+               CK_OBJECT_HANDLE object)
+{
+	rpc_values *values;
+	p11_dictiter iter;
+
+	p11_mutex_lock (&module->mutex);
+	p11_dict_iterate (module->values, &iter);
+	while (p11_dict_next (&iter, NULL, (void **)&values)) {
+		if (values->object == object)
+			values_clear (values);
+	}
+	p11_mutex_unlock (&module->mutex);
+}
+
+/* Keeps @values for their session, which still wants them as before */
+static void
+values_keep (rpc_client *module,
+             rpc_values *values)
+{
+	rpc_values *previous;
+
+	p11_mutex_lock (&module->mutex);
+	previous = p11_dict_get (module->values, &values->session);
+	values->wanted = previous ? previous->wanted : true;
+	p11_dict_remove (module->values, &values->session);
+	if (!p11_dict_set (module->values, &values->session, values))
+		values_free (values);
+	p11_mutex_unlock (&module->mutex);
+}
+
+/*
+ * The server only looks up the values along with the lengths while
+ * the last ones it sent on the session were used.
+ */
+static bool
+values_wanted (rpc_client *module,
+               CK_SESSION_HANDLE session)
+{
+	rpc_values *values;
+	bool wanted;
+
+	p11_mutex_lock (&module->mutex);
+	values = p11_dict_get (module->values, &session);
+	wanted = values ? values->wanted : true;
+	p11_mutex_unlock (&module->mutex);
+
+	return wanted;
+}
+
+/* Forgets everything kept for a session */
+static void
+session_drop (rpc_client *module,
+              CK_SESSION_HANDLE session)
+{
+	p11_mutex_lock (&module->mutex);
+	p11_dict_remove (module->finds, &session);
+	p11_dict_remove (module->values, &session);
+	p11_mutex_unlock (&module->mutex);
+}
+
+static void
+slot_free (void *data)
+{
+	rpc_slot *slot = data;
+	free (slot->mechanisms);
+	p11_array_free (slot->mechanism_infos);
+	free (slot);
+}
+
+static void
+slot_list_clear_inlock (rpc_client *module)
+{
+	free (module->slot_list);
+	module->slot_list = NULL;
+	module->n_slot_list = 0;
+
+	/* What was asked for before this is not kept */
+	module->slots_generation++;
+}
+
+static void
+slots_clear_inlock (rpc_client *module)
+{
+	p11_dict_clear (module->slots);
+	slot_list_clear_inlock (module);
+	module->cache_expires = 0;
+}
+
+/*
+ * Whether slot information may be kept and used, forgetting it all
+ * once it's older than P11_KIT_RPC_CACHE_TTL.
+ */
+static bool
+slots_fresh_inlock (rpc_client *module)
+{
+	time_t now;
+
+	if (module->cache_ttl == 0)
+		return false;
+	if (module->initialized_forkid != p11_forkid || !module->initialize_done)
+		return false;
+
+	now = time (NULL);
+	if (module->cache_expires != 0 && now >= module->cache_expires)
+		slots_clear_inlock (module);
+	if (module->cache_expires == 0)
+		module->cache_expires = now + module->cache_ttl;
+
+	return true;
+}
+
+static rpc_slot *
+slot_lookup_inlock (rpc_client *module,
+                    CK_SLOT_ID slot_id,
+                    bool create)
+{
+	rpc_slot *slot;
+
+	if (!slots_fresh_inlock (module))
+		return NULL;
+
+	slot = p11_dict_get (module->slots, &slot_id);
+	if (slot != NULL || !create)
+		return slot;
+
+	slot = calloc (1, sizeof (rpc_slot));
+	return_val_if_fail (slot != NULL, NULL);
+
+	slot->slot = slot_id;
+	slot->mechanism_infos = p11_array_new (free);
+	if (slot->mechanism_infos == NULL ||
+	    !p11_dict_set (module->slots, &slot->slot, slot)) {
+		slot_free (slot);
+		return_val_if_reached (NULL);
+	}
+
+	return slot;
+}
+
+/* Forgets a slot that changed, and the slot lists it may be on */
+static void
+slot_drop (rpc_client *module,
+           CK_SLOT_ID slot_id)
+{
+	if (module->cache_ttl == 0)
+		return;
+
+	p11_mutex_lock (&module->mutex);
+	p11_dict_remove (module->slots, &slot_id);
+	slot_list_clear_inlock (module);
+	p11_mutex_unlock (&module->mutex);
+}
+
+/* Forgets all slot information, after a device went away */
+static void
+slots_drop (rpc_client *module)
+{
+	if (module->cache_ttl == 0)
+		return;
+
+	p11_mutex_lock (&module->mutex);
+	slots_clear_inlock (module);
+	p11_mutex_unlock (&module->mutex);
+}
+
+/* Hands out a kept list the way C_GetSlotList and friends do */
+static CK_RV
+slot_fill_list (const CK_ULONG *values,
+                CK_ULONG n_values,
+                CK_ULONG *arr,
+                CK_ULONG *count)
+{
+	CK_RV ret = CKR_OK;
+
+	if (arr != NULL) {
+		if (*count < n_values)
+			ret = CKR_BUFFER_TOO_SMALL;
+		else
+			memcpy (arr, values, n_values * sizeof (CK_ULONG));
+	}
+
+	*count = n_values;
+	return ret;
+}
+
+static CK_ULONG *
+slot_copy_list (const CK_ULONG *values,
+                CK_ULONG n_values)
+{
+	CK_ULONG *copy;
+
+	copy = malloc ((n_values ? n_values : 1) * sizeof (CK_ULONG));
+	return_val_if_fail (copy != NULL, NULL);
+
+	memcpy (copy, values, n_values * sizeof (CK_ULONG));
+	return copy;
+}
+
+static void
+object_free (void *data)
+{
+	rpc_object *obj = data;
+	p11_attrs_free (obj->attrs);
+	free (obj);
+}
+
+static unsigned int
+object_id_hash (const void *data)
+{
+	const rpc_object_id *id = data;
+	return p11_dict_ulongptr_hash (&id->object) ^ p11_dict_ulongptr_hash (&id->slot);
+}
+
+static bool
+object_id_equal (const void *one,
+                 const void *two)
+{
+	const rpc_object_id *id1 = one;
+	const rpc_object_id *id2 = two;
+	return id1->object == id2->object && id1->slot == id2->slot;
+}
+
+/* Objects are only known through sessions whose slot is known */
+static bool
+object_id_inlock (rpc_client *module,
+                  CK_SESSION_HANDLE session,
+                  CK_OBJECT_HANDLE object,
+                  rpc_object_id *id)
+{
+	rpc_session *sess;
+
+	sess = p11_dict_get (module->sessions, &session);
+	if (sess == NULL)
+		return false;
+
+	id->slot = sess->slot;
+	id->object = object;
+	return true;
+}
+
+static void
+object_unlink_inlock (rpc_client *module,
+                      rpc_object *obj)
+{
+	if (obj->prev)
+		obj->prev->next = obj->next;
+	else
+		module->objects_first = obj->next;
+	if (obj->next)
+		obj->next->prev = obj->prev;
+	else
+		module->objects_last = obj->prev;
+	obj->prev = obj->next = NULL;
+}
+
+/* Marks the object as the one used most recently */
+static void
+object_touch_inlock (rpc_client *module,
+                     rpc_object *obj)
+{
+	if (module->objects_first == obj)
+		return;
+	if (obj->prev || obj->next || module->objects_last == obj)
+		object_unlink_inlock (module, obj);
+
+	obj->next = module->objects_first;
+	if (obj->next)
+		obj->next->prev = obj;
+	module->objects_first = obj;
+	if (module->objects_last == NULL)
+		module->objects_last = obj;
+}
+
+static void
+object_remove_inlock (rpc_client *module,
+                      rpc_object *obj)
+{
+	object_unlink_inlock (module, obj);
+	module->objects_size -= obj->size;
+	p11_dict_remove (module->objects, &obj->id);
+}
+
+/* Forgets the objects used least recently until the rest fit */
+static void
+objects_trim_inlock (rpc_client *module)
+{
+	while (module->objects_size > module->objects_max && module->objects_last)
+		object_remove_inlock (module, module->objects_last);
+}
+
+static void
+objects_clear_inlock (rpc_client *module)
+{
+	p11_dict_clear (module->objects);
+	module->objects_first = module->objects_last = NULL;
+	module->objects_size = 0;
+}
+
+static void
+objects_clear_slot_inlock (rpc_client *module,
+                           CK_SLOT_ID slot)
+{
+	rpc_object *obj;
+	rpc_object *next;
+
+	for (obj = module->objects_first; obj != NULL; obj = next) {
+		next = obj->next;
+		if (obj->id.slot == slot)
+			object_remove_inlock (module, obj);
+	}
+}
+
+/* Forgets an object that changed or went away, or a reused handle */
+static void
+object_drop (rpc_client *module,
+             CK_SESSION_HANDLE session,
+             CK_OBJECT_HANDLE object)
+{
+	rpc_object_id id;
+	rpc_object *obj;
+
+	if (module->objects_max == 0)
+		return;
+
+	p11_mutex_lock (&module->mutex);
+	if (object_id_inlock (module, session, object, &id)) {
+		obj = p11_dict_get (module->objects, &id);
+		if (obj != NULL)
+			object_remove_inlock (module, obj);
+	}
+	p11_mutex_unlock (&module->mutex);
+}
+
+/* Forgets all objects, as their handles may not be valid any more */
+static void
+objects_drop (rpc_client *module)
+{
+	if (module->objects_max == 0)
+		return;
+
+	p11_mutex_lock (&module->mutex);
+	objects_clear_inlock (module);
+	p11_mutex_unlock (&module->mutex);
+}
+
+/* Remembers the slot of a session, for the objects seen through it */
+static void
+session_opened (rpc_client *module,
+                CK_SESSION_HANDLE session,
+                CK_SLOT_ID slot)
+{
+	rpc_session *sess;
+
+	if (module->objects_max == 0)
+		return;
+
+	sess = malloc (sizeof (rpc_session));
+	return_if_fail (sess != NULL);
+	sess->session = session;
+	sess->slot = slot;
+
+	p11_mutex_lock (&module->mutex);
+	if (!p11_dict_set (module->sessions, &sess->session, sess))
+		free (sess);
+	p11_mutex_unlock (&module->mutex);
+}
+
+/* Object handles of a slot only stay the same while it has sessions open */
+static void
+session_closed (rpc_client *module,
+                CK_SESSION_HANDLE session)
+{
+	rpc_session *sess;
+	p11_dictiter iter;
+	CK_SLOT_ID slot;
+	bool others = false;
+
+	if (module->objects_max == 0)
+		return;
+
+	p11_mutex_lock (&module->mutex);
+
+	sess = p11_dict_get (module->sessions, &session);
+	if (sess != NULL) {
+		slot = sess->slot;
+		p11_dict_remove (module->sessions, &session);
+
+		p11_dict_iterate (module->sessions, &iter);
+		while (!others && p11_dict_next (&iter, NULL, (void **)&sess))
+			others = sess->slot == slot;
+		if (!others)
+			objects_clear_slot_inlock (module, slot);
+	}
+
+	p11_mutex_unlock (&module->mutex);
+}
+
+static void
+sessions_closed (rpc_client *module,
+                 CK_SLOT_ID slot)
+{
+	rpc_session *sess;
+	p11_dictiter iter;
+
+	if (module->objects_max == 0)
+		return;
+
+	p11_mutex_lock (&module->mutex);
+
+	p11_dict_iterate (module->sessions, &iter);
+	while (p11_dict_next (&iter, NULL, (void **)&sess)) {
+		if (sess->slot == slot)
+			p11_dict_remove (module->sessions, &sess->session);
+	}
+	objects_clear_slot_inlock (module, slot);
+
+	p11_mutex_unlock (&module->mutex);
+}
 
-	if (ret != CKR_OK)
-		return ret;
+/* Attributes never kept, even for objects that can't change */
+static bool
+object_attribute_secret (CK_ATTRIBUTE_TYPE type)
+{
+	switch (type) {
+	case CKA_PRIVATE_EXPONENT:
+	case CKA_PRIME_1:
+	case CKA_PRIME_2:
+	case CKA_EXPONENT_1:
+	case CKA_EXPONENT_2:
+	case CKA_COEFFICIENT:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	if (!p11_rpc_message_parse (msg, P11_RPC_RESPONSE))
-		return CKR_DEVICE_ERROR;
+/*
+ * Answers from the attributes kept for an object, when all that's
+ * asked for is known.
+ */
+static bool
+object_lookup (rpc_client *module,
+               CK_SESSION_HANDLE session,
+               CK_OBJECT_HANDLE object,
+               CK_ATTRIBUTE_PTR template,
+               CK_ULONG count,
+               CK_RV *ret)
+{
+	rpc_object_id id;
+	rpc_object *obj = NULL;
+	CK_ATTRIBUTE *attr;
+	CK_ULONG i;
 
-	/* If it's an error code then return it */
-	if (msg->call_id == P11_RPC_CALL_ERROR) {
-		if (!p11_rpc_message_read_ulong (msg, &ckerr)) {
-			p11_message (_("invalid rpc error response: too short"));
-			return CKR_DEVICE_ERROR;
-		}
+	if (module->objects_max == 0 || count == 0)
+		return false;
 
-		if (ckerr <= CKR_OK) {
-			p11_message (_("invalid rpc error response: bad error code"));
-			return CKR_DEVICE_ERROR;
-		}
+	p11_mutex_lock (&module->mutex);
 
-		/* An error code from the other side */
-		return (CK_RV)ckerr;
+	if (object_id_inlock (module, session, object, &id))
+		obj = p11_dict_get (module->objects, &id);
+	for (i = 0; obj != NULL && obj->cacheable && i < count; i++) {
+		if (!p11_attrs_find (obj->attrs, template[i].type))
+			break;
 	}
 
-	/* Make sure other side answered the right call */
-	if (call_id != msg->call_id) {
-		p11_message (_("invalid rpc response: call mismatch"));
-		return CKR_DEVICE_ERROR;
+	if (obj == NULL || !obj->cacheable || i != count) {
+		p11_mutex_unlock (&module->mutex);
+		return false;
 	}
 
-	assert (!p11_buffer_failed (msg->input));
+	*ret = CKR_OK;
+	for (i = 0; i < count; i++) {
+		attr = p11_attrs_find (obj->attrs, template[i].type);
+		if (template[i].pValue == NULL) {
+			template[i].ulValueLen = attr->ulValueLen;
+		} else if (template[i].ulValueLen < attr->ulValueLen) {
+			template[i].ulValueLen = (CK_ULONG)-1;
+			*ret = CKR_BUFFER_TOO_SMALL;
+		} else {
+			memcpy (template[i].pValue, attr->pValue, attr->ulValueLen);
+			template[i].ulValueLen = attr->ulValueLen;
+		}
+	}
 
-	p11_debug ("parsing response values");
-	return CKR_OK;
+	object_touch_inlock (module, obj);
+	p11_mutex_unlock (&module->mutex);
+	return true;
 }
 
-static CK_RV
-call_done (rpc_client *module,
-           p11_rpc_message *msg,
-           CK_RV ret)
+/* Keeps the values the module returned for an object that can't change */
+static void
+object_store (rpc_client *module,
+              CK_SESSION_HANDLE session,
+              CK_OBJECT_HANDLE object,
+              CK_ATTRIBUTE_PTR attrs,
+              CK_ULONG count,
+              CK_RV ret)
 {
-	p11_buffer *buf;
+	rpc_object_id id;
+	rpc_object *obj = NULL;
+	CK_ATTRIBUTE *attr;
+	CK_ATTRIBUTE *stored;
+	void *value;
+	CK_ULONG i;
 
-	assert (module != NULL);
-	assert (msg != NULL);
+	if (module->objects_max == 0)
+		return;
 
-	/* Check for parsing errors that were not caught elsewhere */
-	if (ret == CKR_OK) {
-		if (p11_buffer_failed (msg->input)) {
-			p11_message (_("invalid rpc response: bad argument data"));
-			ret = CKR_GENERAL_ERROR;
-		} else {
-			/* Double check that the signature matched our decoding */
-			assert (p11_rpc_message_is_verified (msg));
+	if (ret == CKR_OBJECT_HANDLE_INVALID) {
+		object_drop (module, session, object);
+		return;
+	}
+
+	if (ret != CKR_OK && ret != CKR_ATTRIBUTE_SENSITIVE &&
+	    ret != CKR_ATTRIBUTE_TYPE_INVALID && ret != CKR_BUFFER_TOO_SMALL)
+		return;
+
+	p11_mutex_lock (&module->mutex);
+
+	if (object_id_inlock (module, session, object, &id))
+		obj = p11_dict_get (module->objects, &id);
+	for (i = 0; obj != NULL && obj->cacheable && i < count; i++) {
+		attr = attrs + i;
+		if (attr->ulValueLen == (CK_ULONG)-1 ||
+		    (attr->pValue == NULL && attr->ulValueLen != 0) ||
+		    IS_ATTRIBUTE_ARRAY (attr) ||
+		    object_attribute_secret (attr->type) ||
+		    p11_attrs_find (obj->attrs, attr->type))
+			continue;
+
+		value = NULL;
+		if (attr->ulValueLen != 0) {
+			value = memdup (attr->pValue, attr->ulValueLen);
+			if (value == NULL)
+				break;
+		}
+
+		stored = p11_attrs_take (obj->attrs, attr->type, value, attr->ulValueLen);
+		if (stored == NULL) {
+			free (value);
+			break;
 		}
+
+		obj->attrs = stored;
+		obj->size += sizeof (CK_ATTRIBUTE) + attr->ulValueLen;
+		module->objects_size += sizeof (CK_ATTRIBUTE) + attr->ulValueLen;
 	}
 
-	/* We used the same buffer for input/output, so this frees both */
-	assert (msg->input == msg->output);
-	buf = msg->input;
-	p11_rpc_message_clear (msg);
-	p11_rpc_buffer_free (buf);
+	if (obj != NULL) {
+		object_touch_inlock (module, obj);
+		objects_trim_inlock (module);
+	}
 
-	return ret;
+	p11_mutex_unlock (&module->mutex);
 }
 
 /* -----------------------------------------------------------------------------
@@ -215,7 +1231,7 @@ proto_read_attribute_array (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "aA"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "aA"));
 
 	/* Get the number of items. We need this value to be correct */
 	if (!p11_rpc_buffer_get_uint32 (msg->input, &msg->parsed, &num))
@@ -291,6 +1307,94 @@ proto_read_attribute_array (p11_rpc_message *msg,
 	return ret;
 }
 
+/*
+ * Reads the lengths into @arr, which has no buffers. When the values
+ * were sent along with them, a copy of everything goes in @values.
+ */
+static CK_RV
+proto_read_attribute_values (p11_rpc_message *msg,
+                             CK_ATTRIBUTE_PTR arr,
+                             CK_ULONG len,
+                             rpc_values **result)
+{
+	rpc_values *values;
+	CK_ATTRIBUTE *attr;
+	uint32_t i, num;
+	CK_BYTE valid = 0;
+	CK_RV ret;
+
+	assert (msg != NULL);
+	assert (msg->input != NULL);
+	assert (result != NULL);
+
+	/* Make sure this is in the right order */
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "aA"));
+
+	if (!p11_rpc_buffer_get_uint32 (msg->input, &msg->parsed, &num))
+		return PARSE_ERROR;
+
+	if (len != num) {
+		p11_message (_("received an attribute array with wrong number of attributes"));
+		return PARSE_ERROR;
+	}
+
+	values = calloc (1, sizeof (rpc_values));
+	return_val_if_fail (values != NULL, CKR_HOST_MEMORY);
+	values->attrs = calloc (num + 1, sizeof (CK_ATTRIBUTE));
+	if (values->attrs == NULL) {
+		free (values);
+		return_val_if_reached (CKR_HOST_MEMORY);
+	}
+
+	ret = CKR_OK;
+	for (i = 0; ret == CKR_OK && i < num; ++i) {
+		CK_ATTRIBUTE temp;
+
+		memset (&temp, 0, sizeof (temp));
+		if (!p11_rpc_message_get_attribute (msg, msg->input, &msg->parsed, &temp)) {
+			ret = PARSE_ERROR;
+			break;
+		}
+
+		if (temp.type != arr[i].type) {
+			p11_message (_("returned attributes in invalid order"));
+			ret = PARSE_ERROR;
+			break;
+		}
+
+		arr[i].ulValueLen = temp.ulValueLen;
+		attr = values->attrs + values->count++;
+		attr->type = temp.type;
+		attr->ulValueLen = temp.ulValueLen;
+
+		/* Nested templates are never sent along */
+		if (temp.ulValueLen != (CK_ULONG)-1 && temp.ulValueLen != 0 &&
+		    !IS_ATTRIBUTE_ARRAY (&temp)) {
+			attr->pValue = memdup (temp.pValue, temp.ulValueLen);
+			if (attr->pValue == NULL)
+				ret = CKR_HOST_MEMORY;
+		}
+	}
+
+	if (ret == CKR_OK) {
+		if (!p11_rpc_message_read_ulong (msg, &ret) ||
+		    !p11_rpc_message_read_byte (msg, &valid))
+			ret = PARSE_ERROR;
+	}
+
+	if (valid && (ret == CKR_OK ||
+	              ret == CKR_ATTRIBUTE_SENSITIVE ||
+	              ret == CKR_ATTRIBUTE_TYPE_INVALID)) {
+		values->rv = ret;
+		values->fetched = true;
+		*result = values;
+	} else {
+		values_free (values);
+	}
+
+	return ret;
+}
+
 static CK_RV
 proto_read_byte_array (p11_rpc_message *msg,
                        CK_BYTE_PTR arr,
@@ -306,7 +1410,7 @@ proto_read_byte_array (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "ay"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "ay"));
 
 	/* A single byte which determines whether valid or not */
 	if (!p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &valid))
@@ -358,7 +1462,7 @@ proto_read_ulong_array (p11_rpc_message *msg, CK_ULONG_PTR arr,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "au"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "au"));
 
 	/* A single byte which determines whether valid or not */
 	if (!p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &valid))
@@ -425,7 +1529,7 @@ proto_write_mechanism (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "M"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "M"));
 
 	/*
 	 * The NULL mechanism is used for C_*Init () functions to
@@ -575,6 +1679,10 @@ proto_read_sesssion_info (p11_rpc_message *msg,
 #define END_CALL \
 	_cleanup: \
 		_ret = call_done (_mod, &_msg, _ret); \
+		if (_ret == CKR_DEVICE_REMOVED || _ret == CKR_TOKEN_NOT_PRESENT) { \
+			slots_drop (_mod); \
+			objects_drop (_mod); \
+		} \
 		p11_debug ("ret: %lu", _ret); \
 		return _ret; \
 	}
@@ -793,6 +1901,13 @@ rpc_C_Initialize (CK_X_FUNCTION_LIST *self,
 #endif
 	}
 
+	/* Searches of a parent process aren't ours */
+	p11_dict_clear (module->finds);
+	p11_dict_clear (module->values);
+	slots_clear_inlock (module);
+	objects_clear_inlock (module);
+	p11_dict_clear (module->sessions);
+
 	/* Successfully initialized */
 	if (ret == CKR_OK) {
 		module->initialized_forkid = p11_forkid;
@@ -877,6 +1992,11 @@ rpc_C_Finalize (CK_X_FUNCTION_LIST *self,
 	}
 
 	module->initialized_forkid = 0;
+	p11_dict_clear (module->finds);
+	p11_dict_clear (module->values);
+	slots_clear_inlock (module);
+	objects_clear_inlock (module);
+	p11_dict_clear (module->sessions);
 
 	p11_mutex_unlock (&module->mutex);
 
@@ -912,13 +2032,11 @@ rpc_C_GetInfo (CK_X_FUNCTION_LIST *self,
 }
 
 static CK_RV
-rpc_C_GetSlotList (CK_X_FUNCTION_LIST *self,
-                   CK_BBOOL token_present,
-                   CK_SLOT_ID_PTR slot_list,
-                   CK_ULONG_PTR count)
+call_get_slot_list (CK_X_FUNCTION_LIST *self,
+                    CK_BBOOL token_present,
+                    CK_SLOT_ID_PTR slot_list,
+                    CK_ULONG_PTR count)
 {
-	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
-
 	BEGIN_CALL_OR (C_GetSlotList, self, (*count = 0, CKR_OK));
 		IN_BYTE (token_present);
 		IN_ULONG_BUFFER (slot_list, count);
@@ -956,13 +2074,11 @@ rpc_C_GetTokenInfo (CK_X_FUNCTION_LIST *self,
 }
 
 static CK_RV
-rpc_C_GetMechanismList (CK_X_FUNCTION_LIST *self,
-                        CK_SLOT_ID slot_id,
-                        CK_MECHANISM_TYPE_PTR mechanism_list,
-                        CK_ULONG_PTR count)
+call_get_mechanism_list (CK_X_FUNCTION_LIST *self,
+                         CK_SLOT_ID slot_id,
+                         CK_MECHANISM_TYPE_PTR mechanism_list,
+                         CK_ULONG_PTR count)
 {
-	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
-
 	BEGIN_CALL_OR (C_GetMechanismList, self, CKR_SLOT_ID_INVALID);
 		IN_ULONG (slot_id);
 		IN_ULONG_BUFFER (mechanism_list, count);
@@ -972,13 +2088,11 @@ rpc_C_GetMechanismList (CK_X_FUNCTION_LIST *self,
 }
 
 static CK_RV
-rpc_C_GetMechanismInfo (CK_X_FUNCTION_LIST *self,
-                        CK_SLOT_ID slot_id,
-                        CK_MECHANISM_TYPE type,
-                        CK_MECHANISM_INFO_PTR info)
+call_get_mechanism_info (CK_X_FUNCTION_LIST *self,
+                         CK_SLOT_ID slot_id,
+                         CK_MECHANISM_TYPE type,
+                         CK_MECHANISM_INFO_PTR info)
 {
-	return_val_if_fail (info, CKR_ARGUMENTS_BAD);
-
 	BEGIN_CALL_OR (C_GetMechanismInfo, self, CKR_SLOT_ID_INVALID);
 		IN_ULONG (slot_id);
 		IN_MECHANISM_TYPE (type);
@@ -987,6 +2101,136 @@ rpc_C_GetMechanismInfo (CK_X_FUNCTION_LIST *self,
 	END_CALL;
 }
 
+static CK_RV
+rpc_C_GetSlotList (CK_X_FUNCTION_LIST *self,
+                   CK_BBOOL token_present,
+                   CK_SLOT_ID_PTR slot_list,
+                   CK_ULONG_PTR count)
+{
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	unsigned int generation;
+	CK_RV ret;
+
+	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
+
+	/* Which slots have a token changes without a slot event */
+	if (token_present)
+		return call_get_slot_list (self, token_present, slot_list, count);
+
+	p11_mutex_lock (&module->mutex);
+	if (slots_fresh_inlock (module) && module->slot_list) {
+		ret = slot_fill_list (module->slot_list, module->n_slot_list,
+		                      slot_list, count);
+		p11_mutex_unlock (&module->mutex);
+		return ret;
+	}
+	generation = module->slots_generation;
+	p11_mutex_unlock (&module->mutex);
+
+	ret = call_get_slot_list (self, token_present, slot_list, count);
+
+	/* Only a complete list is worth keeping, unless the slots changed meanwhile */
+	if (ret == CKR_OK && slot_list != NULL) {
+		p11_mutex_lock (&module->mutex);
+		if (slots_fresh_inlock (module) && generation == module->slots_generation &&
+		    !module->slot_list) {
+			module->slot_list = slot_copy_list (slot_list, *count);
+			module->n_slot_list = *count;
+		}
+		p11_mutex_unlock (&module->mutex);
+	}
+
+	return ret;
+}
+
+static CK_RV
+rpc_C_GetMechanismList (CK_X_FUNCTION_LIST *self,
+                        CK_SLOT_ID slot_id,
+                        CK_MECHANISM_TYPE_PTR mechanism_list,
+                        CK_ULONG_PTR count)
+{
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	unsigned int generation;
+	rpc_slot *slot;
+	CK_RV ret;
+
+	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
+
+	p11_mutex_lock (&module->mutex);
+	slot = slot_lookup_inlock (module, slot_id, false);
+	if (slot && slot->mechanisms) {
+		ret = slot_fill_list (slot->mechanisms, slot->n_mechanisms,
+		                      mechanism_list, count);
+		p11_mutex_unlock (&module->mutex);
+		return ret;
+	}
+	generation = module->slots_generation;
+	p11_mutex_unlock (&module->mutex);
+
+	ret = call_get_mechanism_list (self, slot_id, mechanism_list, count);
+
+	/* Only a complete list is worth keeping */
+	if (ret == CKR_OK && mechanism_list != NULL) {
+		p11_mutex_lock (&module->mutex);
+		slot = slot_lookup_inlock (module, slot_id, true);
+		if (slot && generation == module->slots_generation && !slot->mechanisms) {
+			slot->mechanisms = slot_copy_list (mechanism_list, *count);
+			slot->n_mechanisms = *count;
+		}
+		p11_mutex_unlock (&module->mutex);
+	}
+
+	return ret;
+}
+
+static CK_RV
+rpc_C_GetMechanismInfo (CK_X_FUNCTION_LIST *self,
+                        CK_SLOT_ID slot_id,
+                        CK_MECHANISM_TYPE type,
+                        CK_MECHANISM_INFO_PTR info)
+{
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	unsigned int generation;
+	rpc_mechanism *mech;
+	rpc_slot *slot;
+	unsigned int i;
+	CK_RV ret;
+
+	return_val_if_fail (info, CKR_ARGUMENTS_BAD);
+
+	p11_mutex_lock (&module->mutex);
+	slot = slot_lookup_inlock (module, slot_id, false);
+	for (i = 0; slot && i < slot->mechanism_infos->num; i++) {
+		mech = slot->mechanism_infos->elem[i];
+		if (mech->type == type) {
+			memcpy (info, &mech->info, sizeof (CK_MECHANISM_INFO));
+			p11_mutex_unlock (&module->mutex);
+			return CKR_OK;
+		}
+	}
+	generation = module->slots_generation;
+	p11_mutex_unlock (&module->mutex);
+
+	ret = call_get_mechanism_info (self, slot_id, type, info);
+
+	if (ret == CKR_OK) {
+		p11_mutex_lock (&module->mutex);
+		slot = slot_lookup_inlock (module, slot_id, true);
+		if (slot && generation == module->slots_generation) {
+			mech = malloc (sizeof (rpc_mechanism));
+			if (mech != NULL) {
+				mech->type = type;
+				memcpy (&mech->info, info, sizeof (CK_MECHANISM_INFO));
+				if (!p11_array_push (slot->mechanism_infos, mech))
+					free (mech);
+			}
+		}
+		p11_mutex_unlock (&module->mutex);
+	}
+
+	return ret;
+}
+
 static CK_RV
 C_InitToken1 (CK_X_FUNCTION_LIST *self,
               CK_SLOT_ID slot_id,
@@ -1023,6 +2267,9 @@ rpc_C_InitToken (CK_X_FUNCTION_LIST *self,
 {
         uint8_t version = RPC_VERSION;
 
+	slot_drop (((p11_virtual *)self)->lower_module, slot_id);
+	objects_drop (((p11_virtual *)self)->lower_module);
+
         if (version == 0)
 		return C_InitToken1 (self, slot_id, pin, pin_len, label);
 	else
@@ -1041,6 +2288,8 @@ rpc_C_WaitForSlotEvent (CK_X_FUNCTION_LIST *self,
 		IN_ULONG (flags);
 	PROCESS_CALL;
 		OUT_ULONG (slot);
+		if (_ret == CKR_OK)
+			slot_drop (_mod, *slot);
 	END_CALL;
 }
 
@@ -1059,6 +2308,11 @@ rpc_C_OpenSession (CK_X_FUNCTION_LIST *self,
 		IN_ULONG (flags);
 	PROCESS_CALL;
 		OUT_ULONG (session);
+		/* The handle may have belonged to a closed session */
+		if (_ret == CKR_OK) {
+			session_drop (_mod, *session);
+			session_opened (_mod, *session, slot_id);
+		}
 	END_CALL;
 }
 
@@ -1066,9 +2320,12 @@ static CK_RV
 rpc_C_CloseSession (CK_X_FUNCTION_LIST *self,
                     CK_SESSION_HANDLE session)
 {
+	session_drop (((p11_virtual *)self)->lower_module, session);
+
 	BEGIN_CALL_OR (C_CloseSession, self, CKR_SESSION_HANDLE_INVALID);
 		IN_ULONG (session);
 	PROCESS_CALL;
+		session_closed (_mod, session);
 	END_CALL;
 }
 
@@ -1079,6 +2336,7 @@ rpc_C_CloseAllSessions (CK_X_FUNCTION_LIST *self,
 	BEGIN_CALL_OR (C_CloseAllSessions, self, CKR_SLOT_ID_INVALID);
 		IN_ULONG (slot_id);
 	PROCESS_CALL;
+		sessions_closed (_mod, slot_id);
 	END_CALL;
 }
 
@@ -1197,6 +2455,8 @@ rpc_C_CreateObject (CK_X_FUNCTION_LIST *self,
 		IN_ATTRIBUTE_ARRAY (template, count);
 	PROCESS_CALL;
 		OUT_ULONG (new_object);
+		if (_ret == CKR_OK)
+			object_drop (_mod, session, *new_object);
 	END_CALL;
 }
 
@@ -1216,6 +2476,8 @@ rpc_C_CopyObject (CK_X_FUNCTION_LIST *self,
 		IN_ATTRIBUTE_ARRAY (template, count);
 	PROCESS_CALL;
 		OUT_ULONG (new_object);
+		if (_ret == CKR_OK)
+			object_drop (_mod, session, *new_object);
 	END_CALL;
 }
 
@@ -1225,27 +2487,242 @@ rpc_C_DestroyObject (CK_X_FUNCTION_LIST *self,
                      CK_SESSION_HANDLE session,
                      CK_OBJECT_HANDLE object)
 {
-	BEGIN_CALL_OR (C_DestroyObject, self, CKR_SESSION_HANDLE_INVALID);
+	values_forget (((p11_virtual *)self)->lower_module, object);
+	object_drop (((p11_virtual *)self)->lower_module, session, object);
+
+	BEGIN_CALL_OR (C_DestroyObject, self, CKR_SESSION_HANDLE_INVALID);
+		IN_ULONG (session);
+		IN_ULONG (object);
+	PROCESS_CALL;
+	END_CALL;
+}
+
+static CK_RV
+rpc_C_GetObjectSize (CK_X_FUNCTION_LIST *self,
+                     CK_SESSION_HANDLE session,
+                     CK_OBJECT_HANDLE object,
+                     CK_ULONG_PTR size)
+{
+	return_val_if_fail (size, CKR_ARGUMENTS_BAD);
+
+	BEGIN_CALL_OR (C_GetObjectSize, self, CKR_SESSION_HANDLE_INVALID);
+		IN_ULONG (session);
+		IN_ULONG (object);
+	PROCESS_CALL;
+		OUT_ULONG (size);
+	END_CALL;
+}
+
+/*
+ * Answers from the values that came along with the lengths of the
+ * same attributes, when those are all that's asked for. The values
+ * are only kept until the next C_GetAttributeValue on the session,
+ * which also tells whether they are worth asking for next time.
+ */
+static bool
+values_lookup (rpc_client *module,
+               CK_SESSION_HANDLE session,
+               CK_OBJECT_HANDLE object,
+               CK_ATTRIBUTE_PTR template,
+               CK_ULONG count,
+               CK_RV *ret)
+{
+	rpc_values *values;
+	CK_ATTRIBUTE *attr;
+	bool invalid = false;
+	CK_ULONG i;
+
+	p11_mutex_lock (&module->mutex);
+
+	values = p11_dict_get (module->values, &session);
+	if (values == NULL || values->count == 0) {
+		p11_mutex_unlock (&module->mutex);
+		return false;
+	}
+
+	for (i = 0; values->object == object && i < count; i++) {
+		attr = p11_attrs_findn (values->attrs, values->count, template[i].type);
+		if (attr == NULL)
+			break;
+		if (attr->ulValueLen == (CK_ULONG)-1)
+			invalid = true;
+		else if (template[i].pValue == NULL)
+			continue;
+		else if (IS_ATTRIBUTE_ARRAY (attr) || template[i].ulValueLen < attr->ulValueLen)
+			break;
+	}
+
+	/* Only the values of the same attributes are of any use */
+	values->wanted = values->object == object && i == count;
+	for (i = 0; values->wanted && i < count; i++) {
+		if (template[i].pValue != NULL)
+			break;
+	}
+	values->wanted = values->wanted && i != count;
+
+	/* Anything else is up to the module */
+	if (!values->wanted || !values->fetched || (invalid && values->rv == CKR_OK)) {
+		values_clear (values);
+		p11_mutex_unlock (&module->mutex);
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		attr = p11_attrs_findn (values->attrs, values->count, template[i].type);
+		if (template[i].pValue != NULL && attr->ulValueLen != (CK_ULONG)-1)
+			memcpy (template[i].pValue, attr->pValue, attr->ulValueLen);
+		template[i].ulValueLen = attr->ulValueLen;
+	}
+
+	*ret = invalid ? values->rv : CKR_OK;
+	values_clear (values);
+	p11_mutex_unlock (&module->mutex);
+	return true;
+}
+
+static CK_RV
+call_get_attribute_value (CK_X_FUNCTION_LIST *self,
+                          CK_SESSION_HANDLE session,
+                          CK_OBJECT_HANDLE object,
+                          CK_ATTRIBUTE_PTR template,
+                          CK_ULONG count)
+{
+	BEGIN_CALL_OR (C_GetAttributeValue, self, CKR_SESSION_HANDLE_INVALID);
 		IN_ULONG (session);
 		IN_ULONG (object);
+		IN_ATTRIBUTE_BUFFER (template, count);
 	PROCESS_CALL;
+		OUT_ATTRIBUTE_ARRAY (template, count);
 	END_CALL;
 }
 
+/* Whether the next call for an object should find out if it can be kept */
+static bool
+object_unknown (rpc_client *module,
+                CK_SESSION_HANDLE session,
+                CK_OBJECT_HANDLE object)
+{
+	rpc_object_id id;
+	bool unknown;
+
+	/* Without batches that would take a round trip of its own */
+	if (module->objects_max == 0 || module->version < 2)
+		return false;
+
+	p11_mutex_lock (&module->mutex);
+	unknown = object_id_inlock (module, session, object, &id) &&
+	          p11_dict_get (module->objects, &id) == NULL;
+	p11_mutex_unlock (&module->mutex);
+
+	return unknown;
+}
+
+static void
+object_learn (rpc_client *module,
+              CK_SESSION_HANDLE session,
+              CK_OBJECT_HANDLE object,
+              bool cacheable)
+{
+	rpc_object *obj;
+
+	obj = calloc (1, sizeof (rpc_object));
+	return_if_fail (obj != NULL);
+
+	obj->size = sizeof (rpc_object);
+	obj->cacheable = cacheable;
+
+	p11_mutex_lock (&module->mutex);
+	if (!object_id_inlock (module, session, object, &obj->id) ||
+	    p11_dict_get (module->objects, &obj->id) != NULL ||
+	    !p11_dict_set (module->objects, &obj->id, obj)) {
+		object_free (obj);
+	} else {
+		module->objects_size += obj->size;
+		object_touch_inlock (module, obj);
+		objects_trim_inlock (module);
+	}
+	p11_mutex_unlock (&module->mutex);
+}
+
+/*
+ * Gets the attributes along with finding out whether they may be
+ * kept, in the same round trip: only for public token objects that
+ * can't be modified, and never for keys other than public ones. The
+ * values come along with the lengths when @values is set.
+ */
 static CK_RV
-rpc_C_GetObjectSize (CK_X_FUNCTION_LIST *self,
-                     CK_SESSION_HANDLE session,
-                     CK_OBJECT_HANDLE object,
-                     CK_ULONG_PTR size)
+object_probe (CK_X_FUNCTION_LIST *self,
+              CK_SESSION_HANDLE session,
+              CK_OBJECT_HANDLE object,
+              CK_ATTRIBUTE_PTR template,
+              CK_ULONG count,
+              rpc_values **values)
 {
-	return_val_if_fail (size, CKR_ARGUMENTS_BAD);
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	CK_OBJECT_CLASS klass;
+	CK_BBOOL token, modifiable, private;
+	CK_ATTRIBUTE probe[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_TOKEN, &token, sizeof (token) },
+		{ CKA_MODIFIABLE, &modifiable, sizeof (modifiable) },
+		{ CKA_PRIVATE, &private, sizeof (private) },
+	};
+	p11_rpc_message msgs[2];
+	CK_RV rvs[2] = { CKR_FUNCTION_CANCELED, CKR_FUNCTION_CANCELED };
+	CK_RV ret;
 
-	BEGIN_CALL_OR (C_GetObjectSize, self, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (object);
-	PROCESS_CALL;
-		OUT_ULONG (size);
-	END_CALL;
+	p11_debug ("C_GetAttributeValue: enter");
+
+	ret = call_prepare (module, &msgs[0], values ? P11_RPC_CALL_C_GetAttributeValue2
+	                                             : P11_RPC_CALL_C_GetAttributeValue);
+	if (ret == CKR_DEVICE_REMOVED)
+		return CKR_SESSION_HANDLE_INVALID;
+	if (ret != CKR_OK)
+		return ret;
+
+	ret = call_prepare (module, &msgs[1], P11_RPC_CALL_C_GetAttributeValue);
+	if (ret != CKR_OK) {
+		call_done (module, &msgs[0], ret);
+		return ret;
+	}
+
+	/* The question comes after, so the call is not held up if it fails */
+	if (!p11_rpc_message_write_ulong (&msgs[0], session) ||
+	    !p11_rpc_message_write_ulong (&msgs[0], object) ||
+	    !p11_rpc_message_write_attribute_buffer (&msgs[0], template, count) ||
+	    !p11_rpc_message_write_ulong (&msgs[1], session) ||
+	    !p11_rpc_message_write_ulong (&msgs[1], object) ||
+	    !p11_rpc_message_write_attribute_buffer (&msgs[1], probe, 4))
+		ret = CKR_HOST_MEMORY;
+
+	if (ret == CKR_OK)
+		ret = call_run_batch (module, session, msgs, rvs, 2);
+	if (ret == CKR_OK)
+		ret = rvs[0];
+	if (ret == CKR_OK && values)
+		ret = proto_read_attribute_values (&msgs[0], template, count, values);
+	else if (ret == CKR_OK)
+		ret = proto_read_attribute_array (&msgs[0], template, count);
+
+	if (rvs[1] == CKR_OK)
+		rvs[1] = proto_read_attribute_array (&msgs[1], probe, 4);
+	rvs[1] = call_done (module, &msgs[1], rvs[1]);
+	if (rvs[1] == CKR_OK || rvs[1] == CKR_ATTRIBUTE_TYPE_INVALID ||
+	    rvs[1] == CKR_ATTRIBUTE_SENSITIVE) {
+		object_learn (module, session, object,
+		              rvs[1] == CKR_OK && token && !modifiable && !private &&
+		              klass != CKO_PRIVATE_KEY && klass != CKO_SECRET_KEY &&
+		              klass != CKO_OTP_KEY);
+	}
+
+	ret = call_done (module, &msgs[0], ret);
+	if (ret == CKR_DEVICE_REMOVED || ret == CKR_TOKEN_NOT_PRESENT) {
+		slots_drop (module);
+		objects_drop (module);
+	}
+
+	p11_debug ("ret: %lu", ret);
+	return ret;
 }
 
 static CK_RV
@@ -1255,12 +2732,84 @@ rpc_C_GetAttributeValue (CK_X_FUNCTION_LIST *self,
                          CK_ATTRIBUTE_PTR template,
                          CK_ULONG count)
 {
-	BEGIN_CALL_OR (C_GetAttributeValue, self, CKR_SESSION_HANDLE_INVALID);
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	rpc_values *values = NULL;
+	bool probe;
+	CK_ULONG i;
+	CK_RV ret;
+
+	/* The values that came along are used up first, to tell they were wanted */
+	if (values_lookup (module, session, object, template, count, &ret))
+		return ret;
+	if (object_lookup (module, session, object, template, count, &ret))
+		return ret;
+
+	probe = count != 0 && template != NULL && object_unknown (module, session, object);
+
+	/* When asking for lengths, the values come along too */
+	for (i = 0; i < count; i++) {
+		if (template[i].pValue != NULL)
+			break;
+	}
+
+	if (RPC_VERSION < 2 || count == 0 || i != count) {
+		if (probe)
+			ret = object_probe (self, session, object, template, count, NULL);
+		else
+			ret = call_get_attribute_value (self, session, object, template, count);
+		object_store (module, session, object, template, count, ret);
+		return ret;
+	}
+
+	/* Remember the lengths, to see whether the values are asked for next */
+	if (!values_wanted (module, session)) {
+		if (probe)
+			ret = object_probe (self, session, object, template, count, NULL);
+		else
+			ret = call_get_attribute_value (self, session, object, template, count);
+		object_store (module, session, object, template, count, ret);
+		values = calloc (1, sizeof (rpc_values));
+		return_val_if_fail (values != NULL, ret);
+		values->attrs = calloc (count + 1, sizeof (CK_ATTRIBUTE));
+		if (values->attrs == NULL) {
+			free (values);
+			return_val_if_reached (ret);
+		}
+		for (i = 0; i < count; i++) {
+			values->attrs[i].type = template[i].type;
+			values->attrs[i].ulValueLen = template[i].ulValueLen;
+		}
+		values->count = count;
+		values->session = session;
+		values->object = object;
+		values->rv = ret;
+		values_keep (module, values);
+		return ret;
+	}
+
+	if (probe) {
+		ret = object_probe (self, session, object, template, count, &values);
+		if (values != NULL) {
+			object_store (module, session, object, values->attrs, values->count, values->rv);
+			values->session = session;
+			values->object = object;
+			values_keep (module, values);
+		}
+		return ret;
+	}
+
+	BEGIN_CALL_OR (C_GetAttributeValue2, self, CKR_SESSION_HANDLE_INVALID);
 		IN_ULONG (session);
 		IN_ULONG (object);
 		IN_ATTRIBUTE_BUFFER (template, count);
 	PROCESS_CALL;
-		OUT_ATTRIBUTE_ARRAY (template, count);
+		_ret = proto_read_attribute_values (&_msg, template, count, &values);
+		if (values != NULL) {
+			object_store (_mod, session, object, values->attrs, values->count, values->rv);
+			values->session = session;
+			values->object = object;
+			values_keep (_mod, values);
+		}
 	END_CALL;
 }
 
@@ -1271,6 +2820,9 @@ rpc_C_SetAttributeValue (CK_X_FUNCTION_LIST *self,
                          CK_ATTRIBUTE_PTR template,
                          CK_ULONG count)
 {
+	values_forget (((p11_virtual *)self)->lower_module, object);
+	object_drop (((p11_virtual *)self)->lower_module, session, object);
+
 	BEGIN_CALL_OR (C_SetAttributeValue, self, CKR_SESSION_HANDLE_INVALID);
 		IN_ULONG (session);
 		IN_ULONG (object);
@@ -1279,21 +2831,108 @@ rpc_C_SetAttributeValue (CK_X_FUNCTION_LIST *self,
 	END_CALL;
 }
 
+static CK_RV
+rpc_C_FindObjectsFinal (CK_X_FUNCTION_LIST *self,
+                        CK_SESSION_HANDLE session);
+
+/*
+ * The first handles are asked for in the same round trip as
+ * C_FindObjectsInit, and kept until the caller wants them.
+ */
 static CK_RV
 rpc_C_FindObjectsInit (CK_X_FUNCTION_LIST *self,
                        CK_SESSION_HANDLE session,
                        CK_ATTRIBUTE_PTR template,
                        CK_ULONG count)
 {
-	BEGIN_CALL_OR (C_FindObjectsInit, self, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ATTRIBUTE_ARRAY (template, count);
-	PROCESS_CALL;
-	END_CALL;
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	p11_rpc_message msgs[2];
+	rpc_find *find = NULL;
+	CK_RV rvs[2] = { CKR_FUNCTION_CANCELED, CKR_FUNCTION_CANCELED };
+	CK_ULONG window;
+	CK_RV ret;
+
+	p11_debug ("C_FindObjectsInit: enter");
+
+	if (count != 0 && template == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	ret = call_prepare (module, &msgs[0], P11_RPC_CALL_C_FindObjectsInit);
+	if (ret == CKR_DEVICE_REMOVED)
+		return CKR_SESSION_HANDLE_INVALID;
+	if (ret != CKR_OK)
+		return ret;
+
+	if (!p11_rpc_message_write_ulong (&msgs[0], session) ||
+	    !p11_rpc_message_write_attribute_array (&msgs[0], template, count))
+		ret = CKR_HOST_MEMORY;
+
+	/* Without batches, the handles are only asked for when needed */
+	window = find_window (module, NULL);
+	if (ret != CKR_OK || module->version < 2 || window == 0) {
+		if (ret == CKR_OK)
+			ret = call_run (module, &msgs[0]);
+		if (ret == CKR_OK)
+			find_drop (module, session);
+		ret = call_done (module, &msgs[0], ret);
+		p11_debug ("ret: %lu", ret);
+		return ret;
+	}
+
+	/* Somewhere to put the handles, before asking for them */
+	find = find_new (session, window);
+	if (find == NULL) {
+		call_done (module, &msgs[0], CKR_HOST_MEMORY);
+		return CKR_HOST_MEMORY;
+	}
+
+	ret = call_prepare (module, &msgs[1], P11_RPC_CALL_C_FindObjects);
+	if (ret != CKR_OK) {
+		find_free (find);
+		call_done (module, &msgs[0], ret);
+		return ret;
+	}
+
+	if (!p11_rpc_message_write_ulong (&msgs[1], session) ||
+	    !p11_rpc_message_write_ulong_buffer (&msgs[1], window))
+		ret = CKR_HOST_MEMORY;
+
+	if (ret == CKR_OK)
+		ret = call_run_batch (module, session, msgs, rvs, 2);
+	if (ret == CKR_OK)
+		ret = rvs[0];
+
+	if (ret == CKR_OK && rvs[1] == CKR_OK) {
+		rvs[1] = proto_read_ulong_array (&msgs[1], find->objects,
+		                                 &find->num, window);
+		find->done = find->num == 0;
+	}
+
+	rvs[1] = call_done (module, &msgs[1], rvs[1]);
+	ret = call_done (module, &msgs[0], ret);
+
+	if (ret == CKR_OK && rvs[1] == CKR_OK) {
+		if (!find_keep (module, find))
+			rvs[1] = CKR_HOST_MEMORY;
+	} else {
+		find_free (find);
+	}
+
+	/*
+	 * The server already handed out the first handles, so the search
+	 * can't go on without them. It is ended and the error is reported.
+	 */
+	if (ret == CKR_OK && rvs[1] != CKR_OK) {
+		rpc_C_FindObjectsFinal (self, session);
+		ret = rvs[1];
+	}
+
+	p11_debug ("ret: %lu", ret);
+	return ret;
 }
 
 static CK_RV
-rpc_C_FindObjects (CK_X_FUNCTION_LIST *self,
+call_find_objects (CK_X_FUNCTION_LIST *self,
                    CK_SESSION_HANDLE session,
                    CK_OBJECT_HANDLE_PTR objects,
                    CK_ULONG max_count,
@@ -1302,8 +2941,6 @@ rpc_C_FindObjects (CK_X_FUNCTION_LIST *self,
 	/* HACK: To fix a stupid gcc warning */
 	CK_ULONG_PTR address_of_max_count = &max_count;
 
-	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
-
 	BEGIN_CALL_OR (C_FindObjects, self, CKR_SESSION_HANDLE_INVALID);
 		IN_ULONG (session);
 		IN_ULONG_BUFFER (objects, address_of_max_count);
@@ -1313,10 +2950,112 @@ rpc_C_FindObjects (CK_X_FUNCTION_LIST *self,
 	END_CALL;
 }
 
+/*
+ * Asks the server for more handles than the caller wants when that
+ * is a small number, and keeps the rest for the calls after.
+ */
+static CK_RV
+find_fetch (CK_X_FUNCTION_LIST *self,
+            CK_SESSION_HANDLE session,
+            CK_OBJECT_HANDLE_PTR objects,
+            CK_ULONG max_count,
+            CK_ULONG window,
+            CK_ULONG_PTR count)
+{
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	rpc_find *find;
+	CK_RV ret;
+
+	if (window <= max_count)
+		return call_find_objects (self, session, objects, max_count, count);
+
+	find = find_new (session, window);
+	if (find == NULL)
+		return call_find_objects (self, session, objects, max_count, count);
+
+	ret = call_find_objects (self, session, find->objects, window, &find->num);
+	if (ret != CKR_OK) {
+		find_free (find);
+		return ret;
+	}
+
+	*count = find->num < max_count ? find->num : max_count;
+	memcpy (objects, find->objects, *count * sizeof (CK_OBJECT_HANDLE));
+	find->at = *count;
+	find->done = find->num == 0;
+
+	/* The rest of the handles would be lost otherwise */
+	if (!find_keep (module, find))
+		return CKR_HOST_MEMORY;
+	return CKR_OK;
+}
+
+static CK_RV
+rpc_C_FindObjects (CK_X_FUNCTION_LIST *self,
+                   CK_SESSION_HANDLE session,
+                   CK_OBJECT_HANDLE_PTR objects,
+                   CK_ULONG max_count,
+                   CK_ULONG_PTR count)
+{
+	rpc_client *module = ((p11_virtual *)self)->lower_module;
+	CK_ULONG window;
+	CK_ULONG num = 0;
+	rpc_find *find;
+	bool done;
+	CK_RV ret;
+
+	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
+
+	p11_mutex_lock (&module->mutex);
+
+	find = p11_dict_get (module->finds, &session);
+	if (find == NULL) {
+		window = find_window (module, NULL);
+		p11_mutex_unlock (&module->mutex);
+
+		/* Any error is for the module to report */
+		if (objects == NULL || max_count == 0)
+			return call_find_objects (self, session, objects, max_count, count);
+		return find_fetch (self, session, objects, max_count, window, count);
+	}
+
+	if (objects == NULL || max_count == 0) {
+		p11_mutex_unlock (&module->mutex);
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	num = find->num - find->at;
+	if (num > max_count)
+		num = max_count;
+	memcpy (objects, find->objects + find->at, num * sizeof (CK_OBJECT_HANDLE));
+	find->at += num;
+	done = find->done;
+	window = find_window (module, find);
+
+	/* Once used up, the rest comes from the server */
+	if (find->at == find->num && !done)
+		p11_dict_remove (module->finds, &session);
+
+	p11_mutex_unlock (&module->mutex);
+
+	if (num == max_count || done) {
+		*count = num;
+		return CKR_OK;
+	}
+
+	ret = find_fetch (self, session, objects + num, max_count - num, window, count);
+	if (ret == CKR_OK)
+		*count += num;
+	p11_debug ("ret: %lu", ret);
+	return ret;
+}
+
 static CK_RV
 rpc_C_FindObjectsFinal (CK_X_FUNCTION_LIST *self,
                         CK_SESSION_HANDLE session)
 {
+	find_drop (((p11_virtual *)self)->lower_module, session);
+
 	BEGIN_CALL_OR (C_FindObjectsFinal, self, CKR_SESSION_HANDLE_INVALID);
 		IN_ULONG (session);
 	PROCESS_CALL;
@@ -1804,6 +3543,8 @@ rpc_C_GenerateKey (CK_X_FUNCTION_LIST *self,
 		IN_ATTRIBUTE_ARRAY (template, count);
 	PROCESS_CALL;
 		OUT_ULONG (key);
+		if (_ret == CKR_OK)
+			object_drop (_mod, session, *key);
 	END_CALL;
 }
 
@@ -1826,6 +3567,10 @@ rpc_C_GenerateKeyPair (CK_X_FUNCTION_LIST *self,
 	PROCESS_CALL;
 		OUT_ULONG (pub_key);
 		OUT_ULONG (priv_key);
+		if (_ret == CKR_OK) {
+			object_drop (_mod, session, *pub_key);
+			object_drop (_mod, session, *priv_key);
+		}
 	END_CALL;
 }
 
@@ -1870,6 +3615,8 @@ rpc_C_UnwrapKey (CK_X_FUNCTION_LIST *self,
 		IN_ATTRIBUTE_ARRAY (template, count);
 	PROCESS_CALL;
 		OUT_ULONG (key);
+		if (_ret == CKR_OK)
+			object_drop (_mod, session, *key);
 	END_CALL;
 }
 
@@ -1889,6 +3636,8 @@ rpc_C_DeriveKey (CK_X_FUNCTION_LIST *self,
 		IN_ATTRIBUTE_ARRAY (template, count);
 	PROCESS_CALL;
 		OUT_ULONG (key);
+		if (_ret == CKR_OK)
+			object_drop (_mod, session, *key);
 	END_CALL;
 }
 
@@ -1944,6 +3693,9 @@ rpc_C_SessionCancel (CK_X_FUNCTION_LIST *self,
                      CK_SESSION_HANDLE session,
                      CK_FLAGS flags)
 {
+	if (flags & CKF_FIND_OBJECTS)
+		find_drop (((p11_virtual *)self)->lower_module, session);
+
 	BEGIN_CALL_OR (C_SessionCancel, self, CKR_SESSION_HANDLE_INVALID);
 		IN_ULONG (session)
 		IN_ULONG (flags)
@@ -2381,6 +4133,14 @@ static void
 rpc_client_free (void *data)
 {
 	rpc_client *client = data;
+	p11_dict_free (client->finds);
+	p11_dict_free (client->values);
+	p11_dict_free (client->slots);
+	p11_dict_free (client->sessions);
+	p11_dict_free (client->objects);
+	slot_list_clear_inlock (client);
+	buffers_free (client);
+	p11_mutex_uninit (&client->buffers_mutex);
 	p11_mutex_uninit (&client->mutex);
 	free (client);
 }
@@ -2390,6 +4150,9 @@ p11_rpc_client_init (p11_virtual *virt,
                      p11_rpc_client_vtable *vtable)
 {
 	rpc_client *client;
+	unsigned long value;
+	const char *env;
+	char *end;
 
 	p11_message_clear ();
 
@@ -2399,13 +4162,295 @@ p11_rpc_client_init (p11_virtual *virt,
 	return_val_if_fail (vtable->disconnect != NULL, false);
 
 	P11_RPC_CHECK_CALLS ();
+	p11_rpc_stats_enable (&p11_rpc_client_stats, "client");
 
 	client = calloc (1, sizeof (rpc_client));
 	return_val_if_fail (client != NULL, false);
 
+	client->finds = p11_dict_new (p11_dict_ulongptr_hash, p11_dict_ulongptr_equal,
+	                              NULL, find_free);
+	client->values = p11_dict_new (p11_dict_ulongptr_hash, p11_dict_ulongptr_equal,
+	                               NULL, values_free);
+	client->slots = p11_dict_new (p11_dict_ulongptr_hash, p11_dict_ulongptr_equal,
+	                              NULL, slot_free);
+	client->sessions = p11_dict_new (p11_dict_ulongptr_hash, p11_dict_ulongptr_equal,
+	                                 NULL, free);
+	client->objects = p11_dict_new (object_id_hash, object_id_equal,
+	                                NULL, object_free);
+	if (client->finds == NULL || client->values == NULL ||
+	    client->slots == NULL || client->sessions == NULL ||
+	    client->objects == NULL) {
+		p11_dict_free (client->finds);
+		p11_dict_free (client->values);
+		p11_dict_free (client->slots);
+		p11_dict_free (client->sessions);
+		p11_dict_free (client->objects);
+		free (client);
+		return_val_if_reached (false);
+	}
+
+	/* How many handles C_FindObjects may ask for ahead of the caller */
+	client->find_prefetch = FIND_PREFETCH_MAX;
+	env = secure_getenv ("P11_KIT_RPC_PREFETCH");
+	if (env != NULL) {
+		value = strtoul (env, &end, 10);
+		if (end == env || *end != '\0')
+			p11_message (_("invalid P11_KIT_RPC_PREFETCH: %s"), env);
+		else
+			client->find_prefetch = value;
+	}
+
+	/* How many seconds slot information may be kept, if at all */
+	env = secure_getenv ("P11_KIT_RPC_CACHE_TTL");
+	if (env != NULL) {
+		value = strtoul (env, &end, 10);
+		if (end == env || *end != '\0')
+			p11_message (_("invalid P11_KIT_RPC_CACHE_TTL: %s"), env);
+		else
+			client->cache_ttl = value;
+	}
+
+	/* How many bytes the attributes of unchanging objects may take */
+	env = secure_getenv ("P11_KIT_RPC_ATTRIBUTE_CACHE");
+	if (env != NULL) {
+		value = strtoul (env, &end, 10);
+		if (end == env || *end != '\0')
+			p11_message (_("invalid P11_KIT_RPC_ATTRIBUTE_CACHE: %s"), env);
+		else
+			client->objects_max = value;
+	}
+
 	p11_mutex_init (&client->mutex);
+	p11_mutex_init (&client->buffers_mutex);
 	client->vtable = vtable;
 
 	p11_virtual_init (virt, &rpc_functions, client, rpc_client_free);
 	return true;
 }
+
+/*
+ * A single part operation submitted without waiting for its result. The
+ * initialization and the operation go to the server as a batch, so that
+ * a single response completes both. An output buffer that is too small
+ * leaves the operation active, and the caller can't continue it without
+ * waiting. So the batch ends by initializing again with no mechanism,
+ * which ends the operation if it's still active, and whose result is
+ * of no interest.
+ */
+#define ASYNC_INIT 0
+#define ASYNC_CALL 1
+#define ASYNC_CANCEL 2
+#define ASYNC_CALLS 3
+
+typedef struct {
+	rpc_client *module;
+	p11_rpc_message msg;
+	p11_rpc_message msgs[ASYNC_CALLS];
+	CK_BYTE_PTR output;
+	CK_ULONG output_len;
+	p11_rpc_client_complete complete;
+	void *user_data;
+} rpc_async;
+
+static void
+async_complete (CK_RV ret,
+                void *data)
+{
+	rpc_async *async = data;
+	rpc_client *module = async->module;
+	CK_ULONG output_len = async->output_len;
+	CK_RV rvs[ASYNC_CALLS];
+
+	if (async->msg.probe)
+		call_received (&async->msg);
+	if (ret == CKR_OK)
+		ret = call_parse (module, &async->msg, P11_RPC_CALL_BATCH);
+	ret = call_parse_batch (module, &async->msg, async->msgs, rvs, ASYNC_CALLS, ret);
+
+	if (ret == CKR_OK)
+		ret = rvs[ASYNC_INIT];
+	if (ret == CKR_OK)
+		ret = rvs[ASYNC_CALL];
+	if (ret == CKR_OK)
+		ret = proto_read_byte_array (&async->msgs[ASYNC_CALL], async->output,
+		                             &output_len, async->output_len);
+
+	call_done (module, &async->msgs[ASYNC_CANCEL], CKR_FUNCTION_CANCELED);
+	call_done (module, &async->msgs[ASYNC_INIT], ret);
+	ret = call_done (module, &async->msgs[ASYNC_CALL], ret);
+	if (ret == CKR_DEVICE_REMOVED || ret == CKR_TOKEN_NOT_PRESENT) {
+		slots_drop (module);
+		objects_drop (module);
+	}
+
+	p11_debug ("async ret: %lu", ret);
+	(async->complete) (ret, output_len, async->user_data);
+	free (async);
+}
+
+static CK_RV
+async_submit (p11_virtual *virt,
+              int init_id,
+              int call_id,
+              CK_SESSION_HANDLE session,
+              CK_MECHANISM_PTR mechanism,
+              CK_OBJECT_HANDLE key,
+              CK_BYTE_PTR input,
+              CK_ULONG input_len,
+              CK_BYTE_PTR output,
+              CK_ULONG output_len,
+              p11_rpc_client_complete complete,
+              void *user_data)
+{
+	rpc_client *module;
+	rpc_async *async;
+	p11_rpc_message *msgs;
+	int i;
+	CK_RV ret;
+
+	return_val_if_fail (virt != NULL, CKR_ARGUMENTS_BAD);
+	return_val_if_fail (complete != NULL, CKR_ARGUMENTS_BAD);
+
+	module = virt->lower_module;
+	if (module->vtable->submit == NULL || module->vtable->dispatch == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	/* There is no asking for the output length without waiting */
+	if ((input_len != 0 && input == NULL) || output == NULL || output_len == 0)
+		return CKR_ARGUMENTS_BAD;
+
+	async = calloc (1, sizeof (rpc_async));
+	return_val_if_fail (async != NULL, CKR_HOST_MEMORY);
+	async->module = module;
+	async->output = output;
+	async->output_len = output_len;
+	async->complete = complete;
+	async->user_data = user_data;
+
+	msgs = async->msgs;
+
+	ret = call_prepare (module, &msgs[ASYNC_INIT], init_id);
+	if (ret == CKR_DEVICE_REMOVED)
+		ret = CKR_SESSION_HANDLE_INVALID;
+	if (ret != CKR_OK) {
+		free (async);
+		return ret;
+	}
+
+	/* Batches came with version 2 */
+	if (module->version < 2)
+		ret = CKR_FUNCTION_NOT_SUPPORTED;
+
+	if (ret == CKR_OK &&
+	    !p11_rpc_message_write_ulong (&msgs[ASYNC_INIT], session))
+		ret = CKR_HOST_MEMORY;
+	if (ret == CKR_OK)
+		ret = proto_write_mechanism (&msgs[ASYNC_INIT], mechanism);
+	if (ret == CKR_OK &&
+	    !p11_rpc_message_write_ulong (&msgs[ASYNC_INIT], key))
+		ret = CKR_HOST_MEMORY;
+
+	for (i = ASYNC_CALL; ret == CKR_OK && i < ASYNC_CALLS; i++)
+		ret = call_prepare (module, &msgs[i], i == ASYNC_CALL ? call_id : init_id);
+
+	if (ret == CKR_OK &&
+	    (!p11_rpc_message_write_ulong (&msgs[ASYNC_CALL], session) ||
+	     !p11_rpc_message_write_byte_array (&msgs[ASYNC_CALL], input, input_len) ||
+	     !p11_rpc_message_write_byte_buffer (&msgs[ASYNC_CALL], output_len) ||
+	     !p11_rpc_message_write_ulong (&msgs[ASYNC_CANCEL], session) ||
+	     proto_write_mechanism (&msgs[ASYNC_CANCEL], NULL) != CKR_OK ||
+	     !p11_rpc_message_write_ulong (&msgs[ASYNC_CANCEL], 0)))
+		ret = CKR_HOST_MEMORY;
+
+	if (ret == CKR_OK)
+		ret = call_prepare_batch (module, session, msgs, ASYNC_CALLS, &async->msg);
+
+	if (ret == CKR_OK) {
+		assert (p11_rpc_message_is_verified (&async->msg));
+		if (async->msg.probe)
+			call_sent (&async->msg);
+		ret = (module->vtable->submit) (module->vtable,
+		                                async->msg.output,
+		                                async->msg.input,
+		                                async_complete, async);
+		if (ret != CKR_OK)
+			call_done (module, &async->msg, ret);
+	}
+
+	if (ret != CKR_OK) {
+		/* Those not prepared were never touched */
+		for (i = 0; i < ASYNC_CALLS && msgs[i].output != NULL; i++)
+			call_done (module, &msgs[i], ret);
+		free (async);
+	}
+
+	return ret;
+}
+
+/*
+ * Starts a signature with @mechanism and @key, and signs @data with it,
+ * without waiting for the result. The signature goes in @signature,
+ * which must stay around until @complete is called with the result and
+ * the length of the signature.
+ *
+ * The callback is called from p11_rpc_client_dispatch(), or from another
+ * thread that waits for the response to a call on the same connection.
+ * It must not make calls that wait for their response itself. When
+ * @signature is too small, the callback gets CKR_BUFFER_TOO_SMALL with
+ * the length needed, and the operation is no longer active.
+ */
+CK_RV
+p11_rpc_client_sign_async (p11_virtual *virt,
+                           CK_SESSION_HANDLE session,
+                           CK_MECHANISM_PTR mechanism,
+                           CK_OBJECT_HANDLE key,
+                           CK_BYTE_PTR data,
+                           CK_ULONG data_len,
+                           CK_BYTE_PTR signature,
+                           CK_ULONG signature_len,
+                           p11_rpc_client_complete complete,
+                           void *user_data)
+{
+	return async_submit (virt, P11_RPC_CALL_C_SignInit, P11_RPC_CALL_C_Sign,
+	                     session, mechanism, key, data, data_len,
+	                     signature, signature_len, complete, user_data);
+}
+
+/* As p11_rpc_client_sign_async(), but decrypts */
+CK_RV
+p11_rpc_client_decrypt_async (p11_virtual *virt,
+                              CK_SESSION_HANDLE session,
+                              CK_MECHANISM_PTR mechanism,
+                              CK_OBJECT_HANDLE key,
+                              CK_BYTE_PTR encrypted_data,
+                              CK_ULONG encrypted_data_len,
+                              CK_BYTE_PTR data,
+                              CK_ULONG data_len,
+                              p11_rpc_client_complete complete,
+                              void *user_data)
+{
+	return async_submit (virt, P11_RPC_CALL_C_DecryptInit, P11_RPC_CALL_C_Decrypt,
+	                     session, mechanism, key, encrypted_data, encrypted_data_len,
+	                     data, data_len, complete, user_data);
+}
+
+/*
+ * Calls the callbacks of the submitted operations whose results have
+ * arrived, without waiting for more. Results may already have been read
+ * off the transport by a call that waited for its own, so this is called
+ * before waiting for the file descriptor of the transport to be readable,
+ * and again each time it is.
+ */
+CK_RV
+p11_rpc_client_dispatch (p11_virtual *virt)
+{
+	rpc_client *module;
+
+	return_val_if_fail (virt != NULL, CKR_ARGUMENTS_BAD);
+
+	module = virt->lower_module;
+	if (module->vtable->dispatch == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	return (module->vtable->dispatch) (module->vtable);
+}
@@ -42,6 +42,7 @@
 #include "message.h"
 #include "private.h"
 #include "rpc-message.h"
+#include "p11-kit/rpc-calls-generated.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -56,6 +57,125 @@
 
 #define ELEMS(x) (sizeof (x) / sizeof (x[0]))
 
+struct _p11_rpc_arena_chunk {
+	p11_rpc_arena_chunk *next;
+	size_t size;
+};
+
+/* Enough for anything that is allocated from an arena */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND (sizeof (p11_rpc_arena_chunk))
+
+/* The first chunk, when nothing is known about what is needed yet */
+#define ARENA_CHUNK 1024
+
+void
+p11_rpc_arena_init (p11_rpc_arena *arena,
+                    size_t retain,
+                    void * (* frealloc) (void *data, size_t size),
+                    void (* ffree) (void *data))
+{
+	assert (arena != NULL);
+	assert (frealloc != NULL);
+	assert (ffree != NULL);
+
+	memset (arena, 0, sizeof (*arena));
+	arena->retain = retain;
+	arena->frealloc = frealloc;
+	arena->ffree = ffree;
+}
+
+void *
+p11_rpc_arena_alloc (p11_rpc_arena *arena,
+                     size_t length)
+{
+	p11_rpc_arena_chunk *chunk;
+	size_t size;
+
+	assert (arena != NULL);
+
+	if (length > SIZE_MAX - ARENA_HEADER - ARENA_ALIGN)
+		return NULL;
+	length = ARENA_ROUND (length);
+
+	chunk = arena->chunks;
+	if (chunk == NULL || chunk->size - arena->used < length) {
+		/* The first one should fit what was needed last time */
+		size = chunk ? ARENA_CHUNK : arena->wanted;
+		if (size < ARENA_CHUNK)
+			size = ARENA_CHUNK;
+		if (size < length)
+			size = length;
+
+		chunk = (arena->frealloc) (NULL, ARENA_HEADER + size);
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->size = size;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->used = 0;
+	}
+
+	arena->used += length;
+	return (unsigned char *)chunk + ARENA_HEADER + arena->used - length;
+}
+
+static void
+arena_free_chunks (p11_rpc_arena *arena)
+{
+	p11_rpc_arena_chunk *chunk;
+	size_t used = arena->used;
+
+	/* These held whatever was decoded, PINs and key material too */
+	while (arena->chunks != NULL) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		memset ((unsigned char *)chunk + ARENA_HEADER, 0, used);
+		(arena->ffree) (chunk);
+
+		/* Only the newest chunk is partly used */
+		if (arena->chunks != NULL)
+			used = arena->chunks->size;
+	}
+
+	arena->used = 0;
+}
+
+void
+p11_rpc_arena_reset (p11_rpc_arena *arena)
+{
+	p11_rpc_arena_chunk *chunk;
+	size_t total = 0;
+
+	assert (arena != NULL);
+
+	for (chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
+		total += chunk->size;
+
+	/* A single chunk is reused as it is */
+	if (arena->chunks != NULL && arena->chunks->next == NULL &&
+	    total <= arena->retain) {
+		memset ((unsigned char *)arena->chunks + ARENA_HEADER, 0, arena->used);
+		arena->used = 0;
+		return;
+	}
+
+	/* Otherwise the next round gets one chunk large enough for this one */
+	arena_free_chunks (arena);
+	arena->wanted = total <= arena->retain ? total : 0;
+}
+
+void
+p11_rpc_arena_uninit (p11_rpc_arena *arena)
+{
+	assert (arena != NULL);
+
+	arena_free_chunks (arena);
+	arena->wanted = 0;
+}
+
 void
 p11_rpc_message_init (p11_rpc_message *msg,
                       p11_buffer *input,
@@ -70,57 +190,45 @@ p11_rpc_message_init (p11_rpc_message *msg,
 
 	msg->output = output;
 	msg->input = input;
+
+	/* Unless given a longer lived one, only used for this message */
+	p11_rpc_arena_init (&msg->extra, 0, output->frealloc, output->ffree);
+	msg->arena = &msg->extra;
 }
 
 void
 p11_rpc_message_clear (p11_rpc_message *msg)
 {
-	void *allocated;
-	void **data;
-
 	assert (msg != NULL);
 
-	/* Free up the extra allocated memory */
-	allocated = msg->extra;
-	while (allocated != NULL) {
-		data = (void **)allocated;
-
-		/* Pointer to the next allocation */
-		allocated = *data;
-		assert (msg->output->ffree);
-		(msg->output->ffree) (data);
-	}
+	/* Someone else's arena is reset by its owner */
+	p11_rpc_arena_uninit (&msg->extra);
 
 	msg->output = NULL;
 	msg->input = NULL;
-	msg->extra = NULL;
+	msg->arena = NULL;
 }
 
 void *
 p11_rpc_message_alloc_extra (p11_rpc_message *msg,
                              size_t length)
 {
-	void **data;
+	void *data;
 
 	assert (msg != NULL);
+	assert (msg->arena != NULL);
 
 	if (length > 0x7fffffff)
 		return NULL;
 
-	assert (msg->output->frealloc != NULL);
-	data = (msg->output->frealloc) (NULL, sizeof (void *) + length);
+	data = p11_rpc_arena_alloc (msg->arena, length);
 	if (data == NULL)
 		return NULL;
 
 	/* Munch up the memory to help catch bugs */
-	memset (data, 0xff, sizeof (void *) + length);
-
-	/* Store pointer to next allocated block at beginning */
-	*data = msg->extra;
-	msg->extra = data;
+	memset (data, 0xff, length);
 
-	/* Data starts after first pointer */
-	return (void *)(data + 1);
+	return data;
 }
 
 void *
@@ -140,7 +248,7 @@ p11_rpc_message_prep (p11_rpc_message *msg,
                       int call_id,
                       p11_rpc_message_type type)
 {
-	int len;
+	const p11_rpc_header *header;
 
 	assert (type != 0);
 	assert (call_id >= P11_RPC_CALL_ERROR);
@@ -162,12 +270,13 @@ p11_rpc_message_prep (p11_rpc_message *msg,
 	msg->call_id = call_id;
 	msg->call_type = type;
 
-	/* Encode the two of them */
-	p11_rpc_buffer_add_uint32 (msg->output, call_id);
-	if (msg->signature) {
-		len = strlen (msg->signature);
-		p11_rpc_buffer_add_byte_array (msg->output, (unsigned char*)msg->signature, len);
-	}
+	/* The two of them are encoded ahead of time */
+	if (msg->output->flags & P11_RPC_BUFFER_COMPACT)
+		header = &p11_rpc_compact_headers[call_id][type - P11_RPC_REQUEST];
+	else
+		header = &p11_rpc_headers[call_id][type - P11_RPC_REQUEST];
+	assert (header->data != NULL);
+	p11_buffer_add (msg->output, header->data, header->length);
 
 	msg->parsed = 0;
 	return !p11_buffer_failed (msg->output);
@@ -177,6 +286,7 @@ bool
 p11_rpc_message_parse (p11_rpc_message *msg,
                        p11_rpc_message_type type)
 {
+	const p11_rpc_header *header;
 	const unsigned char *val;
 	size_t len;
 	uint32_t call_id;
@@ -211,6 +321,17 @@ p11_rpc_message_parse (p11_rpc_message *msg,
 	msg->call_type = type;
 	msg->sigverify = msg->signature;
 
+	/* Usually the message starts exactly as one encoded ahead of time */
+	if (msg->input->flags & P11_RPC_BUFFER_COMPACT)
+		header = &p11_rpc_compact_headers[call_id][type - P11_RPC_REQUEST];
+	else
+		header = &p11_rpc_headers[call_id][type - P11_RPC_REQUEST];
+	if (msg->input->len >= header->length &&
+	    memcmp (msg->input->data, header->data, header->length) == 0) {
+		msg->parsed = header->length;
+		return true;
+	}
+
 	/* Verify the incoming signature */
 	if (!p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &val, &len) ||
 	    /* This can happen if the length header == 0xffffffff */
@@ -227,6 +348,37 @@ p11_rpc_message_parse (p11_rpc_message *msg,
 	return true;
 }
 
+bool
+p11_rpc_message_peek (p11_buffer *buffer,
+                      size_t offset,
+                      uint32_t *call_id,
+                      uint64_t *arg,
+                      size_t *arg_offset)
+{
+	const unsigned char *signature;
+	size_t len;
+
+	assert (buffer != NULL);
+	assert (call_id != NULL);
+	assert (arg_offset != NULL);
+
+	*arg_offset = 0;
+
+	if (!p11_rpc_buffer_get_uint32 (buffer, &offset, call_id))
+		return false;
+
+	/* Only a leading ulong argument is of interest, anything else is left at zero */
+	if (!p11_rpc_buffer_get_byte_array (buffer, &offset, &signature, &len) ||
+	    signature == NULL || len == 0 || signature[0] != 'u')
+		return true;
+
+	*arg_offset = offset;
+	if (!p11_rpc_buffer_get_uint64 (buffer, &offset, arg))
+		*arg_offset = 0;
+
+	return true;
+}
+
 bool
 p11_rpc_message_verify_part (p11_rpc_message *msg,
                              const char* part)
@@ -282,7 +434,7 @@ p11_rpc_message_write_attribute_buffer (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "fA"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "fA"));
 
 	p11_rpc_message_write_attribute_buffer_array (msg, arr, num);
 	return !p11_buffer_failed (msg->output);
@@ -300,7 +452,7 @@ p11_rpc_message_write_attribute_array (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "aA"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "aA"));
 
 	/* Write the number of items */
 	p11_rpc_buffer_add_uint32 (msg->output, num);
@@ -319,7 +471,7 @@ p11_rpc_message_read_byte (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "y"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "y"));
 	return p11_rpc_buffer_get_byte (msg->input, &msg->parsed, val);
 }
 
@@ -331,7 +483,7 @@ p11_rpc_message_write_byte (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "y"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "y"));
 	p11_rpc_buffer_add_byte (msg->output, val);
 	return !p11_buffer_failed (msg->output);
 }
@@ -346,7 +498,7 @@ p11_rpc_message_read_ulong (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "u"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "u"));
 
 	if (!p11_rpc_buffer_get_uint64 (msg->input, &msg->parsed, &v))
 		return false;
@@ -363,7 +515,7 @@ p11_rpc_message_write_ulong (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "u"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "u"));
 	p11_rpc_buffer_add_uint64 (msg->output, val);
 	return !p11_buffer_failed (msg->output);
 }
@@ -376,7 +528,7 @@ p11_rpc_message_write_byte_buffer (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "fy"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "fy"));
 	p11_rpc_buffer_add_uint32 (msg->output, count);
 	return !p11_buffer_failed (msg->output);
 }
@@ -390,7 +542,7 @@ p11_rpc_message_write_byte_array (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "ay"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "ay"));
 
 	/* No array, no data, just length */
 	if (!arr && num != 0) {
@@ -412,7 +564,7 @@ p11_rpc_message_write_ulong_buffer (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "fu"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "fu"));
 	p11_rpc_buffer_add_uint32 (msg->output, count);
 	return !p11_buffer_failed (msg->output);
 }
@@ -428,7 +580,7 @@ p11_rpc_message_write_ulong_array (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "au"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "au"));
 
 	/* We send a byte which determines whether there's actual data present or not */
 	p11_rpc_buffer_add_byte (msg->output, array ? 1 : 0);
@@ -452,7 +604,7 @@ p11_rpc_message_read_version (p11_rpc_message *msg,
 	assert (version != NULL);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "v"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "v"));
 
 	return p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &version->major) &&
 	       p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &version->minor);
@@ -467,7 +619,7 @@ p11_rpc_message_write_version (p11_rpc_message *msg,
 	assert (version != NULL);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "v"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "v"));
 
 	p11_rpc_buffer_add_byte (msg->output, version->major);
 	p11_rpc_buffer_add_byte (msg->output, version->minor);
@@ -488,7 +640,7 @@ p11_rpc_message_read_space_string (p11_rpc_message *msg,
 	assert (buffer != NULL);
 	assert (length != 0);
 
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "s"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "s"));
 
 	if (!p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &data, &n_data))
 		return false;
@@ -513,7 +665,7 @@ p11_rpc_message_write_space_string (p11_rpc_message *msg,
 	assert (data != NULL);
 	assert (length != 0);
 
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "s"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "s"));
 
 	p11_rpc_buffer_add_byte_array (msg->output, data, length);
 	return !p11_buffer_failed (msg->output);
@@ -527,7 +679,7 @@ p11_rpc_message_write_zero_string (p11_rpc_message *msg,
 	assert (msg->output != NULL);
 	assert (string != NULL);
 
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "z"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "z"));
 
 	p11_rpc_buffer_add_byte_array (msg->output, string,
 	                               string ? strlen ((char *)string) : 0);
@@ -674,11 +826,69 @@ p11_rpc_buffer_decode_uint32 (unsigned char* ptr)
 	return val;
 }
 
+/*
+ * Since protocol version 5, integers are sent in groups of 7 bits, the
+ * least significant first, with the high bit set on all but the last.
+ */
+static void
+buffer_add_varint (p11_buffer *buffer,
+                   uint64_t value)
+{
+	unsigned char data[10];
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		data[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	data[len++] = value;
+
+	p11_buffer_add (buffer, data, len);
+}
+
+static bool
+buffer_get_varint (p11_buffer *buf,
+                   size_t *offset,
+                   uint64_t maximum,
+                   uint64_t *value)
+{
+	const unsigned char *ptr = buf->data;
+	unsigned int shift;
+	uint64_t val = 0;
+	size_t off;
+
+	for (off = *offset, shift = 0; off < buf->len && shift < 64; off++, shift += 7) {
+		/* The last of 10 bytes only has room for the top bit */
+		if (shift == 63 && ptr[off] > 1)
+			break;
+
+		val |= (uint64_t)(ptr[off] & 0x7f) << shift;
+		if (ptr[off] & 0x80)
+			continue;
+
+		if (val > maximum)
+			break;
+		if (value != NULL)
+			*value = val;
+		*offset = off + 1;
+		return true;
+	}
+
+	p11_buffer_fail (buf);
+	return false;
+}
+
 void
 p11_rpc_buffer_add_uint32 (p11_buffer *buffer,
                            uint32_t value)
 {
 	size_t offset = buffer->len;
+
+	if (buffer->flags & P11_RPC_BUFFER_COMPACT) {
+		buffer_add_varint (buffer, value);
+		return;
+	}
+
 	if (!p11_buffer_append (buffer, 4))
 		return_val_if_reached ();
 	p11_rpc_buffer_set_uint32 (buffer, offset, value);
@@ -705,6 +915,16 @@ p11_rpc_buffer_get_uint32 (p11_buffer *buf,
                            uint32_t *value)
 {
 	unsigned char *ptr;
+	uint64_t val;
+
+	if (buf->flags & P11_RPC_BUFFER_COMPACT) {
+		if (!buffer_get_varint (buf, offset, UINT32_MAX, &val))
+			return false;
+		if (value != NULL)
+			*value = val;
+		return true;
+	}
+
 	if (buf->len < 4 || *offset > buf->len - 4) {
 		p11_buffer_fail (buf);
 		return false;
@@ -720,6 +940,11 @@ void
 p11_rpc_buffer_add_uint64 (p11_buffer *buffer,
                            uint64_t value)
 {
+	if (buffer->flags & P11_RPC_BUFFER_COMPACT) {
+		buffer_add_varint (buffer, value);
+		return;
+	}
+
 	p11_rpc_buffer_add_uint32 (buffer, ((value >> 32) & 0xffffffff));
 	p11_rpc_buffer_add_uint32 (buffer, (value & 0xffffffff));
 }
@@ -731,6 +956,10 @@ p11_rpc_buffer_get_uint64 (p11_buffer *buf,
 {
 	size_t off = *offset;
 	uint32_t a, b;
+
+	if (buf->flags & P11_RPC_BUFFER_COMPACT)
+		return buffer_get_varint (buf, offset, UINT64_MAX, value);
+
 	if (!p11_rpc_buffer_get_uint32 (buf, &off, &a) ||
 	    !p11_rpc_buffer_get_uint32 (buf, &off, &b))
 		return false;
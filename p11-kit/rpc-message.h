@@ -43,6 +43,7 @@
 #include "buffer.h"
 #include "pkcs11.h"
 #include "pkcs11x.h"
+#include "rpc-stats.h"
 
 /* The calls, must be in sync with array below */
 enum {
@@ -139,6 +140,12 @@ enum {
 
 	P11_RPC_CALL_C_InitToken2,
 
+	/* Several calls on one session, since protocol version 2 */
+	P11_RPC_CALL_BATCH,
+
+	/* Sends the values along with the lengths, since protocol version 2 */
+	P11_RPC_CALL_C_GetAttributeValue2,
+
 	P11_RPC_CALL_MAX
 };
 
@@ -253,6 +260,9 @@ static const p11_rpc_call p11_rpc_calls[] = {
 	{ P11_RPC_CALL_C_MessageVerifyFinal,   "C_MessageVerifyFinal",   "u",       ""                     },
 
 	{ P11_RPC_CALL_C_InitToken2,           "C_InitToken2",           "uays",    ""                     },
+
+	{ P11_RPC_CALL_BATCH,                  "BATCH",                  "uay",     "ay"                   },
+	{ P11_RPC_CALL_C_GetAttributeValue2,   "C_GetAttributeValue2",   "uufA",    "aAuy"                 },
 };
 
 #ifdef _DEBUG
@@ -276,11 +286,34 @@ typedef enum _p11_rpc_value_type {
 	P11_RPC_VALUE_BYTE_ARRAY
 } p11_rpc_value_type;
 
+/*
+ * Set in the flags of a buffer when its integers are encoded as varints
+ * rather than in 4 or 8 bytes, as agreed on since protocol version 5.
+ * Beyond those defined in buffer.h.
+ */
+#define P11_RPC_BUFFER_COMPACT (1 << 8)
+
 typedef enum _p11_rpc_message_type {
 	P11_RPC_REQUEST = 1,
 	P11_RPC_RESPONSE
 } p11_rpc_message_type;
 
+typedef struct _p11_rpc_arena_chunk p11_rpc_arena_chunk;
+
+/*
+ * Memory that is handed out by bumping a pointer, and given back all at
+ * once. After a reset the memory is kept for the next round, unless
+ * more than @retain bytes were needed.
+ */
+typedef struct {
+	p11_rpc_arena_chunk *chunks;
+	size_t used;
+	size_t wanted;
+	size_t retain;
+	void * (* frealloc) (void *data, size_t size);
+	void (* ffree) (void *data);
+} p11_rpc_arena;
+
 typedef struct {
 	int call_id;
 	p11_rpc_message_type call_type;
@@ -289,21 +322,37 @@ typedef struct {
 	p11_buffer *output;
 	size_t parsed;
 	const char *sigverify;
-	void *extra;
+
+	/* Where the extra memory comes from, may be set after init */
+	p11_rpc_arena *arena;
+	p11_rpc_arena extra;
+
+	/* Where the time went, NULL unless statistics are collected */
+	p11_rpc_probe *probe;
 } p11_rpc_message;
 
 typedef void (*p11_rpc_value_encoder) (p11_buffer *, const void *, CK_ULONG);
 typedef bool (*p11_rpc_value_decoder) (p11_buffer *, size_t *, void *, CK_ULONG *);
 typedef bool (*p11_rpc_message_decoder) (p11_rpc_message *msg, p11_buffer *, size_t *, void *, CK_ULONG *);
 
+void             p11_rpc_arena_init                      (p11_rpc_arena *arena,
+                                                          size_t retain,
+                                                          void * (* frealloc) (void *data, size_t size),
+                                                          void (* ffree) (void *data));
+
+void *           p11_rpc_arena_alloc                     (p11_rpc_arena *arena,
+                                                          size_t length);
+
+void             p11_rpc_arena_reset                     (p11_rpc_arena *arena);
+
+void             p11_rpc_arena_uninit                    (p11_rpc_arena *arena);
+
 void             p11_rpc_message_init                    (p11_rpc_message *msg,
                                                           p11_buffer *input,
                                                           p11_buffer *output);
 
 void             p11_rpc_message_clear                   (p11_rpc_message *msg);
 
-#define          p11_rpc_message_is_verified(msg)        (!(msg)->sigverify || (msg)->sigverify[0] == 0)
-
 void *           p11_rpc_message_alloc_extra             (p11_rpc_message *msg,
                                                           size_t length);
 
@@ -318,9 +367,26 @@ bool             p11_rpc_message_prep                    (p11_rpc_message *msg,
 bool             p11_rpc_message_parse                   (p11_rpc_message *msg,
                                                           p11_rpc_message_type type);
 
+bool             p11_rpc_message_peek                    (p11_buffer *buffer,
+                                                          size_t offset,
+                                                          uint32_t *call_id,
+                                                          uint64_t *arg,
+                                                          size_t *arg_offset);
+
 bool             p11_rpc_message_verify_part             (p11_rpc_message *msg,
                                                           const char* part);
 
+/*
+ * The whole signature is checked when a message is parsed, checking
+ * that each part is read or written in order is only done when
+ * debugging RPC. Expects P11_DEBUG_FLAG and debug.h at the call site.
+ */
+#define P11_RPC_MESSAGE_VERIFY_PART(msg, part) \
+	(!(msg)->signature || !p11_debugging || \
+	 p11_rpc_message_verify_part ((msg), (part)))
+
+#define          p11_rpc_message_is_verified(msg)        (!p11_debugging || !(msg)->sigverify || (msg)->sigverify[0] == 0)
+
 bool             p11_rpc_message_write_byte              (p11_rpc_message *msg,
                                                           CK_BYTE val);
 
@@ -60,6 +60,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef OS_UNIX
+#include <poll.h>
+#endif
+
 #ifdef ENABLE_NLS
 #include <libintl.h>
 #define _(x) dgettext(PACKAGE_NAME, x)
@@ -89,7 +93,7 @@ proto_read_byte_buffer (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Check that we're supposed to be reading this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "fy"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "fy"));
 
 	/* The number of ulongs there's room for on the other end */
 	if (!p11_rpc_buffer_get_uint32 (msg->input, &msg->parsed, &length))
@@ -129,7 +133,7 @@ proto_read_byte_array (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "ay"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "ay"));
 
 	/* Read out the byte which says whether data is present or not */
 	if (!p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &valid))
@@ -196,7 +200,7 @@ proto_read_ulong_buffer (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Check that we're supposed to be reading this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "fu"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "fu"));
 
 	/* The number of ulongs there's room for on the other end */
 	if (!p11_rpc_buffer_get_uint32 (msg->input, &msg->parsed, &length))
@@ -316,7 +320,7 @@ proto_read_attribute_buffer (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "fA"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "fA"));
 
 	return proto_read_attribute_buffer_array (msg, result, n_result);
 }
@@ -335,7 +339,7 @@ proto_read_attribute_array (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "aA"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "aA"));
 
 	/* Read the number of attributes */
 	if (!p11_rpc_buffer_get_uint32 (msg->input, &msg->parsed, &n_attrs))
@@ -401,7 +405,7 @@ proto_read_null_string (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "z"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "z"));
 
 	if (!p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &data, &n_data))
 		return PARSE_ERROR;
@@ -430,7 +434,7 @@ proto_read_space_string (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "s"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "s"));
 
 	if (!p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &data, &n_data))
 		return PARSE_ERROR;
@@ -460,7 +464,7 @@ proto_read_mechanism (p11_rpc_message *msg,
 	assert (msg->input != NULL);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || p11_rpc_message_verify_part (msg, "M"));
+	assert (P11_RPC_MESSAGE_VERIFY_PART (msg, "M"));
 
 	/* Check the length needed to store the parameter */
 	memset (&temp, 0, sizeof (temp));
@@ -615,6 +619,8 @@ call_ready (p11_rpc_message *msg)
 
 	/* All done parsing input */
 	msg->input = NULL;
+	if (msg->probe)
+		p11_rpc_probe_lap (msg->probe, P11_RPC_STATS_SERIALIZE);
 
 	if (!p11_rpc_message_prep (msg, msg->call_id, P11_RPC_RESPONSE)) {
 		p11_message (_("couldn't initialize rpc response"));
@@ -624,6 +630,14 @@ call_ready (p11_rpc_message *msg)
 	return CKR_OK;
 }
 
+/* Called right after the PKCS#11 function returns */
+static void
+call_returned (p11_rpc_message *msg)
+{
+	if (msg->probe)
+		p11_rpc_probe_lap (msg->probe, P11_RPC_STATS_MODULE);
+}
+
 /* -------------------------------------------------------------------
  * CALL MACROS
  */
@@ -640,7 +654,8 @@ call_ready (p11_rpc_message *msg)
 #define PROCESS_CALL(args) \
 		_ret = call_ready (msg); \
 		if (_ret != CKR_OK) { goto _cleanup; } \
-		_ret = _func args
+		_ret = _func args; \
+		call_returned (msg)
 
 #define END_CALL \
 	_cleanup: \
@@ -693,6 +708,10 @@ call_ready (p11_rpc_message *msg)
 	if (_ret == CKR_OK && !p11_rpc_message_write_ulong (msg, val)) \
 		_ret = PREP_ERROR;
 
+#define OUT_BYTE(val) \
+	if (_ret == CKR_OK && !p11_rpc_message_write_byte (msg, val)) \
+		_ret = PREP_ERROR;
+
 #define OUT_BYTE_ARRAY(array, len) \
 	/* Note how we filter return codes */ \
 	_ret = proto_write_byte_array (msg, array, len, _ret);
@@ -778,6 +797,7 @@ rpc_C_Initialize (CK_X_FUNCTION_LIST *self,
 		func = self->C_Initialize;
 		assert (func != NULL);
 		ret = (func) (self, &init_args);
+		call_returned (msg);
 
 		/* Empty response */
 		if (ret == CKR_OK)
@@ -1171,6 +1191,82 @@ rpc_C_GetAttributeValue (CK_X_FUNCTION_LIST *self,
 	END_CALL;
 }
 
+/*
+ * When only the lengths are asked for, the values are looked up too
+ * and sent back along with them, saving the caller a round trip.
+ */
+static CK_BYTE
+proto_lookup_attribute_values (CK_X_FUNCTION_LIST *self,
+                               p11_rpc_message *msg,
+                               CK_SESSION_HANDLE session,
+                               CK_OBJECT_HANDLE object,
+                               CK_ATTRIBUTE_PTR template,
+                               CK_ULONG count)
+{
+	CK_ATTRIBUTE_PTR values;
+	CK_ULONG i;
+	CK_RV rv;
+
+	values = p11_rpc_message_alloc_extra_array (msg, count, sizeof (CK_ATTRIBUTE));
+	if (values == NULL)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		values[i] = template[i];
+
+		/* Nested templates are left for the caller to ask for */
+		if (values[i].ulValueLen == (CK_ULONG)-1 ||
+		    values[i].ulValueLen == 0 ||
+		    IS_ATTRIBUTE_ARRAY (values + i))
+			continue;
+
+		values[i].pValue = p11_rpc_message_alloc_extra (msg, values[i].ulValueLen);
+		if (values[i].pValue == NULL)
+			return 0;
+	}
+
+	rv = (self->C_GetAttributeValue) (self, session, object, values, count);
+	if (rv != CKR_OK && rv != CKR_ATTRIBUTE_SENSITIVE && rv != CKR_ATTRIBUTE_TYPE_INVALID)
+		return 0;
+
+	/* The object may have changed in between */
+	for (i = 0; i < count; i++) {
+		if (values[i].ulValueLen != template[i].ulValueLen)
+			return 0;
+	}
+
+	memcpy (template, values, count * sizeof (CK_ATTRIBUTE));
+	return 1;
+}
+
+static CK_RV
+rpc_C_GetAttributeValue2 (CK_X_FUNCTION_LIST *self,
+                          p11_rpc_message *msg)
+{
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CK_ATTRIBUTE_PTR template;
+	CK_ULONG count;
+	CK_BYTE values = 0;
+	CK_ULONG i;
+
+	BEGIN_CALL (GetAttributeValue);
+		IN_ULONG (session);
+		IN_ULONG (object);
+		IN_ATTRIBUTE_BUFFER (template, count);
+		for (i = 0; i < count; i++) {
+			if (template[i].pValue != NULL)
+				break;
+		}
+	PROCESS_CALL ((self, session, object, template, count));
+		if (i == count &&
+		    (_ret == CKR_OK || _ret == CKR_ATTRIBUTE_SENSITIVE || _ret == CKR_ATTRIBUTE_TYPE_INVALID))
+			values = proto_lookup_attribute_values (self, msg, session, object, template, count);
+		OUT_ATTRIBUTE_ARRAY (template, count);
+		OUT_BYTE (values);
+	END_CALL;
+}
+
 static CK_RV
 rpc_C_SetAttributeValue (CK_X_FUNCTION_LIST *self,
                          p11_rpc_message *msg)
@@ -2292,22 +2388,165 @@ rpc_C_MessageVerifyFinal (CK_X_FUNCTION_LIST *self,
 	END_CALL;
 }
 
-bool
-p11_rpc_server_handle (CK_X_FUNCTION_LIST *self,
-                       p11_buffer *request,
-                       p11_buffer *response)
+/* Only calls on the same session, which don't change its state */
+static bool
+batch_request_valid (p11_buffer *request,
+                     CK_SESSION_HANDLE session)
+{
+	size_t offset;
+	uint32_t call_id;
+	uint64_t val;
+
+	if (!p11_rpc_message_peek (request, 0, &call_id, &val, &offset))
+		return false;
+
+	switch (call_id) {
+	case P11_RPC_CALL_C_Initialize:
+	case P11_RPC_CALL_C_Finalize:
+	case P11_RPC_CALL_C_InitToken:
+	case P11_RPC_CALL_C_InitToken2:
+	case P11_RPC_CALL_C_CloseAllSessions:
+	case P11_RPC_CALL_C_GetInfo:
+	case P11_RPC_CALL_C_GetSlotList:
+	case P11_RPC_CALL_C_GetSlotInfo:
+	case P11_RPC_CALL_C_GetTokenInfo:
+	case P11_RPC_CALL_C_GetMechanismList:
+	case P11_RPC_CALL_C_GetMechanismInfo:
+	case P11_RPC_CALL_C_OpenSession:
+	case P11_RPC_CALL_C_WaitForSlotEvent:
+	case P11_RPC_CALL_C_CloseSession:
+	case P11_RPC_CALL_C_Login:
+	case P11_RPC_CALL_C_LoginUser:
+	case P11_RPC_CALL_C_Logout:
+	case P11_RPC_CALL_BATCH:
+		return false;
+	default:
+		if (call_id <= P11_RPC_CALL_ERROR || call_id >= P11_RPC_CALL_MAX)
+			return false;
+		break;
+	}
+
+	return offset != 0 && val == session;
+}
+
+/*
+ * A batch carries several requests on the same session, which are run
+ * in order until one of them fails. The responses of those that ran
+ * are sent back together.
+ */
+static bool server_handle (CK_X_FUNCTION_LIST *self,
+                           p11_buffer *request,
+                           p11_buffer *response,
+                           p11_rpc_arena *arena);
+
+static CK_RV
+rpc_batch (CK_X_FUNCTION_LIST *self,
+           p11_rpc_message *msg)
+{
+	CK_SESSION_HANDLE session;
+	const unsigned char *data;
+	p11_buffer requests;
+	p11_buffer responses;
+	p11_buffer buffer;
+	unsigned char valid;
+	uint32_t call_id;
+	uint64_t arg;
+	size_t offset;
+	size_t at;
+	size_t len;
+	int flags;
+	CK_RV ret;
+
+	p11_debug ("BATCH: enter");
+	assert (msg != NULL);
+	assert (self != NULL);
+
+	if (!p11_rpc_message_read_ulong (msg, &session) ||
+	    !P11_RPC_MESSAGE_VERIFY_PART (msg, "ay") ||
+	    !p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &valid) || !valid ||
+	    !p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &data, &len))
+		return PARSE_ERROR;
+
+	/* The calls are encoded like the batch itself */
+	flags = msg->input->flags & P11_RPC_BUFFER_COMPACT;
+
+	/* The response is written over the request */
+	if (!p11_buffer_init (&requests, len))
+		return CKR_DEVICE_MEMORY;
+	p11_buffer_add (&requests, data, len);
+
+	ret = call_ready (msg);
+	if (ret != CKR_OK) {
+		p11_buffer_uninit (&requests);
+		return ret;
+	}
+
+	p11_buffer_init (&responses, 0);
+
+	offset = 0;
+	while (ret == CKR_OK && offset < requests.len) {
+		if (!p11_rpc_buffer_get_byte_array (&requests, &offset, &data, &len) ||
+		    data == NULL || !p11_buffer_init (&buffer, len)) {
+			ret = PARSE_ERROR;
+			break;
+		}
+
+		buffer.flags |= flags;
+		p11_buffer_add (&buffer, data, len);
+
+		if (!batch_request_valid (&buffer, session)) {
+			p11_message (_("invalid request in batch"));
+			ret = PARSE_ERROR;
+		} else if (!server_handle (self, &buffer, &buffer, msg->arena)) {
+			ret = PARSE_ERROR;
+		} else {
+			p11_rpc_buffer_add_byte_array (&responses, buffer.data, buffer.len);
+
+			/* Later calls usually depend on this one, so stop */
+			if (p11_rpc_message_peek (&buffer, 0, &call_id, &arg, &at) &&
+			    call_id == P11_RPC_CALL_ERROR)
+				offset = requests.len;
+		}
+
+		p11_buffer_uninit (&buffer);
+	}
+
+	if (ret == CKR_OK && !p11_rpc_message_write_byte_array (msg, responses.data, responses.len))
+		ret = CKR_DEVICE_MEMORY;
+
+	p11_buffer_uninit (&requests);
+	p11_buffer_uninit (&responses);
+
+	p11_debug ("ret: %d", (int)ret);
+	return ret;
+}
+
+/*
+ * The memory needed while handling the request comes from @arena when
+ * given, which is then left for the caller to reset.
+ */
+static bool
+server_handle (CK_X_FUNCTION_LIST *self,
+               p11_buffer *request,
+               p11_buffer *response,
+               p11_rpc_arena *arena)
 {
 	p11_rpc_message msg;
+	p11_rpc_probe probe;
 	CK_RV ret;
 	int req_id;
 
-	return_val_if_fail (self != NULL, false);
-	return_val_if_fail (request != NULL, false);
-	return_val_if_fail (response != NULL, false);
-
 	p11_message_clear ();
 
+	/* The reply is encoded like the request */
+	if (request->flags & P11_RPC_BUFFER_COMPACT)
+		response->flags |= P11_RPC_BUFFER_COMPACT;
+	else
+		response->flags &= ~P11_RPC_BUFFER_COMPACT;
+
 	p11_rpc_message_init (&msg, request, response);
+	if (arena != NULL)
+		msg.arena = arena;
 
 	if (!p11_rpc_message_parse (&msg, P11_RPC_REQUEST)) {
 		p11_rpc_message_clear (&msg);
@@ -2320,6 +2559,16 @@ p11_rpc_server_handle (CK_X_FUNCTION_LIST *self,
 	assert (msg.call_id < P11_RPC_CALL_MAX);
 	req_id = msg.call_id;
 
+	/*
+	 * The only time the call looks at whether statistics are collected.
+	 * The request and response may be the same buffer.
+	 */
+	if (p11_rpc_server_stats) {
+		p11_rpc_probe_start (&probe, req_id);
+		probe.received = request->len;
+		msg.probe = &probe;
+	}
+
 	switch(req_id) {
 	#define CASE_CALL(name) \
 	case P11_RPC_CALL_##name: \
@@ -2415,7 +2664,11 @@ p11_rpc_server_handle (CK_X_FUNCTION_LIST *self,
 	CASE_CALL (C_MessageVerifyFinal)
 
 	CASE_CALL (C_InitToken2)
+	CASE_CALL (C_GetAttributeValue2)
 	#undef CASE_CALL
+	case P11_RPC_CALL_BATCH:
+		ret = rpc_batch (self, &msg);
+		break;
 	default:
 		/* This should have been caught by the parse code */
 		assert (0 && "Unchecked call");
@@ -2453,10 +2706,559 @@ p11_rpc_server_handle (CK_X_FUNCTION_LIST *self,
 		}
 	}
 
+	if (msg.probe) {
+		p11_rpc_probe_lap (msg.probe, P11_RPC_STATS_SERIALIZE);
+		msg.probe->sent = response->len;
+		p11_rpc_stats_record (p11_rpc_server_stats, msg.probe);
+	}
+
 	p11_rpc_message_clear (&msg);
 	return true;
 }
 
+bool
+p11_rpc_server_handle (CK_X_FUNCTION_LIST *self,
+                       p11_buffer *request,
+                       p11_buffer *response)
+{
+	return_val_if_fail (self != NULL, false);
+	return_val_if_fail (request != NULL, false);
+	return_val_if_fail (response != NULL, false);
+
+	return server_handle (self, request, response, NULL);
+}
+
+/*
+ * Requests are served by a small pool of threads. One thread at a time
+ * reads the next request from the client, and then usually goes on to
+ * run it, while another thread takes over reading. Requests on the same
+ * session are run in the order they arrived, while those on different
+ * sessions run concurrently. Responses are written as soon as they are
+ * ready, tagged with the call code of their request, so the client may
+ * see them out of order.
+ */
+
+#define RPC_SERVER_MAX_WORKERS 16
+
+/* Each of the threads keeps up to this much memory for requests */
+#define RPC_SERVER_ARENA_RETAIN (64 * 1024)
+
+/* How many jobs are kept for later requests, with buffers up to what size */
+#define RPC_SERVER_SPARE_JOBS 8
+#define RPC_SERVER_SPARE_SIZE (64 * 1024)
+
+enum {
+	/* Run alone, once all earlier requests have completed */
+	CALL_EXCLUSIVE,
+	/* Doesn't touch a session, runs whenever a thread is free */
+	CALL_SESSIONLESS,
+	/* Runs after the earlier requests on the same session */
+	CALL_SESSION,
+};
+
+typedef struct _rpc_job {
+	int code;
+	int type;
+	CK_SESSION_HANDLE session;
+	p11_buffer buffer;
+	bool running;
+	struct _rpc_job *next;
+} rpc_job;
+
+typedef struct {
+	rpc_server *server;
+	int in_fd;
+	int out_fd;
+
+	/* Since version 4, when messages go through shared memory */
+	p11_rpc_ring *ring;
+
+	/* Serializes the responses written to out_fd */
+	p11_mutex_t write_lock;
+
+	/* Protects all of the below */
+	p11_mutex_t lock;
+#ifdef OS_UNIX
+	p11_cond_t cond;
+#endif
+	rpc_job *jobs;
+	rpc_job *jobs_tail;
+	rpc_job *spare;
+	int num_spare;
+	p11_buffer options;
+	bool reading;
+	bool concurrent;
+	bool stopping;
+	bool failed;
+	int num_idle;
+	int num_workers;
+	p11_thread_t workers[RPC_SERVER_MAX_WORKERS];
+} rpc_dispatcher;
+
+static int
+request_call_type (p11_buffer *request,
+                   CK_SESSION_HANDLE *session)
+{
+	size_t offset;
+	uint32_t call_id;
+	uint64_t val;
+
+	if (!p11_rpc_message_peek (request, 0, &call_id, &val, &offset))
+		return CALL_EXCLUSIVE;
+
+	switch (call_id) {
+	case P11_RPC_CALL_C_Initialize:
+	case P11_RPC_CALL_C_Finalize:
+	case P11_RPC_CALL_C_InitToken:
+	case P11_RPC_CALL_C_InitToken2:
+	case P11_RPC_CALL_C_CloseAllSessions:
+		return CALL_EXCLUSIVE;
+	case P11_RPC_CALL_C_GetInfo:
+	case P11_RPC_CALL_C_GetSlotList:
+	case P11_RPC_CALL_C_GetSlotInfo:
+	case P11_RPC_CALL_C_GetTokenInfo:
+	case P11_RPC_CALL_C_GetMechanismList:
+	case P11_RPC_CALL_C_GetMechanismInfo:
+	case P11_RPC_CALL_C_OpenSession:
+	case P11_RPC_CALL_C_WaitForSlotEvent:
+		return CALL_SESSIONLESS;
+	default:
+		if (call_id <= P11_RPC_CALL_ERROR || call_id >= P11_RPC_CALL_MAX)
+			return CALL_EXCLUSIVE;
+		break;
+	}
+
+	/* All other calls take the session handle as their first argument */
+	if (offset == 0)
+		return CALL_EXCLUSIVE;
+
+	*session = val;
+	return CALL_SESSION;
+}
+
+/*
+ * Calls that can take a long time, waiting for a PIN pad, a device or
+ * key generation. Other requests should not have to wait behind them.
+ */
+static bool
+request_may_block (p11_buffer *request)
+{
+	size_t offset;
+	uint32_t call_id;
+	uint64_t val;
+
+	if (!p11_rpc_message_peek (request, 0, &call_id, &val, &offset))
+		return false;
+
+	switch (call_id) {
+	case P11_RPC_CALL_C_WaitForSlotEvent:
+	case P11_RPC_CALL_C_InitPIN:
+	case P11_RPC_CALL_C_SetPIN:
+	case P11_RPC_CALL_C_Login:
+	case P11_RPC_CALL_C_LoginUser:
+	case P11_RPC_CALL_C_GenerateKey:
+	case P11_RPC_CALL_C_GenerateKeyPair:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool
+rpc_dispatcher_respond (rpc_dispatcher *disp,
+                        rpc_job *job)
+{
+	p11_rpc_status status;
+	p11_buffer options;
+	size_t state;
+
+	p11_buffer_init_null (&options, 0);
+
+	p11_mutex_lock (&disp->write_lock);
+
+	state = 0;
+	do {
+		if (disp->ring) {
+			status = p11_rpc_ring_write (disp->ring, job->code,
+			                             &options, &job->buffer);
+		} else {
+			status = p11_rpc_transport_write (disp->out_fd, &state, job->code,
+			                                  &options, &job->buffer);
+		}
+	} while (status == P11_RPC_AGAIN);
+
+	p11_mutex_unlock (&disp->write_lock);
+
+	switch (status) {
+	case P11_RPC_OK:
+		return true;
+	case P11_RPC_EOF:
+	case P11_RPC_AGAIN:
+		assert_not_reached ();
+	case P11_RPC_ERROR:
+		p11_message_err (errno, _("failed to write rpc message"));
+		return false;
+	}
+
+	return_val_if_reached (false);
+}
+
+static bool
+input_pending (int fd)
+{
+#ifdef OS_UNIX
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	return poll (&pfd, 1, 0) > 0;
+#else
+	return false;
+#endif
+}
+
+static void
+rpc_dispatcher_wait_inlock (rpc_dispatcher *disp)
+{
+#ifdef OS_UNIX
+	disp->num_idle++;
+	p11_cond_wait (&disp->cond, &disp->lock);
+	disp->num_idle--;
+#else
+	/* Only a single thread is used */
+	assert_not_reached ();
+#endif
+}
+
+static void
+rpc_dispatcher_wake_inlock (rpc_dispatcher *disp)
+{
+#ifdef OS_UNIX
+	p11_cond_broadcast (&disp->cond);
+#endif
+}
+
+static rpc_job *
+rpc_dispatcher_next_inlock (rpc_dispatcher *disp)
+{
+	rpc_job *job;
+	rpc_job *prev;
+
+	for (job = disp->jobs; job != NULL; job = job->next) {
+		/* Exclusive requests are run by the thread that read them */
+		if (job->running || job->type == CALL_EXCLUSIVE)
+			continue;
+		if (job->type == CALL_SESSIONLESS)
+			return job;
+
+		/* Wait for earlier requests on the same session */
+		for (prev = disp->jobs; prev != job; prev = prev->next) {
+			if (prev->type == CALL_SESSION && prev->session == job->session)
+				break;
+		}
+		if (prev == job)
+			return job;
+	}
+
+	return NULL;
+}
+
+/*
+ * A job that is done is usually kept along with its buffer, so that
+ * later requests don't need to allocate any memory.
+ */
+static rpc_job *
+rpc_dispatcher_job_inlock (rpc_dispatcher *disp)
+{
+	rpc_job *job = disp->spare;
+
+	if (job != NULL) {
+		disp->spare = job->next;
+		disp->num_spare--;
+		p11_buffer_reset (&job->buffer, 0);
+	} else {
+		job = calloc (1, sizeof (rpc_job));
+		return_val_if_fail (job != NULL, NULL);
+		p11_buffer_init (&job->buffer, 0);
+	}
+
+	job->code = 0;
+	job->type = 0;
+	job->session = 0;
+	job->running = false;
+	job->next = NULL;
+
+	if (disp->server->version >= 5)
+		job->buffer.flags |= P11_RPC_BUFFER_COMPACT;
+	else
+		job->buffer.flags &= ~P11_RPC_BUFFER_COMPACT;
+	return job;
+}
+
+static void
+rpc_dispatcher_release_inlock (rpc_dispatcher *disp,
+                               rpc_job *job)
+{
+	if (disp->num_spare < RPC_SERVER_SPARE_JOBS &&
+	    !p11_buffer_failed (&job->buffer) &&
+	    job->buffer.size <= RPC_SERVER_SPARE_SIZE) {
+		/* Nothing of this request, such as a PIN, is left for the next one */
+		memset (job->buffer.data, 0, job->buffer.size);
+		job->next = disp->spare;
+		disp->spare = job;
+		disp->num_spare++;
+		return;
+	}
+
+	p11_buffer_uninit (&job->buffer);
+	free (job);
+}
+
+static void
+rpc_dispatcher_remove_inlock (rpc_dispatcher *disp,
+                              rpc_job *job)
+{
+	rpc_job **link;
+	rpc_job *prev = NULL;
+
+	for (link = &disp->jobs; *link != job; link = &(*link)->next)
+		prev = *link;
+	*link = job->next;
+	if (disp->jobs_tail == job)
+		disp->jobs_tail = prev;
+
+	rpc_dispatcher_release_inlock (disp, job);
+}
+
+static void
+rpc_dispatcher_run_inlock (rpc_dispatcher *disp,
+                           rpc_job *job,
+                           p11_rpc_arena *arena)
+{
+	bool concurrent;
+	bool pending;
+	bool ok;
+
+	concurrent = disp->concurrent;
+	job->running = true;
+	p11_mutex_unlock (&disp->lock);
+
+	ok = server_handle (&disp->server->virt.funcs, &job->buffer, &job->buffer, arena);
+	if (!ok)
+		p11_message (_("unexpected error handling rpc message"));
+	p11_rpc_arena_reset (arena);
+
+	/*
+	 * A client that waits for each response can't have sent another
+	 * request yet. If it has, then it makes concurrent calls.
+	 */
+	pending = ok && !concurrent &&
+	          (disp->ring ? p11_rpc_ring_pending (disp->ring) : input_pending (disp->in_fd));
+
+	if (ok)
+		ok = rpc_dispatcher_respond (disp, job);
+
+	p11_mutex_lock (&disp->lock);
+	if (pending && !disp->concurrent) {
+		p11_debug ("client makes concurrent calls");
+		disp->concurrent = true;
+	}
+	if (!ok)
+		disp->failed = disp->stopping = true;
+	rpc_dispatcher_remove_inlock (disp, job);
+
+	/* Requests waiting on this one may be able to run now */
+	rpc_dispatcher_wake_inlock (disp);
+}
+
+#ifdef OS_UNIX
+static void *rpc_dispatcher_worker (void *data);
+#endif
+
+/*
+ * Reads the next request, and queues it. Called with the lock held,
+ * which is released while blocking on the client.
+ */
+static void
+rpc_dispatcher_read_inlock (rpc_dispatcher *disp,
+                            p11_rpc_arena *arena)
+{
+	p11_rpc_status status;
+	rpc_job *job;
+	size_t state;
+
+	job = rpc_dispatcher_job_inlock (disp);
+	if (job == NULL) {
+		disp->failed = disp->stopping = true;
+		return;
+	}
+
+	disp->reading = true;
+	p11_mutex_unlock (&disp->lock);
+
+	state = 0;
+	do {
+		if (disp->ring) {
+			status = p11_rpc_ring_read (disp->ring, &job->code,
+			                            &disp->options, &job->buffer);
+		} else {
+			status = p11_rpc_transport_read (disp->in_fd, &state, &job->code,
+			                                 &disp->options, &job->buffer);
+		}
+	} while (status == P11_RPC_AGAIN);
+
+	p11_mutex_lock (&disp->lock);
+
+	switch (status) {
+	case P11_RPC_OK:
+		break;
+	case P11_RPC_EOF:
+		disp->stopping = true;
+		break;
+	case P11_RPC_AGAIN:
+		assert_not_reached ();
+	case P11_RPC_ERROR:
+		p11_message_err (errno, _("failed to read rpc message"));
+		disp->failed = disp->stopping = true;
+		break;
+	}
+
+	if (disp->stopping) {
+		rpc_dispatcher_release_inlock (disp, job);
+		disp->reading = false;
+		rpc_dispatcher_wake_inlock (disp);
+		return;
+	}
+
+	job->type = request_call_type (&job->buffer, &job->session);
+
+	if (disp->jobs_tail)
+		disp->jobs_tail->next = job;
+	else
+		disp->jobs = job;
+	disp->jobs_tail = job;
+
+	/*
+	 * Also used for messages we can't make sense of, which then fail.
+	 * Nothing else is read until such a request has completed.
+	 */
+	if (job->type == CALL_EXCLUSIVE) {
+		while (disp->jobs != job)
+			rpc_dispatcher_wait_inlock (disp);
+		rpc_dispatcher_run_inlock (disp, job, arena);
+		disp->reading = false;
+		return;
+	}
+
+	disp->reading = false;
+
+	/*
+	 * As long as the client doesn't make concurrent calls, this thread
+	 * runs the request and then reads the next one, which saves waking
+	 * up another thread for every request. A request that may block
+	 * gets another thread reading anyway, as we would otherwise only
+	 * notice concurrent calls once it has completed.
+	 */
+	if (!disp->concurrent && !request_may_block (&job->buffer))
+		return;
+
+	/* Make sure there's another thread to read the next request */
+#ifdef OS_UNIX
+	if (disp->num_idle == 0 && disp->num_workers < RPC_SERVER_MAX_WORKERS) {
+		if (p11_thread_create (disp->workers + disp->num_workers,
+		                       rpc_dispatcher_worker, disp) == 0)
+			disp->num_workers++;
+	}
+#endif
+
+	rpc_dispatcher_wake_inlock (disp);
+}
+
+static void
+rpc_dispatcher_loop (rpc_dispatcher *disp)
+{
+	p11_rpc_arena arena;
+	rpc_job *job;
+
+	/* The memory for handling requests is kept between them */
+	p11_rpc_arena_init (&arena, RPC_SERVER_ARENA_RETAIN, realloc, free);
+
+	p11_mutex_lock (&disp->lock);
+
+	for (;;) {
+		job = rpc_dispatcher_next_inlock (disp);
+		if (job != NULL)
+			rpc_dispatcher_run_inlock (disp, job, &arena);
+		else if (disp->stopping && !disp->reading)
+			break;
+		else if (!disp->reading)
+			rpc_dispatcher_read_inlock (disp, &arena);
+		else
+			rpc_dispatcher_wait_inlock (disp);
+	}
+
+	p11_mutex_unlock (&disp->lock);
+
+	p11_rpc_arena_uninit (&arena);
+}
+
+#ifdef OS_UNIX
+static void *
+rpc_dispatcher_worker (void *data)
+{
+	rpc_dispatcher_loop (data);
+	return NULL;
+}
+#endif
+
+/*
+ * Serves requests until the client goes away, or something fails, in
+ * which case false is returned.
+ */
+static bool
+rpc_dispatcher_serve (rpc_server *server,
+                      int in_fd,
+                      int out_fd,
+                      p11_rpc_ring *ring)
+{
+	rpc_dispatcher disp;
+	rpc_job *job;
+	int i;
+
+	memset (&disp, 0, sizeof (rpc_dispatcher));
+	disp.server = server;
+	disp.in_fd = in_fd;
+	disp.out_fd = out_fd;
+	disp.ring = ring;
+	p11_buffer_init (&disp.options, 0);
+	p11_mutex_init (&disp.write_lock);
+	p11_mutex_init (&disp.lock);
+#ifdef OS_UNIX
+	p11_cond_init (&disp.cond);
+#endif
+
+	/* This thread serves too, other threads are started as needed */
+	rpc_dispatcher_loop (&disp);
+
+	for (i = 0; i < disp.num_workers; i++)
+		p11_thread_join (disp.workers[i]);
+
+	assert (disp.jobs == NULL);
+
+	while (disp.spare != NULL) {
+		job = disp.spare;
+		disp.spare = job->next;
+		p11_buffer_uninit (&job->buffer);
+		free (job);
+	}
+
+#ifdef OS_UNIX
+	p11_cond_uninit (&disp.cond);
+#endif
+	p11_mutex_uninit (&disp.lock);
+	p11_mutex_uninit (&disp.write_lock);
+	p11_buffer_uninit (&disp.options);
+
+	return !disp.failed;
+}
+
 /**
  * p11_kit_remote_serve_module:
  * @module: a pointer to a loaded module
@@ -2472,19 +3274,15 @@ p11_kit_remote_serve_module (CK_FUNCTION_LIST *module,
                              int in_fd,
                              int out_fd)
 {
-	p11_rpc_status status;
+	p11_rpc_ring *ring = NULL;
 	rpc_server server;
-	p11_buffer options;
-	p11_buffer buffer;
-	size_t state;
+	uint8_t byte;
+	int attached;
 	int ret = 1;
-	int code;
 
 	return_val_if_fail (module != NULL, 1);
 
-	p11_buffer_init (&options, 0);
-	p11_buffer_init (&buffer, 0);
-
+	p11_rpc_stats_enable (&p11_rpc_server_stats, "server");
 	p11_virtual_init (&server.virt, &p11_virtual_base, module, NULL);
 
 	switch (read (in_fd, &server.version, 1)) {
@@ -2515,57 +3313,34 @@ p11_kit_remote_serve_module (CK_FUNCTION_LIST *module,
 		goto out;
 	}
 
-	status = P11_RPC_OK;
-	while (status == P11_RPC_OK) {
-		state = 0;
-		code = 0;
-
-		do {
-			status = p11_rpc_transport_read (in_fd, &state, &code,
-			                                 &options, &buffer);
-		} while (status == P11_RPC_AGAIN);
-
-		switch (status) {
-		case P11_RPC_OK:
-			break;
-		case P11_RPC_EOF:
-			ret = 0;
-			continue;
-		case P11_RPC_AGAIN:
-			assert_not_reached ();
-		case P11_RPC_ERROR:
-			p11_message_err (errno, _("failed to read rpc message"));
+	/*
+	 * Since version 3, the client says which options it wants, and the
+	 * server which ones it will use. Since version 4 the client may
+	 * pass memory for the rings.
+	 */
+	if (server.version >= 3) {
+		if (p11_rpc_transport_read_handshake (in_fd, &byte, &attached) != 1) {
+			p11_message_err (errno, _("couldn't read credential byte"));
 			goto out;
 		}
-
-		if (!p11_rpc_server_handle (&server.virt.funcs, &buffer, &buffer)) {
-			p11_message (_("unexpected error handling rpc message"));
-			goto out;
+		if (attached != -1) {
+			if (server.version >= 4 && byte == 1)
+				ring = p11_rpc_ring_attach (attached, in_fd);
+			close (attached);
 		}
 
-		state = 0;
-		options.len = 0;
-		do {
-			status = p11_rpc_transport_write (out_fd, &state, code,
-			                                  &options, &buffer);
-		} while (status == P11_RPC_AGAIN);
-
-		switch (status) {
-		case P11_RPC_OK:
-			break;
-		case P11_RPC_EOF:
-		case P11_RPC_AGAIN:
-			assert_not_reached ();
-		case P11_RPC_ERROR:
-			p11_message_err (errno, _("failed to write rpc message"));
+		byte = ring ? 1 : 0;
+		if (write (out_fd, &byte, 1) != 1) {
+			p11_message_err (errno, _("couldn't write credential byte"));
 			goto out;
 		}
 	}
 
-out:
-	p11_buffer_uninit (&buffer);
-	p11_buffer_uninit (&options);
+	if (rpc_dispatcher_serve (&server, in_fd, out_fd, ring))
+		ret = 0;
 
+out:
+	p11_rpc_ring_free (ring);
 	p11_virtual_uninit (&server.virt);
 
 	return ret;
@@ -2813,6 +3588,9 @@ p11_kit_remote_serve_tokens (const char **tokens,
 	ret = p11_kit_remote_serve_module (proxy, in_fd, out_fd);
 
  out:
+	/* This also finalizes the tokens if the client did not */
+	if (proxy != NULL)
+		p11_virtual_unwrap (proxy);
 	if (filtered != NULL)
 		p11_array_free (filtered);
 	if (filters != NULL)
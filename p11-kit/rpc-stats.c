@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2026, Red Hat Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "config.h"
+
+#define P11_DEBUG_FLAG P11_DEBUG_RPC
+#include "compat.h"
+#include "debug.h"
+#include "message.h"
+#include "rpc-message.h"
+#include "rpc-stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef OS_UNIX
+#include <unistd.h>
+#endif
+
+#ifdef ENABLE_NLS
+#include <libintl.h>
+#define _(x) dgettext(PACKAGE_NAME, x)
+#else
+#define _(x) (x)
+#endif
+
+p11_rpc_stats *p11_rpc_client_stats = NULL;
+p11_rpc_stats *p11_rpc_server_stats = NULL;
+
+/* Calls are counted from several threads at once */
+#ifdef __GNUC__
+#define stats_add(place, value) \
+	__atomic_fetch_add (&(place), (value), __ATOMIC_RELAXED)
+#else
+#define stats_add(place, value) \
+	((place) += (value))
+#endif
+
+static const char *phase_names[P11_RPC_STATS_PHASES] = {
+	"serialize",
+	"transport",
+	"module",
+};
+
+p11_rpc_stats *
+p11_rpc_stats_new (const char *side)
+{
+	p11_rpc_stats *stats;
+
+	stats = calloc (1, sizeof (p11_rpc_stats));
+	return_val_if_fail (stats != NULL, NULL);
+
+	stats->calls = calloc (P11_RPC_CALL_MAX, sizeof (p11_rpc_call_stats));
+	if (stats->calls == NULL) {
+		free (stats);
+		return_val_if_reached (NULL);
+	}
+
+	stats->side = side;
+	return stats;
+}
+
+void
+p11_rpc_stats_free (p11_rpc_stats *stats)
+{
+	if (stats == NULL)
+		return;
+	free (stats->calls);
+	free (stats);
+}
+
+/*
+ * Called as the client or the server starts. When P11_KIT_RPC_STATS is
+ * set, calls are counted until the library is unloaded, when they are
+ * appended to the file it names, or written to stderr if it's empty.
+ */
+void
+p11_rpc_stats_enable (p11_rpc_stats **place,
+                      const char *side)
+{
+	p11_rpc_stats *stats;
+#ifdef __GNUC__
+	p11_rpc_stats *expected = NULL;
+#endif
+
+	if (*place != NULL || secure_getenv ("P11_KIT_RPC_STATS") == NULL)
+		return;
+
+	stats = p11_rpc_stats_new (side);
+	if (stats == NULL)
+		return;
+
+	/* Not under p11_lock, which may be held while loading modules */
+#ifdef __GNUC__
+	if (!__atomic_compare_exchange_n (place, &expected, stats, false,
+	                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		p11_rpc_stats_free (stats);
+#else
+	if (*place == NULL)
+		*place = stats;
+	else
+		p11_rpc_stats_free (stats);
+#endif
+}
+
+static uint64_t
+stats_now (void)
+{
+#ifdef OS_UNIX
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+
+	if (!QueryPerformanceCounter (&counter) ||
+	    !QueryPerformanceFrequency (&frequency))
+		return 0;
+	return (uint64_t)((double)counter.QuadPart * 1000000000.0 / frequency.QuadPart);
+#endif
+}
+
+void
+p11_rpc_probe_start (p11_rpc_probe *probe,
+                     int call_id)
+{
+	probe->call_id = call_id;
+	probe->stamp = stats_now ();
+}
+
+/* The time since the last lap was spent on @phase */
+void
+p11_rpc_probe_lap (p11_rpc_probe *probe,
+                   int phase)
+{
+	uint64_t now = stats_now ();
+
+	probe->nsec[phase] += now - probe->stamp;
+	probe->stamp = now;
+}
+
+static unsigned int
+histogram_bucket (uint64_t nsec)
+{
+	unsigned int octave = 0;
+	unsigned int bucket;
+
+	if (nsec < 4)
+		return nsec;
+
+	/* Shifted down by the octave, the value is between 4 and 7 */
+#ifdef __GNUC__
+	octave = 61 - __builtin_clzll (nsec);
+#else
+	while ((nsec >> octave) >= 8)
+		octave++;
+#endif
+
+	bucket = (octave + 1) * 4 + ((nsec >> octave) & 3);
+	return bucket < P11_RPC_STATS_BUCKETS ? bucket : P11_RPC_STATS_BUCKETS - 1;
+}
+
+/* The largest value that goes in @bucket */
+static uint64_t
+histogram_bucket_max (unsigned int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+	return ((uint64_t)(5 + bucket % 4) << (bucket / 4 - 1)) - 1;
+}
+
+void
+p11_rpc_histogram_add (p11_rpc_histogram *histogram,
+                       uint64_t nsec)
+{
+	stats_add (histogram->count, 1);
+	stats_add (histogram->total, nsec);
+	stats_add (histogram->buckets[histogram_bucket (nsec)], 1);
+}
+
+uint64_t
+p11_rpc_histogram_percentile (p11_rpc_histogram *histogram,
+                              unsigned int percent)
+{
+	uint64_t wanted;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	return_val_if_fail (percent <= 100, 0);
+
+	if (histogram->count == 0)
+		return 0;
+
+	wanted = (histogram->count * percent + 99) / 100;
+	if (wanted == 0)
+		wanted = 1;
+
+	for (i = 0; i < P11_RPC_STATS_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= wanted)
+			break;
+	}
+
+	return histogram_bucket_max (i < P11_RPC_STATS_BUCKETS ? i : P11_RPC_STATS_BUCKETS - 1);
+}
+
+void
+p11_rpc_stats_record (p11_rpc_stats *stats,
+                      p11_rpc_probe *probe)
+{
+	p11_rpc_call_stats *call;
+	int i;
+
+	return_if_fail (stats != NULL);
+	return_if_fail (probe->call_id >= 0 && probe->call_id < P11_RPC_CALL_MAX);
+
+	call = stats->calls + probe->call_id;
+	stats_add (call->count, 1);
+	stats_add (call->sent, probe->sent);
+	stats_add (call->received, probe->received);
+
+	for (i = 0; i < P11_RPC_STATS_PHASES; i++)
+		p11_rpc_histogram_add (call->phases + i, probe->nsec[i]);
+}
+
+/*
+ * A line for each call that was made, with tab separated fields that
+ * are named by the first line. Times are in nanoseconds.
+ */
+bool
+p11_rpc_stats_format (p11_rpc_stats *stats,
+                      p11_buffer *buffer)
+{
+	p11_rpc_histogram *histogram;
+	p11_rpc_call_stats *call;
+	char line[512];
+	size_t len;
+	int pid;
+	int i;
+	int j;
+
+	return_val_if_fail (stats != NULL, false);
+
+#ifdef OS_WIN32
+	pid = (int)GetCurrentProcessId ();
+#else
+	pid = (int)getpid ();
+#endif
+
+	p11_buffer_add (buffer, "#side\tpid\tcall\tcount\tsent\treceived", -1);
+	for (j = 0; j < P11_RPC_STATS_PHASES; j++) {
+		snprintf (line, sizeof (line), "\t%s_total\t%s_p50\t%s_p99",
+		          phase_names[j], phase_names[j], phase_names[j]);
+		p11_buffer_add (buffer, line, -1);
+	}
+	p11_buffer_add (buffer, "\n", 1);
+
+	for (i = 0; i < P11_RPC_CALL_MAX; i++) {
+		call = stats->calls + i;
+		if (call->count == 0)
+			continue;
+
+		len = snprintf (line, sizeof (line), "%s\t%d\t%s\t%llu\t%llu\t%llu",
+		                stats->side, pid, p11_rpc_calls[i].name,
+		                (unsigned long long)call->count,
+		                (unsigned long long)call->sent,
+		                (unsigned long long)call->received);
+		for (j = 0; j < P11_RPC_STATS_PHASES && len < sizeof (line); j++) {
+			histogram = call->phases + j;
+			len += snprintf (line + len, sizeof (line) - len, "\t%llu\t%llu\t%llu",
+			                 (unsigned long long)histogram->total,
+			                 (unsigned long long)p11_rpc_histogram_percentile (histogram, 50),
+			                 (unsigned long long)p11_rpc_histogram_percentile (histogram, 99));
+		}
+
+		p11_buffer_add (buffer, line, -1);
+		p11_buffer_add (buffer, "\n", 1);
+	}
+
+	return p11_buffer_ok (buffer);
+}
+
+static void
+stats_write (const char *path)
+{
+	p11_buffer buffer;
+	FILE *file;
+
+	if (!p11_buffer_init_null (&buffer, 4096))
+		return_if_reached ();
+
+	if (p11_rpc_client_stats)
+		p11_rpc_stats_format (p11_rpc_client_stats, &buffer);
+	if (p11_rpc_server_stats)
+		p11_rpc_stats_format (p11_rpc_server_stats, &buffer);
+
+	if (!p11_buffer_ok (&buffer)) {
+		p11_buffer_uninit (&buffer);
+		return_if_reached ();
+	}
+
+	if (path[0] == '\0') {
+		fwrite (buffer.data, 1, buffer.len, stderr);
+	} else {
+		file = fopen (path, "a");
+		if (file == NULL) {
+			p11_message_err (errno, _("couldn't open rpc statistics file: %s"), path);
+		} else {
+			fwrite (buffer.data, 1, buffer.len, file);
+			fclose (file);
+		}
+	}
+
+	p11_buffer_uninit (&buffer);
+}
+
+/* Called as the library is unloaded, after the calls are done */
+void
+p11_rpc_stats_dump (void)
+{
+	const char *path;
+
+	if (p11_rpc_client_stats == NULL && p11_rpc_server_stats == NULL)
+		return;
+
+	path = secure_getenv ("P11_KIT_RPC_STATS");
+	if (path != NULL)
+		stats_write (path);
+
+	p11_rpc_stats_free (p11_rpc_client_stats);
+	p11_rpc_client_stats = NULL;
+	p11_rpc_stats_free (p11_rpc_server_stats);
+	p11_rpc_server_stats = NULL;
+}
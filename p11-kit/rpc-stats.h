@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2026, Red Hat Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef P11_RPC_STATS_H_
+#define P11_RPC_STATS_H_
+
+#include "buffer.h"
+
+#include <stdint.h>
+
+/*
+ * Where the time of a call goes. The client spends it serializing, and
+ * waiting for the transport, the server serializing and in the module.
+ */
+enum {
+	P11_RPC_STATS_SERIALIZE,
+	P11_RPC_STATS_TRANSPORT,
+	P11_RPC_STATS_MODULE,
+	P11_RPC_STATS_PHASES
+};
+
+/*
+ * Durations in nanoseconds are counted in buckets of a quarter octave
+ * each, which puts percentiles within about 20% of the actual value.
+ * The last bucket counts everything above 2^40 nanoseconds.
+ */
+#define P11_RPC_STATS_OCTAVES 40
+#define P11_RPC_STATS_BUCKETS (P11_RPC_STATS_OCTAVES * 4)
+
+typedef struct {
+	uint64_t count;
+	uint64_t total;
+	uint64_t buckets[P11_RPC_STATS_BUCKETS];
+} p11_rpc_histogram;
+
+typedef struct {
+	uint64_t count;
+	uint64_t sent;
+	uint64_t received;
+	p11_rpc_histogram phases[P11_RPC_STATS_PHASES];
+} p11_rpc_call_stats;
+
+typedef struct {
+	const char *side;
+	p11_rpc_call_stats *calls;
+} p11_rpc_stats;
+
+/* The time spent on a single call so far */
+typedef struct {
+	int call_id;
+	uint64_t stamp;
+	uint64_t nsec[P11_RPC_STATS_PHASES];
+	size_t sent;
+	size_t received;
+} p11_rpc_probe;
+
+/*
+ * Only set when P11_KIT_RPC_STATS is. Each call checks these once, and
+ * only gets a probe when they're set. Otherwise what remains is a test
+ * of the NULL probe of the message where each phase ends: twice per call
+ * in the client, three times in the server.
+ */
+extern p11_rpc_stats *  p11_rpc_client_stats;
+
+extern p11_rpc_stats *  p11_rpc_server_stats;
+
+void                    p11_rpc_stats_enable        (p11_rpc_stats **place,
+                                                     const char *side);
+
+p11_rpc_stats *         p11_rpc_stats_new           (const char *side);
+
+void                    p11_rpc_stats_free          (p11_rpc_stats *stats);
+
+void                    p11_rpc_probe_start         (p11_rpc_probe *probe,
+                                                     int call_id);
+
+void                    p11_rpc_probe_lap           (p11_rpc_probe *probe,
+                                                     int phase);
+
+void                    p11_rpc_stats_record        (p11_rpc_stats *stats,
+                                                     p11_rpc_probe *probe);
+
+void                    p11_rpc_histogram_add       (p11_rpc_histogram *histogram,
+                                                     uint64_t nsec);
+
+uint64_t                p11_rpc_histogram_percentile (p11_rpc_histogram *histogram,
+                                                      unsigned int percent);
+
+bool                    p11_rpc_stats_format        (p11_rpc_stats *stats,
+                                                     p11_buffer *buffer);
+
+void                    p11_rpc_stats_dump          (void);
+
+#endif /* P11_RPC_STATS_H_ */
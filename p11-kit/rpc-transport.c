@@ -57,15 +57,27 @@
 #include <string.h>
 
 #ifdef OS_UNIX
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <limits.h>
 #endif
 
+#if defined(OS_UNIX) && defined(HAVE_MEMFD_CREATE) && defined(HAVE_LINUX_FUTEX_H)
+#define RPC_RING 1
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <time.h>
+#endif
+
 #ifdef OS_WIN32
 #include <process.h>
 #include <signal.h>
@@ -86,6 +98,28 @@
 #define _(x) (x)
 #endif
 
+/*
+ * A caller waiting for the response to a request. Whichever waiting
+ * thread is currently reading from the socket dispatches responses to
+ * the waiters by their call code, so that responses can arrive in any
+ * order.
+ *
+ * A request that was submitted without waiting has a callback instead,
+ * which is called by the thread that reads its response.
+ */
+typedef struct _rpc_waiter {
+	uint32_t code;
+	p11_buffer *buffer;
+	bool done;
+	p11_rpc_complete complete;
+	void *data;
+	struct _rpc_waiter *next;
+} rpc_waiter;
+
+#ifdef RPC_RING
+static void rpc_ring_close (p11_rpc_ring *ring);
+#endif
+
 typedef struct {
 	/* Never changes.  On Unix, these are identical, as it is
 	 * backed by a socket.  On Windows, it is another file
@@ -101,14 +135,34 @@ typedef struct {
 	/* This data is protected by read mutex */
 	p11_mutex_t read_lock;
 #ifdef OS_UNIX
-        /* Signalled when read_code changes */
-        p11_cond_t read_code_cond;
+	/* Signalled when a response has been dispatched */
+	p11_cond_t read_cond;
 #endif
-	uint32_t read_code;
-	uint32_t read_olen;
-	uint32_t read_dlen;
+	rpc_waiter *waiters;
+	bool reading;
+	bool read_failed;
+
+#ifdef OS_UNIX
+	/* Since protocol version 4, messages may go through shared memory
+	 * rings instead, when asked for before authenticating */
+	bool want_ring;
+	p11_rpc_ring *ring;
+#endif
+
+	/* Data read ahead from the socket, between start and end. Only
+	 * touched by the thread that is currently reading */
+	unsigned char *read_buf;
+	size_t read_start;
+	size_t read_end;
 } rpc_socket;
 
+/*
+ * Size of the read ahead buffer. Most messages fit, so that the header
+ * and the body are read in a single call. Larger bodies are read
+ * directly into their destination.
+ */
+#define RPC_SOCKET_READ_SIZE 4096
+
 static rpc_socket *
 rpc_socket_new (int fd)
 {
@@ -117,6 +171,12 @@ rpc_socket_new (int fd)
 	sock = calloc (1, sizeof (rpc_socket));
 	return_val_if_fail (sock != NULL, NULL);
 
+	sock->read_buf = malloc (RPC_SOCKET_READ_SIZE);
+	if (sock->read_buf == NULL) {
+		free (sock);
+		return_val_if_reached (NULL);
+	}
+
 	sock->read_fd = fd;
 	sock->write_fd = fd;
 	sock->last_code = 0x10;
@@ -126,13 +186,12 @@ rpc_socket_new (int fd)
 	p11_mutex_init (&sock->read_lock);
 
 #ifdef OS_UNIX
-        p11_cond_init (&sock->read_code_cond);
+	p11_cond_init (&sock->read_cond);
 #endif
 
 	return sock;
 }
 
-#if 0
 static rpc_socket *
 rpc_socket_ref (rpc_socket *sock)
 {
@@ -145,6 +204,7 @@ rpc_socket_ref (rpc_socket *sock)
 	return sock;
 }
 
+#if 0
 static bool
 rpc_socket_is_open (rpc_socket *sock)
 {
@@ -160,6 +220,10 @@ rpc_socket_close (rpc_socket *sock)
 	if (sock->read_fd != -1)
 		close (sock->read_fd);
 	sock->read_fd = -1;
+#ifdef RPC_RING
+	if (sock->ring)
+		rpc_ring_close (sock->ring);
+#endif
 #ifdef OS_WIN32
 	if (sock->write_fd != -1)
 		close (sock->write_fd);
@@ -186,11 +250,15 @@ rpc_socket_unref (rpc_socket *sock)
 	assert (sock->refs == 0);
 
 	rpc_socket_close (sock);
+#ifdef OS_UNIX
+	p11_rpc_ring_free (sock->ring);
+#endif
 	p11_mutex_uninit (&sock->write_lock);
 	p11_mutex_uninit (&sock->read_lock);
 #ifdef OS_UNIX
-        p11_cond_uninit (&sock->read_code_cond);
+	p11_cond_uninit (&sock->read_cond);
 #endif
+	free (sock->read_buf);
 	free (sock);
 }
 
@@ -248,6 +316,543 @@ read_all (int fd,
 	return true;
 }
 
+#ifdef OS_UNIX
+
+/* Skips the first @skip bytes, and returns the number of vectors left */
+static int
+advance_iov (struct iovec **iov,
+             int count,
+             size_t skip)
+{
+	while (count > 0 && skip >= (*iov)->iov_len) {
+		skip -= (*iov)->iov_len;
+		(*iov)++;
+		count--;
+	}
+
+	if (count > 0) {
+		(*iov)->iov_base = (unsigned char *)(*iov)->iov_base + skip;
+		(*iov)->iov_len -= skip;
+	}
+
+	return count;
+}
+
+static bool
+writev_all (int fd,
+            struct iovec *iov,
+            int count)
+{
+	ssize_t r;
+
+	count = advance_iov (&iov, count, 0);
+	while (count > 0) {
+		r = writev (fd, iov, count);
+		if (r == -1) {
+			if (errno == EPIPE) {
+				p11_message (_("couldn't send data: closed connection"));
+				return false;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				p11_message_err (errno, _("couldn't send data"));
+				return false;
+			}
+		} else {
+			p11_debug ("wrote %d bytes", (int)r);
+			count = advance_iov (&iov, count, r);
+		}
+	}
+
+	return true;
+}
+
+/* Whether file descriptors can be passed along on @fd */
+static bool
+can_attach (int fd)
+{
+	struct sockaddr_storage sa;
+	socklen_t len = sizeof (sa);
+
+	if (getsockname (fd, (struct sockaddr *)&sa, &len) < 0)
+		return false;
+	return sa.ss_family == AF_UNIX;
+}
+
+#ifdef RPC_RING
+
+/*
+ * Sends @iov, passing @attach along with the first byte. The rest is sent
+ * like writev_all() would.
+ */
+static bool
+sendmsg_all (int fd,
+             struct iovec *iov,
+             int count,
+             int attach)
+{
+	union {
+		struct cmsghdr hdr;
+		unsigned char buf[CMSG_SPACE (sizeof (int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	ssize_t r;
+
+	memset (&control, 0, sizeof (control));
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof (control.buf);
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+	memcpy (CMSG_DATA (cmsg), &attach, sizeof (int));
+
+	do {
+		r = sendmsg (fd, &msg, 0);
+	} while (r == -1 && (errno == EAGAIN || errno == EINTR));
+
+	if (r == -1) {
+		if (errno == EPIPE)
+			p11_message (_("couldn't send data: closed connection"));
+		else
+			p11_message_err (errno, _("couldn't send data"));
+		return false;
+	}
+
+	p11_debug ("wrote %d bytes with a file descriptor", (int)r);
+	count = advance_iov (&iov, count, r);
+	return writev_all (fd, iov, count);
+}
+
+#endif /* RPC_RING */
+
+/*
+ * Reads like read() does, but keeps the first file descriptor passed
+ * along in @attached, if there was none there yet. Any others are closed.
+ */
+static ssize_t
+recv_attached (int fd,
+               unsigned char *data,
+               size_t len,
+               int *attached)
+{
+	union {
+		struct cmsghdr hdr;
+		unsigned char buf[CMSG_SPACE (sizeof (int) * 4)];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned char *passed;
+	int flags = 0;
+	ssize_t r;
+	size_t i;
+	int pfd;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof (control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	r = recvmsg (fd, &msg, flags);
+	if (r < 0)
+		return r;
+
+	for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		passed = CMSG_DATA (cmsg);
+		for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int); i++) {
+			memcpy (&pfd, passed + i * sizeof (int), sizeof (int));
+			if (*attached == -1)
+				*attached = pfd;
+			else
+				close (pfd);
+		}
+	}
+
+	return r;
+}
+
+#ifdef RPC_RING
+
+/*
+ * With the "shm:" transport, since protocol version 4, messages travel
+ * through two rings in memory shared with the server, one for requests
+ * and one for responses, instead of through the socket. The messages
+ * themselves are the same. The client creates the memory as a sealed
+ * memfd and passes it along when connecting, and the socket is only
+ * kept to notice when the other side goes away.
+ */
+#define RPC_RING_MAGIC 0x70313172U
+
+/* Of each ring. Larger messages pass through in several parts */
+#define RPC_RING_SIZE (256 * 1024)
+#define RPC_RING_SIZE_MAX (16 * 1024 * 1024)
+
+/* How often a waiting side checks whether the other one is still there */
+#define RPC_RING_TIMEOUT_MSEC 100
+
+/* How long to spin before sleeping, when there is more than one CPU */
+#define RPC_RING_SPIN_USEC 50
+
+#if defined(__i386__) || defined(__x86_64__)
+#define rpc_ring_relax() __builtin_ia32_pause ()
+#else
+#define rpc_ring_relax() do { } while (0)
+#endif
+
+/* One direction. The positions count all bytes ever passed through it */
+typedef struct {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t reader_waiting;
+	uint32_t writer_waiting;
+	uint32_t closed;
+	unsigned char pad[44];
+} rpc_ring_half;
+
+/* At the start of the shared memory, followed by the data of both rings */
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	unsigned char pad[56];
+	rpc_ring_half halves[2];
+} rpc_ring_header;
+
+struct _p11_rpc_ring {
+	rpc_ring_header *header;
+	size_t length;
+	uint32_t size;
+	int fd;
+	pid_t pid;
+	bool spin;
+
+	/* Our own positions, as the other side can't be trusted with them */
+	rpc_ring_half *tx;
+	unsigned char *tx_data;
+	uint32_t tx_head;
+	rpc_ring_half *rx;
+	unsigned char *rx_data;
+	uint32_t rx_tail;
+};
+
+static long
+rpc_ring_futex (uint32_t *word,
+                int op,
+                uint32_t value,
+                const struct timespec *timeout)
+{
+	return syscall (SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static p11_rpc_ring *
+rpc_ring_map (int memfd,
+              int fd,
+              bool server)
+{
+	rpc_ring_header *header;
+	p11_rpc_ring *ring;
+	struct stat sb;
+	uint32_t size;
+	void *data;
+	int seals;
+
+	if (fstat (memfd, &sb) < 0 || !S_ISREG (sb.st_mode) ||
+	    (size_t)sb.st_size < sizeof (rpc_ring_header))
+		return NULL;
+
+	/* Otherwise the memory could go away while in use */
+	seals = fcntl (memfd, F_GET_SEALS);
+	if (seals < 0 || (seals & F_SEAL_SHRINK) == 0)
+		return NULL;
+
+	data = mmap (NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	header = data;
+	size = header->size;
+	if (header->magic != RPC_RING_MAGIC ||
+	    size == 0 || size > RPC_RING_SIZE_MAX || (size & (size - 1)) != 0 ||
+	    (size_t)sb.st_size < sizeof (rpc_ring_header) + 2 * (size_t)size) {
+		munmap (data, sb.st_size);
+		return NULL;
+	}
+
+	ring = calloc (1, sizeof (p11_rpc_ring));
+	if (ring == NULL) {
+		munmap (data, sb.st_size);
+		return_val_if_reached (NULL);
+	}
+
+	ring->header = header;
+	ring->length = sb.st_size;
+	ring->size = size;
+	ring->fd = fd;
+	ring->pid = getpid ();
+	ring->spin = sysconf (_SC_NPROCESSORS_ONLN) > 1;
+
+	/* The first ring carries the requests, the second the responses */
+	data = (unsigned char *)data + sizeof (rpc_ring_header);
+	ring->rx = &header->halves[server ? 0 : 1];
+	ring->rx_data = (unsigned char *)data + (server ? 0 : size);
+	ring->rx_tail = __atomic_load_n (&ring->rx->tail, __ATOMIC_ACQUIRE);
+	ring->tx = &header->halves[server ? 1 : 0];
+	ring->tx_data = (unsigned char *)data + (server ? size : 0);
+	ring->tx_head = __atomic_load_n (&ring->tx->head, __ATOMIC_ACQUIRE);
+
+	return ring;
+}
+
+/* Creates the rings on the client, and the memfd to pass to the server */
+static p11_rpc_ring *
+rpc_ring_new (int fd,
+              int *memfd)
+{
+	size_t length = sizeof (rpc_ring_header) + 2 * RPC_RING_SIZE;
+	rpc_ring_header header;
+	p11_rpc_ring *ring;
+
+	*memfd = memfd_create ("p11-kit-rpc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (*memfd < 0)
+		return NULL;
+
+	memset (&header, 0, sizeof (header));
+	header.magic = RPC_RING_MAGIC;
+	header.size = RPC_RING_SIZE;
+
+	ring = NULL;
+	if (ftruncate (*memfd, length) == 0 &&
+	    fcntl (*memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0 &&
+	    pwrite (*memfd, &header, sizeof (header), 0) == sizeof (header))
+		ring = rpc_ring_map (*memfd, fd, false);
+
+	if (ring == NULL) {
+		close (*memfd);
+		*memfd = -1;
+	}
+
+	return ring;
+}
+
+/* Tells the other side that we're gone, and wakes it up */
+static void
+rpc_ring_close (p11_rpc_ring *ring)
+{
+	/* Not when inherited over a fork, as the parent still uses it */
+	if (ring->pid != getpid ())
+		return;
+
+	__atomic_store_n (&ring->tx->closed, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n (&ring->rx->closed, 1, __ATOMIC_SEQ_CST);
+	rpc_ring_futex (&ring->tx->head, FUTEX_WAKE, INT_MAX, NULL);
+	rpc_ring_futex (&ring->rx->tail, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * Waits until the other side changes @word from @seen. Returns false if
+ * it goes away instead.
+ */
+static bool
+rpc_ring_wait (p11_rpc_ring *ring,
+               uint32_t *word,
+               uint32_t seen,
+               uint32_t *waiting)
+{
+	struct timespec timeout = { 0, RPC_RING_TIMEOUT_MSEC * 1000 * 1000 };
+	struct timespec start, now;
+	struct pollfd pfd;
+	bool ok = true;
+	int i;
+
+	/* A quick response is likely, and cheaper to wait for by spinning */
+	if (ring->spin) {
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		for (i = 1; __atomic_load_n (word, __ATOMIC_ACQUIRE) == seen; i++) {
+			rpc_ring_relax ();
+			if (i % 64 != 0)
+				continue;
+			clock_gettime (CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - start.tv_sec) * 1000000 +
+			    (now.tv_nsec - start.tv_nsec) / 1000 >= RPC_RING_SPIN_USEC)
+				break;
+		}
+	}
+
+	for (;;) {
+		/* The other side only wakes us up when it sees this */
+		__atomic_store_n (waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (word, __ATOMIC_SEQ_CST) != seen)
+			break;
+
+		if (__atomic_load_n (&ring->rx->closed, __ATOMIC_SEQ_CST) ||
+		    __atomic_load_n (&ring->tx->closed, __ATOMIC_SEQ_CST)) {
+			ok = false;
+			break;
+		}
+
+		/* Nothing else is sent on the socket, unless it's closed */
+		if (rpc_ring_futex (word, FUTEX_WAIT, seen, &timeout) < 0 &&
+		    errno == ETIMEDOUT) {
+			pfd.fd = ring->fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll (&pfd, 1, 0) > 0) {
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	__atomic_store_n (waiting, 0, __ATOMIC_SEQ_CST);
+	if (!ok)
+		errno = EPIPE;
+	return ok;
+}
+
+/* Writes all of @iov, waiting for space as needed */
+static bool
+rpc_ring_send (p11_rpc_ring *ring,
+               struct iovec *iov,
+               int count)
+{
+	unsigned char *data;
+	uint32_t tail;
+	uint32_t used;
+	uint32_t off;
+	uint32_t num;
+	uint32_t part;
+	size_t len;
+
+	for (; count > 0; iov++, count--) {
+		data = iov->iov_base;
+		len = iov->iov_len;
+
+		while (len > 0) {
+			tail = __atomic_load_n (&ring->tx->tail, __ATOMIC_ACQUIRE);
+			used = ring->tx_head - tail;
+			if (used > ring->size) {
+				errno = EPROTO;
+				return false;
+			} else if (used == ring->size) {
+				if (!rpc_ring_wait (ring, &ring->tx->tail, tail,
+				                    &ring->tx->writer_waiting))
+					return false;
+				continue;
+			}
+
+			num = ring->size - used;
+			if (num > len)
+				num = len;
+			off = ring->tx_head & (ring->size - 1);
+			part = ring->size - off;
+			if (part > num)
+				part = num;
+			memcpy (ring->tx_data + off, data, part);
+			memcpy (ring->tx_data, data + part, num - part);
+
+			ring->tx_head += num;
+			__atomic_store_n (&ring->tx->head, ring->tx_head, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n (&ring->tx->reader_waiting, __ATOMIC_SEQ_CST))
+				rpc_ring_futex (&ring->tx->head, FUTEX_WAKE, 1, NULL);
+
+			data += num;
+			len -= num;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Reads like read() does, waiting until there is something to read.
+ * Returns zero when the other side has gone away.
+ */
+static ssize_t
+rpc_ring_recv (p11_rpc_ring *ring,
+               unsigned char *data,
+               size_t len)
+{
+	uint32_t head;
+	uint32_t avail;
+	uint32_t off;
+	uint32_t part;
+
+	for (;;) {
+		head = __atomic_load_n (&ring->rx->head, __ATOMIC_ACQUIRE);
+		avail = head - ring->rx_tail;
+		if (avail > ring->size) {
+			errno = EPROTO;
+			return -1;
+		} else if (avail > 0) {
+			break;
+		}
+
+		if (!rpc_ring_wait (ring, &ring->rx->head, head,
+		                    &ring->rx->reader_waiting))
+			return 0;
+	}
+
+	if (avail > len)
+		avail = len;
+	off = ring->rx_tail & (ring->size - 1);
+	part = ring->size - off;
+	if (part > avail)
+		part = avail;
+	memcpy (data, ring->rx_data + off, part);
+	memcpy (data + part, ring->rx_data, avail - part);
+
+	/* Other threads may look at how far we got, see p11_rpc_ring_pending() */
+	__atomic_store_n (&ring->rx_tail, ring->rx_tail + avail, __ATOMIC_RELEASE);
+	__atomic_store_n (&ring->rx->tail, ring->rx_tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&ring->rx->writer_waiting, __ATOMIC_SEQ_CST))
+		rpc_ring_futex (&ring->rx->tail, FUTEX_WAKE, 1, NULL);
+
+	return avail;
+}
+
+static p11_rpc_status
+rpc_ring_read_all (p11_rpc_ring *ring,
+                   unsigned char *data,
+                   size_t len,
+                   bool start)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = rpc_ring_recv (ring, data, len);
+		if (r < 0)
+			return P11_RPC_ERROR;
+		if (r == 0) {
+			if (start)
+				return P11_RPC_EOF;
+			errno = EPROTO;
+			return P11_RPC_ERROR;
+		}
+		start = false;
+		data += r;
+		len -= r;
+	}
+
+	return P11_RPC_OK;
+}
+
+#endif /* RPC_RING */
+
+#endif /* OS_UNIX */
+
 static CK_RV
 rpc_socket_write_inlock (rpc_socket *sock,
                          int code,
@@ -255,6 +860,9 @@ rpc_socket_write_inlock (rpc_socket *sock,
                          p11_buffer *buffer)
 {
 	unsigned char header[12];
+#ifdef OS_UNIX
+	struct iovec iov[3];
+#endif
 
 	/* The socket is locked and referenced at this point */
 	assert (buffer != NULL);
@@ -263,14 +871,39 @@ rpc_socket_write_inlock (rpc_socket *sock,
 	p11_rpc_buffer_encode_uint32 (header + 4, options->len);
 	p11_rpc_buffer_encode_uint32 (header + 8, buffer->len);
 
+#ifdef OS_UNIX
+	/* Send the whole message with as few syscalls as possible */
+	iov[0].iov_base = header;
+	iov[0].iov_len = 12;
+	iov[1].iov_base = options->data;
+	iov[1].iov_len = options->len;
+	iov[2].iov_base = buffer->data;
+	iov[2].iov_len = buffer->len;
+
+#ifdef RPC_RING
+	if (sock->ring) {
+		if (!rpc_ring_send (sock->ring, iov, 3)) {
+			p11_message_err (errno, _("couldn't send data"));
+			return CKR_DEVICE_ERROR;
+		}
+		return CKR_OK;
+	}
+#endif
+
+	if (!writev_all (sock->write_fd, iov, 3))
+		return CKR_DEVICE_ERROR;
+#else
 	if (!write_all (sock->write_fd, header, 12) ||
 	    !write_all (sock->write_fd, options->data, options->len) ||
 	    !write_all (sock->write_fd, buffer->data, buffer->len))
 		return CKR_DEVICE_ERROR;
+#endif
 
 	return CKR_OK;
 }
 
+#ifndef OS_UNIX
+
 static p11_rpc_status
 write_at (int fd,
           unsigned char *data,
@@ -323,6 +956,63 @@ write_at (int fd,
 	return status;
 }
 
+#endif /* !OS_UNIX */
+
+#ifdef OS_UNIX
+
+static p11_rpc_status
+writev_at (int fd,
+           struct iovec *iov,
+           int count,
+           size_t *at)
+{
+	p11_rpc_status status;
+	size_t len = 0;
+	ssize_t num;
+	int errn;
+	int i;
+
+	count = advance_iov (&iov, count, *at);
+	if (count == 0)
+		return P11_RPC_OK;
+
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	num = writev (fd, iov, count);
+	errn = errno;
+
+	/* Update state */
+	if (num > 0)
+		*at += num;
+
+	/* Completely written out the message */
+	if (num == len) {
+		p11_debug ("ok: wrote message of %d", (int)num);
+		status = P11_RPC_OK;
+
+	/* Partially written out the message */
+	} else if (num >= 0) {
+		p11_debug ("again: partial write of %d", (int)num);
+		status = P11_RPC_AGAIN;
+
+	/* Didn't write out message due to transient issue */
+	} else if (errn == EINTR || errn == EAGAIN || errn == EWOULDBLOCK) {
+		p11_debug ("again: due to %d", errn);
+		status = P11_RPC_AGAIN;
+
+	/* Failure */
+	} else {
+		p11_debug ("error: due to %d", errn);
+		status = P11_RPC_ERROR;
+	}
+
+	errno = errn;
+	return status;
+}
+
+#endif /* OS_UNIX */
+
 p11_rpc_status
 p11_rpc_transport_write (int fd,
                          size_t *state,
@@ -332,6 +1022,9 @@ p11_rpc_transport_write (int fd,
 {
 	unsigned char header[12] = { 0, };
 	p11_rpc_status status;
+#ifdef OS_UNIX
+	struct iovec iov[3];
+#endif
 
 	assert (state != NULL);
 	assert (options != NULL);
@@ -343,6 +1036,16 @@ p11_rpc_transport_write (int fd,
 		p11_rpc_buffer_encode_uint32 (header + 8, buffer->len);
 	}
 
+#ifdef OS_UNIX
+	iov[0].iov_base = header;
+	iov[0].iov_len = 12;
+	iov[1].iov_base = options->data;
+	iov[1].iov_len = options->len;
+	iov[2].iov_base = buffer->data;
+	iov[2].iov_len = buffer->len;
+
+	status = writev_at (fd, iov, 3, state);
+#else
 	status = write_at (fd, header, 12, 0, state);
 
 	if (status == P11_RPC_OK) {
@@ -354,6 +1057,7 @@ p11_rpc_transport_write (int fd,
 		status = write_at (fd, buffer->data, buffer->len,
 		                   12 + options->len, state);
 	}
+#endif
 
 	/* All done */
 	if (status == P11_RPC_OK)
@@ -362,106 +1066,322 @@ p11_rpc_transport_write (int fd,
 	return status;
 }
 
-static void
-rpc_socket_set_read_code_inlock (rpc_socket *sock,
-                                 int code)
+/*
+ * Makes sure that at least @want bytes are in the read ahead buffer,
+ * reading as much as is available from the socket in the process.
+ */
+static bool
+rpc_socket_fill (rpc_socket *sock,
+                 size_t want)
 {
-        sock->read_code = code;
-#ifdef OS_UNIX
-        p11_cond_broadcast (&sock->read_code_cond);
+	ssize_t r;
+
+	assert (want <= RPC_SOCKET_READ_SIZE);
+
+	if (sock->read_end - sock->read_start >= want)
+		return true;
+
+	if (sock->read_start == sock->read_end)
+		sock->read_start = sock->read_end = 0;
+
+	/* Move the remaining data to the front to make space */
+	if (sock->read_start + want > RPC_SOCKET_READ_SIZE) {
+		memmove (sock->read_buf, sock->read_buf + sock->read_start,
+		         sock->read_end - sock->read_start);
+		sock->read_end -= sock->read_start;
+		sock->read_start = 0;
+	}
+
+	while (sock->read_end - sock->read_start < want) {
+#ifdef RPC_RING
+		if (sock->ring) {
+			r = rpc_ring_recv (sock->ring, sock->read_buf + sock->read_end,
+			                   RPC_SOCKET_READ_SIZE - sock->read_end);
+		} else
 #endif
+		r = read (sock->read_fd, sock->read_buf + sock->read_end,
+		          RPC_SOCKET_READ_SIZE - sock->read_end);
+		if (r == 0) {
+			p11_message (_("couldn't receive data: closed connection"));
+			return false;
+		} else if (r == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				p11_message_err (errno, _("couldn't receive data"));
+				return false;
+			}
+		} else {
+			p11_debug ("read %d bytes", (int)r);
+			sock->read_end += r;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Reads @len bytes into @data, or discards them if @data is NULL. Data
+ * that is not already buffered is read directly into @data, unless it is
+ * small enough to go through the read ahead buffer.
+ */
+static bool
+rpc_socket_read_data (rpc_socket *sock,
+                      unsigned char *data,
+                      size_t len)
+{
+	size_t num;
+
+	while (len > 0) {
+		num = sock->read_end - sock->read_start;
+		if (num == 0) {
+#ifdef RPC_RING
+			if (data && len >= RPC_SOCKET_READ_SIZE && sock->ring) {
+				if (rpc_ring_read_all (sock->ring, data, len, false) == P11_RPC_OK)
+					return true;
+				p11_message_err (errno, _("couldn't receive data"));
+				return false;
+			}
+#endif
+			if (data && len >= RPC_SOCKET_READ_SIZE)
+				return read_all (sock->read_fd, data, len);
+			num = len < RPC_SOCKET_READ_SIZE ? len : RPC_SOCKET_READ_SIZE;
+			if (!rpc_socket_fill (sock, num))
+				return false;
+			num = sock->read_end - sock->read_start;
+		}
+
+		if (num > len)
+			num = len;
+		if (data) {
+			memcpy (data, sock->read_buf + sock->read_start, num);
+			data += num;
+		}
+		sock->read_start += num;
+		len -= num;
+	}
+
+	return true;
 }
 
-#ifdef OS_UNIX
 static void
-rpc_socket_wait_for_read_code_change_inlock (rpc_socket *sock)
+rpc_socket_remove_waiter_inlock (rpc_socket *sock,
+                                 rpc_waiter *waiter);
+
+/* Hands the response of a submitted request to its callback */
+static void
+rpc_waiter_complete (rpc_socket *sock,
+                     rpc_waiter *waiter,
+                     CK_RV rv)
 {
-        p11_cond_wait (&sock->read_code_cond, &sock->read_lock);
+	(waiter->complete) (rv, waiter->data);
+	free (waiter);
+	rpc_socket_unref (sock);
 }
-#endif
 
-static int
-rpc_socket_read (rpc_socket *sock,
-                 int *code,
-                 p11_buffer *buffer)
+/*
+ * Reads one complete message from the socket, and hands it over to the
+ * waiter with the matching call code. Called with the read lock held, but
+ * on Unix the lock is released while blocking on the socket, so that other
+ * threads can queue up their waiters in the meantime.
+ */
+static bool
+rpc_socket_dispatch_inlock (rpc_socket *sock)
 {
-	CK_RV ret = CKR_DEVICE_ERROR;
-	unsigned char header[12];
-#ifdef OS_WIN32
-	HANDLE handle;
-	DWORD mode;
+	rpc_waiter *waiter;
+	unsigned char *header;
+	uint32_t code = 0;
+	uint32_t olen = 0;
+	uint32_t dlen = 0;
+	bool ok;
+
+#ifdef OS_UNIX
+	p11_mutex_unlock (&sock->read_lock);
 #endif
 
-	assert (code != NULL);
-	assert (buffer != NULL);
+	ok = rpc_socket_fill (sock, 12);
+	if (ok) {
+		header = sock->read_buf + sock->read_start;
+		sock->read_start += 12;
 
-	/*
-	 * We are not in the main socket lock here, but the socket
-	 * is referenced, and won't go away
-	 */
+		/* Decode the message header */
+		code = p11_rpc_buffer_decode_uint32 (header);
+		olen = p11_rpc_buffer_decode_uint32 (header + 4);
+		dlen = p11_rpc_buffer_decode_uint32 (header + 8);
+	}
 
+#ifdef OS_UNIX
 	p11_mutex_lock (&sock->read_lock);
+#endif
 
-	for (;;) {
-		/* No message header has been read yet? ... read one in */
-		if (sock->read_code == 0) {
-			if (!read_all (sock->read_fd, header, 12))
-				break;
+	if (!ok)
+		return false;
 
-			/* Decode and check the message header */
-			rpc_socket_set_read_code_inlock (sock, p11_rpc_buffer_decode_uint32 (header));
-			sock->read_olen = p11_rpc_buffer_decode_uint32 (header + 4);
-			sock->read_dlen = p11_rpc_buffer_decode_uint32 (header + 8);
-			if (sock->read_code == 0) {
-				p11_message (_("received invalid rpc header values: perhaps wrong protocol"));
-				break;
-			}
+	for (waiter = sock->waiters; waiter != NULL; waiter = waiter->next) {
+		if (waiter->code == code && !waiter->done)
+			break;
+	}
+
+	if (code == 0 || waiter == NULL) {
+		p11_message (_("received invalid rpc header values: perhaps wrong protocol"));
+		return false;
+	}
+
+	/* The waiter stays put until it is marked done, or reading fails */
+#ifdef OS_UNIX
+	p11_mutex_unlock (&sock->read_lock);
+#endif
+
+	ok = p11_buffer_reset (waiter->buffer, dlen);
+	if (!ok) {
+		warn_if_reached ();
+
+	/* We ignore the options, then read the data */
+	} else if (!rpc_socket_read_data (sock, NULL, olen)) {
+		ok = false;
+	} else {
+		ok = rpc_socket_read_data (sock, waiter->buffer->data, dlen);
+	}
+
+	if (ok)
+		waiter->buffer->len = dlen;
+
+#ifdef OS_UNIX
+	p11_mutex_lock (&sock->read_lock);
+#endif
+
+	if (!ok)
+		return false;
+
+	if (waiter->complete) {
+		rpc_socket_remove_waiter_inlock (sock, waiter);
+		p11_mutex_unlock (&sock->read_lock);
+		rpc_waiter_complete (sock, waiter, CKR_OK);
+		p11_mutex_lock (&sock->read_lock);
+	} else {
+		waiter->done = true;
+	}
+
+	return true;
+}
+
+/*
+ * Registers a waiter for the response to the request with @code. This
+ * is done before the request is written, so that the response can't
+ * arrive before anyone is waiting for it.
+ */
+static void
+rpc_socket_add_waiter (rpc_socket *sock,
+                       rpc_waiter *waiter,
+                       uint32_t code,
+                       p11_buffer *buffer)
+{
+	waiter->code = code;
+	waiter->buffer = buffer;
+	waiter->done = false;
+
+	p11_mutex_lock (&sock->read_lock);
+	waiter->next = sock->waiters;
+	sock->waiters = waiter;
+	p11_mutex_unlock (&sock->read_lock);
+}
+
+static void
+rpc_socket_remove_waiter_inlock (rpc_socket *sock,
+                                 rpc_waiter *waiter)
+{
+	rpc_waiter **link;
+
+	for (link = &sock->waiters; *link != NULL; link = &(*link)->next) {
+		if (*link == waiter) {
+			*link = waiter->next;
+			break;
 		}
+	}
+}
 
-		/* If it's our header (or caller doesn't care), then yay! */
-		if (*code == -1 || sock->read_code == *code) {
+/*
+ * Once reading has failed, no more responses arrive. The submitted
+ * requests are completed with an error, while the callers waiting for
+ * their responses notice by themselves.
+ */
+static void
+rpc_socket_fail_inlock (rpc_socket *sock)
+{
+	rpc_waiter *waiter;
 
-			/* We ignore the options, so read into the same as buffer */
-			if (!p11_buffer_reset (buffer, sock->read_olen) ||
-			    !p11_buffer_reset (buffer, sock->read_dlen)) {
-				warn_if_reached ();
-				break;
-			}
+	sock->read_failed = true;
 
-			/* Read in the the options first, and then data */
-			if (!read_all (sock->read_fd, buffer->data, sock->read_olen) ||
-			    !read_all (sock->read_fd, buffer->data, sock->read_dlen))
+	for (;;) {
+		for (waiter = sock->waiters; waiter != NULL; waiter = waiter->next) {
+			if (waiter->complete)
 				break;
+		}
+		if (waiter == NULL)
+			break;
 
-			buffer->len = sock->read_dlen;
-			*code = sock->read_code;
+		rpc_socket_remove_waiter_inlock (sock, waiter);
+		p11_mutex_unlock (&sock->read_lock);
+		rpc_waiter_complete (sock, waiter, CKR_DEVICE_ERROR);
+		p11_mutex_lock (&sock->read_lock);
+	}
+}
+
+static CK_RV
+rpc_socket_read (rpc_socket *sock,
+                 rpc_waiter *waiter)
+{
+	CK_RV ret = CKR_DEVICE_ERROR;
+
+	assert (waiter != NULL);
+
+	/*
+	 * We are not in the main socket lock here, but the socket
+	 * is referenced, and won't go away
+	 */
+
+	p11_mutex_lock (&sock->read_lock);
 
-			/* Yay, we got our data, off we go */
-                        rpc_socket_set_read_code_inlock (sock, 0);
-			sock->read_olen = 0;
-			sock->read_dlen = 0;
+	for (;;) {
+		if (waiter->done) {
 			ret = CKR_OK;
 			break;
 		}
 
-		/* Give another thread the chance to read data for this header */
-		if (sock->read_code != 0) {
-			p11_debug ("received header in wrong thread");
+		if (sock->read_failed)
+			break;
 
+		/*
+		 * Nobody is reading, so this thread takes over, and dispatches
+		 * responses to the other waiters until its own has arrived.
+		 */
+		if (!sock->reading) {
+			sock->reading = true;
+			while (!waiter->done) {
+				if (!rpc_socket_dispatch_inlock (sock)) {
+					rpc_socket_fail_inlock (sock);
+					break;
+				}
 #ifdef OS_UNIX
-                        rpc_socket_wait_for_read_code_change_inlock (sock);
+				/* The response was for another thread */
+				if (!waiter->done)
+					p11_cond_broadcast (&sock->read_cond);
 #endif
-#ifdef OS_WIN32
-			/* Used as a simple wait */
-			p11_mutex_unlock (&sock->read_lock);
-			handle = (HANDLE) _get_osfhandle (sock->read_fd);
-			if (!ReadFile (handle, NULL, 0, &mode, NULL))
-				p11_message (_("couldn't use select to wait on rpc pipe"));
-			p11_mutex_lock (&sock->read_lock);
+			}
+
+			/* Let another waiter take over reading */
+			sock->reading = false;
+#ifdef OS_UNIX
+			if (sock->waiters != waiter || waiter->next != NULL)
+				p11_cond_broadcast (&sock->read_cond);
 #endif
+			continue;
 		}
+
+#ifdef OS_UNIX
+		p11_cond_wait (&sock->read_cond, &sock->read_lock);
+#endif
 	}
 
+	rpc_socket_remove_waiter_inlock (sock, waiter);
 	p11_mutex_unlock (&sock->read_lock);
 	return ret;
 }
@@ -493,28 +1413,90 @@ read_at (int fd,
 	if (num > 0)
 		*at += num;
 
-	/* Completely read out this block */
-	if (num == len - from) {
-		p11_debug ("ok: read block of %d", (int)num);
+	/* Completely read out this block */
+	if (num == len - from) {
+		p11_debug ("ok: read block of %d", (int)num);
+		status = P11_RPC_OK;
+
+	/* Partially read out this block */
+	} else if (num > 0) {
+		p11_debug ("again: partial read of %d", (int)num);
+		status = P11_RPC_AGAIN;
+
+	/* End of file, valid if at offset zero */
+	} else if (num == 0) {
+		if (offset == 0) {
+			p11_debug ("eof: read zero bytes");
+			status = P11_RPC_EOF;
+		} else {
+			p11_debug ("error: early truncate");
+			errn = EPROTO;
+			status = P11_RPC_ERROR;
+		}
+
+	/* Didn't read out block due to transient issue */
+	} else if (errn == EINTR || errn == EAGAIN || errn == EWOULDBLOCK) {
+		p11_debug ("again: due to %d", errn);
+		status = P11_RPC_AGAIN;
+
+	/* Failure */
+	} else {
+		p11_debug ("error: due to %d", errn);
+		status = P11_RPC_ERROR;
+	}
+
+	errno = errn;
+	return status;
+}
+
+#ifdef OS_UNIX
+
+static p11_rpc_status
+readv_at (int fd,
+          struct iovec *iov,
+          int count,
+          size_t offset,
+          size_t *at)
+{
+	p11_rpc_status status;
+	size_t len = 0;
+	ssize_t num;
+	int errn;
+	int i;
+
+	assert (*at >= offset);
+
+	count = advance_iov (&iov, count, *at - offset);
+	if (count == 0)
+		return P11_RPC_OK;
+
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	num = readv (fd, iov, count);
+	errn = errno;
+
+	/* Update state */
+	if (num > 0)
+		*at += num;
+
+	/* Completely read out the blocks */
+	if (num == len) {
+		p11_debug ("ok: read blocks of %d", (int)num);
 		status = P11_RPC_OK;
 
-	/* Partially read out this block */
+	/* Partially read out the blocks */
 	} else if (num > 0) {
 		p11_debug ("again: partial read of %d", (int)num);
 		status = P11_RPC_AGAIN;
 
-	/* End of file, valid if at offset zero */
+	/* End of file, always in the middle of a message here */
 	} else if (num == 0) {
-		if (offset == 0) {
-			p11_debug ("eof: read zero bytes");
-			status = P11_RPC_EOF;
-		} else {
-			p11_debug ("error: early truncate");
-			errn = EPROTO;
-			status = P11_RPC_ERROR;
-		}
+		p11_debug ("error: early truncate");
+		errn = EPROTO;
+		status = P11_RPC_ERROR;
 
-	/* Didn't read out block due to transient issue */
+	/* Didn't read out blocks due to transient issue */
 	} else if (errn == EINTR || errn == EAGAIN || errn == EWOULDBLOCK) {
 		p11_debug ("again: due to %d", errn);
 		status = P11_RPC_AGAIN;
@@ -529,6 +1511,8 @@ read_at (int fd,
 	return status;
 }
 
+#endif /* OS_UNIX */
+
 p11_rpc_status
 p11_rpc_transport_read (int fd,
                         size_t *state,
@@ -539,6 +1523,9 @@ p11_rpc_transport_read (int fd,
 	unsigned char *header;
 	p11_rpc_status status;
 	size_t len;
+#ifdef OS_UNIX
+	struct iovec iov[2];
+#endif
 
 	assert (state != NULL);
 	assert (call_code != NULL);
@@ -561,17 +1548,27 @@ p11_rpc_transport_read (int fd,
 			return_val_if_reached (P11_RPC_ERROR);
 		options->len = len;
 		len = p11_rpc_buffer_decode_uint32 (header + 8);
+
 		if (!p11_buffer_reset (buffer, len))
 			return_val_if_reached (P11_RPC_ERROR);
 		buffer->len = len;
 	}
 
 	/* At this point options has a valid len field */
+#ifdef OS_UNIX
+	iov[0].iov_base = options->data;
+	iov[0].iov_len = options->len;
+	iov[1].iov_base = buffer->data;
+	iov[1].iov_len = buffer->len;
+
+	status = readv_at (fd, iov, 2, 12, state);
+#else
 	status = read_at (fd, options->data, options->len, 12, state);
 	if (status == P11_RPC_OK) {
 		status = read_at (fd, buffer->data, buffer->len,
 		                  12 + options->len, state);
 	}
+#endif
 
 	if (status == P11_RPC_OK)
 		*state = 0;
@@ -579,6 +1576,165 @@ p11_rpc_transport_read (int fd,
 	return status;
 }
 
+/*
+ * Reads a byte sent by a client while connecting, along with the file
+ * descriptor that may come with it, which is returned in @attached or
+ * -1 if there is none. Since protocol version 3, a byte follows the
+ * version with the options the client wants, and since version 4 with
+ * the shared memory for the rings if it wants to use them.
+ */
+int
+p11_rpc_transport_read_handshake (int fd,
+                                  uint8_t *byte,
+                                  int *attached)
+{
+	assert (byte != NULL);
+	assert (attached != NULL);
+
+	*attached = -1;
+
+#ifdef OS_UNIX
+	if (can_attach (fd))
+		return recv_attached (fd, byte, 1, attached);
+#endif
+
+	return read (fd, byte, 1);
+}
+
+#ifdef RPC_RING
+
+p11_rpc_ring *
+p11_rpc_ring_attach (int memfd,
+                     int fd)
+{
+	return rpc_ring_map (memfd, fd, true);
+}
+
+void
+p11_rpc_ring_free (p11_rpc_ring *ring)
+{
+	if (ring == NULL)
+		return;
+
+	rpc_ring_close (ring);
+	munmap (ring->header, ring->length);
+	free (ring);
+}
+
+/* Called on other threads than the one reading the ring */
+bool
+p11_rpc_ring_pending (p11_rpc_ring *ring)
+{
+	uint32_t tail;
+
+	tail = __atomic_load_n (&ring->rx_tail, __ATOMIC_ACQUIRE);
+	return __atomic_load_n (&ring->rx->head, __ATOMIC_ACQUIRE) != tail;
+}
+
+p11_rpc_status
+p11_rpc_ring_read (p11_rpc_ring *ring,
+                   int *call_code,
+                   p11_buffer *options,
+                   p11_buffer *buffer)
+{
+	unsigned char header[12];
+	p11_rpc_status status;
+	size_t len;
+
+	assert (ring != NULL);
+	assert (call_code != NULL);
+	assert (options != NULL);
+	assert (buffer != NULL);
+
+	status = rpc_ring_read_all (ring, header, 12, true);
+	if (status != P11_RPC_OK)
+		return status;
+
+	*call_code = p11_rpc_buffer_decode_uint32 (header);
+	len = p11_rpc_buffer_decode_uint32 (header + 4);
+	if (!p11_buffer_reset (options, len))
+		return_val_if_reached (P11_RPC_ERROR);
+	options->len = len;
+	len = p11_rpc_buffer_decode_uint32 (header + 8);
+	if (!p11_buffer_reset (buffer, len))
+		return_val_if_reached (P11_RPC_ERROR);
+	buffer->len = len;
+
+	status = rpc_ring_read_all (ring, options->data, options->len, false);
+	if (status == P11_RPC_OK)
+		status = rpc_ring_read_all (ring, buffer->data, buffer->len, false);
+
+	return status;
+}
+
+p11_rpc_status
+p11_rpc_ring_write (p11_rpc_ring *ring,
+                    int call_code,
+                    p11_buffer *options,
+                    p11_buffer *buffer)
+{
+	unsigned char header[12];
+	struct iovec iov[3];
+
+	assert (ring != NULL);
+	assert (options != NULL);
+	assert (buffer != NULL);
+
+	p11_rpc_buffer_encode_uint32 (header, call_code);
+	p11_rpc_buffer_encode_uint32 (header + 4, options->len);
+	p11_rpc_buffer_encode_uint32 (header + 8, buffer->len);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = 12;
+	iov[1].iov_base = options->data;
+	iov[1].iov_len = options->len;
+	iov[2].iov_base = buffer->data;
+	iov[2].iov_len = buffer->len;
+
+	return rpc_ring_send (ring, iov, 3) ? P11_RPC_OK : P11_RPC_ERROR;
+}
+
+#else /* !RPC_RING */
+
+p11_rpc_ring *
+p11_rpc_ring_attach (int memfd,
+                     int fd)
+{
+	return NULL;
+}
+
+void
+p11_rpc_ring_free (p11_rpc_ring *ring)
+{
+	assert (ring == NULL);
+}
+
+bool
+p11_rpc_ring_pending (p11_rpc_ring *ring)
+{
+	return_val_if_reached (false);
+}
+
+p11_rpc_status
+p11_rpc_ring_read (p11_rpc_ring *ring,
+                   int *call_code,
+                   p11_buffer *options,
+                   p11_buffer *buffer)
+{
+	return_val_if_reached (P11_RPC_ERROR);
+}
+
+p11_rpc_status
+p11_rpc_ring_write (p11_rpc_ring *ring,
+                    int call_code,
+                    p11_buffer *options,
+                    p11_buffer *buffer)
+{
+	return_val_if_reached (P11_RPC_ERROR);
+}
+
+#endif /* !RPC_RING */
+
 struct _p11_rpc_transport {
 	p11_rpc_client_vtable vtable;
 	p11_destroyer destroyer;
@@ -593,6 +1749,13 @@ rpc_transport_disconnect (p11_rpc_client_vtable *vtable,
 	p11_rpc_transport *rpc = (p11_rpc_transport *)vtable;
 
 	if (rpc->socket) {
+#ifdef OS_UNIX
+		/* Submitted requests won't get their responses anymore */
+		p11_mutex_lock (&rpc->socket->read_lock);
+		if (!rpc->socket->reading)
+			rpc_socket_fail_inlock (rpc->socket);
+		p11_mutex_unlock (&rpc->socket->read_lock);
+#endif
 		rpc_socket_close (rpc->socket);
 		rpc_socket_unref (rpc->socket);
 		rpc->socket = NULL;
@@ -619,18 +1782,60 @@ rpc_transport_uninit (p11_rpc_transport *rpc)
 	p11_buffer_uninit (&rpc->options);
 }
 
-static CK_RV
-rpc_transport_authenticate (p11_rpc_client_vtable *vtable,
-			    uint8_t *version)
+/*
+ * Since protocol version 3, the client says which options it wants with
+ * another byte, and the server answers which ones it will use. Since
+ * version 4 that is whether to use shared memory rings, whose memory
+ * comes along with the byte. Other bits are reserved.
+ */
+static bool
+rpc_socket_setup_options (rpc_socket *sock,
+                          uint8_t version)
 {
-	p11_rpc_transport *rpc = (p11_rpc_transport *)vtable;
-	rpc_socket *sock;
+	uint8_t byte = 0;
+#ifdef RPC_RING
+	p11_rpc_ring *ring = NULL;
+	struct iovec iov;
+	int memfd = -1;
+#endif
+	bool ok;
+
+#ifdef RPC_RING
+	if (sock->want_ring && version >= 4 && can_attach (sock->write_fd))
+		ring = rpc_ring_new (sock->read_fd, &memfd);
+	if (ring) {
+		byte = 1;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		ok = sendmsg_all (sock->write_fd, &iov, 1, memfd);
+		close (memfd);
+	} else
+#endif
+	ok = write_all (sock->write_fd, &byte, 1);
 
-	assert (rpc != NULL);
-	assert (version != NULL);
+	if (ok)
+		ok = read_all (sock->read_fd, &byte, 1);
+
+#ifdef RPC_RING
+	if (ok && ring && (byte & 1)) {
+		p11_debug ("using shared memory rings");
+		sock->ring = ring;
+		ring = NULL;
+	}
+	p11_rpc_ring_free (ring);
+#endif
+
+	if (!ok)
+		p11_message_err (errno, _("couldn't set up the connection"));
+	return ok;
+}
 
-	sock = rpc->socket;
+static CK_RV
+rpc_socket_authenticate (rpc_socket *sock,
+                         uint8_t *version)
+{
 	assert (sock != NULL);
+	assert (version != NULL);
 
 	if (sock->read_fd == -1) {
 		return CKR_DEVICE_ERROR;
@@ -644,7 +1849,7 @@ rpc_transport_authenticate (p11_rpc_client_vtable *vtable,
 	p11_debug ("authenticating with version %u", *version);
 
 	/* Place holder byte, will later carry unix credentials (on some systems) */
-	if (write_all (sock->write_fd, version, 1) != 1) {
+	if (!write_all (sock->write_fd, version, 1)) {
 		p11_message_err (errno, _("couldn't send socket credentials"));
 		return CKR_DEVICE_ERROR;
 	}
@@ -661,25 +1866,34 @@ rpc_transport_authenticate (p11_rpc_client_vtable *vtable,
 	}
 #endif
 
+	if (*version >= 3 && !rpc_socket_setup_options (sock, *version))
+		return CKR_DEVICE_ERROR;
+
 	return CKR_OK;
 }
 
 static CK_RV
-rpc_transport_buffer (p11_rpc_client_vtable *vtable,
-                      p11_buffer *request,
-                      p11_buffer *response)
+rpc_transport_authenticate (p11_rpc_client_vtable *vtable,
+			    uint8_t *version)
 {
 	p11_rpc_transport *rpc = (p11_rpc_transport *)vtable;
-	CK_RV rv = CKR_OK;
-	rpc_socket *sock;
-	int call_code;
 
 	assert (rpc != NULL);
-	assert (request != NULL);
-	assert (response != NULL);
+	assert (version != NULL);
+	assert (rpc->socket != NULL);
 
-	sock = rpc->socket;
-	assert (sock != NULL);
+	return rpc_socket_authenticate (rpc->socket, version);
+}
+
+static CK_RV
+rpc_socket_call (rpc_socket *sock,
+                 p11_buffer *options,
+                 p11_buffer *request,
+                 p11_buffer *response)
+{
+	CK_RV rv = CKR_OK;
+	rpc_waiter waiter = { 0, };
+	int call_code;
 
 	p11_mutex_lock (&sock->write_lock);
 	assert (sock->refs > 0);
@@ -694,16 +1908,22 @@ rpc_transport_buffer (p11_rpc_client_vtable *vtable,
 	if (sock->write_fd == -1)
 		rv = CKR_DEVICE_ERROR;
 #endif
-	if (rv == CKR_OK)
-		rv = rpc_socket_write_inlock (sock, call_code, &rpc->options, request);
-
-	/* We unlock the socket mutex while reading a response */
 	if (rv == CKR_OK) {
-		p11_mutex_unlock (&sock->write_lock);
+		rpc_socket_add_waiter (sock, &waiter, call_code, response);
+		rv = rpc_socket_write_inlock (sock, call_code, options, request);
+
+		/* We unlock the socket mutex while reading a response */
+		if (rv == CKR_OK) {
+			p11_mutex_unlock (&sock->write_lock);
 
-		rv = rpc_socket_read (sock, &call_code, response);
+			rv = rpc_socket_read (sock, &waiter);
 
-		p11_mutex_lock (&sock->write_lock);
+			p11_mutex_lock (&sock->write_lock);
+		} else {
+			p11_mutex_lock (&sock->read_lock);
+			rpc_socket_remove_waiter_inlock (sock, &waiter);
+			p11_mutex_unlock (&sock->read_lock);
+		}
 	}
 
 	if (rv != CKR_OK && sock->read_fd != -1) {
@@ -728,6 +1948,187 @@ rpc_transport_buffer (p11_rpc_client_vtable *vtable,
 
 #ifdef OS_UNIX
 
+/*
+ * Writes a request without waiting for its response. The response is
+ * read by whichever thread reads from the socket next, which then calls
+ * @complete: usually the one that calls rpc_socket_dispatch() once the
+ * socket is readable, but possibly another one that waits for a
+ * response of its own.
+ */
+static CK_RV
+rpc_socket_submit (rpc_socket *sock,
+                   p11_buffer *options,
+                   p11_buffer *request,
+                   p11_buffer *response,
+                   p11_rpc_complete complete,
+                   void *data)
+{
+	rpc_waiter *waiter;
+	CK_RV rv = CKR_OK;
+	int call_code;
+
+	/* The callers can't be woken up for a ring */
+	if (sock->ring)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	waiter = calloc (1, sizeof (rpc_waiter));
+	return_val_if_fail (waiter != NULL, CKR_HOST_MEMORY);
+	waiter->complete = complete;
+	waiter->data = data;
+
+	p11_mutex_lock (&sock->write_lock);
+	assert (sock->refs > 0);
+
+	call_code = sock->last_code++;
+
+	if (sock->read_fd == -1) {
+		rv = CKR_DEVICE_ERROR;
+	} else {
+		/* Until the waiter is completed */
+		sock->refs++;
+		rpc_socket_add_waiter (sock, waiter, call_code, response);
+		rv = rpc_socket_write_inlock (sock, call_code, options, request);
+
+		if (rv != CKR_OK) {
+			p11_mutex_lock (&sock->read_lock);
+			rpc_socket_remove_waiter_inlock (sock, waiter);
+			p11_mutex_unlock (&sock->read_lock);
+			sock->refs--;
+
+			p11_message (_("closing socket due to protocol failure"));
+			close (sock->read_fd);
+			sock->read_fd = -1;
+		}
+	}
+
+	p11_mutex_unlock (&sock->write_lock);
+
+	if (rv != CKR_OK)
+		free (waiter);
+	return rv;
+}
+
+static bool
+rpc_socket_submitted_inlock (rpc_socket *sock)
+{
+	rpc_waiter *waiter;
+
+	for (waiter = sock->waiters; waiter != NULL; waiter = waiter->next) {
+		if (waiter->complete)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Reads the responses to submitted requests that have arrived, without
+ * blocking until more arrive. Nothing is read while another thread is
+ * reading, as that one hands them to their callbacks.
+ */
+static CK_RV
+rpc_socket_dispatch (rpc_socket *sock)
+{
+	struct pollfd pfd;
+	CK_RV rv = CKR_OK;
+	bool ok;
+
+	rpc_socket_ref (sock);
+	p11_mutex_lock (&sock->read_lock);
+
+	while (!sock->reading && !sock->read_failed &&
+	       rpc_socket_submitted_inlock (sock)) {
+		if (sock->read_fd == -1) {
+			rpc_socket_fail_inlock (sock);
+			break;
+		}
+
+		/* Only what was read ahead already, or is waiting */
+		if (sock->read_start == sock->read_end) {
+			pfd.fd = sock->read_fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll (&pfd, 1, 0) <= 0)
+				break;
+		}
+
+		sock->reading = true;
+		ok = rpc_socket_dispatch_inlock (sock);
+		sock->reading = false;
+
+		if (!ok)
+			rpc_socket_fail_inlock (sock);
+
+		/* Another thread may be waiting to read, or for its response */
+		p11_cond_broadcast (&sock->read_cond);
+	}
+
+	if (sock->read_failed) {
+		rpc_socket_fail_inlock (sock);
+		rv = CKR_DEVICE_ERROR;
+	}
+
+	p11_mutex_unlock (&sock->read_lock);
+	rpc_socket_unref (sock);
+	return rv;
+}
+
+#endif /* OS_UNIX */
+
+static CK_RV
+rpc_transport_buffer (p11_rpc_client_vtable *vtable,
+                      p11_buffer *request,
+                      p11_buffer *response)
+{
+	p11_rpc_transport *rpc = (p11_rpc_transport *)vtable;
+
+	assert (rpc != NULL);
+	assert (request != NULL);
+	assert (response != NULL);
+	assert (rpc->socket != NULL);
+	return rpc_socket_call (rpc->socket, &rpc->options, request, response);
+}
+
+static CK_RV
+rpc_transport_submit (p11_rpc_client_vtable *vtable,
+                      p11_buffer *request,
+                      p11_buffer *response,
+                      p11_rpc_complete complete,
+                      void *data)
+{
+	p11_rpc_transport *rpc = (p11_rpc_transport *)vtable;
+
+	assert (rpc != NULL);
+	assert (request != NULL);
+	assert (response != NULL);
+	assert (complete != NULL);
+
+#ifdef OS_UNIX
+	assert (rpc->socket != NULL);
+	return rpc_socket_submit (rpc->socket, &rpc->options,
+	                          request, response, complete, data);
+#else
+	return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+}
+
+static CK_RV
+rpc_transport_dispatch (p11_rpc_client_vtable *vtable)
+{
+	p11_rpc_transport *rpc = (p11_rpc_transport *)vtable;
+
+	assert (rpc != NULL);
+
+#ifdef OS_UNIX
+	if (rpc->socket != NULL)
+		return rpc_socket_dispatch (rpc->socket);
+#endif
+
+	return CKR_OK;
+}
+
+#ifdef OS_UNIX
+
 typedef struct {
 	p11_rpc_transport base;
 	p11_array *argv;
@@ -1090,6 +2491,8 @@ rpc_exec_init (const char *remote,
 	rex->base.vtable.disconnect = rpc_exec_disconnect;
 	rex->base.vtable.authenticate = rpc_transport_authenticate;
 	rex->base.vtable.transport = rpc_transport_buffer;
+	rex->base.vtable.submit = rpc_transport_submit;
+	rex->base.vtable.dispatch = rpc_transport_dispatch;
 	rpc_transport_init (&rex->base, name, rpc_exec_free);
 
 	p11_debug ("initialized rpc exec: %s", remote);
@@ -1101,6 +2504,7 @@ rpc_exec_init (const char *remote,
 typedef struct {
 	p11_rpc_transport base;
 	struct sockaddr_un sa;
+	bool ring;
 } rpc_unix;
 
 static CK_RV
@@ -1124,6 +2528,7 @@ rpc_unix_connect (p11_rpc_client_vtable *vtable,
 
 	run->base.socket = rpc_socket_new (fd);
 	return_val_if_fail (run->base.socket != NULL, CKR_GENERAL_ERROR);
+	run->base.socket->want_ring = run->ring;
 
 	return CKR_OK;
 }
@@ -1152,6 +2557,7 @@ rpc_unix_free (void *data)
 
 static p11_rpc_transport *
 rpc_unix_init (const char *remote,
+	       bool ring,
 	       const char *name)
 {
 	rpc_unix *run;
@@ -1162,11 +2568,14 @@ rpc_unix_init (const char *remote,
 	memset (&run->sa, 0, sizeof (run->sa));
 	run->sa.sun_family = AF_UNIX;
 	snprintf (run->sa.sun_path, sizeof (run->sa.sun_path), "%s", remote);
+	run->ring = ring;
 
 	run->base.vtable.connect = rpc_unix_connect;
 	run->base.vtable.disconnect = rpc_unix_disconnect;
 	run->base.vtable.authenticate = rpc_transport_authenticate;
 	run->base.vtable.transport = rpc_transport_buffer;
+	run->base.vtable.submit = rpc_transport_submit;
+	run->base.vtable.dispatch = rpc_transport_dispatch;
 	rpc_transport_init (&run->base, name, rpc_unix_free);
 
 	p11_debug ("initialized rpc socket: %s", remote);
@@ -1250,6 +2659,8 @@ rpc_vsock_init (unsigned int cid,
 	run->base.vtable.disconnect = rpc_vsock_disconnect;
 	run->base.vtable.authenticate = rpc_transport_authenticate;
 	run->base.vtable.transport = rpc_transport_buffer;
+	run->base.vtable.submit = rpc_transport_submit;
+	run->base.vtable.dispatch = rpc_transport_dispatch;
 	rpc_transport_init (&run->base, name, rpc_vsock_free);
 
 	p11_debug ("initialized rpc socket: vsock:cid=%u;port=%u",
@@ -1275,13 +2686,15 @@ p11_rpc_transport_new (p11_virtual *virt,
 		rpc = rpc_exec_init (remote + 1, name);
 
 #ifdef OS_UNIX
-	} else if (strncmp (remote, "unix:path=/", 11) == 0) {
+	} else if (strncmp (remote, "unix:path=/", 11) == 0 ||
+	           strncmp (remote, "shm:path=/", 10) == 0) {
 		/* Only absolute path is supported */
 		char *path;
 
-		path = p11_path_decode (remote + 10);
+		/* The same socket, but messages go through shared memory */
+		path = p11_path_decode (strchr (remote, '=') + 1);
 		return_val_if_fail (path != NULL, NULL);
-		rpc = rpc_unix_init (path, name);
+		rpc = rpc_unix_init (path, remote[0] == 's', name);
 		free (path);
 #endif /* OS_UNIX */
 #ifdef HAVE_VSOCK
@@ -1310,6 +2723,25 @@ p11_rpc_transport_new (p11_virtual *virt,
 	return rpc;
 }
 
+/*
+ * The file descriptor to wait on for more responses to submitted
+ * requests, or -1. It doesn't become readable for responses that were
+ * read ahead already, see p11_rpc_client_dispatch().
+ */
+int
+p11_rpc_transport_get_fd (p11_rpc_transport *rpc)
+{
+	return_val_if_fail (rpc != NULL, -1);
+
+	if (rpc->socket == NULL)
+		return -1;
+#ifdef RPC_RING
+	if (rpc->socket->ring)
+		return -1;
+#endif
+	return rpc->socket->read_fd;
+}
+
 void
 p11_rpc_transport_free (void *data)
 {
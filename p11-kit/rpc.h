@@ -43,6 +43,9 @@
 
 typedef struct _p11_rpc_client_vtable p11_rpc_client_vtable;
 
+typedef void        (* p11_rpc_complete)              (CK_RV rv,
+                                                       void *data);
+
 struct _p11_rpc_client_vtable {
 	void *data;
 
@@ -58,11 +61,53 @@ struct _p11_rpc_client_vtable {
 
 	void        (* disconnect)    (p11_rpc_client_vtable *vtable,
 	                               void *fini_reserved);
+
+	/* Optional, for calls that don't wait for their response */
+	CK_RV       (* submit)        (p11_rpc_client_vtable *vtable,
+	                               p11_buffer *request,
+	                               p11_buffer *response,
+	                               p11_rpc_complete complete,
+	                               void *data);
+
+	CK_RV       (* dispatch)      (p11_rpc_client_vtable *vtable);
 };
 
 bool                   p11_rpc_client_init         (p11_virtual *virt,
                                                     p11_rpc_client_vtable *vtable);
 
+/*
+ * Calls that don't wait for their result. Like the rest of this header
+ * these are internal, for code linked with the RPC client, and are not
+ * exported from libp11-kit.
+ */
+typedef void        (* p11_rpc_client_complete)       (CK_RV rv,
+                                                       CK_ULONG output_len,
+                                                       void *user_data);
+
+CK_RV                  p11_rpc_client_sign_async   (p11_virtual *virt,
+                                                    CK_SESSION_HANDLE session,
+                                                    CK_MECHANISM_PTR mechanism,
+                                                    CK_OBJECT_HANDLE key,
+                                                    CK_BYTE_PTR data,
+                                                    CK_ULONG data_len,
+                                                    CK_BYTE_PTR signature,
+                                                    CK_ULONG signature_len,
+                                                    p11_rpc_client_complete complete,
+                                                    void *user_data);
+
+CK_RV                  p11_rpc_client_decrypt_async (p11_virtual *virt,
+                                                     CK_SESSION_HANDLE session,
+                                                     CK_MECHANISM_PTR mechanism,
+                                                     CK_OBJECT_HANDLE key,
+                                                     CK_BYTE_PTR encrypted_data,
+                                                     CK_ULONG encrypted_data_len,
+                                                     CK_BYTE_PTR data,
+                                                     CK_ULONG data_len,
+                                                     p11_rpc_client_complete complete,
+                                                     void *user_data);
+
+CK_RV                  p11_rpc_client_dispatch     (p11_virtual *virt);
+
 bool                   p11_rpc_server_handle       (CK_X_FUNCTION_LIST *funcs,
                                                     p11_buffer *request,
                                                     p11_buffer *response);
@@ -77,6 +122,8 @@ p11_rpc_transport *    p11_rpc_transport_new       (p11_virtual *virt,
 
 void                   p11_rpc_transport_free      (void *transport);
 
+int                    p11_rpc_transport_get_fd    (p11_rpc_transport *transport);
+
 typedef enum {
 	P11_RPC_OK,
 	P11_RPC_EOF,
@@ -96,4 +143,27 @@ p11_rpc_status         p11_rpc_transport_write     (int fd,
                                                     p11_buffer *options,
                                                     p11_buffer *buffer);
 
+int                    p11_rpc_transport_read_handshake (int fd,
+                                                         uint8_t *byte,
+                                                         int *attached);
+
+typedef struct _p11_rpc_ring p11_rpc_ring;
+
+p11_rpc_ring *         p11_rpc_ring_attach         (int memfd,
+                                                    int fd);
+
+void                   p11_rpc_ring_free           (p11_rpc_ring *ring);
+
+bool                   p11_rpc_ring_pending        (p11_rpc_ring *ring);
+
+p11_rpc_status         p11_rpc_ring_read           (p11_rpc_ring *ring,
+                                                    int *call_code,
+                                                    p11_buffer *options,
+                                                    p11_buffer *buffer);
+
+p11_rpc_status         p11_rpc_ring_write          (p11_rpc_ring *ring,
+                                                    int call_code,
+                                                    p11_buffer *options,
+                                                    p11_buffer *buffer);
+
 #endif /* __P11_RPC_H__ */
@@ -34,6 +34,7 @@
 
 #include "config.h"
 
+#include "array.h"
 #include "compat.h"
 #include "debug.h"
 #include "message.h"
@@ -110,11 +111,20 @@ typedef struct {
 #endif /* HAVE_VSOCK */
 
 	int socket;
+
+	/* Serving connections from threads, rather than child processes */
+	bool threads;
+	CK_FUNCTION_LIST **modules;
+	p11_array *connections;
+	p11_mutex_t mutex;
+	int wakeup[2];
+
+	/* Idle 'p11-kit remote' processes waiting for a connection */
+	unsigned int n_workers;
+	p11_array *workers;
 #endif /* OS_UNIX */
 
-#ifdef OS_WIN32
 	CK_FUNCTION_LIST *module;
-#endif /* OS_WIN32 */
 } Server;
 
 static void
@@ -126,12 +136,25 @@ server_free (Server *server)
 #ifdef OS_UNIX
 	if (server->socket >= 0)
 		close (server->socket);
+
+	if (server->threads) {
+		p11_array_free (server->connections);
+		p11_mutex_uninit (&server->mutex);
+		close (server->wakeup[0]);
+		close (server->wakeup[1]);
+	}
+
+	/* Idle workers exit when their socket is closed */
+	p11_array_free (server->workers);
+
+	if (server->modules)
+		p11_kit_modules_finalize_and_release (server->modules);
+	if (server->module)
+		p11_kit_module_finalize (server->module);
 #endif /* OS_UNIX */
 
-#ifdef OS_WIN32
 	if (server->module)
 		p11_kit_module_release (server->module);
-#endif /* OS_WIN32 */
 
 	free (server);
 }
@@ -231,15 +254,56 @@ ocsignal (int signum, SIGHANDLER_T handler)
 	return old_action.sa_handler;
 }
 
+typedef struct {
+	pid_t pid;
+	int fd;
+} Worker;
+
+static void
+worker_free (void *data)
+{
+	Worker *worker = data;
+	close (worker->fd);
+	free (worker);
+}
+
+static bool
+remove_worker (Server *server,
+	       pid_t pid)
+{
+	Worker *worker;
+	unsigned int i;
+
+	if (server->workers == NULL)
+		return false;
+
+	for (i = 0; i < server->workers->num; i++) {
+		worker = server->workers->elem[i];
+		if (worker->pid == pid) {
+			p11_array_remove (server->workers, i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static void
-cleanup_children (void)
+cleanup_children (Server *server)
 {
 	int status;
 	pid_t pid;
 
 	while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
-		if (children_avail > 0)
+		/* A worker should not exit before it gets a connection,
+		 * so don't keep starting new ones if they do */
+		if (remove_worker (server, pid)) {
+			p11_message (_("worker %u exited without a connection, not starting more"),
+				     (unsigned)pid);
+			server->n_workers = 0;
+		} else if (children_avail > 0) {
 			children_avail--;
+		}
 		if (WIFSIGNALED (status)) {
 			if (WTERMSIG (status) == SIGSEGV)
 				p11_message (_("child %u died with sigsegv"), (unsigned)pid);
@@ -297,6 +361,155 @@ exec_external (int argc,
 	return rc;
 }
 
+static void
+exec_remote (Server *server,
+	     int fd,
+	     bool worker)
+{
+	char **args;
+	size_t n_args, i;
+	int max_fd;
+	int errn;
+
+	/* A worker receives the connection over its standard input */
+	if (dup2 (fd, STDIN_FILENO) < 0 ||
+	    (!worker && dup2 (fd, STDOUT_FILENO) < 0)) {
+		errn = errno;
+		p11_message_err (errn, "couldn't dup file descriptors in remote child");
+		_exit (errn);
+	}
+
+	/* Close file descriptors, except for above on exec */
+	max_fd = STDERR_FILENO + 1;
+	fdwalk (set_cloexec_on_fd, &max_fd);
+
+	/* Execute 'p11-kit remote'; this shouldn't return */
+	args = calloc (4 + server->n_tokens + 1, sizeof (char *));
+	if (args == NULL) {
+		errn = errno;
+		p11_message_err (errn, "couldn't allocate memory for 'p11-kit remote' arguments");
+		_exit (errn);
+	}
+
+	n_args = 0;
+	args[n_args] = P11_KIT_REMOTE;
+	n_args++;
+
+	if (worker) {
+		args[n_args] = "--worker";
+		n_args++;
+	}
+
+	if (server->provider) {
+		args[n_args] = "--provider";
+		n_args++;
+		args[n_args] = (char *)server->provider;
+		n_args++;
+	}
+
+	for (i = 0; i < server->n_tokens; i++, n_args++)
+		args[n_args] = (char *)server->tokens[i];
+
+	exec_external (n_args, args);
+	free (args);
+
+	errn = errno;
+	p11_message_err (errn, "couldn't execute 'p11-kit remote'");
+	_exit (errn);
+}
+
+static bool
+start_worker (Server *server,
+	      sigset_t *blockset)
+{
+	Worker *worker;
+	int fds[2];
+	pid_t pid;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		p11_message_err (errno, _("could not create socket pair"));
+		return false;
+	}
+
+	pid = fork ();
+	switch (pid) {
+	case -1:
+		p11_message_err (errno, _("failed to fork for worker"));
+		close (fds[0]);
+		close (fds[1]);
+		return false;
+	case 0:
+		sigprocmask (SIG_UNBLOCK, blockset, NULL);
+		exec_remote (server, fds[1], true);
+		break;
+	default:
+		break;
+	}
+
+	close (fds[1]);
+	fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+
+	worker = calloc (1, sizeof (Worker));
+	return_val_if_fail (worker != NULL, false);
+	worker->pid = pid;
+	worker->fd = fds[0];
+
+	if (!p11_array_push (server->workers, worker))
+		return_val_if_reached (false);
+
+	return true;
+}
+
+static bool
+hand_over (Server *server,
+	   int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (sizeof (int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	Worker *worker;
+	unsigned char byte = 0;
+	ssize_t ret;
+
+	/* Hand the connection to the worker waiting for the longest */
+	while (server->workers->num > 0) {
+		worker = server->workers->elem[0];
+
+		memset (&msg, 0, sizeof (msg));
+		memset (&control, 0, sizeof (control));
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof (control.buf);
+
+		cmsg = CMSG_FIRSTHDR (&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+
+		do {
+			ret = sendmsg (worker->fd, &msg, MSG_NOSIGNAL);
+		} while (ret < 0 && errno == EINTR);
+
+		/* The worker is now busy, or gone */
+		p11_array_remove (server->workers, 0);
+
+		if (ret == 1) {
+			children_avail++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static int
 create_unix_socket (const char *address,
 		    uid_t uid,
@@ -422,6 +635,166 @@ check_credentials (int fd,
 	return true;
 }
 
+typedef struct {
+	Server *server;
+	p11_thread_t thread;
+	int fd;
+	bool done;
+} Connection;
+
+static const char *
+server_module_name (Server *server)
+{
+	if (server->provider)
+		return server->provider;
+	if (strncmp (server->tokens[0], "pkcs11:", 7) != 0)
+		return server->tokens[0];
+	return NULL;
+}
+
+static bool
+server_start_threads (Server *server)
+{
+	const char *name;
+	int i;
+
+	/* Keep the modules initialized for as long as we run, so that
+	 * they are not initialized again for each connection */
+	name = server_module_name (server);
+	if (name) {
+		server->module = p11_kit_module_load (name, 0);
+		if (server->module == NULL)
+			return false;
+		if (p11_kit_module_initialize (server->module) != CKR_OK) {
+			p11_kit_module_release (server->module);
+			server->module = NULL;
+			return false;
+		}
+	} else {
+		server->modules = p11_kit_modules_load_and_initialize (0);
+		if (server->modules == NULL)
+			return false;
+	}
+
+	if (pipe (server->wakeup) == -1) {
+		p11_message_err (errno, _("could not create pipe"));
+		return false;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fcntl (server->wakeup[i], F_SETFL, O_NONBLOCK);
+		fcntl (server->wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	server->connections = p11_array_new (free);
+	return_val_if_fail (server->connections != NULL, false);
+
+	p11_mutex_init (&server->mutex);
+	server->threads = true;
+
+	return true;
+}
+
+static void *
+serve_connection (void *data)
+{
+	Connection *conn = data;
+	Server *server = conn->server;
+	CK_FUNCTION_LIST *module = NULL;
+	const char *name;
+
+	/* Each connection has its own instance of the module, so that
+	 * its sessions go away with it, and not with other connections */
+	name = server_module_name (server);
+	if (name)
+		module = p11_kit_module_load (name, 0);
+
+	if (module != NULL && server->provider == NULL) {
+		p11_kit_remote_serve_module (module, conn->fd, conn->fd);
+
+		/* In case the client went away without finalizing */
+		module->C_Finalize (NULL);
+	} else if (module != NULL || name == NULL) {
+		p11_kit_remote_serve_tokens ((const char **)server->tokens,
+					     server->n_tokens,
+					     module,
+					     conn->fd, conn->fd);
+	}
+
+	if (module != NULL)
+		p11_kit_module_release (module);
+
+	p11_mutex_lock (&server->mutex);
+	conn->done = true;
+	p11_mutex_unlock (&server->mutex);
+
+	/* Wake up the accept loop to join us */
+	if (write (server->wakeup[1], "", 1) < 0 && errno != EAGAIN)
+		p11_message_err (errno, _("could not wake up server"));
+
+	return NULL;
+}
+
+static bool
+start_connection (Server *server,
+		  int fd)
+{
+	Connection *conn;
+
+	conn = calloc (1, sizeof (Connection));
+	return_val_if_fail (conn != NULL, false);
+
+	conn->server = server;
+	conn->fd = fd;
+
+	if (p11_thread_create (&conn->thread, serve_connection, conn) != 0) {
+		p11_message_err (errno, _("failed to create thread for accept"));
+		free (conn);
+		return false;
+	}
+
+	if (!p11_array_push (server->connections, conn))
+		return_val_if_reached (false);
+
+	children_avail++;
+	return true;
+}
+
+static void
+cleanup_connections (Server *server,
+		     bool all)
+{
+	Connection *conn;
+	char buf[64];
+	unsigned int i;
+	bool done;
+
+	while (read (server->wakeup[0], buf, sizeof (buf)) > 0);
+
+	for (i = 0; i < server->connections->num; ) {
+		conn = server->connections->elem[i];
+
+		/* Let the connection finish on its own */
+		if (all)
+			shutdown (conn->fd, SHUT_RDWR);
+
+		p11_mutex_lock (&server->mutex);
+		done = conn->done;
+		p11_mutex_unlock (&server->mutex);
+
+		if (!done && !all) {
+			i++;
+			continue;
+		}
+
+		p11_thread_join (conn->thread);
+		close (conn->fd);
+		if (children_avail > 0)
+			children_avail--;
+		p11_array_remove (server->connections, i);
+	}
+}
+
 static bool
 print_environment (pid_t pid, Server *server, bool csh)
 {
@@ -467,6 +840,7 @@ print_environment (pid_t pid, Server *server, bool csh)
 static int
 server_loop (Server *server,
 	     bool foreground,
+	     bool threads,
 	     struct timespec *timeout)
 {
 	int ret;
@@ -476,10 +850,7 @@ server_loop (Server *server,
 	struct sockaddr_un sa;
 	fd_set rd_set;
 	sigset_t emptyset, blockset;
-	char **args;
-	size_t n_args, i;
-	int max_fd;
-	int errn;
+	int nfds;
 
 	sigemptyset (&blockset);
 	sigemptyset (&emptyset);
@@ -490,6 +861,10 @@ server_loop (Server *server,
 	ocsignal (SIGTERM, handle_term);
 	ocsignal (SIGINT, handle_term);
 
+	/* a client going away must not take the other connections along */
+	if (threads)
+		ocsignal (SIGPIPE, SIG_IGN);
+
 	/* run as daemon */
 	if (!foreground) {
 		pid = fork ();
@@ -531,6 +906,15 @@ server_loop (Server *server,
 	if (server->socket == -1)
 		return 1;
 
+	/* after daemonizing, as modules may not survive a fork */
+	if (threads && !server_start_threads (server))
+		return 1;
+
+	if (server->n_workers > 0) {
+		server->workers = p11_array_new (worker_free);
+		return_val_if_fail (server->workers != NULL, 1);
+	}
+
 	sigprocmask (SIG_BLOCK, &blockset, NULL);
 
 	/* for testing purposes, even when started in foreground,
@@ -545,18 +929,36 @@ server_loop (Server *server,
 	ret = 0;
 	for (;;) {
 		if (need_children_cleanup)
-			cleanup_children ();
+			cleanup_children (server);
 
 		if (terminate)
 			break;
 
+		/* Get a new worker ready for each one handed a connection */
+		while (server->workers && server->workers->num < server->n_workers) {
+			if (!start_worker (server, &blockset))
+				break;
+		}
+
 		FD_ZERO (&rd_set);
 		FD_SET (server->socket, &rd_set);
+		nfds = server->socket + 1;
 
-		ret = pselect (server->socket + 1, &rd_set, NULL, NULL, timeout, &emptyset);
+		if (server->threads) {
+			FD_SET (server->wakeup[0], &rd_set);
+			if (server->wakeup[0] >= nfds)
+				nfds = server->wakeup[0] + 1;
+		}
+
+		ret = pselect (nfds, &rd_set, NULL, NULL, timeout, &emptyset);
 		if (ret == -1 && errno == EINTR)
 			continue;
 
+		if (server->threads && FD_ISSET (server->wakeup[0], &rd_set)) {
+			cleanup_connections (server, false);
+			continue;
+		}
+
 		/* timeout */
 		if (ret == 0 && children_avail == 0 && timeout != NULL) {
 			p11_message (_("no connections to %s for %" PRIu64 " secs, exiting"), server->socket_name, (uint64_t)timeout->tv_sec);
@@ -576,6 +978,17 @@ server_loop (Server *server,
 			    !check_credentials (cfd, server->uid, server->gid))
 				continue;
 
+			if (server->threads) {
+				if (!start_connection (server, cfd))
+					close (cfd);
+				continue;
+			}
+
+			if (server->workers && hand_over (server, cfd)) {
+				close (cfd);
+				continue;
+			}
+
 			pid = fork ();
 			switch (pid) {
 			case -1:
@@ -584,45 +997,8 @@ server_loop (Server *server,
 			/* Child */
 			case 0:
 				sigprocmask (SIG_UNBLOCK, &blockset, NULL);
-				if (dup2 (cfd, STDIN_FILENO) < 0 ||
-				    dup2 (cfd, STDOUT_FILENO) < 0) {
-					errn = errno;
-					p11_message_err (errn, "couldn't dup file descriptors in remote child");
-					_exit (errn);
-				}
-
-				/* Close file descriptors, except for above on exec */
-				max_fd = STDERR_FILENO + 1;
-				fdwalk (set_cloexec_on_fd, &max_fd);
-
-				/* Execute 'p11-kit remote'; this shouldn't return */
-				args = calloc (3 + server->n_tokens + 1, sizeof (char *));
-				if (args == NULL) {
-					errn = errno;
-					p11_message_err (errn, "couldn't allocate memory for 'p11-kit remote' arguments");
-					_exit (errn);
-				}
-
-				n_args = 0;
-				args[n_args] = P11_KIT_REMOTE;
-				n_args++;
-
-				if (server->provider) {
-					args[n_args] = "--provider";
-					n_args++;
-					args[n_args] = (char *)server->provider;
-					n_args++;
-				}
-
-				for (i = 0; i < server->n_tokens; i++, n_args++)
-					args[n_args] = (char *)server->tokens[i];
-
-				exec_external (n_args, args);
-				free (args);
-
-				errn = errno;
-				p11_message_err (errn, "couldn't execute 'p11-kit remote'");
-				_exit (errn);
+				exec_remote (server, cfd, false);
+				break;
 			default:
 				children_avail++;
 				break;
@@ -631,6 +1007,9 @@ server_loop (Server *server,
 		}
 	}
 
+	if (server->threads)
+		cleanup_connections (server, true);
+
 	remove (server->socket_name);
 
 	return ret;
@@ -647,6 +1026,8 @@ main (int argc,
 	const struct passwd *pwd;
 	const struct group *grp;
 	bool foreground = false;
+	bool threads = false;
+	unsigned int workers = 0;
 	bool kill_opt = false;
 	struct timespec *timeout = NULL, ts;
 	char *name = NULL;
@@ -668,7 +1049,9 @@ main (int argc,
 		opt_provider = 'p',
 		opt_kill = 'k',
 		opt_csh = 'c',
-		opt_sh = 's'
+		opt_sh = 's',
+		opt_threads = 1000,
+		opt_workers,
 	};
 
 	struct option options[] = {
@@ -686,6 +1069,8 @@ main (int argc,
 		{ "kill", no_argument, NULL, opt_kill },
 		{ "csh", no_argument, NULL, opt_csh },
 		{ "sh", no_argument, NULL, opt_sh },
+		{ "threads", no_argument, NULL, opt_threads },
+		{ "workers", required_argument, NULL, opt_workers },
 		{ 0 },
 	};
 
@@ -702,6 +1087,8 @@ main (int argc,
 		{ opt_kill, "terminate the running server" },
 		{ opt_csh, "generate C-shell commands on stdout" },
 		{ opt_sh, "generate Bourne shell commands on stdout" },
+		{ opt_threads, "serve connections from threads instead of processes" },
+		{ opt_workers, "keep processes started ahead of connections" },
 		{ 0 },
 	};
 
@@ -756,6 +1143,12 @@ main (int argc,
 		case opt_foreground:
 			foreground = true;
 			break;
+		case opt_threads:
+			threads = true;
+			break;
+		case opt_workers:
+			workers = atoi (optarg);
+			break;
 		case opt_provider:
 			provider = optarg;
 			break;
@@ -892,7 +1285,8 @@ main (int argc,
 
 	server->uid = uid;
 	server->gid = gid;
-	ret = server_loop (server, foreground, timeout);
+	server->n_workers = threads ? 0 : workers;
+	ret = server_loop (server, foreground, threads, timeout);
 
  out:
 	server_free (server);
@@ -285,6 +285,37 @@ test_priority (void)
 	finalize_and_free_modules (modules);
 }
 
+static void
+test_duplicate_name (void)
+{
+	CK_FUNCTION_LIST_PTR_PTR modules;
+	CK_FUNCTION_LIST_PTR module;
+	char *setting;
+	char *name;
+
+	/*
+	 * Both two-duplicate.module and two.badname configure mock-two, and
+	 * the first name in sort order always wins, whatever the order of
+	 * the config files in the dict.
+	 */
+
+	modules = initialize_and_get_modules ();
+
+	module = lookup_module_with_filename (modules, "mock-two" SHLEXT);
+	assert_ptr_not_null (module);
+	name = p11_kit_module_get_name (module);
+	assert_str_eq ("two-duplicate", name);
+	free (name);
+
+	/* The config comes from the same file as the name */
+	setting = p11_kit_config_option (module, "setting");
+	assert_ptr_eq (NULL, setting);
+
+	assert_ptr_eq (NULL, p11_kit_module_for_name (modules, "two.badname"));
+
+	finalize_and_free_modules (modules);
+}
+
 static void
 test_module_name (void)
 {
@@ -468,6 +499,7 @@ main (int argc,
 	p11_test (test_enable, "/modules/test_enable");
 	p11_test (test_priority, "/modules/test_priority");
 	p11_test (test_module_name, "/modules/test_module_name");
+	p11_test (test_duplicate_name, "/modules/duplicate-name");
 	p11_test (test_module_flags, "/modules/test_module_flags");
 	p11_test (test_config_option, "/modules/test_config_option");
 	p11_test (test_module_trusted_only, "/modules/trusted-only");
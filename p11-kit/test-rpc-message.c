@@ -90,6 +90,8 @@ rpc_authenticate (p11_rpc_client_vtable *vtable,
 	assert_str_eq (vtable->data, "vtable-data");
 	assert_ptr_not_null (version);
 
+	/* The mock tests in test-rpc.c use the compact encoding */
+	*version = 4;
 	return CKR_OK;
 }
 
@@ -352,6 +354,81 @@ test_uint64_static (void)
 	assert (0x8967452311223344ull == val);
 }
 
+static void
+test_uint64_compact (void)
+{
+	p11_buffer buffer;
+	uint64_t val = 0;
+	uint32_t val32;
+	size_t next;
+	bool ret;
+
+	p11_buffer_init (&buffer, 0);
+	buffer.flags |= P11_RPC_BUFFER_COMPACT;
+
+	p11_rpc_buffer_add_uint64 (&buffer, 5);
+	assert_num_eq (1, buffer.len);
+	p11_rpc_buffer_add_uint64 (&buffer, 0x0123456708ABCDEFull);
+	assert_num_eq (10, buffer.len);
+	p11_rpc_buffer_add_uint64 (&buffer, UINT64_MAX);
+	assert_num_eq (20, buffer.len);
+	p11_rpc_buffer_add_uint32 (&buffer, 300);
+	assert_num_eq (22, buffer.len);
+	assert (!p11_buffer_failed (&buffer));
+
+	next = 0;
+	ret = p11_rpc_buffer_get_uint64 (&buffer, &next, &val);
+	assert_num_eq (true, ret);
+	assert_num_eq (1, next);
+	assert (5 == val);
+	ret = p11_rpc_buffer_get_uint64 (&buffer, &next, &val);
+	assert_num_eq (true, ret);
+	assert_num_eq (10, next);
+	assert (0x0123456708ABCDEFull == val);
+	ret = p11_rpc_buffer_get_uint64 (&buffer, &next, &val);
+	assert_num_eq (true, ret);
+	assert_num_eq (20, next);
+	assert (UINT64_MAX == val);
+	ret = p11_rpc_buffer_get_uint32 (&buffer, &next, &val32);
+	assert_num_eq (true, ret);
+	assert_num_eq (22, next);
+	assert_num_eq (300, val32);
+
+	p11_buffer_uninit (&buffer);
+}
+
+static void
+test_uint64_compact_invalid (void)
+{
+	p11_buffer truncated = { (unsigned char *)"\x80\x80", 2, };
+	p11_buffer overlong = { (unsigned char *)"\xff\xff\xff\xff\xff\xff\xff\xff\xff\x02", 10, };
+	p11_buffer too_large = { (unsigned char *)"\x80\x80\x80\x80\x10", 5, };
+	uint64_t val = 0;
+	uint32_t val32;
+	size_t next;
+
+	truncated.flags = P11_RPC_BUFFER_COMPACT;
+	next = 0;
+	assert (!p11_rpc_buffer_get_uint64 (&truncated, &next, &val));
+	assert_num_eq (0, next);
+
+	/* Only the top bit fits in the tenth byte */
+	overlong.flags = P11_RPC_BUFFER_COMPACT;
+	next = 0;
+	assert (!p11_rpc_buffer_get_uint64 (&overlong, &next, &val));
+	assert_num_eq (0, next);
+
+	/* Fine as a 64-bit value, but not as a 32-bit one */
+	too_large.flags = P11_RPC_BUFFER_COMPACT;
+	next = 0;
+	assert (p11_rpc_buffer_get_uint64 (&too_large, &next, &val));
+	assert (0x100000000ull == val);
+	too_large.flags = P11_RPC_BUFFER_COMPACT;
+	next = 0;
+	assert (!p11_rpc_buffer_get_uint32 (&too_large, &next, &val32));
+	assert_num_eq (0, next);
+}
+
 static void
 test_byte_array (void)
 {
@@ -806,6 +883,384 @@ test_message_write (void)
 	p11_buffer_uninit (&buffer);
 }
 
+static void
+encode_get_session_info (p11_rpc_message *msg)
+{
+	p11_rpc_message_write_ulong (msg, 1);
+	p11_rpc_message_write_ulong (msg, CKS_RO_PUBLIC_SESSION);
+	p11_rpc_message_write_ulong (msg, CKF_SERIAL_SESSION);
+	p11_rpc_message_write_ulong (msg, 0);
+}
+
+static void
+decode_get_session_info (p11_rpc_message *msg)
+{
+	CK_SESSION_INFO info;
+	CK_ULONG error;
+
+	if (!p11_rpc_message_read_ulong (msg, &info.slotID) ||
+	    !p11_rpc_message_read_ulong (msg, &info.state) ||
+	    !p11_rpc_message_read_ulong (msg, &info.flags) ||
+	    !p11_rpc_message_read_ulong (msg, &error))
+		assert_fail ("couldn't decode", "C_GetSessionInfo");
+	assert_num_eq (CKF_SERIAL_SESSION, info.flags);
+}
+
+static void
+encode_get_token_info (p11_rpc_message *msg)
+{
+	CK_VERSION version = { 1, 2 };
+	CK_UTF8CHAR label[32];
+	int i;
+
+	memset (label, ' ', sizeof (label));
+	for (i = 0; i < 4; i++)
+		p11_rpc_message_write_space_string (msg, label, i == 3 ? 16 : 32);
+	for (i = 0; i < 11; i++)
+		p11_rpc_message_write_ulong (msg, i);
+	p11_rpc_message_write_version (msg, &version);
+	p11_rpc_message_write_version (msg, &version);
+	p11_rpc_message_write_space_string (msg, label, 16);
+}
+
+static void
+decode_get_token_info (p11_rpc_message *msg)
+{
+	CK_VERSION version;
+	CK_UTF8CHAR label[32];
+	CK_ULONG value;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (!p11_rpc_message_read_space_string (msg, label, i == 3 ? 16 : 32))
+			assert_fail ("couldn't decode", "C_GetTokenInfo");
+	}
+	for (i = 0; i < 11; i++) {
+		if (!p11_rpc_message_read_ulong (msg, &value))
+			assert_fail ("couldn't decode", "C_GetTokenInfo");
+	}
+	if (!p11_rpc_message_read_version (msg, &version) ||
+	    !p11_rpc_message_read_version (msg, &version) ||
+	    !p11_rpc_message_read_space_string (msg, label, 16))
+		assert_fail ("couldn't decode", "C_GetTokenInfo");
+	assert_num_eq (2, version.minor);
+}
+
+static void
+encode_encrypt (p11_rpc_message *msg)
+{
+	unsigned char data[64];
+
+	memset (data, 'a', sizeof (data));
+	p11_rpc_message_write_ulong (msg, 1);
+	p11_rpc_message_write_byte_array (msg, data, sizeof (data));
+	p11_rpc_message_write_byte_buffer (msg, sizeof (data));
+}
+
+static void
+decode_encrypt (p11_rpc_message *msg)
+{
+	const unsigned char *data;
+	unsigned char valid;
+	CK_ULONG session;
+	size_t len;
+
+	if (!p11_rpc_message_read_ulong (msg, &session) ||
+	    !p11_rpc_buffer_get_byte (msg->input, &msg->parsed, &valid) || !valid ||
+	    !p11_rpc_buffer_get_byte_array (msg->input, &msg->parsed, &data, &len))
+		assert_fail ("couldn't decode", "C_Encrypt");
+	assert_num_eq (64, len);
+}
+
+static void
+encode_get_attribute_value (p11_rpc_message *msg)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, NULL, sizeof (CK_OBJECT_CLASS) },
+		{ CKA_LABEL, NULL, 32 },
+		{ CKA_ID, NULL, 20 },
+		{ CKA_VALUE, NULL, 1024 },
+	};
+
+	p11_rpc_message_write_ulong (msg, 1);
+	p11_rpc_message_write_ulong (msg, 2);
+	p11_rpc_message_write_attribute_buffer (msg, attrs, ELEMS (attrs));
+}
+
+static void
+decode_get_attribute_value (p11_rpc_message *msg)
+{
+	CK_ULONG session;
+	CK_ULONG object;
+
+	if (!p11_rpc_message_read_ulong (msg, &session) ||
+	    !p11_rpc_message_read_ulong (msg, &object))
+		assert_fail ("couldn't decode", "C_GetAttributeValue");
+	assert_num_eq (2, object);
+}
+
+static void
+test_message_round_trip (void)
+{
+	struct {
+		int call_id;
+		p11_rpc_message_type type;
+		void (* encode) (p11_rpc_message *);
+		void (* decode) (p11_rpc_message *);
+	} calls[] = {
+		{ P11_RPC_CALL_C_GetSessionInfo, P11_RPC_RESPONSE, encode_get_session_info, decode_get_session_info },
+		{ P11_RPC_CALL_C_GetTokenInfo, P11_RPC_RESPONSE, encode_get_token_info, decode_get_token_info },
+		{ P11_RPC_CALL_C_Encrypt, P11_RPC_REQUEST, encode_encrypt, decode_encrypt },
+		{ P11_RPC_CALL_C_GetAttributeValue, P11_RPC_REQUEST, encode_get_attribute_value, decode_get_attribute_value },
+	};
+	p11_rpc_message msg;
+	p11_buffer buffer;
+	size_t lengths[ELEMS (calls)];
+	int compact;
+	size_t i;
+
+	if (!p11_buffer_init (&buffer, 0))
+		assert_not_reached ();
+
+	/* Each message is encoded, then parsed and decoded from the same buffer */
+	for (compact = 0; compact < 2; compact++) {
+		if (compact)
+			buffer.flags |= P11_RPC_BUFFER_COMPACT;
+
+		for (i = 0; i < ELEMS (calls); i++) {
+			p11_rpc_message_init (&msg, &buffer, &buffer);
+			if (!p11_rpc_message_prep (&msg, calls[i].call_id, calls[i].type))
+				assert_not_reached ();
+			calls[i].encode (&msg);
+			assert (!p11_buffer_failed (&buffer));
+
+			if (!p11_rpc_message_parse (&msg, calls[i].type))
+				assert_not_reached ();
+			calls[i].decode (&msg);
+			p11_rpc_message_clear (&msg);
+
+			/* The compact encoding is never longer */
+			if (compact)
+				assert_num_cmp (buffer.len, <=, lengths[i]);
+			lengths[i] = buffer.len;
+		}
+	}
+
+	p11_buffer_uninit (&buffer);
+}
+
+static unsigned int allocations = 0;
+
+static void *
+counting_realloc (void *data,
+                  size_t size)
+{
+	if (data == NULL)
+		allocations++;
+	return realloc (data, size);
+}
+
+static unsigned char *wiped_data = NULL;
+static size_t wiped_length = 0;
+
+static void
+checking_free (void *data)
+{
+	size_t i;
+
+	/* Only the chunk that holds it, just past the chunk header */
+	if (wiped_data == NULL || wiped_data < (unsigned char *)data ||
+	    wiped_data > (unsigned char *)data + 64) {
+		free (data);
+		return;
+	}
+
+	/* What was handed out should have been cleared by now */
+	for (i = 0; i < wiped_length; i++)
+		assert_num_eq (0, wiped_data[i]);
+	wiped_data = NULL;
+	free (data);
+}
+
+static void
+test_arena_wipe (void)
+{
+	p11_rpc_arena arena;
+	unsigned char *data;
+	size_t i;
+
+	/* A kept chunk is cleared before being handed out again */
+	p11_rpc_arena_init (&arena, 64 * 1024, realloc, checking_free);
+	data = p11_rpc_arena_alloc (&arena, 100);
+	assert_ptr_not_null (data);
+	memset (data, 0xAA, 100);
+	p11_rpc_arena_reset (&arena);
+	assert_ptr_eq (data, p11_rpc_arena_alloc (&arena, 100));
+	for (i = 0; i < 100; i++)
+		assert_num_eq (0, data[i]);
+
+	wiped_data = data;
+	wiped_length = 100;
+	memset (data, 0xAA, 100);
+	p11_rpc_arena_uninit (&arena);
+	assert_ptr_eq (NULL, wiped_data);
+
+	/* And chunks that are let go, the older full ones too */
+	p11_rpc_arena_init (&arena, 0, realloc, checking_free);
+	data = p11_rpc_arena_alloc (&arena, 4096);
+	assert_ptr_not_null (data);
+	memset (data, 0xAA, 4096);
+	memset (p11_rpc_arena_alloc (&arena, 64), 0xAA, 64);
+
+	wiped_data = data;
+	wiped_length = 4096;
+	p11_rpc_arena_reset (&arena);
+	assert_ptr_eq (NULL, wiped_data);
+	p11_rpc_arena_uninit (&arena);
+}
+
+#define ARENA_ATTRIBUTES 20
+
+static void
+decode_create_object (p11_rpc_message *msg)
+{
+	CK_ATTRIBUTE *attrs;
+	CK_ULONG session;
+	uint32_t count;
+	uint32_t i;
+
+	/* As the server reads a template */
+	if (!p11_rpc_message_read_ulong (msg, &session) ||
+	    !p11_rpc_buffer_get_uint32 (msg->input, &msg->parsed, &count))
+		assert_fail ("couldn't decode", "C_CreateObject");
+	attrs = p11_rpc_message_alloc_extra_array (msg, count, sizeof (CK_ATTRIBUTE));
+	assert_ptr_not_null (attrs);
+	for (i = 0; i < count; i++) {
+		if (!p11_rpc_message_get_attribute (msg, msg->input, &msg->parsed, attrs + i))
+			assert_fail ("couldn't decode", "C_CreateObject");
+	}
+	assert_num_eq (ARENA_ATTRIBUTES, count);
+}
+
+static void
+test_arena_reuse (void)
+{
+	CK_ATTRIBUTE attrs[ARENA_ATTRIBUTES];
+	unsigned char value[64];
+	p11_rpc_message msg;
+	p11_rpc_arena arena;
+	p11_buffer buffer;
+	int reuse;
+	int i;
+
+	memset (value, 'v', sizeof (value));
+	for (i = 0; i < ARENA_ATTRIBUTES; i++) {
+		attrs[i].type = CKA_VENDOR_DEFINED + i;
+		attrs[i].pValue = value;
+		attrs[i].ulValueLen = 8 + i * 2;
+	}
+
+	p11_buffer_init_full (&buffer, NULL, 0, 0, counting_realloc, free);
+	p11_rpc_message_init (&msg, &buffer, &buffer);
+	if (!p11_rpc_message_prep (&msg, P11_RPC_CALL_C_CreateObject, P11_RPC_REQUEST) ||
+	    !p11_rpc_message_write_ulong (&msg, 1) ||
+	    !p11_rpc_message_write_attribute_array (&msg, attrs, ARENA_ATTRIBUTES))
+		assert_not_reached ();
+	p11_rpc_message_clear (&msg);
+
+	/* First with memory only for each message, then kept between them */
+	p11_rpc_arena_init (&arena, 64 * 1024, counting_realloc, free);
+	for (reuse = 0; reuse < 2; reuse++) {
+		for (i = 0; i < 10; i++) {
+			/* By then a kept arena has settled on one chunk that fits */
+			if (i == 2)
+				allocations = 0;
+			p11_rpc_message_init (&msg, &buffer, &buffer);
+			if (reuse)
+				msg.arena = &arena;
+			if (!p11_rpc_message_parse (&msg, P11_RPC_REQUEST))
+				assert_not_reached ();
+			decode_create_object (&msg);
+			p11_rpc_message_clear (&msg);
+			p11_rpc_arena_reset (&arena);
+		}
+
+		if (reuse)
+			assert_num_eq (0, allocations);
+		else
+			assert_num_cmp (allocations, >=, 8);
+	}
+	p11_rpc_arena_uninit (&arena);
+
+	p11_buffer_uninit (&buffer);
+}
+
+static void
+test_stats_histogram (void)
+{
+	p11_rpc_histogram histogram;
+	uint64_t value;
+	uint64_t i;
+
+	memset (&histogram, 0, sizeof (histogram));
+	assert_num_eq (0, p11_rpc_histogram_percentile (&histogram, 50));
+
+	p11_rpc_histogram_add (&histogram, 3);
+	assert_num_eq (1, histogram.count);
+	assert_num_eq (3, histogram.total);
+	assert_num_eq (3, p11_rpc_histogram_percentile (&histogram, 50));
+
+	memset (&histogram, 0, sizeof (histogram));
+	for (i = 1; i <= 1000000; i += 1000)
+		p11_rpc_histogram_add (&histogram, i);
+	assert_num_eq (1000, histogram.count);
+
+	/* The percentile is the top of its bucket, a quarter octave wide */
+	value = p11_rpc_histogram_percentile (&histogram, 50);
+	assert_num_cmp (value, >=, 499001);
+	assert_num_cmp (value, <=, 499001 * 5 / 4);
+	value = p11_rpc_histogram_percentile (&histogram, 99);
+	assert_num_cmp (value, >=, 989001);
+	assert_num_cmp (value, <=, 989001 * 5 / 4);
+	value = p11_rpc_histogram_percentile (&histogram, 100);
+	assert_num_cmp (value, >=, 999001);
+
+	/* Longer than the last bucket */
+	p11_rpc_histogram_add (&histogram, UINT64_MAX / 2);
+	assert_num_cmp (p11_rpc_histogram_percentile (&histogram, 100), >, 999001);
+}
+
+static void
+test_stats_format (void)
+{
+	p11_rpc_probe probe;
+	p11_rpc_stats *stats;
+	p11_buffer buffer;
+
+	stats = p11_rpc_stats_new ("client");
+	assert_ptr_not_null (stats);
+
+	memset (&probe, 0, sizeof (probe));
+	p11_rpc_probe_start (&probe, P11_RPC_CALL_C_GetInfo);
+	probe.sent = 10;
+	probe.received = 200;
+	p11_rpc_probe_lap (&probe, P11_RPC_STATS_SERIALIZE);
+	p11_rpc_stats_record (stats, &probe);
+	p11_rpc_stats_record (stats, &probe);
+
+	assert (p11_buffer_init_null (&buffer, 0));
+	assert (p11_rpc_stats_format (stats, &buffer));
+	assert_ptr_not_null (strstr (buffer.data, "#side\tpid\tcall\tcount\tsent\treceived\tserialize_total"));
+	assert_ptr_not_null (strstr (buffer.data, "\tmodule_p99\n"));
+	assert_ptr_not_null (strstr (buffer.data, "\tC_GetInfo\t2\t20\t400\t"));
+
+	/* Calls that weren't made are left out */
+	assert (strstr (buffer.data, "C_GetSlotList") == NULL);
+
+	p11_buffer_uninit (&buffer);
+	p11_rpc_stats_free (stats);
+}
+
 #include "test-mock.c"
 
 static CK_MECHANISM_TYPE mechanisms[] = {
@@ -835,6 +1290,8 @@ main (int argc,
 	p11_test (test_uint32_static, "/rpc-message/uint32-static");
 	p11_test (test_uint64, "/rpc-message/uint64");
 	p11_test (test_uint64_static, "/rpc-message/uint64-static");
+	p11_test (test_uint64_compact, "/rpc-message/uint64-compact");
+	p11_test (test_uint64_compact_invalid, "/rpc-message/uint64-compact-invalid");
 	p11_test (test_byte_array, "/rpc-message/byte-array");
 	p11_test (test_byte_array_null, "/rpc-message/byte-array-null");
 	p11_test (test_byte_array_too_long, "/rpc-message/byte-array-too-long");
@@ -848,6 +1305,11 @@ main (int argc,
 	p11_test (test_byte_array_value, "/rpc-message/byte-array-value");
 	p11_test (test_mechanism_value, "/rpc-message/mechanism-value");
 	p11_test (test_message_write, "/rpc-message/message-write");
+	p11_test (test_message_round_trip, "/rpc-message/message-round-trip");
+	p11_test (test_arena_wipe, "/rpc-message/arena-wipe");
+	p11_test (test_arena_reuse, "/rpc-message/arena-reuse");
+	p11_test (test_stats_histogram, "/rpc-message/stats-histogram");
+	p11_test (test_stats_format, "/rpc-message/stats-format");
 
 	test_mock_add_tests ("/rpc-message", NULL);
 
@@ -747,6 +747,1049 @@ test_fork_and_reinitialize (void *module)
 
 #endif /* OS_UNIX */
 
+static unsigned int rpc_round_trips = 0;
+
+static CK_RV
+rpc_authenticate_version_one (p11_rpc_client_vtable *vtable,
+                              uint8_t *version)
+{
+	assert_str_eq (vtable->data, "vtable-data");
+	assert_ptr_not_null (version);
+
+	*version = 1;
+	return CKR_OK;
+}
+
+static CK_RV
+rpc_transport_counted (p11_rpc_client_vtable *vtable,
+                       p11_buffer *request,
+                       p11_buffer *response)
+{
+	rpc_round_trips++;
+	return rpc_transport (vtable, request, response);
+}
+
+static p11_rpc_client_vtable test_counted_vtable = {
+	NULL,
+	rpc_initialize,
+	rpc_authenticate,
+	rpc_transport_counted,
+	rpc_finalize,
+};
+
+static p11_rpc_client_vtable test_counted_version_one_vtable = {
+	NULL,
+	rpc_initialize,
+	rpc_authenticate_version_one,
+	rpc_transport_counted,
+	rpc_finalize,
+};
+
+/* Returns the number of round trips used by the search */
+static unsigned int
+find_objects_counted (CK_FUNCTION_LIST *rpc_module,
+                      CK_SESSION_HANDLE session,
+                      CK_ATTRIBUTE *match,
+                      CK_ULONG n_match,
+                      CK_ULONG max_count,
+                      CK_OBJECT_HANDLE *found,
+                      CK_ULONG *n_found)
+{
+	CK_ULONG count;
+	CK_RV rv;
+
+	rpc_round_trips = 0;
+	*n_found = 0;
+
+	rv = (rpc_module->C_FindObjectsInit) (session, match, n_match);
+	assert_num_eq (CKR_OK, rv);
+
+	do {
+		rv = (rpc_module->C_FindObjects) (session, found + *n_found, max_count, &count);
+		assert_num_eq (CKR_OK, rv);
+		assert_num_cmp (count, <=, max_count);
+		*n_found += count;
+	} while (count > 0);
+
+	rv = (rpc_module->C_FindObjectsFinal) (session);
+	assert_num_eq (CKR_OK, rv);
+
+	return rpc_round_trips;
+}
+
+static CK_FUNCTION_LIST *
+setup_find_objects (p11_rpc_client_vtable *vtable,
+                    CK_FUNCTION_LIST_3_0 *module,
+                    CK_SESSION_HANDLE *session,
+                    CK_ATTRIBUTE *attrs,
+                    CK_ULONG n_attrs,
+                    CK_OBJECT_HANDLE *created,
+                    CK_ULONG n_created)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_ULONG i;
+	CK_RV rv;
+
+	rpc_module = setup_test_rpc_module (vtable, module, session);
+	for (i = 0; i < n_created; i++) {
+		rv = (rpc_module->C_CreateObject) (*session, attrs, n_attrs, created + i);
+		assert_num_eq (CKR_OK, rv);
+	}
+
+	return rpc_module;
+}
+
+static void
+test_find_objects_prefetch (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE created[40];
+	CK_OBJECT_HANDLE found[64];
+	CK_ULONG n_found;
+	CK_OBJECT_CLASS klass = CKO_DATA;
+	char label[] = "batched";
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_LABEL, label, sizeof (label) - 1 },
+	};
+	unsigned int trips;
+	int i;
+
+	struct {
+		p11_rpc_client_vtable *vtable;
+		const char *prefetch;
+		CK_ULONG max_count;
+		unsigned int trips;
+	} fixtures[] = {
+		/* The first handles come with C_FindObjectsInit */
+		{ &test_counted_vtable, NULL, 10, 4 },
+		{ &test_counted_version_one_vtable, NULL, 10, 5 },
+		/* Each time more are asked for */
+		{ &test_counted_vtable, "5", 1, 10 },
+		{ &test_counted_version_one_vtable, "5", 1, 11 },
+		{ &test_counted_vtable, "8", 3, 7 },
+		/* Every call is a round trip without */
+		{ &test_counted_vtable, "0", 10, 7 },
+		{ &test_counted_version_one_vtable, "1", 10, 7 },
+		{ &test_counted_vtable, "0", 1, 43 },
+		{ &test_counted_vtable, NULL, 64, 4 },
+		{ NULL },
+	};
+
+	for (i = 0; fixtures[i].vtable != NULL; i++) {
+		if (fixtures[i].prefetch)
+			setenv ("P11_KIT_RPC_PREFETCH", fixtures[i].prefetch, 1);
+		else
+			unsetenv ("P11_KIT_RPC_PREFETCH");
+
+		rpc_module = setup_find_objects (fixtures[i].vtable, module,
+		                                 &session, attrs, 2, created, 40);
+		trips = find_objects_counted (rpc_module, session, attrs + 1, 1,
+		                              fixtures[i].max_count, found, &n_found);
+		assert_num_eq (40, n_found);
+		assert (memcmp (found, created, sizeof (created)) == 0);
+		assert_num_eq (fixtures[i].trips, trips);
+
+		teardown_mock_module (rpc_module);
+	}
+
+	unsetenv ("P11_KIT_RPC_PREFETCH");
+}
+
+static CK_RV
+find_objects_short (CK_X_FUNCTION_LIST *self,
+                    CK_SESSION_HANDLE session,
+                    CK_OBJECT_HANDLE_PTR objects,
+                    CK_ULONG max_count,
+                    CK_ULONG_PTR count)
+{
+	/* Fewer handles than asked for, even when more are left */
+	if (max_count > 3)
+		max_count = 3;
+	return p11_virtual_base.C_FindObjects (self, session, objects, max_count, count);
+}
+
+static void
+test_find_objects_short (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE created[40];
+	CK_OBJECT_HANDLE found[64];
+	CK_ULONG n_found;
+	CK_OBJECT_CLASS klass = CKO_DATA;
+	char label[] = "batched";
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_LABEL, label, sizeof (label) - 1 },
+	};
+
+	rpc_module = setup_find_objects (&test_counted_vtable, module,
+	                                 &session, attrs, 2, created, 40);
+	base.funcs.C_FindObjects = find_objects_short;
+
+	/* Only an empty answer ends the search */
+	find_objects_counted (rpc_module, session, attrs + 1, 1, 10, found, &n_found);
+	assert_num_eq (40, n_found);
+	assert (memcmp (found, created, sizeof (created)) == 0);
+
+	teardown_mock_module (rpc_module);
+}
+
+static void
+test_find_objects_restart (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE created[40];
+	CK_OBJECT_HANDLE found[64];
+	CK_ULONG n_found;
+	CK_ULONG n_all;
+	CK_OBJECT_CLASS klass = CKO_DATA;
+	CK_OBJECT_CLASS public_key = CKO_PUBLIC_KEY;
+	char label[] = "batched";
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_LABEL, label, sizeof (label) - 1 },
+	};
+	CK_ATTRIBUTE keys = { CKA_CLASS, &public_key, sizeof (public_key) };
+	unsigned int trips;
+	CK_RV rv;
+
+	rpc_module = setup_find_objects (&test_counted_vtable, module,
+	                                 &session, attrs, 2, created, 40);
+
+	/* A short search needs one more round trip to find out it is over */
+	trips = find_objects_counted (rpc_module, session, &keys, 1, 1, found, &n_found);
+	assert_num_cmp (n_found, >, 0);
+	assert_num_eq (3, trips);
+	n_all = n_found;
+
+	/* Restarting a search forgets the handles of the old one */
+	rv = (rpc_module->C_FindObjectsInit) (session, attrs + 1, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjectsInit) (session, &keys, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjects) (session, found, 64, &n_found);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (n_all, n_found);
+	rv = (rpc_module->C_FindObjectsFinal) (session);
+	assert_num_eq (CKR_OK, rv);
+
+	/* As does cancelling it */
+	rv = (rpc_module->C_FindObjectsInit) (session, attrs + 1, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjects) (session, found, 1, &n_found);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, n_found);
+	rv = (((CK_FUNCTION_LIST_3_0 *)rpc_module)->C_SessionCancel) (session, CKF_FIND_OBJECTS);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjects) (session, found, 64, &n_found);
+	assert_num_eq (CKR_OPERATION_NOT_INITIALIZED, rv);
+
+	/* Nothing is left over once the search is done */
+	rv = (rpc_module->C_FindObjectsInit) (session, attrs + 1, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjects) (session, found, 1, &n_found);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjectsFinal) (session);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjects) (session, found, 64, &n_found);
+	assert_num_eq (CKR_OPERATION_NOT_INITIALIZED, rv);
+
+	/* Nor when it couldn't be started */
+	rv = (rpc_module->C_FindObjectsInit) (0, attrs, 1);
+	assert_num_eq (CKR_SESSION_HANDLE_INVALID, rv);
+	rv = (rpc_module->C_FindObjects) (0, found, 64, &n_found);
+	assert_num_eq (CKR_SESSION_HANDLE_INVALID, rv);
+
+	/* Bad arguments are still reported */
+	rv = (rpc_module->C_FindObjectsInit) (session, attrs + 1, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjects) (session, NULL, 1, &n_found);
+	assert_num_eq (CKR_ARGUMENTS_BAD, rv);
+	rv = (rpc_module->C_FindObjects) (session, found, 0, &n_found);
+	assert_num_eq (CKR_ARGUMENTS_BAD, rv);
+	rv = (rpc_module->C_FindObjectsFinal) (session);
+	assert_num_eq (CKR_OK, rv);
+
+	teardown_mock_module (rpc_module);
+}
+
+static bool cut_found_handles = true;
+
+/* Cuts off the last byte of the handles found along with C_FindObjectsInit */
+static CK_RV
+rpc_transport_cut_batch (p11_rpc_client_vtable *vtable,
+                         p11_buffer *request,
+                         p11_buffer *response)
+{
+	const unsigned char *data;
+	p11_rpc_message msg;
+	p11_buffer responses;
+	p11_buffer buffer;
+	unsigned char valid;
+	uint32_t call_id;
+	uint64_t arg;
+	size_t offset;
+	size_t last;
+	size_t len;
+	int flags;
+	CK_RV rv;
+
+	rv = rpc_transport (vtable, request, response);
+	if (rv != CKR_OK || !cut_found_handles ||
+	    !p11_rpc_message_peek (request, 0, &call_id, &arg, &offset) ||
+	    call_id != P11_RPC_CALL_BATCH)
+		return rv;
+
+	flags = response->flags & P11_RPC_BUFFER_COMPACT;
+	p11_rpc_message_init (&msg, response, response);
+	if (!p11_rpc_message_parse (&msg, P11_RPC_RESPONSE) ||
+	    !p11_rpc_buffer_get_byte (response, &msg.parsed, &valid) ||
+	    !p11_rpc_buffer_get_byte_array (response, &msg.parsed, &data, &len))
+		assert_not_reached ();
+
+	p11_buffer_init (&responses, 0);
+	responses.flags |= flags;
+	p11_buffer_add (&responses, data, len);
+	p11_rpc_message_clear (&msg);
+
+	p11_buffer_init (&buffer, 0);
+	buffer.flags |= flags;
+	last = 0;
+	for (offset = 0; offset < responses.len; ) {
+		last = offset;
+		if (!p11_rpc_buffer_get_byte_array (&responses, &offset, &data, &len))
+			assert_not_reached ();
+		if (offset == responses.len)
+			len--;
+		p11_rpc_buffer_add_byte_array (&buffer, data, len);
+	}
+	/* Both calls were answered */
+	assert_num_cmp (last, >, 0);
+
+	p11_buffer_reset (response, 0);
+	p11_rpc_message_init (&msg, response, response);
+	if (!p11_rpc_message_prep (&msg, P11_RPC_CALL_BATCH, P11_RPC_RESPONSE) ||
+	    !p11_rpc_message_write_byte_array (&msg, buffer.data, buffer.len))
+		assert_not_reached ();
+	p11_rpc_message_clear (&msg);
+
+	p11_buffer_uninit (&responses);
+	p11_buffer_uninit (&buffer);
+	return CKR_OK;
+}
+
+static p11_rpc_client_vtable test_cut_batch_vtable = {
+	NULL,
+	rpc_initialize,
+	rpc_authenticate,
+	rpc_transport_cut_batch,
+	rpc_finalize,
+};
+
+static void
+test_find_objects_lost (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE created[10];
+	CK_OBJECT_HANDLE found[64];
+	CK_ULONG n_found;
+	CK_OBJECT_CLASS klass = CKO_DATA;
+	char label[] = "batched";
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_LABEL, label, sizeof (label) - 1 },
+	};
+	CK_RV rv;
+
+	rpc_module = setup_find_objects (&test_cut_batch_vtable, module,
+	                                 &session, attrs, 2, created, 10);
+
+	/* Handles that couldn't be read are not quietly left out */
+	p11_kit_be_quiet ();
+	cut_found_handles = true;
+	rv = (rpc_module->C_FindObjectsInit) (session, attrs + 1, 1);
+	assert_num_cmp (CKR_OK, !=, rv);
+	p11_message_loud ();
+
+	/* And the search that was started is over */
+	cut_found_handles = false;
+	rv = (rpc_module->C_FindObjects) (session, found, 64, &n_found);
+	assert_num_eq (CKR_OPERATION_NOT_INITIALIZED, rv);
+	rv = (rpc_module->C_FindObjectsInit) (session, attrs + 1, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_FindObjects) (session, found, 64, &n_found);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (10, n_found);
+	rv = (rpc_module->C_FindObjectsFinal) (session);
+	assert_num_eq (CKR_OK, rv);
+
+	teardown_mock_module (rpc_module);
+}
+
+/* Sends a batch of calls with only their session argument to the server */
+static uint32_t
+batch_handled (CK_SESSION_HANDLE session,
+               const int *call_ids,
+               const CK_SESSION_HANDLE *sessions,
+               int count)
+{
+	p11_rpc_message msg;
+	p11_buffer requests;
+	p11_buffer buffer;
+	p11_buffer unused;
+	uint32_t call_id;
+	uint64_t arg;
+	size_t offset;
+	int i;
+
+	p11_buffer_init (&requests, 0);
+	p11_buffer_init (&buffer, 0);
+	p11_buffer_init (&unused, 0);
+
+	for (i = 0; i < count; i++) {
+		p11_rpc_message_init (&msg, &unused, &buffer);
+		if (!p11_rpc_message_prep (&msg, call_ids[i], P11_RPC_REQUEST) ||
+		    !p11_rpc_message_write_ulong (&msg, sessions[i]))
+			assert_not_reached ();
+		p11_rpc_buffer_add_byte_array (&requests, buffer.data, buffer.len);
+		p11_rpc_message_clear (&msg);
+	}
+
+	p11_rpc_message_init (&msg, &unused, &buffer);
+	if (!p11_rpc_message_prep (&msg, P11_RPC_CALL_BATCH, P11_RPC_REQUEST) ||
+	    !p11_rpc_message_write_ulong (&msg, session) ||
+	    !p11_rpc_message_write_byte_array (&msg, requests.data, requests.len))
+		assert_not_reached ();
+	p11_rpc_message_clear (&msg);
+
+	if (!p11_rpc_server_handle (&base.funcs, &buffer, &buffer))
+		assert_not_reached ();
+	if (!p11_rpc_message_peek (&buffer, 0, &call_id, &arg, &offset))
+		assert_not_reached ();
+
+	p11_buffer_uninit (&requests);
+	p11_buffer_uninit (&buffer);
+	p11_buffer_uninit (&unused);
+	return call_id;
+}
+
+static void
+test_batch_refused (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_HANDLE other;
+	CK_SESSION_INFO info;
+	CK_RV rv;
+	int i;
+
+	struct {
+		int call_ids[2];
+		int is_other[2];
+		uint32_t expected;
+	} fixtures[] = {
+		{ { P11_RPC_CALL_C_GetSessionInfo, P11_RPC_CALL_C_GetSessionInfo }, { 0, 0 }, P11_RPC_CALL_BATCH },
+		/* Calls that change the session or login state */
+		{ { P11_RPC_CALL_C_GetSessionInfo, P11_RPC_CALL_C_CloseSession }, { 0, 0 }, P11_RPC_CALL_ERROR },
+		{ { P11_RPC_CALL_C_GetSessionInfo, P11_RPC_CALL_C_Login }, { 0, 0 }, P11_RPC_CALL_ERROR },
+		{ { P11_RPC_CALL_C_Logout, P11_RPC_CALL_C_GetSessionInfo }, { 0, 0 }, P11_RPC_CALL_ERROR },
+		/* Calls on more than one session */
+		{ { P11_RPC_CALL_C_GetSessionInfo, P11_RPC_CALL_C_GetSessionInfo }, { 0, 1 }, P11_RPC_CALL_ERROR },
+		{ { P11_RPC_CALL_C_GetSessionInfo, P11_RPC_CALL_C_GetSessionInfo }, { 1, 1 }, P11_RPC_CALL_ERROR },
+		/* Nor can batches be nested */
+		{ { P11_RPC_CALL_C_GetSessionInfo, P11_RPC_CALL_BATCH }, { 0, 0 }, P11_RPC_CALL_ERROR },
+		{ { 0 } },
+	};
+
+	rpc_module = setup_mock_module (&session);
+	rv = (rpc_module->C_OpenSession) (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION, NULL, NULL, &other);
+	assert_num_eq (CKR_OK, rv);
+
+	p11_message_quiet ();
+
+	for (i = 0; fixtures[i].call_ids[0] != 0; i++) {
+		CK_SESSION_HANDLE sessions[2] = {
+			fixtures[i].is_other[0] ? other : session,
+			fixtures[i].is_other[1] ? other : session,
+		};
+		assert_num_eq (fixtures[i].expected, batch_handled (session, fixtures[i].call_ids, sessions, 2));
+	}
+
+	p11_message_loud ();
+
+	/* None of the refused calls ran */
+	rv = (rpc_module->C_GetSessionInfo) (session, &info);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (CKS_RW_PUBLIC_SESSION, info.state);
+
+	teardown_mock_module (rpc_module);
+}
+
+static unsigned int
+get_attribute_values_counted (CK_FUNCTION_LIST *rpc_module,
+                              CK_SESSION_HANDLE session,
+                              CK_OBJECT_HANDLE object,
+                              CK_ATTRIBUTE *attrs,
+                              CK_ULONG count,
+                              CK_RV expected)
+{
+	CK_ULONG i;
+	CK_RV rv;
+
+	rpc_round_trips = 0;
+
+	for (i = 0; i < count; i++) {
+		attrs[i].pValue = NULL;
+		attrs[i].ulValueLen = 0;
+	}
+
+	rv = (rpc_module->C_GetAttributeValue) (session, object, attrs, count);
+	assert_num_eq (expected, rv);
+
+	for (i = 0; i < count; i++) {
+		if (attrs[i].ulValueLen != (CK_ULONG)-1)
+			attrs[i].pValue = malloc (attrs[i].ulValueLen + 1);
+	}
+
+	rv = (rpc_module->C_GetAttributeValue) (session, object, attrs, count);
+	assert_num_eq (expected, rv);
+
+	return rpc_round_trips;
+}
+
+static unsigned int module_lookups = 0;
+
+static CK_RV
+get_attribute_value_counted (CK_X_FUNCTION_LIST *self,
+                             CK_SESSION_HANDLE session,
+                             CK_OBJECT_HANDLE object,
+                             CK_ATTRIBUTE_PTR template,
+                             CK_ULONG count)
+{
+	module_lookups++;
+	return p11_virtual_base.C_GetAttributeValue (self, session, object, template, count);
+}
+
+static void
+test_get_attribute_value_sizes (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_HANDLE other_session;
+	CK_OBJECT_HANDLE token_object;
+	CK_BBOOL btrue = CK_TRUE;
+	CK_OBJECT_HANDLE objects[2];
+	CK_OBJECT_CLASS klass = CKO_DATA;
+	char label[] = "label";
+	char value[] = "the value";
+	char other[] = "other";
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_LABEL, label, sizeof (label) - 1 },
+		{ CKA_VALUE, value, sizeof (value) - 1 },
+	};
+	CK_ATTRIBUTE token_attrs[] = {
+		{ CKA_TOKEN, &btrue, sizeof (btrue) },
+		{ CKA_VALUE, value, sizeof (value) - 1 },
+	};
+	CK_ATTRIBUTE changed = { CKA_VALUE, other, sizeof (other) - 1 };
+	CK_ATTRIBUTE templ[3];
+	char buffer[32];
+	unsigned int trips;
+	CK_ULONG i;
+	CK_RV rv;
+
+	rpc_module = setup_find_objects (&test_counted_version_one_vtable, module,
+	                                 &session, attrs, 3, objects, 1);
+
+	/* With version 1 the values take another round trip */
+	templ[0].type = CKA_LABEL;
+	templ[1].type = CKA_VALUE;
+	trips = get_attribute_values_counted (rpc_module, session, objects[0], templ, 2, CKR_OK);
+	assert_num_eq (2, trips);
+	assert_num_eq (sizeof (value) - 1, templ[1].ulValueLen);
+	assert (memcmp (templ[1].pValue, value, templ[1].ulValueLen) == 0);
+	free (templ[0].pValue);
+	free (templ[1].pValue);
+
+	teardown_mock_module (rpc_module);
+
+	rpc_module = setup_find_objects (&test_counted_vtable, module,
+	                                 &session, attrs, 3, objects, 2);
+
+	/* The values come along with the lengths */
+	trips = get_attribute_values_counted (rpc_module, session, objects[0], templ, 2, CKR_OK);
+	assert_num_eq (1, trips);
+	assert_num_eq (sizeof (label) - 1, templ[0].ulValueLen);
+	assert (memcmp (templ[0].pValue, label, templ[0].ulValueLen) == 0);
+	assert_num_eq (sizeof (value) - 1, templ[1].ulValueLen);
+	assert (memcmp (templ[1].pValue, value, templ[1].ulValueLen) == 0);
+	free (templ[0].pValue);
+	free (templ[1].pValue);
+
+	/* Including which of them are invalid */
+	templ[2].type = CKA_ID;
+	trips = get_attribute_values_counted (rpc_module, session, objects[0], templ, 3,
+	                                      CKR_ATTRIBUTE_TYPE_INVALID);
+	assert_num_eq (1, trips);
+	assert_num_eq (sizeof (value) - 1, templ[1].ulValueLen);
+	assert (memcmp (templ[1].pValue, value, templ[1].ulValueLen) == 0);
+	assert_num_eq ((CK_ULONG)-1, templ[2].ulValueLen);
+	for (i = 0; i < 3; i++)
+		free (templ[i].pValue);
+
+	/* The values are only used once */
+	templ[0].pValue = buffer;
+	templ[0].ulValueLen = sizeof (buffer);
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[0], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (2, rpc_round_trips);
+
+	/* Nor after the object changed */
+	templ[0].type = CKA_VALUE;
+	templ[0].pValue = NULL;
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[0], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_SetAttributeValue) (session, objects[0], &changed, 1);
+	assert_num_eq (CKR_OK, rv);
+	templ[0].pValue = buffer;
+	templ[0].ulValueLen = sizeof (buffer);
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[0], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (sizeof (other) - 1, templ[0].ulValueLen);
+	assert (memcmp (buffer, other, templ[0].ulValueLen) == 0);
+
+	/* Nor for another object */
+	templ[0].pValue = NULL;
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[0], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	templ[0].pValue = buffer;
+	templ[0].ulValueLen = sizeof (buffer);
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[1], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (sizeof (value) - 1, templ[0].ulValueLen);
+	assert (memcmp (buffer, value, templ[0].ulValueLen) == 0);
+
+	/* Nor with a buffer that is too small */
+	templ[0].pValue = NULL;
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[1], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	templ[0].pValue = buffer;
+	templ[0].ulValueLen = 2;
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[1], templ, 1);
+	assert_num_eq (CKR_BUFFER_TOO_SMALL, rv);
+
+	/* Which means they aren't looked up for the session next time */
+	base.funcs.C_GetAttributeValue = get_attribute_value_counted;
+	module_lookups = 0;
+	templ[0].pValue = NULL;
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[1], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, module_lookups);
+
+	/* Until it turns out they would have been used */
+	templ[0].pValue = buffer;
+	templ[0].ulValueLen = sizeof (buffer);
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[1], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (2, module_lookups);
+	templ[0].pValue = NULL;
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[1], templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (4, module_lookups);
+
+	/* Changes made on another session are seen too */
+	rv = (rpc_module->C_CreateObject) (session, token_attrs, 2, &token_object);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_OpenSession) (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION, NULL, NULL, &other_session);
+	assert_num_eq (CKR_OK, rv);
+	templ[0].pValue = NULL;
+	rv = (rpc_module->C_GetAttributeValue) (other_session, token_object, templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_SetAttributeValue) (session, token_object, &changed, 1);
+	assert_num_eq (CKR_OK, rv);
+	templ[0].pValue = buffer;
+	templ[0].ulValueLen = sizeof (buffer);
+	rv = (rpc_module->C_GetAttributeValue) (other_session, token_object, templ, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (sizeof (other) - 1, templ[0].ulValueLen);
+	assert (memcmp (buffer, other, templ[0].ulValueLen) == 0);
+
+	teardown_mock_module (rpc_module);
+}
+
+static void
+test_slot_info_cache (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SLOT_ID slots[8];
+	CK_SLOT_INFO slot_info;
+	CK_TOKEN_INFO token_info;
+	CK_MECHANISM_TYPE mechs[16];
+	CK_MECHANISM_INFO mech_info;
+	CK_SLOT_ID slot;
+	CK_ULONG count;
+	CK_ULONG n_slots;
+	CK_ULONG n_mechs;
+	int i;
+	CK_RV rv;
+
+	/* Nothing is kept unless asked for */
+	rpc_module = setup_test_rpc_module (&test_counted_vtable, module, NULL);
+	rpc_round_trips = 0;
+	for (i = 0; i < 2; i++) {
+		rv = (rpc_module->C_GetSlotInfo) (MOCK_SLOT_ONE_ID, &slot_info);
+		assert_num_eq (CKR_OK, rv);
+	}
+	assert_num_eq (2, rpc_round_trips);
+	teardown_mock_module (rpc_module);
+
+	setenv ("P11_KIT_RPC_CACHE_TTL", "60", 1);
+	rpc_module = setup_test_rpc_module (&test_counted_vtable, module, NULL);
+	unsetenv ("P11_KIT_RPC_CACHE_TTL");
+	rpc_round_trips = 0;
+
+	/* Each list and mechanism information goes over the wire once */
+	for (i = 0; i < 2; i++) {
+		rv = (rpc_module->C_GetSlotList) (CK_FALSE, NULL, &n_slots);
+		assert_num_eq (CKR_OK, rv);
+		assert_num_cmp (n_slots, >, 0);
+		count = 8;
+		rv = (rpc_module->C_GetSlotList) (CK_FALSE, slots, &count);
+		assert_num_eq (CKR_OK, rv);
+		assert_num_eq (n_slots, count);
+		assert_num_eq (MOCK_SLOT_ONE_ID, slots[0]);
+
+		rv = (rpc_module->C_GetMechanismList) (MOCK_SLOT_ONE_ID, NULL, &n_mechs);
+		assert_num_eq (CKR_OK, rv);
+		assert_num_cmp (n_mechs, >, 0);
+		rv = (rpc_module->C_GetMechanismList) (MOCK_SLOT_ONE_ID, mechs, &n_mechs);
+		assert_num_eq (CKR_OK, rv);
+		rv = (rpc_module->C_GetMechanismInfo) (MOCK_SLOT_ONE_ID, mechs[0], &mech_info);
+		assert_num_eq (CKR_OK, rv);
+	}
+	assert_num_eq (5, rpc_round_trips);
+
+	/* Buffers that are too small are handled without the server */
+	count = 0;
+	rv = (rpc_module->C_GetSlotList) (CK_FALSE, slots, &count);
+	assert_num_eq (CKR_BUFFER_TOO_SMALL, rv);
+	assert_num_eq (n_slots, count);
+	assert_num_eq (5, rpc_round_trips);
+
+	/* Which slots have a token, and slot and token information, change any time */
+	for (i = 0; i < 2; i++) {
+		count = 8;
+		rv = (rpc_module->C_GetSlotList) (CK_TRUE, slots, &count);
+		assert_num_eq (CKR_OK, rv);
+		assert_num_eq (1, count);
+		rv = (rpc_module->C_GetSlotInfo) (MOCK_SLOT_ONE_ID, &slot_info);
+		assert_num_eq (CKR_OK, rv);
+		assert (memcmp (slot_info.slotDescription, "TEST SLOT", 9) == 0);
+		rv = (rpc_module->C_GetTokenInfo) (MOCK_SLOT_ONE_ID, &token_info);
+		assert_num_eq (CKR_OK, rv);
+		assert (memcmp (token_info.label, "TEST LABEL", 10) == 0);
+	}
+	assert_num_eq (11, rpc_round_trips);
+
+	/* A slot event makes the slot list be asked for again */
+	rv = (rpc_module->C_WaitForSlotEvent) (0, &slot, NULL);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (MOCK_SLOT_TWO_ID, slot);
+	count = 8;
+	rv = (rpc_module->C_GetSlotList) (CK_FALSE, slots, &count);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_GetMechanismList) (MOCK_SLOT_ONE_ID, mechs, &n_mechs);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (13, rpc_round_trips);
+
+	/* And nothing is kept across finalizing */
+	rv = (rpc_module->C_Finalize) (NULL);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_Initialize) (NULL);
+	assert_num_eq (CKR_OK, rv);
+	rpc_round_trips = 0;
+	rv = (rpc_module->C_GetMechanismList) (MOCK_SLOT_ONE_ID, mechs, &n_mechs);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, rpc_round_trips);
+
+	teardown_mock_module (rpc_module);
+}
+
+/* Returns the number of round trips used to get a value twice */
+static unsigned int
+get_value_twice (CK_FUNCTION_LIST *rpc_module,
+                 CK_SESSION_HANDLE session,
+                 CK_OBJECT_HANDLE object,
+                 CK_ATTRIBUTE_TYPE type,
+                 const char *expected)
+{
+	CK_ATTRIBUTE attr = { type, NULL, 0 };
+	char buffer[64];
+	int i;
+	CK_RV rv;
+
+	rpc_round_trips = 0;
+
+	for (i = 0; i < 2; i++) {
+		attr.pValue = NULL;
+		rv = (rpc_module->C_GetAttributeValue) (session, object, &attr, 1);
+		assert_num_eq (CKR_OK, rv);
+		assert_num_eq (strlen (expected), attr.ulValueLen);
+
+		attr.pValue = buffer;
+		rv = (rpc_module->C_GetAttributeValue) (session, object, &attr, 1);
+		assert_num_eq (CKR_OK, rv);
+		assert_num_eq (strlen (expected), attr.ulValueLen);
+		assert (memcmp (buffer, expected, attr.ulValueLen) == 0);
+	}
+
+	return rpc_round_trips;
+}
+
+static void
+test_attribute_cache (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_HANDLE other_session;
+	CK_OBJECT_HANDLE objects[3];
+	CK_OBJECT_CLASS certificate = CKO_CERTIFICATE;
+	CK_OBJECT_CLASS secret = CKO_SECRET_KEY;
+	CK_BBOOL btrue = CK_TRUE;
+	CK_BBOOL bfalse = CK_FALSE;
+	char value[] = "certificate";
+	char label[] = "label";
+	char other[] = "other";
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_TOKEN, &btrue, sizeof (btrue) },
+		{ CKA_PRIVATE, &bfalse, sizeof (bfalse) },
+		{ CKA_MODIFIABLE, &bfalse, sizeof (bfalse) },
+		{ CKA_VALUE, value, sizeof (value) - 1 },
+		{ CKA_LABEL, label, sizeof (label) - 1 },
+	};
+	CK_ATTRIBUTE changed = { CKA_LABEL, other, sizeof (other) - 1 };
+	CK_ATTRIBUTE attr;
+	char buffer[4];
+	CK_RV rv;
+
+	/* Nothing is kept unless asked for */
+	rpc_module = setup_test_rpc_module (&test_counted_vtable, module, &session);
+	rv = (rpc_module->C_CreateObject) (session, attrs, 6, objects);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (2, get_value_twice (rpc_module, session, objects[0], CKA_VALUE, value));
+	assert_num_eq (2, get_value_twice (rpc_module, session, objects[0], CKA_VALUE, value));
+	teardown_mock_module (rpc_module);
+
+	setenv ("P11_KIT_RPC_ATTRIBUTE_CACHE", "65536", 1);
+	rpc_module = setup_test_rpc_module (&test_counted_vtable, module, &session);
+	unsetenv ("P11_KIT_RPC_ATTRIBUTE_CACHE");
+
+	rv = (rpc_module->C_CreateObject) (session, attrs, 6, objects + 0);
+	assert_num_eq (CKR_OK, rv);
+	attrs[3].pValue = &btrue;
+	rv = (rpc_module->C_CreateObject) (session, attrs, 6, objects + 1);
+	assert_num_eq (CKR_OK, rv);
+	attrs[0].pValue = &secret;
+	attrs[3].pValue = &bfalse;
+	rv = (rpc_module->C_CreateObject) (session, attrs, 6, objects + 2);
+	assert_num_eq (CKR_OK, rv);
+
+	/* Whether the object can change is asked along with the first call */
+	assert_num_eq (1, get_value_twice (rpc_module, session, objects[0], CKA_VALUE, value));
+	assert_num_eq (1, get_value_twice (rpc_module, session, objects[0], CKA_LABEL, label));
+	assert_num_eq (0, get_value_twice (rpc_module, session, objects[0], CKA_VALUE, value));
+
+	/* Buffers that are too small are handled without the server */
+	attr.type = CKA_VALUE;
+	attr.pValue = buffer;
+	attr.ulValueLen = sizeof (buffer);
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[0], &attr, 1);
+	assert_num_eq (CKR_BUFFER_TOO_SMALL, rv);
+	assert_num_eq ((CK_ULONG)-1, attr.ulValueLen);
+	assert_num_eq (0, rpc_round_trips);
+
+	/* Objects that can change, and keys, are always asked about */
+	assert_num_eq (2, get_value_twice (rpc_module, session, objects[1], CKA_VALUE, value));
+	assert_num_eq (2, get_value_twice (rpc_module, session, objects[1], CKA_VALUE, value));
+	assert_num_eq (2, get_value_twice (rpc_module, session, objects[2], CKA_VALUE, value));
+
+	/* Changing the object makes it be asked about again */
+	rv = (rpc_module->C_SetAttributeValue) (session, objects[0], &changed, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, get_value_twice (rpc_module, session, objects[0], CKA_LABEL, other));
+
+	/* Closing another session on the slot doesn't */
+	rv = (rpc_module->C_OpenSession) (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION, NULL, NULL, &other_session);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (0, get_value_twice (rpc_module, other_session, objects[0], CKA_LABEL, other));
+	rv = (rpc_module->C_CloseSession) (other_session);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (0, get_value_twice (rpc_module, session, objects[0], CKA_LABEL, other));
+
+	/* But closing the last one does */
+	rv = (rpc_module->C_CloseSession) (session);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_OpenSession) (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, get_value_twice (rpc_module, session, objects[0], CKA_LABEL, other));
+
+	/* As does closing all sessions of the slot */
+	rv = (rpc_module->C_OpenSession) (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION, NULL, NULL, &other_session);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_CloseAllSessions) (MOCK_SLOT_ONE_ID);
+	assert_num_eq (CKR_OK, rv);
+	rv = (rpc_module->C_OpenSession) (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, get_value_twice (rpc_module, session, objects[0], CKA_LABEL, other));
+
+	/* And destroying it */
+	rv = (rpc_module->C_DestroyObject) (session, objects[0]);
+	assert_num_eq (CKR_OK, rv);
+	attr.type = CKA_LABEL;
+	attr.pValue = NULL;
+	rv = (rpc_module->C_GetAttributeValue) (session, objects[0], &attr, 1);
+	assert_num_eq (CKR_OBJECT_HANDLE_INVALID, rv);
+
+	teardown_mock_module (rpc_module);
+}
+
+/* Marks the buffers that the transport has seen before */
+#define RPC_BUFFER_SEEN (1 << 15)
+
+static unsigned int rpc_buffer_allocations = 0;
+static size_t rpc_buffer_size = 0;
+
+static CK_RV
+rpc_transport_allocations (p11_rpc_client_vtable *vtable,
+                           p11_buffer *request,
+                           p11_buffer *response)
+{
+	size_t size;
+	CK_RV rv;
+
+	/* A call that used a new buffer, or grew it, had to allocate */
+	if (!(request->flags & RPC_BUFFER_SEEN) || request->size != rpc_buffer_size)
+		rpc_buffer_allocations++;
+	size = request->size;
+
+	rv = rpc_transport (vtable, request, response);
+	assert_ptr_eq (request, response);
+
+	if (response->size != size)
+		rpc_buffer_allocations++;
+	response->flags |= RPC_BUFFER_SEEN;
+	rpc_buffer_size = response->size;
+	return rv;
+}
+
+static p11_rpc_client_vtable test_allocations_vtable = {
+	NULL,
+	rpc_initialize,
+	rpc_authenticate,
+	rpc_transport_allocations,
+	rpc_finalize,
+};
+
+static void
+test_buffer_reuse (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_INFO info;
+	CK_BYTE data[32];
+	CK_BYTE *large;
+	CK_RV rv;
+	int i;
+
+	rpc_module = setup_test_rpc_module (&test_allocations_vtable, module, &session);
+
+	/* Once a buffer has grown large enough, the calls all use it */
+	rpc_buffer_allocations = 0;
+	for (i = 0; i < 100; i++) {
+		rv = (rpc_module->C_GetSessionInfo) (session, &info);
+		assert_num_eq (CKR_OK, rv);
+	}
+	assert_num_cmp (rpc_buffer_allocations, <=, 1);
+
+	rpc_buffer_allocations = 0;
+	for (i = 0; i < 100; i++) {
+		rv = (rpc_module->C_GenerateRandom) (session, data, sizeof (data));
+		assert_num_eq (CKR_OK, rv);
+		rv = (rpc_module->C_GetSessionInfo) (session, &info);
+		assert_num_eq (CKR_OK, rv);
+	}
+	assert_num_cmp (rpc_buffer_allocations, <=, 1);
+
+	/* But a buffer that grew very large isn't kept around */
+	large = malloc (128 * 1024);
+	assert_ptr_not_null (large);
+	rv = (rpc_module->C_GenerateRandom) (session, large, 128 * 1024);
+	assert_num_eq (CKR_OK, rv);
+	free (large);
+
+	rpc_buffer_allocations = 0;
+	rv = (rpc_module->C_GetSessionInfo) (session, &info);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, rpc_buffer_allocations);
+
+	teardown_mock_module (rpc_module);
+}
+
+static void
+test_stats (void *module)
+{
+	CK_FUNCTION_LIST *rpc_module;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_INFO info;
+	p11_rpc_call_stats *call;
+	p11_rpc_stats *client;
+	p11_rpc_stats *server;
+	int i;
+
+	/* Whatever P11_KIT_RPC_STATS may have enabled */
+	client = p11_rpc_client_stats;
+	server = p11_rpc_server_stats;
+	p11_rpc_client_stats = p11_rpc_stats_new ("client");
+	p11_rpc_server_stats = p11_rpc_stats_new ("server");
+
+	rpc_module = setup_test_rpc_module (&test_normal_vtable, module, &session);
+
+	for (i = 0; i < 10; i++)
+		assert_num_eq (CKR_OK, (rpc_module->C_GetSessionInfo) (session, &info));
+
+	/* A bad handle is counted along with the rest */
+	assert_num_eq (CKR_SESSION_HANDLE_INVALID, (rpc_module->C_GetSessionInfo) (0, &info));
+
+	call = p11_rpc_client_stats->calls + P11_RPC_CALL_C_GetSessionInfo;
+	assert_num_eq (11, call->count);
+	assert_num_cmp (call->sent, >, 0);
+	assert_num_cmp (call->received, >, call->sent);
+	assert_num_eq (11, call->phases[P11_RPC_STATS_TRANSPORT].count);
+
+	/* The server sees the same calls and bytes the other way around */
+	call = p11_rpc_server_stats->calls + P11_RPC_CALL_C_GetSessionInfo;
+	assert_num_eq (11, call->count);
+	assert_num_eq (p11_rpc_client_stats->calls[P11_RPC_CALL_C_GetSessionInfo].sent, call->received);
+	assert_num_eq (p11_rpc_client_stats->calls[P11_RPC_CALL_C_GetSessionInfo].received, call->sent);
+	assert_num_eq (11, call->phases[P11_RPC_STATS_MODULE].count);
+
+	assert_num_eq (1, p11_rpc_client_stats->calls[P11_RPC_CALL_C_OpenSession].count);
+
+	teardown_mock_module (rpc_module);
+
+	p11_rpc_stats_free (p11_rpc_client_stats);
+	p11_rpc_client_stats = client;
+	p11_rpc_stats_free (p11_rpc_server_stats);
+	p11_rpc_server_stats = server;
+}
+
 #include "test-mock.c"
 
 static const CK_VERSION test_version_three = {CRYPTOKI_VERSION_MAJOR, CRYPTOKI_VERSION_MINOR};
@@ -805,6 +1848,16 @@ main (int argc,
 	p11_testx (test_get_slot_list_no_device, &mock_module_v3_no_slots, "/rpc3/get-slot-list-no-device");
 	p11_testx (test_simultaneous_functions, &mock_module_v3_no_slots, "/rpc3/simultaneous-functions");
 	p11_testx (test_mechanism_unsupported, &mock_module_v3, "/rpc3/mechanism-unsupported");
+	p11_testx (test_find_objects_prefetch, &mock_module_v3, "/rpc3/find-objects-prefetch");
+	p11_testx (test_find_objects_short, &mock_module_v3, "/rpc3/find-objects-short");
+	p11_testx (test_find_objects_restart, &mock_module_v3, "/rpc3/find-objects-restart");
+	p11_testx (test_find_objects_lost, &mock_module_v3, "/rpc3/find-objects-lost");
+	p11_testx (test_batch_refused, &mock_module_v3, "/rpc3/batch-refused");
+	p11_testx (test_get_attribute_value_sizes, &mock_module_v3, "/rpc3/get-attribute-value-sizes");
+	p11_testx (test_slot_info_cache, &mock_module_v3, "/rpc3/slot-info-cache");
+	p11_testx (test_attribute_cache, &mock_module_v3, "/rpc3/attribute-cache");
+	p11_testx (test_buffer_reuse, &mock_module_v3, "/rpc3/buffer-reuse");
+	p11_testx (test_stats, &mock_module_v3, "/rpc3/stats");
 
 #ifdef OS_UNIX
 	p11_testx (test_fork_and_reinitialize, &mock_module_v3_no_slots, "/rpc3/fork-and-reinitialize");
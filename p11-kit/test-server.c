@@ -66,6 +66,8 @@ struct fixture {
 	char *provider;
 	char *token;
 	int slots;
+	bool threads;
+	char *workers;
 };
 
 static void
@@ -85,6 +87,16 @@ setup_server (void *arg)
 		assert_not_reached ();
 	if (!p11_array_push (args, "-f"))
 		assert_not_reached ();
+	if (fixture->threads) {
+		if (!p11_array_push (args, "--threads"))
+			assert_not_reached ();
+	}
+	if (fixture->workers) {
+		if (!p11_array_push (args, "--workers"))
+			assert_not_reached ();
+		if (!p11_array_push (args, fixture->workers))
+			assert_not_reached ();
+	}
 	if (fixture->provider) {
 		if (!p11_array_push (args, "--provider"))
 			assert_not_reached ();
@@ -265,6 +277,91 @@ test_open_session_write_protected (void *unused)
 	p11_kit_module_release (module);
 }
 
+static void
+test_reconnect (void *arg)
+{
+	int i;
+
+	/* More connections than there are workers waiting for them */
+	for (i = 0; i < 5; i++)
+		test_open_session (arg);
+}
+
+static void
+test_threads_isolation (void *unused)
+{
+	CK_SESSION_HANDLE session;
+	CK_SESSION_HANDLE other;
+	CK_FUNCTION_LIST_PTR module;
+	CK_SESSION_INFO info;
+	CK_SLOT_ID slots[32];
+	CK_ULONG count;
+	int fds[2];
+	pid_t pid;
+	int status;
+	CK_RV rv;
+
+	if (pipe (fds) < 0)
+		assert_not_reached ();
+
+	/* Another client, with a session open on its own connection */
+	pid = fork ();
+	assert (pid >= 0);
+	if (pid == 0) {
+		close (fds[0]);
+		module = p11_kit_module_load (P11_MODULE_PATH "/p11-kit-client" SHLEXT, 0);
+		if (module == NULL || p11_kit_module_initialize (module) != CKR_OK)
+			_exit (1);
+		count = 32;
+		if (module->C_GetSlotList (CK_TRUE, slots, &count) != CKR_OK ||
+		    module->C_OpenSession (slots[0], CKF_SERIAL_SESSION, NULL, NULL, &other) != CKR_OK)
+			_exit (1);
+		if (write (fds[1], &other, sizeof (other)) != sizeof (other))
+			_exit (1);
+		/* Go away without finalizing once the parent is done */
+		while (read (fds[1], &other, sizeof (other)) > 0);
+		_exit (0);
+	}
+
+	close (fds[1]);
+	assert_num_eq (sizeof (other), read (fds[0], &other, sizeof (other)));
+
+	module = p11_kit_module_load (P11_MODULE_PATH "/p11-kit-client" SHLEXT, 0);
+	assert (module != NULL);
+
+	rv = p11_kit_module_initialize (module);
+	assert (rv == CKR_OK);
+
+	/* The session of the other client is not ours */
+	rv = module->C_GetSessionInfo (other, &info);
+	assert (rv == CKR_SESSION_HANDLE_INVALID);
+
+	count = 32;
+	rv = module->C_GetSlotList (CK_TRUE, slots, &count);
+	assert (rv == CKR_OK);
+
+	rv = module->C_OpenSession (slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert (rv == CKR_OK);
+	rv = module->C_GetSessionInfo (session, &info);
+	assert (rv == CKR_OK);
+
+	/* The other client going away leaves our session alone */
+	close (fds[0]);
+	assert_num_eq (pid, waitpid (pid, &status, 0));
+	assert (WIFEXITED (status));
+	assert_num_eq (0, WEXITSTATUS (status));
+
+	rv = module->C_GetSessionInfo (session, &info);
+	assert (rv == CKR_OK);
+	rv = module->C_CloseSession (session);
+	assert (rv == CKR_OK);
+
+	rv = p11_kit_module_finalize (module);
+	assert (rv == CKR_OK);
+
+	p11_kit_module_release (module);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -284,6 +381,32 @@ main (int argc,
 		"pkcs11:?write-protected=yes",
 		1
 	};
+	struct fixture threads_with_provider = {
+		P11_MODULE_PATH "/mock-one" SHLEXT,
+		"pkcs11:",
+		1,
+		true
+	};
+	struct fixture threads_without_provider = {
+		NULL,
+		"pkcs11:",
+		3,
+		true
+	};
+	struct fixture workers_with_provider = {
+		P11_MODULE_PATH "/mock-one" SHLEXT,
+		"pkcs11:",
+		1,
+		false,
+		"2"
+	};
+	struct fixture workers_without_provider = {
+		NULL,
+		"pkcs11:",
+		3,
+		false,
+		"2"
+	};
 
 	p11_library_init ();
 	mock_module_init ();
@@ -298,5 +421,14 @@ main (int argc,
 	p11_testx (test_initialize_no_address, (void *)&without_provider, "/server/all/initialize-no-address");
 	p11_testx (test_open_session, (void *)&without_provider, "/server/all/open-session");
 
+	p11_testx (test_initialize, (void *)&threads_with_provider, "/server/threads/initialize");
+	p11_testx (test_open_session, (void *)&threads_with_provider, "/server/threads/open-session");
+	p11_testx (test_threads_isolation, (void *)&threads_with_provider, "/server/threads/isolation");
+	p11_testx (test_open_session, (void *)&threads_without_provider, "/server/threads/all/open-session");
+
+	p11_testx (test_open_session, (void *)&workers_with_provider, "/server/workers/open-session");
+	p11_testx (test_reconnect, (void *)&workers_with_provider, "/server/workers/reconnect");
+	p11_testx (test_reconnect, (void *)&workers_without_provider, "/server/workers/all/reconnect");
+
 	return p11_test_run (argc, argv);
 }
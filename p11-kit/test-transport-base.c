@@ -42,6 +42,7 @@
 #include "private.h"
 
 #include "p11-kit.h"
+#include "remote.h"
 #include "rpc.h"
 
 #include <errno.h>
@@ -51,6 +52,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <unistd.h>
 #endif
 #include <stdlib.h>
@@ -149,14 +151,11 @@ teardown_mock_module (CK_FUNCTION_LIST *module)
 
 #ifdef OS_UNIX
 
-static void
-launch_server (void)
+static int
+listen_server (void)
 {
-	int fd, nfd, rc;
-	socklen_t sa_len;
+	int fd, rc;
 	struct sockaddr_un sa;
-	fd_set fds;
-	char *argv[3];
 
 	memset (&sa, 0, sizeof (sa));
 	sa.sun_family = AF_UNIX;
@@ -174,6 +173,17 @@ launch_server (void)
 	rc = listen (fd, 1024);
 	assert_num_cmp (rc, !=, -1);
 
+	return fd;
+}
+
+static int
+accept_server (int fd)
+{
+	int nfd, rc;
+	socklen_t sa_len;
+	struct sockaddr_un sa;
+	fd_set fds;
+
 	FD_ZERO (&fds);
 	FD_SET (fd, &fds);
 	rc = select (fd + 1, &fds, NULL, NULL, NULL);
@@ -183,9 +193,20 @@ launch_server (void)
 
 	sa_len = sizeof (sa);
 	nfd = accept (fd, (struct sockaddr *)&sa, &sa_len);
-	assert_num_cmp (rc, !=, -1);
+	assert_num_cmp (nfd, !=, -1);
 	close (fd);
 
+	return nfd;
+}
+
+static void
+launch_server (int fd)
+{
+	int nfd, rc;
+	char *argv[3];
+
+	nfd = accept_server (fd);
+
 	rc = dup2 (nfd, STDIN_FILENO);
 	assert_num_cmp (rc, !=, -1);
 
@@ -200,12 +221,40 @@ launch_server (void)
 	assert_num_cmp (rc, !=, -1);
 }
 
+static CK_RV
+slow_C_Login (CK_SESSION_HANDLE session,
+              CK_USER_TYPE user_type,
+              CK_UTF8CHAR_PTR pin,
+              CK_ULONG pin_len)
+{
+	/* As if waiting for the PIN to be entered */
+	p11_sleep_ms (2000);
+
+	return mock_C_Login (session, user_type, pin, pin_len);
+}
+
 static void
-setup_remote_unix (void *unused)
+launch_slow_server (int fd)
+{
+	CK_FUNCTION_LIST module;
+	int nfd;
+
+	nfd = accept_server (fd);
+
+	memcpy (&module, &mock_module, sizeof (CK_FUNCTION_LIST));
+	module.C_Login = slow_C_Login;
+
+	p11_kit_remote_serve_module (&module, nfd, nfd);
+}
+
+static void
+setup_remote_socket (const char *scheme,
+                     void (*launch) (int))
 {
 	char *data;
 	char *path;
 	pid_t pid;
+	int fd;
 
 	test.directory = p11_test_directory ("p11-test-transport");
 	test.user_modules = p11_path_build (test.directory, "modules", NULL);
@@ -216,19 +265,25 @@ setup_remote_unix (void *unused)
 	test.user_config = p11_path_build (test.directory, "pkcs11.conf", NULL);
 	p11_test_file_write (NULL, test.user_config, data, strlen (data));
 
+	/* Listen before forking, so that connecting can't come too early */
+	fd = listen_server ();
+
 	pid = fork ();
 	switch (pid) {
 	case -1:
 		assert_not_reached ();
 		break;
 	case 0:
-		launch_server ();
-		exit (0);
+		/* Without flushing what the parent still has buffered */
+		launch (fd);
+		_exit (0);
 		break;
 	default:
 		test.pid = pid;
 	}
 
+	close (fd);
+
 	setenv ("P11_KIT_PRIVATEDIR", BUILDDIR "/p11-kit", 1);
 
 	if (asprintf (&path, "%s/pkcs11", test.directory) < 0)
@@ -237,7 +292,7 @@ setup_remote_unix (void *unused)
 	assert_ptr_not_null (data);
 	free (path);
 	path = data;
-	if (asprintf (&data, "remote: unix:path=%s\n", path) < 0)
+	if (asprintf (&data, "remote: %s:path=%s\n", scheme, path) < 0)
 		assert_not_reached ();
 	free (path);
 	p11_test_file_write (test.user_modules, "remote.module", data, strlen (data));
@@ -248,6 +303,24 @@ setup_remote_unix (void *unused)
 				       test.user_modules);
 }
 
+static void
+setup_remote_unix (void *unused)
+{
+	setup_remote_socket ("unix", launch_server);
+}
+
+static void
+setup_remote_slow (void *unused)
+{
+	setup_remote_socket ("unix", launch_slow_server);
+}
+
+static void
+setup_remote_shm (void *unused)
+{
+	setup_remote_socket ("shm", launch_server);
+}
+
 static void
 teardown_remote_unix (void *unused)
 {
@@ -348,8 +421,383 @@ test_simultaneous_functions (void)
 	p11_kit_modules_release (modules);
 }
 
+typedef struct {
+	CK_FUNCTION_LIST *module;
+	CK_SESSION_HANDLE session;
+} session_thread;
+
+static void *
+find_in_thread (void *arg)
+{
+	CK_FUNCTION_LIST *module = ((session_thread *)arg)->module;
+	CK_SESSION_HANDLE session = ((session_thread *)arg)->session;
+	CK_SESSION_INFO info;
+	CK_OBJECT_HANDLE objects[16];
+	CK_ULONG count;
+	CK_RV rv;
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		rv = (module->C_GetSessionInfo) (session, &info);
+		assert_num_eq (rv, CKR_OK);
+		assert_num_eq (MOCK_SLOT_ONE_ID, info.slotID);
+
+		rv = (module->C_FindObjectsInit) (session, NULL, 0);
+		assert_num_eq (rv, CKR_OK);
+		rv = (module->C_FindObjects) (session, objects, 16, &count);
+		assert_num_eq (rv, CKR_OK);
+		assert_num_cmp (count, >, 0);
+		rv = (module->C_FindObjectsFinal) (session);
+		assert_num_eq (rv, CKR_OK);
+	}
+
+	return NULL;
+}
+
+static void
+test_simultaneous_sessions (void)
+{
+	CK_FUNCTION_LIST **modules;
+	CK_FUNCTION_LIST *module;
+	const int num_threads = 16;
+	session_thread sessions[num_threads];
+	p11_thread_t threads[num_threads];
+	int i, ret;
+	CK_RV rv;
+
+	modules = p11_kit_modules_load (NULL, 0);
+
+	module = p11_kit_module_for_name (modules, "remote");
+	assert (module != NULL);
+
+	rv = p11_kit_module_initialize (module);
+	assert_num_eq (rv, CKR_OK);
+
+	for (i = 0; i < num_threads; i++) {
+		sessions[i].module = module;
+		rv = (module->C_OpenSession) (MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION,
+		                              NULL, NULL, &sessions[i].session);
+		assert_num_eq (rv, CKR_OK);
+	}
+
+	/* Each thread keeps its own session busy on the shared connection */
+	for (i = 0; i < num_threads; i++) {
+		ret = p11_thread_create (threads + i, find_in_thread, sessions + i);
+		assert_num_eq (0, ret);
+	}
+
+	for (i = 0; i < num_threads; i++)
+		p11_thread_join (threads[i]);
+
+	rv = (module->C_CloseAllSessions) (MOCK_SLOT_ONE_ID);
+	assert_num_eq (rv, CKR_OK);
+
+	rv = p11_kit_module_finalize (module);
+	assert_num_eq (rv, CKR_OK);
+
+	p11_kit_modules_release (modules);
+}
+
+/* Each call sends the data to the server and gets it back */
+static void
+test_encrypt_sizes (void)
+{
+	static const CK_ULONG sizes[] = { 1024, 64 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	CK_MECHANISM mech = { CKM_MOCK_CAPITALIZE, NULL, 0 };
+	CK_FUNCTION_LIST **modules;
+	CK_FUNCTION_LIST *module;
+	CK_SESSION_HANDLE session;
+	CK_SLOT_ID slots[8];
+	CK_ULONG count = 8;
+	CK_BYTE *data;
+	CK_BYTE *encrypted;
+	CK_ULONG encrypted_len;
+	CK_ULONG i;
+	CK_RV rv;
+
+	modules = p11_kit_modules_load (NULL, 0);
+
+	module = p11_kit_module_for_name (modules, "remote");
+	assert (module != NULL);
+
+	rv = p11_kit_module_initialize (module);
+	assert_num_eq (rv, CKR_OK);
+
+	rv = (module->C_GetSlotList) (CK_TRUE, slots, &count);
+	assert_num_eq (rv, CKR_OK);
+	assert_num_cmp (count, >, 0);
+
+	rv = (module->C_OpenSession) (slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert_num_eq (rv, CKR_OK);
+
+	data = malloc (sizes[3]);
+	assert_ptr_not_null (data);
+	encrypted = malloc (sizes[3]);
+	assert_ptr_not_null (encrypted);
+
+	for (i = 0; i < sizes[3]; i++)
+		data[i] = 'a' + (i % 26);
+
+	for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+		rv = (module->C_EncryptInit) (session, &mech, MOCK_PUBLIC_KEY_CAPITALIZE);
+		assert_num_eq (rv, CKR_OK);
+
+		encrypted_len = sizes[i];
+		rv = (module->C_Encrypt) (session, data, sizes[i], encrypted, &encrypted_len);
+		assert_num_eq (rv, CKR_OK);
+		assert_num_eq (encrypted_len, sizes[i]);
+
+		assert_num_eq (encrypted[0], 'A');
+		assert_num_eq (encrypted[sizes[i] - 1], 'A' + ((sizes[i] - 1) % 26));
+	}
+
+	free (data);
+	free (encrypted);
+
+	rv = p11_kit_module_finalize (module);
+	assert_num_eq (rv, CKR_OK);
+
+	p11_kit_modules_release (modules);
+}
+
 #ifdef OS_UNIX
 
+static void
+test_server_gone (void)
+{
+	CK_FUNCTION_LIST **modules;
+	CK_FUNCTION_LIST *module;
+	CK_SLOT_ID slots[8];
+	CK_ULONG count = 8;
+	CK_SLOT_INFO info;
+	CK_RV rv;
+
+	modules = p11_kit_modules_load (NULL, 0);
+
+	module = p11_kit_module_for_name (modules, "remote");
+	assert (module != NULL);
+
+	rv = p11_kit_module_initialize (module);
+	assert_num_eq (rv, CKR_OK);
+
+	rv = (module->C_GetSlotList) (CK_TRUE, slots, &count);
+	assert_num_eq (rv, CKR_OK);
+	assert_num_cmp (count, >, 0);
+
+	kill (test.pid, SIGKILL);
+	waitpid (test.pid, NULL, 0);
+
+	/* Fails instead of waiting for a response forever */
+	rv = (module->C_GetSlotInfo) (slots[0], &info);
+	assert_num_cmp (rv, !=, CKR_OK);
+
+	p11_kit_module_finalize (module);
+	p11_kit_modules_release (modules);
+}
+
+static void *
+login_in_thread (void *arg)
+{
+	CK_FUNCTION_LIST *module = ((session_thread *)arg)->module;
+	CK_SESSION_HANDLE session = ((session_thread *)arg)->session;
+	CK_RV rv;
+
+	rv = (module->C_Login) (session, CKU_USER, (CK_UTF8CHAR_PTR)"booo", 4);
+	assert_num_eq (rv, CKR_OK);
+
+	return NULL;
+}
+
+static void
+test_slow_call (void)
+{
+	CK_FUNCTION_LIST **modules;
+	CK_FUNCTION_LIST *module;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_INFO info;
+	session_thread login;
+	p11_thread_t thread;
+	CK_SLOT_ID slots[8];
+	CK_ULONG count = 8;
+	uint64_t start;
+	int ret;
+	CK_RV rv;
+
+	modules = p11_kit_modules_load (NULL, 0);
+
+	module = p11_kit_module_for_name (modules, "remote");
+	assert (module != NULL);
+
+	rv = p11_kit_module_initialize (module);
+	assert_num_eq (rv, CKR_OK);
+
+	rv = (module->C_GetSlotList) (CK_TRUE, slots, &count);
+	assert_num_eq (rv, CKR_OK);
+	assert_num_cmp (count, >, 0);
+
+	login.module = module;
+	rv = (module->C_OpenSession) (slots[0], CKF_SERIAL_SESSION, NULL, NULL, &login.session);
+	assert_num_eq (rv, CKR_OK);
+	rv = (module->C_OpenSession) (slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert_num_eq (rv, CKR_OK);
+
+	/* Nothing so far told the server that calls are made concurrently */
+	ret = p11_thread_create (&thread, login_in_thread, &login);
+	assert_num_eq (0, ret);
+	p11_sleep_ms (200);
+
+	/* Doesn't wait for the login on the other session to complete */
+	start = p11_test_time_usec ();
+	rv = (module->C_GetSessionInfo) (session, &info);
+	assert_num_eq (rv, CKR_OK);
+	assert_num_cmp (p11_test_time_usec () - start, <, 1000000);
+
+	p11_thread_join (thread);
+
+	rv = p11_kit_module_finalize (module);
+	assert_num_eq (rv, CKR_OK);
+
+	p11_kit_modules_release (modules);
+}
+
+typedef struct {
+	CK_BYTE data[32];
+	CK_ULONG data_len;
+	CK_RV rv;
+	bool done;
+} async_result;
+
+static void
+async_completed (CK_RV rv,
+                 CK_ULONG output_len,
+                 void *user_data)
+{
+	async_result *result = user_data;
+
+	assert (!result->done);
+	result->rv = rv;
+	result->data_len = output_len;
+	result->done = true;
+}
+
+static void
+test_async_calls (void)
+{
+	CK_MECHANISM decrypt = { CKM_MOCK_CAPITALIZE, NULL, 0 };
+	CK_MECHANISM sign = { CKM_MOCK_PREFIX, NULL, 0 };
+	CK_SESSION_HANDLE sessions[32];
+	async_result results[32];
+	async_result failed = { { 0, }, 0, 0, false };
+	async_result small = { { 0, }, 0, 0, false };
+	CK_SESSION_HANDLE session;
+	CK_SESSION_INFO info;
+	CK_BYTE output[32];
+	CK_ULONG output_len;
+	p11_rpc_transport *rpc;
+	p11_virtual virt;
+	struct pollfd pfd;
+	char input[16];
+	int pending;
+	int i;
+	CK_RV rv;
+
+	rpc = p11_rpc_transport_new (&virt, "|" BUILDDIR "/p11-kit/p11-kit" EXEEXT " remote "
+	                             P11_MODULE_PATH "/" MOCK_MODULE_TWO SHLEXT, "async");
+	assert_ptr_not_null (rpc);
+
+	rv = virt.funcs.C_Initialize (&virt.funcs, NULL);
+	assert_num_eq (rv, CKR_OK);
+
+	/* Each operation goes on its own session, all from this thread */
+	for (i = 0; i < 32; i++) {
+		rv = virt.funcs.C_OpenSession (&virt.funcs, MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION,
+		                               NULL, NULL, sessions + i);
+		assert_num_eq (rv, CKR_OK);
+
+		memset (results + i, 0, sizeof (async_result));
+		snprintf (input, sizeof (input), "ASYNC %d", i);
+		rv = p11_rpc_client_decrypt_async (&virt, sessions[i], &decrypt, MOCK_PRIVATE_KEY_CAPITALIZE,
+		                                   (CK_BYTE_PTR)input, strlen (input),
+		                                   results[i].data, sizeof (results[i].data),
+		                                   async_completed, results + i);
+		assert_num_eq (rv, CKR_OK);
+	}
+
+	/* Failures come through the callback, as with any other result */
+	rv = p11_rpc_client_sign_async (&virt, sessions[0], &sign, MOCK_PUBLIC_KEY_PREFIX,
+	                                (CK_BYTE_PTR)"data", 4, failed.data, sizeof (failed.data),
+	                                async_completed, &failed);
+	assert_num_eq (rv, CKR_OK);
+
+	/* An output buffer that is too small doesn't leave the operation active */
+	rv = virt.funcs.C_OpenSession (&virt.funcs, MOCK_SLOT_ONE_ID, CKF_SERIAL_SESSION,
+	                               NULL, NULL, &session);
+	assert_num_eq (rv, CKR_OK);
+	rv = p11_rpc_client_decrypt_async (&virt, session, &decrypt, MOCK_PRIVATE_KEY_CAPITALIZE,
+	                                   (CK_BYTE_PTR)"data", 4, small.data, 2,
+	                                   async_completed, &small);
+	assert_num_eq (rv, CKR_OK);
+
+	/* There is no asking for the length */
+	rv = p11_rpc_client_sign_async (&virt, sessions[0], &sign, MOCK_PRIVATE_KEY_PREFIX,
+	                                (CK_BYTE_PTR)"data", 4, NULL, 0,
+	                                async_completed, &failed);
+	assert_num_eq (rv, CKR_ARGUMENTS_BAD);
+
+	pfd.fd = p11_rpc_transport_get_fd (rpc);
+	pfd.events = POLLIN;
+	assert_num_cmp (pfd.fd, !=, -1);
+
+	/* A call that waits may come across some of the results */
+	rv = virt.funcs.C_GetSessionInfo (&virt.funcs, sessions[31], &info);
+	assert_num_eq (rv, CKR_OK);
+
+	/* That call read ahead, so what arrived is dispatched before polling */
+	for (;;) {
+		rv = p11_rpc_client_dispatch (&virt);
+		assert_num_eq (rv, CKR_OK);
+
+		pending = failed.done ? 0 : 1;
+		pending += small.done ? 0 : 1;
+		for (i = 0; i < 32; i++)
+			pending += results[i].done ? 0 : 1;
+		if (pending == 0)
+			break;
+
+		assert_num_cmp (poll (&pfd, 1, 10000), >, 0);
+	}
+
+	for (i = 0; i < 32; i++) {
+		snprintf (input, sizeof (input), "async %d", i);
+		assert_num_eq (results[i].rv, CKR_OK);
+		assert_num_eq (results[i].data_len, strlen (input));
+		assert (memcmp (results[i].data, input, strlen (input)) == 0);
+	}
+
+	assert_num_eq (failed.rv, CKR_KEY_HANDLE_INVALID);
+
+	assert_num_eq (small.rv, CKR_BUFFER_TOO_SMALL);
+	assert_num_eq (small.data_len, 4);
+	output_len = sizeof (output);
+	rv = virt.funcs.C_Decrypt (&virt.funcs, session, (CK_BYTE_PTR)"data", 4,
+	                           output, &output_len);
+	assert_num_eq (rv, CKR_OPERATION_NOT_INITIALIZED);
+
+	rv = virt.funcs.C_Finalize (&virt.funcs, NULL);
+	assert_num_eq (rv, CKR_OK);
+
+	/* Nothing left to dispatch once finalized */
+	memset (&failed, 0, sizeof (failed));
+	rv = p11_rpc_client_sign_async (&virt, sessions[0], &sign, MOCK_PRIVATE_KEY_PREFIX,
+	                                (CK_BYTE_PTR)"data", 4, failed.data, sizeof (failed.data),
+	                                async_completed, &failed);
+	assert_num_eq (rv, CKR_CRYPTOKI_NOT_INITIALIZED);
+	assert (!failed.done);
+
+	p11_virtual_uninit (&virt);
+	p11_rpc_transport_free (rpc);
+}
+
 static void
 test_fork_and_reinitialize (void)
 {
@@ -433,9 +881,12 @@ main (int argc,
 	p11_test (test_basic_exec, "/transport/basic");
 	p11_test (test_basic_exec_with_init_arg, "/transport/init-arg");
 	p11_test (test_simultaneous_functions, "/transport/simultaneous-functions");
+	p11_test (test_simultaneous_sessions, "/transport/simultaneous-sessions");
+	p11_test (test_encrypt_sizes, "/transport/encrypt-sizes");
 
 #ifdef OS_UNIX
 	p11_test (test_fork_and_reinitialize, "/transport/fork-and-reinitialize");
+	p11_test (test_async_calls, "/transport/async-calls");
 #endif
 
 	test_mock_add_tests (TEST_PREFIX, TEST_VERSION);
@@ -443,6 +894,16 @@ main (int argc,
 #ifdef OS_UNIX
 	p11_fixture (setup_remote_unix, teardown_remote_unix);
 	p11_test (test_basic_exec, "/transport/unix/basic");
+	p11_test (test_encrypt_sizes, "/transport/unix/encrypt-sizes");
+
+	p11_fixture (setup_remote_slow, teardown_remote_unix);
+	p11_test (test_slow_call, "/transport/unix/slow-call");
+
+	p11_fixture (setup_remote_shm, teardown_remote_unix);
+	p11_test (test_basic_exec, "/transport/shm/basic");
+	p11_test (test_simultaneous_functions, "/transport/shm/simultaneous-functions");
+	p11_test (test_server_gone, "/transport/shm/server-gone");
+	p11_test (test_encrypt_sizes, "/transport/shm/encrypt-sizes");
 #endif
 
 	return  p11_test_run (argc, argv);
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2026, Red Hat Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "config.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "digest.h"
+
+/*
+ * Times hashing certificate sized inputs, as the trust module does when
+ * it loads them, with each of the transforms built in. Not run as part
+ * of the tests, as the numbers are only useful when compared with other
+ * runs on the same machine.
+ */
+
+#define BENCH_CERTS 2000
+#define BENCH_CERT_LEN 1536
+
+static uint64_t
+bench_digest (void (* digest) (unsigned char *, const void *, size_t, ...),
+              unsigned char *hashes,
+              size_t hash_len,
+              const unsigned char *data)
+{
+	uint64_t start;
+	int i;
+
+	start = p11_test_time_usec ();
+	for (i = 0; i < BENCH_CERTS; i++)
+		digest (hashes + i * hash_len, data + i * BENCH_CERT_LEN, (size_t)BENCH_CERT_LEN, NULL);
+	return p11_test_time_usec () - start;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	struct {
+		int which;
+		const char *name;
+	} transforms[] = {
+		{ P11_DIGEST_PORTABLE, "portable" },
+		{ P11_DIGEST_ACCELERATED, "accelerated" },
+	};
+	unsigned char *hashes;
+	unsigned char *data;
+	size_t i;
+
+	if (argc != 1) {
+		fprintf (stderr, "usage: bench-digest\n");
+		return 2;
+	}
+
+	data = malloc (BENCH_CERTS * BENCH_CERT_LEN);
+	hashes = malloc (BENCH_CERTS * P11_DIGEST_SHA256_LEN);
+	assert (data != NULL && hashes != NULL);
+
+	for (i = 0; i < BENCH_CERTS * BENCH_CERT_LEN; i++)
+		data[i] = i & 0xff;
+
+	for (i = 0; i < sizeof (transforms) / sizeof (transforms[0]); i++) {
+		if (!p11_digest_transforms (transforms[i].which)) {
+			printf ("%s: not available\n", transforms[i].name);
+			continue;
+		}
+
+		printf ("%s sha1: %d x %d bytes: %llu usec\n",
+		        transforms[i].name, BENCH_CERTS, BENCH_CERT_LEN,
+		        (unsigned long long)bench_digest (p11_digest_sha1, hashes,
+		                                          P11_DIGEST_SHA1_LEN, data));
+		printf ("%s sha256: %d x %d bytes: %llu usec\n",
+		        transforms[i].name, BENCH_CERTS, BENCH_CERT_LEN,
+		        (unsigned long long)bench_digest (p11_digest_sha256, hashes,
+		                                          P11_DIGEST_SHA256_LEN, data));
+	}
+
+	p11_digest_transforms (P11_DIGEST_DEFAULT);
+	free (data);
+	free (hashes);
+	return 0;
+}
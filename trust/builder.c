@@ -64,10 +64,21 @@
 
 #define ELEMS(x) (sizeof (x) / sizeof (x[0]))
 
+/* Extensions looked up for each certificate, see lookup_extension() */
+static const unsigned char *extension_oids[] = {
+	P11_OID_BASIC_CONSTRAINTS,
+	P11_OID_KEY_USAGE,
+	P11_OID_EXTENDED_KEY_USAGE,
+	P11_OID_OPENSSL_REJECT,
+};
+
 struct _p11_builder {
 	p11_asn1_cache *asn1_cache;
 	p11_dict *asn1_defs;
 	int flags;
+
+	/* The templates to find the extensions above, hashed once */
+	unsigned int extension_hashes[ELEMS (extension_oids)][3];
 };
 
 enum {
@@ -129,6 +140,9 @@ lookup_extension (p11_builder *builder,
 	size_t length;
 	asn1_node node;
 
+	const unsigned int *hashes = NULL;
+	int i;
+
 	CK_ATTRIBUTE match[] = {
 		{ CKA_PUBLIC_KEY_INFO, },
 		{ CKA_OBJECT_ID, (void *)oid, p11_oid_length (oid) },
@@ -142,7 +156,14 @@ lookup_extension (p11_builder *builder,
 	/* Look for an attached certificate extension */
 	if (public_key != NULL) {
 		memcpy (match, public_key, sizeof (CK_ATTRIBUTE));
-		obj = p11_index_find (index, match, -1);
+
+		/* The public key isn't indexed, so the hashes hold for any */
+		for (i = 0; i < ELEMS (extension_oids); i++) {
+			if (extension_oids[i] == oid)
+				hashes = builder->extension_hashes[i];
+		}
+
+		obj = p11_index_find_hashed (index, match, -1, hashes);
 		attrs = p11_index_lookup (index, obj);
 		if (attrs != NULL) {
 			value = p11_attrs_find_value (attrs, CKA_VALUE, &length);
@@ -190,7 +211,9 @@ lookup_related  (p11_index *index,
 p11_builder *
 p11_builder_new (int flags)
 {
+	CK_OBJECT_CLASS klass = CKO_X_CERTIFICATE_EXTENSION;
 	p11_builder *builder;
+	int i;
 
 	builder = calloc (1, sizeof (p11_builder));
 	return_val_if_fail (builder != NULL, NULL);
@@ -202,6 +225,16 @@ p11_builder_new (int flags)
 	}
 	builder->asn1_defs = p11_asn1_cache_defs (builder->asn1_cache);
 
+	for (i = 0; i < ELEMS (extension_oids); i++) {
+		CK_ATTRIBUTE match[] = {
+			{ CKA_PUBLIC_KEY_INFO, },
+			{ CKA_OBJECT_ID, (void *)extension_oids[i], p11_oid_length (extension_oids[i]) },
+			{ CKA_CLASS, &klass, sizeof (klass) },
+		};
+
+		p11_index_hash_template (match, ELEMS (match), builder->extension_hashes[i]);
+	}
+
 	builder->flags = flags;
 	return builder;
 }
@@ -707,6 +740,7 @@ certificate_value_attrs (p11_builder *builder,
                          CK_ATTRIBUTE *public_key)
 {
 	unsigned char checksum[P11_DIGEST_SHA1_LEN];
+	unsigned char fingerprint[P11_DIGEST_SHA256_LEN];
 	unsigned char *keyid = NULL;
 	size_t keyid_len;
 	unsigned char *ext = NULL;
@@ -725,6 +759,7 @@ certificate_value_attrs (p11_builder *builder,
 	CK_ATTRIBUTE hash_of_issuer_public_key = { CKA_HASH_OF_ISSUER_PUBLIC_KEY, "", 0 };
 	CK_ATTRIBUTE java_midp_security_domain = { CKA_JAVA_MIDP_SECURITY_DOMAIN, &zero, sizeof (zero) };
 	CK_ATTRIBUTE check_value = { CKA_CHECK_VALUE, &checkv, sizeof (checkv) };
+	CK_ATTRIBUTE sha256_hash = { CKA_X_CERT_SHA256_HASH, fingerprint, sizeof (fingerprint) };
 	CK_ATTRIBUTE start_date = { CKA_START_DATE, &startv, sizeof (startv) };
 	CK_ATTRIBUTE end_date = { CKA_END_DATE, &endv, sizeof (endv) };
 	CK_ATTRIBUTE subject = { CKA_SUBJECT, };
@@ -740,6 +775,11 @@ certificate_value_attrs (p11_builder *builder,
 	else
 		calc_check_value (der, der_len, checkv);
 
+	if (der == NULL || der_len == 0)
+		sha256_hash.type = CKA_INVALID;
+	else
+		p11_digest_sha256 (fingerprint, der, der_len, NULL);
+
 	if (!calc_date (node, "tbsCertificate.validity.notBefore", &startv))
 		start_date.ulValueLen = 0;
 	if (!calc_date (node, "tbsCertificate.validity.notAfter", &endv))
@@ -793,7 +833,7 @@ certificate_value_attrs (p11_builder *builder,
 
 	attrs = p11_attrs_build (attrs, &trusted, &distrusted, &url, &hash_of_issuer_public_key,
 	                         &hash_of_subject_public_key, &java_midp_security_domain,
-	                         &check_value, &start_date, &end_date, &id,
+	                         &check_value, &sha256_hash, &start_date, &end_date, &id,
 	                         &subject, &issuer, &serial_number, &label, public_key,
 				 NULL);
 	return_val_if_fail (attrs != NULL, NULL);
@@ -875,6 +915,34 @@ certificate_validate (p11_builder *builder,
 	return CKR_OK;
 }
 
+static bool
+certificate_check_fingerprint (CK_ATTRIBUTE *attrs,
+                               CK_ATTRIBUTE *merge)
+{
+	unsigned char fingerprint[P11_DIGEST_SHA256_LEN];
+	CK_ATTRIBUTE *hash;
+	CK_ATTRIBUTE *value;
+
+	/*
+	 * The fingerprint can only be set when loading from our store, and
+	 * then it must be the one computed from the certificate value.
+	 */
+
+	hash = p11_attrs_find (merge, CKA_X_CERT_SHA256_HASH);
+	if (hash == NULL)
+		return true;
+
+	value = p11_attrs_find_valid (merge, CKA_VALUE);
+	if (value == NULL)
+		value = p11_attrs_find_valid (attrs, CKA_VALUE);
+	if (value == NULL || value->ulValueLen == 0 ||
+	    hash->ulValueLen != P11_DIGEST_SHA256_LEN)
+		return false;
+
+	p11_digest_sha256 (fingerprint, value->pValue, value->ulValueLen, NULL);
+	return memcmp (fingerprint, hash->pValue, P11_DIGEST_SHA256_LEN) == 0;
+}
+
 const static builder_schema certificate_schema = {
 	NORMAL_BUILD,
 	{ COMMON_ATTRS,
@@ -886,6 +954,7 @@ const static builder_schema certificate_schema = {
 	  { CKA_NSS_EMAIL_DISTRUST_AFTER, CREATE | WANT, type_false_or_time },
 	  { CKA_CERTIFICATE_CATEGORY, CREATE | WANT, type_ulong },
 	  { CKA_CHECK_VALUE, CREATE | WANT, },
+	  { CKA_X_CERT_SHA256_HASH, WANT },
 	  { CKA_START_DATE, CREATE | MODIFY | WANT, type_date },
 	  { CKA_END_DATE, CREATE | MODIFY | WANT, type_date },
 	  { CKA_SUBJECT, CREATE | WANT, type_der_name },
@@ -1208,6 +1277,11 @@ p11_builder_build (void *bilder,
 			p11_message (_("missing %s on object"), type_name (CKA_CERTIFICATE_TYPE));
 			return CKR_TEMPLATE_INCOMPLETE;
 		} else if (type == CKC_X_509) {
+			if (!certificate_check_fingerprint (attrs, merge)) {
+				p11_message (_("the %s attribute does not match the certificate"),
+				             type_name (CKA_X_CERT_SHA256_HASH));
+				return CKR_ATTRIBUTE_VALUE_INVALID;
+			}
 			return build_for_schema (builder, index, &certificate_schema, attrs, merge, populate);
 		} else {
 			p11_message (_("%s unsupported %s"), value_name (p11_constant_certs, type),
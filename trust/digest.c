@@ -32,6 +32,7 @@
 
 #include "config.h"
 
+#include "debug.h"
 #include "digest.h"
 
 #include <assert.h>
@@ -39,6 +40,38 @@
 #include <stdint.h>
 #include <string.h>
 
+/*
+ * SHA-1 and SHA-256 have dedicated instructions on recent x86 (SHA-NI) and ARMv8
+ * (crypto extensions). The instructions are used when cpuid says they are
+ * present on x86, or the hardware capabilities the kernel passes say so on
+ * ARM. Otherwise we fall back to the portable implementation below.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define WITH_SHA_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(HAVE_GETAUXVAL) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8))
+#define WITH_SHA_ARM 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifdef __clang__
+#define SHA_ARM_TARGET __attribute__((target ("crypto")))
+#else
+#define SHA_ARM_TARGET __attribute__((target ("+crypto")))
+#endif
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
 #ifdef WITH_FREEBL
 
 /*
@@ -55,6 +88,7 @@
 typedef enum {
 	HASH_AlgMD5    = 2,
 	HASH_AlgSHA1   = 3,
+	HASH_AlgSHA256 = 4,
 } HASH_HashType;
 
 typedef struct NSSLOWInitContextStr NSSLOWInitContext;
@@ -77,10 +111,15 @@ void NSSLOWHASH_Destroy(NSSLOWHASHContext *context);
 
 #define SHA1_BLOCK_LENGTH 64U
 
+typedef void (* sha1_transform_func) (uint32_t state[5],
+                                      const unsigned char *data,
+                                      size_t blocks);
+
 typedef struct {
 	uint32_t state[5];
 	uint32_t count[2];
 	unsigned char buffer[SHA1_BLOCK_LENGTH];
+	sha1_transform_func transform;
 } sha1_t;
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -197,6 +236,366 @@ transform_sha1 (uint32_t state[5],
 }
 
 
+static void
+transform_sha1_portable (uint32_t state[5],
+                         const unsigned char *data,
+                         size_t blocks)
+{
+	while (blocks-- > 0) {
+		transform_sha1 (state, data);
+		data += SHA1_BLOCK_LENGTH;
+	}
+}
+
+#ifdef WITH_SHA_X86
+
+/*
+ * Four SHA-1 rounds with the SHA-NI instructions, while expanding the
+ * message schedule for later rounds. The message words rotate through
+ * four registers and the E values alternate between two.
+ */
+#define SHANI_ROUNDS(e_next, e_prev, m0, m1, m2, m3, func) \
+	e_next = _mm_sha1nexte_epu32 (e_next, m0); \
+	e_prev = abcd; \
+	m1 = _mm_sha1msg2_epu32 (m1, m0); \
+	abcd = _mm_sha1rnds4_epu32 (abcd, e_next, func); \
+	m3 = _mm_sha1msg1_epu32 (m3, m0); \
+	m2 = _mm_xor_si128 (m2, m0);
+
+__attribute__((target ("sha,ssse3,sse4.1")))
+static void
+transform_sha1_x86 (uint32_t state[5],
+                    const unsigned char *data,
+                    size_t blocks)
+{
+	__m128i abcd, abcd_save, e0, e0_save, e1;
+	__m128i msg0, msg1, msg2, msg3;
+	const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+	                                     0x08090a0b0c0d0e0fULL);
+
+	abcd = _mm_loadu_si128 ((const __m128i *)state);
+	abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+	e0 = _mm_set_epi32 ((int)state[4], 0, 0, 0);
+
+	while (blocks-- > 0) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		/* Rounds 0-3 */
+		msg0 = _mm_loadu_si128 ((const __m128i *)(data + 0));
+		msg0 = _mm_shuffle_epi8 (msg0, mask);
+		e0 = _mm_add_epi32 (e0, msg0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+
+		/* Rounds 4-7 */
+		msg1 = _mm_loadu_si128 ((const __m128i *)(data + 16));
+		msg1 = _mm_shuffle_epi8 (msg1, mask);
+		e1 = _mm_sha1nexte_epu32 (e1, msg1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+		msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+
+		/* Rounds 8-11 */
+		msg2 = _mm_loadu_si128 ((const __m128i *)(data + 32));
+		msg2 = _mm_shuffle_epi8 (msg2, mask);
+		e0 = _mm_sha1nexte_epu32 (e0, msg2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+		msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+		msg0 = _mm_xor_si128 (msg0, msg2);
+
+		/* Rounds 12-15 */
+		msg3 = _mm_loadu_si128 ((const __m128i *)(data + 48));
+		msg3 = _mm_shuffle_epi8 (msg3, mask);
+		e1 = _mm_sha1nexte_epu32 (e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+		msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+		msg1 = _mm_xor_si128 (msg1, msg3);
+
+		/* Rounds 16-63 */
+		SHANI_ROUNDS (e0, e1, msg0, msg1, msg2, msg3, 0);
+		SHANI_ROUNDS (e1, e0, msg1, msg2, msg3, msg0, 1);
+		SHANI_ROUNDS (e0, e1, msg2, msg3, msg0, msg1, 1);
+		SHANI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 1);
+		SHANI_ROUNDS (e0, e1, msg0, msg1, msg2, msg3, 1);
+		SHANI_ROUNDS (e1, e0, msg1, msg2, msg3, msg0, 1);
+		SHANI_ROUNDS (e0, e1, msg2, msg3, msg0, msg1, 2);
+		SHANI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 2);
+		SHANI_ROUNDS (e0, e1, msg0, msg1, msg2, msg3, 2);
+		SHANI_ROUNDS (e1, e0, msg1, msg2, msg3, msg0, 2);
+		SHANI_ROUNDS (e0, e1, msg2, msg3, msg0, msg1, 2);
+		SHANI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 3);
+
+		/* Rounds 64-67 */
+		e0 = _mm_sha1nexte_epu32 (e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32 (abcd, e0, 3);
+		msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+		msg2 = _mm_xor_si128 (msg2, msg0);
+
+		/* Rounds 68-71 */
+		e1 = _mm_sha1nexte_epu32 (e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+		msg3 = _mm_xor_si128 (msg3, msg1);
+
+		/* Rounds 72-75 */
+		e0 = _mm_sha1nexte_epu32 (e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32 (abcd, e0, 3);
+
+		/* Rounds 76-79 */
+		e1 = _mm_sha1nexte_epu32 (e1, msg3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+
+		/* Add the working vars back into the state */
+		e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+		abcd = _mm_add_epi32 (abcd, abcd_save);
+
+		data += SHA1_BLOCK_LENGTH;
+	}
+
+	abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+	_mm_storeu_si128 ((__m128i *)state, abcd);
+	state[4] = (uint32_t)_mm_extract_epi32 (e0, 3);
+}
+
+static bool
+have_sha_x86 (void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return false;
+	if (__get_cpuid_max (0, NULL) < 7)
+		return false;
+
+	/* Structured extended feature flags, EBX bit 29 is SHA */
+	__cpuid_count (7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1U << 29)) != 0;
+}
+
+#endif /* WITH_SHA_X86 */
+
+#ifdef WITH_SHA_ARM
+
+static bool
+have_sha_arm (unsigned long hwcap)
+{
+	return (getauxval (AT_HWCAP) & hwcap) == hwcap;
+}
+
+SHA_ARM_TARGET
+static void
+transform_sha1_arm (uint32_t state[5],
+                    const unsigned char *data,
+                    size_t blocks)
+{
+	uint32x4_t abcd, abcd_save, msg0, msg1, msg2, msg3, tmp0, tmp1;
+	uint32_t e0, e0_save, e1;
+	const uint32x4_t k0 = vdupq_n_u32 (0x5A827999);
+	const uint32x4_t k1 = vdupq_n_u32 (0x6ED9EBA1);
+	const uint32x4_t k2 = vdupq_n_u32 (0x8F1BBCDC);
+	const uint32x4_t k3 = vdupq_n_u32 (0xCA62C1D6);
+
+	abcd = vld1q_u32 (state);
+	e0 = state[4];
+
+	while (blocks-- > 0) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		msg0 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 0)));
+		msg1 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 16)));
+		msg2 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 32)));
+		msg3 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 48)));
+
+		tmp0 = vaddq_u32 (msg0, k0);
+		tmp1 = vaddq_u32 (msg1, k0);
+
+		/* Rounds 0-3 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1cq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg2, k0);
+		msg0 = vsha1su0q_u32 (msg0, msg1, msg2);
+
+		/* Rounds 4-7 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1cq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg3, k0);
+		msg0 = vsha1su1q_u32 (msg0, msg3);
+		msg1 = vsha1su0q_u32 (msg1, msg2, msg3);
+
+		/* Rounds 8-11 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1cq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg0, k0);
+		msg1 = vsha1su1q_u32 (msg1, msg0);
+		msg2 = vsha1su0q_u32 (msg2, msg3, msg0);
+
+		/* Rounds 12-15 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1cq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg1, k1);
+		msg2 = vsha1su1q_u32 (msg2, msg1);
+		msg3 = vsha1su0q_u32 (msg3, msg0, msg1);
+
+		/* Rounds 16-19 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1cq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg2, k1);
+		msg3 = vsha1su1q_u32 (msg3, msg2);
+		msg0 = vsha1su0q_u32 (msg0, msg1, msg2);
+
+		/* Rounds 20-23 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg3, k1);
+		msg0 = vsha1su1q_u32 (msg0, msg3);
+		msg1 = vsha1su0q_u32 (msg1, msg2, msg3);
+
+		/* Rounds 24-27 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg0, k1);
+		msg1 = vsha1su1q_u32 (msg1, msg0);
+		msg2 = vsha1su0q_u32 (msg2, msg3, msg0);
+
+		/* Rounds 28-31 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg1, k1);
+		msg2 = vsha1su1q_u32 (msg2, msg1);
+		msg3 = vsha1su0q_u32 (msg3, msg0, msg1);
+
+		/* Rounds 32-35 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg2, k2);
+		msg3 = vsha1su1q_u32 (msg3, msg2);
+		msg0 = vsha1su0q_u32 (msg0, msg1, msg2);
+
+		/* Rounds 36-39 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg3, k2);
+		msg0 = vsha1su1q_u32 (msg0, msg3);
+		msg1 = vsha1su0q_u32 (msg1, msg2, msg3);
+
+		/* Rounds 40-43 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1mq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg0, k2);
+		msg1 = vsha1su1q_u32 (msg1, msg0);
+		msg2 = vsha1su0q_u32 (msg2, msg3, msg0);
+
+		/* Rounds 44-47 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1mq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg1, k2);
+		msg2 = vsha1su1q_u32 (msg2, msg1);
+		msg3 = vsha1su0q_u32 (msg3, msg0, msg1);
+
+		/* Rounds 48-51 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1mq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg2, k2);
+		msg3 = vsha1su1q_u32 (msg3, msg2);
+		msg0 = vsha1su0q_u32 (msg0, msg1, msg2);
+
+		/* Rounds 52-55 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1mq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg3, k3);
+		msg0 = vsha1su1q_u32 (msg0, msg3);
+		msg1 = vsha1su0q_u32 (msg1, msg2, msg3);
+
+		/* Rounds 56-59 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1mq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg0, k3);
+		msg1 = vsha1su1q_u32 (msg1, msg0);
+		msg2 = vsha1su0q_u32 (msg2, msg3, msg0);
+
+		/* Rounds 60-63 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg1, k3);
+		msg2 = vsha1su1q_u32 (msg2, msg1);
+		msg3 = vsha1su0q_u32 (msg3, msg0, msg1);
+
+		/* Rounds 64-67 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e0, tmp0);
+		tmp0 = vaddq_u32 (msg2, k3);
+		msg3 = vsha1su1q_u32 (msg3, msg2);
+
+		/* Rounds 68-71 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e1, tmp1);
+		tmp1 = vaddq_u32 (msg3, k3);
+
+		/* Rounds 72-75 */
+		e1 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e0, tmp0);
+
+		/* Rounds 76-79 */
+		e0 = vsha1h_u32 (vgetq_lane_u32 (abcd, 0));
+		abcd = vsha1pq_u32 (abcd, e1, tmp1);
+
+		/* Add the working vars back into the state */
+		e0 += e0_save;
+		abcd = vaddq_u32 (abcd_save, abcd);
+
+		data += SHA1_BLOCK_LENGTH;
+	}
+
+	vst1q_u32 (state, abcd);
+	state[4] = e0;
+}
+
+#endif /* WITH_SHA_ARM */
+
+/* Resolving twice from racing threads gives the same answer */
+static sha1_transform_func sha1_resolved = NULL;
+
+static sha1_transform_func
+sha1_transform_accelerated (void)
+{
+#if defined(WITH_SHA_X86)
+	if (have_sha_x86 ())
+		return transform_sha1_x86;
+#elif defined(WITH_SHA_ARM)
+	if (have_sha_arm (HWCAP_SHA1))
+		return transform_sha1_arm;
+#endif
+	return NULL;
+}
+
+static sha1_transform_func
+sha1_transform_resolve (void)
+{
+	sha1_transform_func resolved = sha1_resolved;
+
+	if (resolved)
+		return resolved;
+
+	resolved = sha1_transform_accelerated ();
+	if (!resolved)
+		resolved = transform_sha1_portable;
+	sha1_resolved = resolved;
+	return resolved;
+}
+
 /*!
  * isc_sha1_init - Initialize new context
  */
@@ -213,6 +612,7 @@ sha1_init (sha1_t *context)
 	context->state[4] = 0xC3D2E1F0;
 	context->count[0] = 0;
 	context->count[1] = 0;
+	context->transform = sha1_transform_resolve ();
 }
 
 static void
@@ -229,7 +629,7 @@ sha1_update(sha1_t *context,
             const unsigned char *data,
             unsigned int len)
 {
-	unsigned int i, j;
+	unsigned int i, j, blocks;
 
 	assert (context != 0);
 	assert (data != 0);
@@ -240,9 +640,12 @@ sha1_update(sha1_t *context,
 	j = (j >> 3) & 63;
 	if ((j + len) > 63) {
 		(void)memcpy(&context->buffer[j], data, (i = 64 - j));
-		transform_sha1 (context->state, context->buffer);
-		for (; i + 63 < len; i += 64)
-			transform_sha1 (context->state, &data[i]);
+		(context->transform) (context->state, context->buffer, 1);
+		blocks = (len - i) / 64;
+		if (blocks > 0) {
+			(context->transform) (context->state, &data[i], blocks);
+			i += blocks * 64;
+		}
 		j = 0;
 	} else {
 		i = 0;
@@ -360,6 +763,458 @@ p11_digest_sha1 (unsigned char *hash,
 }
 
 
+
+/*
+ * SHA-256 as described in FIPS 180-4. The portable block function is
+ * a straightforward rendering of the specification.
+ */
+
+#define SHA256_BLOCK_LENGTH 64U
+
+typedef void (* sha256_transform_func) (uint32_t state[8],
+                                        const unsigned char *data,
+                                        size_t blocks);
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char buffer[SHA256_BLOCK_LENGTH];
+	sha256_transform_func transform;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+#define SHA256_CH(x,y,z)  (((x) & (y)) ^ (~(x) & (z)))
+#define SHA256_MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define SHA256_S0(x)      (ror (x, 2) ^ ror (x, 13) ^ ror (x, 22))
+#define SHA256_S1(x)      (ror (x, 6) ^ ror (x, 11) ^ ror (x, 25))
+#define SHA256_G0(x)      (ror (x, 7) ^ ror (x, 18) ^ ((x) >> 3))
+#define SHA256_G1(x)      (ror (x, 17) ^ ror (x, 19) ^ ((x) >> 10))
+
+static void
+transform_sha256_portable (uint32_t state[8],
+                           const unsigned char *data,
+                           size_t blocks)
+{
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	uint32_t w[64];
+	int i;
+
+	while (blocks-- > 0) {
+		for (i = 0; i < 16; i++) {
+			w[i] = (uint32_t)data[i * 4] << 24 |
+			       (uint32_t)data[i * 4 + 1] << 16 |
+			       (uint32_t)data[i * 4 + 2] << 8 |
+			       (uint32_t)data[i * 4 + 3];
+		}
+		for (i = 16; i < 64; i++)
+			w[i] = SHA256_G1 (w[i - 2]) + w[i - 7] + SHA256_G0 (w[i - 15]) + w[i - 16];
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + SHA256_S1 (e) + SHA256_CH (e, f, g) + sha256_k[i] + w[i];
+			t2 = SHA256_S0 (a) + SHA256_MAJ (a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	memset (w, 0, sizeof (w));
+}
+
+#ifdef WITH_SHA_X86
+
+/*
+ * Four SHA-256 rounds with the SHA-NI instructions. The message words
+ * rotate through four registers, and while each quad is consumed the
+ * schedule for later rounds is extended.
+ */
+#define SHANI256_ROUNDS(i, m0, m1, m3) \
+	msg = _mm_add_epi32 (m0, _mm_loadu_si128 ((const __m128i *)(sha256_k + i))); \
+	state1 = _mm_sha256rnds2_epu32 (state1, state0, msg); \
+	tmp = _mm_alignr_epi8 (m0, m3, 4); \
+	m1 = _mm_add_epi32 (m1, tmp); \
+	m1 = _mm_sha256msg2_epu32 (m1, m0); \
+	msg = _mm_shuffle_epi32 (msg, 0x0E); \
+	state0 = _mm_sha256rnds2_epu32 (state0, state1, msg); \
+	m3 = _mm_sha256msg1_epu32 (m3, m0);
+
+#define SHANI256_LOAD(i, m) \
+	m = _mm_loadu_si128 ((const __m128i *)(data + i * 4)); \
+	m = _mm_shuffle_epi8 (m, mask); \
+	msg = _mm_add_epi32 (m, _mm_loadu_si128 ((const __m128i *)(sha256_k + i))); \
+	state1 = _mm_sha256rnds2_epu32 (state1, state0, msg); \
+	msg = _mm_shuffle_epi32 (msg, 0x0E); \
+	state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);
+
+__attribute__((target ("sha,ssse3,sse4.1")))
+static void
+transform_sha256_x86 (uint32_t state[8],
+                      const unsigned char *data,
+                      size_t blocks)
+{
+	__m128i state0, state1, abef_save, cdgh_save;
+	__m128i msg, tmp, msg0, msg1, msg2, msg3;
+	const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+	                                     0x0405060700010203ULL);
+
+	/* The instructions want the state as ABEF and CDGH */
+	tmp = _mm_loadu_si128 ((const __m128i *)(state + 0));
+	state1 = _mm_loadu_si128 ((const __m128i *)(state + 4));
+	tmp = _mm_shuffle_epi32 (tmp, 0xB1);
+	state1 = _mm_shuffle_epi32 (state1, 0x1B);
+	state0 = _mm_alignr_epi8 (tmp, state1, 8);
+	state1 = _mm_blend_epi16 (state1, tmp, 0xF0);
+
+	while (blocks-- > 0) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		/* Rounds 0-11 */
+		SHANI256_LOAD (0, msg0);
+		SHANI256_LOAD (4, msg1);
+		msg0 = _mm_sha256msg1_epu32 (msg0, msg1);
+		SHANI256_LOAD (8, msg2);
+		msg1 = _mm_sha256msg1_epu32 (msg1, msg2);
+
+		/* Rounds 12-15 */
+		msg3 = _mm_loadu_si128 ((const __m128i *)(data + 48));
+		msg3 = _mm_shuffle_epi8 (msg3, mask);
+		SHANI256_ROUNDS (12, msg3, msg0, msg2);
+
+		/* Rounds 16-51 */
+		SHANI256_ROUNDS (16, msg0, msg1, msg3);
+		SHANI256_ROUNDS (20, msg1, msg2, msg0);
+		SHANI256_ROUNDS (24, msg2, msg3, msg1);
+		SHANI256_ROUNDS (28, msg3, msg0, msg2);
+		SHANI256_ROUNDS (32, msg0, msg1, msg3);
+		SHANI256_ROUNDS (36, msg1, msg2, msg0);
+		SHANI256_ROUNDS (40, msg2, msg3, msg1);
+		SHANI256_ROUNDS (44, msg3, msg0, msg2);
+		SHANI256_ROUNDS (48, msg0, msg1, msg3);
+
+		/* Rounds 52-55 */
+		msg = _mm_add_epi32 (msg1, _mm_loadu_si128 ((const __m128i *)(sha256_k + 52)));
+		state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+		tmp = _mm_alignr_epi8 (msg1, msg0, 4);
+		msg2 = _mm_add_epi32 (msg2, tmp);
+		msg2 = _mm_sha256msg2_epu32 (msg2, msg1);
+		msg = _mm_shuffle_epi32 (msg, 0x0E);
+		state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);
+
+		/* Rounds 56-59 */
+		msg = _mm_add_epi32 (msg2, _mm_loadu_si128 ((const __m128i *)(sha256_k + 56)));
+		state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+		tmp = _mm_alignr_epi8 (msg2, msg1, 4);
+		msg3 = _mm_add_epi32 (msg3, tmp);
+		msg3 = _mm_sha256msg2_epu32 (msg3, msg2);
+		msg = _mm_shuffle_epi32 (msg, 0x0E);
+		state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);
+
+		/* Rounds 60-63 */
+		msg = _mm_add_epi32 (msg3, _mm_loadu_si128 ((const __m128i *)(sha256_k + 60)));
+		state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+		msg = _mm_shuffle_epi32 (msg, 0x0E);
+		state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);
+
+		state0 = _mm_add_epi32 (state0, abef_save);
+		state1 = _mm_add_epi32 (state1, cdgh_save);
+
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	/* Back to ABCD and EFGH */
+	tmp = _mm_shuffle_epi32 (state0, 0x1B);
+	state1 = _mm_shuffle_epi32 (state1, 0xB1);
+	state0 = _mm_blend_epi16 (tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8 (state1, tmp, 8);
+
+	_mm_storeu_si128 ((__m128i *)(state + 0), state0);
+	_mm_storeu_si128 ((__m128i *)(state + 4), state1);
+}
+
+#endif /* WITH_SHA_X86 */
+
+#ifdef WITH_SHA_ARM
+
+/*
+ * Four SHA-256 rounds with the ARMv8 instructions, extending the
+ * message schedule while the first 48 rounds are run.
+ */
+#define ARM256_ROUNDS(i, m0, m1, m2, m3) \
+	tmp = vaddq_u32 (m0, vld1q_u32 (sha256_k + i)); \
+	abcd_prev = abcd; \
+	if (i < 48) m0 = vsha256su0q_u32 (m0, m1); \
+	abcd = vsha256hq_u32 (abcd, efgh, tmp); \
+	efgh = vsha256h2q_u32 (efgh, abcd_prev, tmp); \
+	if (i < 48) m0 = vsha256su1q_u32 (m0, m2, m3);
+
+SHA_ARM_TARGET
+static void
+transform_sha256_arm (uint32_t state[8],
+                      const unsigned char *data,
+                      size_t blocks)
+{
+	uint32x4_t abcd, efgh, abcd_save, efgh_save, abcd_prev, tmp;
+	uint32x4_t msg0, msg1, msg2, msg3;
+
+	abcd = vld1q_u32 (state + 0);
+	efgh = vld1q_u32 (state + 4);
+
+	while (blocks-- > 0) {
+		abcd_save = abcd;
+		efgh_save = efgh;
+
+		msg0 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 0)));
+		msg1 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 16)));
+		msg2 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 32)));
+		msg3 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 48)));
+
+		ARM256_ROUNDS (0, msg0, msg1, msg2, msg3);
+		ARM256_ROUNDS (4, msg1, msg2, msg3, msg0);
+		ARM256_ROUNDS (8, msg2, msg3, msg0, msg1);
+		ARM256_ROUNDS (12, msg3, msg0, msg1, msg2);
+		ARM256_ROUNDS (16, msg0, msg1, msg2, msg3);
+		ARM256_ROUNDS (20, msg1, msg2, msg3, msg0);
+		ARM256_ROUNDS (24, msg2, msg3, msg0, msg1);
+		ARM256_ROUNDS (28, msg3, msg0, msg1, msg2);
+		ARM256_ROUNDS (32, msg0, msg1, msg2, msg3);
+		ARM256_ROUNDS (36, msg1, msg2, msg3, msg0);
+		ARM256_ROUNDS (40, msg2, msg3, msg0, msg1);
+		ARM256_ROUNDS (44, msg3, msg0, msg1, msg2);
+		ARM256_ROUNDS (48, msg0, msg1, msg2, msg3);
+		ARM256_ROUNDS (52, msg1, msg2, msg3, msg0);
+		ARM256_ROUNDS (56, msg2, msg3, msg0, msg1);
+		ARM256_ROUNDS (60, msg3, msg0, msg1, msg2);
+
+		abcd = vaddq_u32 (abcd, abcd_save);
+		efgh = vaddq_u32 (efgh, efgh_save);
+
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	vst1q_u32 (state + 0, abcd);
+	vst1q_u32 (state + 4, efgh);
+}
+
+#endif /* WITH_SHA_ARM */
+
+/* Resolving twice from racing threads gives the same answer */
+static sha256_transform_func sha256_resolved = NULL;
+
+static sha256_transform_func
+sha256_transform_accelerated (void)
+{
+#if defined(WITH_SHA_X86)
+	if (have_sha_x86 ())
+		return transform_sha256_x86;
+#elif defined(WITH_SHA_ARM)
+	if (have_sha_arm (HWCAP_SHA2))
+		return transform_sha256_arm;
+#endif
+	return NULL;
+}
+
+static sha256_transform_func
+sha256_transform_resolve (void)
+{
+	sha256_transform_func resolved = sha256_resolved;
+
+	if (resolved)
+		return resolved;
+
+	resolved = sha256_transform_accelerated ();
+	if (!resolved)
+		resolved = transform_sha256_portable;
+	sha256_resolved = resolved;
+	return resolved;
+}
+
+static void
+sha256_init (sha256_t *context)
+{
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	assert (context != NULL);
+
+	memcpy (context->state, initial, sizeof (initial));
+	context->count = 0;
+	context->transform = sha256_transform_resolve ();
+}
+
+static void
+sha256_update (sha256_t *context,
+               const unsigned char *data,
+               size_t len)
+{
+	size_t used;
+	size_t fill;
+	size_t blocks;
+
+	assert (context != NULL);
+	assert (data != NULL || len == 0);
+
+	used = context->count & (SHA256_BLOCK_LENGTH - 1);
+	context->count += len;
+
+	if (used > 0) {
+		fill = SHA256_BLOCK_LENGTH - used;
+		if (len < fill) {
+			memcpy (context->buffer + used, data, len);
+			return;
+		}
+		memcpy (context->buffer + used, data, fill);
+		(context->transform) (context->state, context->buffer, 1);
+		data += fill;
+		len -= fill;
+	}
+
+	blocks = len / SHA256_BLOCK_LENGTH;
+	if (blocks > 0) {
+		(context->transform) (context->state, data, blocks);
+		data += blocks * SHA256_BLOCK_LENGTH;
+		len -= blocks * SHA256_BLOCK_LENGTH;
+	}
+
+	if (len > 0)
+		memcpy (context->buffer, data, len);
+}
+
+static void
+sha256_final (sha256_t *context,
+              unsigned char *digest)
+{
+	uint64_t bits;
+	size_t used;
+	int i;
+
+	assert (context != NULL);
+	assert (digest != NULL);
+
+	bits = context->count << 3;
+	used = context->count & (SHA256_BLOCK_LENGTH - 1);
+
+	context->buffer[used++] = 0x80;
+	if (used > SHA256_BLOCK_LENGTH - 8) {
+		memset (context->buffer + used, 0, SHA256_BLOCK_LENGTH - used);
+		(context->transform) (context->state, context->buffer, 1);
+		used = 0;
+	}
+
+	memset (context->buffer + used, 0, SHA256_BLOCK_LENGTH - 8 - used);
+	for (i = 0; i < 8; i++)
+		context->buffer[SHA256_BLOCK_LENGTH - 1 - i] = (unsigned char)(bits >> (i * 8));
+	(context->transform) (context->state, context->buffer, 1);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = (unsigned char)(context->state[i >> 2] >> ((3 - (i & 3)) * 8));
+
+	memset (context, 0, sizeof (sha256_t));
+}
+
+bool
+p11_digest_transforms (int which)
+{
+	sha1_transform_func sha1;
+	sha256_transform_func sha256;
+
+	switch (which) {
+	case P11_DIGEST_DEFAULT:
+		sha1 = NULL;
+		sha256 = NULL;
+		break;
+	case P11_DIGEST_PORTABLE:
+		sha1 = transform_sha1_portable;
+		sha256 = transform_sha256_portable;
+		break;
+	case P11_DIGEST_ACCELERATED:
+		sha1 = sha1_transform_accelerated ();
+		sha256 = sha256_transform_accelerated ();
+		if (!sha1 || !sha256)
+			return false;
+		break;
+	default:
+		return_val_if_reached (false);
+	}
+
+	sha1_resolved = sha1;
+	sha256_resolved = sha256;
+	return true;
+}
+
+void
+p11_digest_sha256 (unsigned char *hash,
+                   const void *input,
+                   size_t length,
+                   ...)
+{
+	va_list va;
+	sha256_t sha256;
+
+#ifdef WITH_FREEBL
+	bool ret;
+
+	va_start (va, length);
+	ret = nss_slow_hash (HASH_AlgSHA256, hash, P11_DIGEST_SHA256_LEN, input, length, va);
+	va_end (va);
+
+	if (ret)
+		return;
+#endif
+
+	sha256_init (&sha256);
+
+	va_start (va, length);
+	while (input != NULL) {
+		sha256_update (&sha256, input, length);
+		input = va_arg (va, const void *);
+		if (input)
+			length = va_arg (va, size_t);
+	}
+	va_end (va);
+
+	sha256_final (&sha256, hash);
+}
+
 /*! \file
  * This code implements the MD5 message-digest algorithm.
  * The algorithm is due to Ron Rivest.  This code was
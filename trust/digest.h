@@ -41,6 +41,9 @@
  * The SHA-1 and MD5 digests here are used for checksums in legacy
  * protocols. We don't use them in cryptographic contexts at all.
  * These particular algorithms would be poor choices for that.
+ *
+ * SHA-256 is used for certificate fingerprints, which callers use to
+ * look up and deduplicate certificates.
  */
 
 #define P11_DIGEST_MD5_LEN 16
@@ -57,4 +60,25 @@ void     p11_digest_sha1    (unsigned char *hash,
                              size_t length,
                              ...) GNUC_NULL_TERMINATED;
 
+#define P11_DIGEST_SHA256_LEN 32
+
+void     p11_digest_sha256  (unsigned char *hash,
+                             const void *input,
+                             size_t length,
+                             ...) GNUC_NULL_TERMINATED;
+
+/*
+ * SHA-1 and SHA-256 each have a portable implementation, and one that
+ * uses the instructions of the CPU where it has them. Tests use this to
+ * check one against the other, and bench-digest to time them. It picks the ones used for digests begun
+ * from then on, and returns false if this machine can't run them.
+ */
+enum {
+	P11_DIGEST_DEFAULT,
+	P11_DIGEST_PORTABLE,
+	P11_DIGEST_ACCELERATED,
+};
+
+bool     p11_digest_transforms (int which);
+
 #endif /* P11_DIGEST_H_ */
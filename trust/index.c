@@ -91,9 +91,24 @@ struct _p11_index {
 	bool notifying;
 };
 
+/*
+ * The hash of an indexable attribute value, remembered along with the
+ * value it was computed from. Attribute values owned by the index are
+ * never modified in place, so the same pointer and length means the
+ * same value, as long as the previous value is still allocated.
+ */
+typedef struct {
+	CK_ATTRIBUTE_TYPE type;
+	void *value;
+	CK_ULONG length;
+	unsigned int hash;
+} index_hashed;
+
 typedef struct {
 	CK_OBJECT_HANDLE handle;
 	CK_ATTRIBUTE *attrs;
+	index_hashed *hashes;
+	int num_hashes;
 } index_object;
 
 static void
@@ -101,6 +116,7 @@ free_object (void *data)
 {
 	index_object *obj = data;
 	p11_attrs_free (obj->attrs);
+	free (obj->hashes);
 	free (obj);
 }
 
@@ -218,6 +234,7 @@ is_indexable (p11_index *index,
 	case CKA_OBJECT_ID:
 	case CKA_ID:
 	case CKA_X_ORIGIN:
+	case CKA_X_CERT_SHA256_HASH:
 		return true;
 	}
 
@@ -307,19 +324,61 @@ bucket_push (index_bucket *bucket,
 	return true;
 }
 
-static void
+static unsigned int
+cached_hash (index_object *obj,
+             CK_ATTRIBUTE *attr)
+{
+	int i;
+
+	for (i = 0; i < obj->num_hashes; i++) {
+		if (obj->hashes[i].type == attr->type &&
+		    obj->hashes[i].value == attr->pValue &&
+		    obj->hashes[i].length == attr->ulValueLen)
+			return obj->hashes[i].hash;
+	}
+
+	return p11_attr_hash (attr);
+}
+
+/*
+ * Must be called before the previous attribute values of the object
+ * are freed, so that cached hashes are only reused for live values.
+ */
+static CK_RV
 index_hash (p11_index *index,
-            index_object *obj)
+            index_object *obj,
+            CK_ATTRIBUTE *attrs)
 {
+	index_hashed *hashes;
 	unsigned int hash;
+	int num;
 	int i;
 
-	for (i = 0; !p11_attrs_terminator (obj->attrs + i); i++) {
-		if (is_indexable (index, obj->attrs[i].type)) {
-			hash = p11_attr_hash (obj->attrs + i);
+	for (i = 0, num = 0; !p11_attrs_terminator (attrs + i); i++) {
+		if (is_indexable (index, attrs[i].type))
+			num++;
+	}
+
+	hashes = num ? calloc (num, sizeof (index_hashed)) : NULL;
+	return_val_if_fail (num == 0 || hashes != NULL, CKR_HOST_MEMORY);
+
+	for (i = 0, num = 0; !p11_attrs_terminator (attrs + i); i++) {
+		if (is_indexable (index, attrs[i].type)) {
+			hash = cached_hash (obj, attrs + i);
 			bucket_insert (index->buckets + (hash % NUM_BUCKETS), obj->handle);
+
+			hashes[num].type = attrs[i].type;
+			hashes[num].value = attrs[i].pValue;
+			hashes[num].length = attrs[i].ulValueLen;
+			hashes[num].hash = hash;
+			num++;
 		}
 	}
+
+	free (obj->hashes);
+	obj->hashes = hashes;
+	obj->num_hashes = num;
+	return CKR_OK;
 }
 
 static void
@@ -348,7 +407,7 @@ merge_attrs (CK_ATTRIBUTE *output,
 
 static CK_RV
 index_build (p11_index *index,
-             CK_OBJECT_HANDLE handle,
+             index_object *obj,
              CK_ATTRIBUTE **attrs,
              CK_ATTRIBUTE *merge)
 {
@@ -395,7 +454,9 @@ index_build (p11_index *index,
 		assert (p11_attrs_terminator (built + count));
 	}
 
-	rv = index->store (index->data, index, handle, &built);
+	rv = index->store (index->data, index, obj->handle, &built);
+	if (rv == CKR_OK)
+		rv = index_hash (index, obj, built);
 
 	if (rv == CKR_OK) {
 		for (i = 0; stack && i < stack->num; i++)
@@ -519,7 +580,7 @@ p11_index_take (p11_index *index,
 
 	obj->handle = p11_module_next_id ();
 
-	rv = index_build (index, obj->handle, &obj->attrs, attrs);
+	rv = index_build (index, obj, &obj->attrs, attrs);
 	if (rv != CKR_OK) {
 		p11_attrs_free (attrs);
 		free (obj);
@@ -531,8 +592,6 @@ p11_index_take (p11_index *index,
 	if (!p11_dict_set (index->objects, &obj->handle, obj))
 		return_val_if_reached (CKR_HOST_MEMORY);
 
-	index_hash (index, obj);
-
 	if (handle)
 		*handle = obj->handle;
 
@@ -574,13 +633,12 @@ p11_index_update (p11_index *index,
 		return CKR_OBJECT_HANDLE_INVALID;
 	}
 
-	rv = index_build (index, obj->handle, &obj->attrs, update);
+	rv = index_build (index, obj, &obj->attrs, update);
 	if (rv != CKR_OK) {
 		p11_attrs_free (update);
 		return rv;
 	}
 
-	index_hash (index, obj);
 	index_notify (index, obj->handle, NULL);
 
 	return CKR_OK;
@@ -665,14 +723,13 @@ index_replacev (p11_index *index,
 					continue;
 				if (p11_attrs_matchn (replace[j], attr, 1)) {
 					attrs = NULL;
-					rv = index_build (index, obj->handle, &attrs, replace[j]);
+					rv = index_build (index, obj, &attrs, replace[j]);
 					if (rv != CKR_OK)
 						return rv;
 					p11_attrs_free (obj->attrs);
 					obj->attrs = attrs;
 					replace[j] = NULL;
 					handled = true;
-					index_hash (index, obj);
 					index_notify (index, obj->handle, NULL);
 					break;
 				}
@@ -769,6 +826,7 @@ static void
 index_select (p11_index *index,
               CK_ATTRIBUTE *match,
               CK_ULONG count,
+              const unsigned int *hashes,
               index_sink sink,
               void *data)
 {
@@ -784,7 +842,7 @@ index_select (p11_index *index,
 	/* First look for any matching buckets */
 	for (n = 0, num = 0; n < count && num < MAX_SELECT; n++) {
 		if (is_indexable (index, match[n].type)) {
-			hash = p11_attr_hash (match + n);
+			hash = hashes ? hashes[n] : p11_attr_hash (match + n);
 			selected[num] = index->buckets + (hash % NUM_BUCKETS);
 
 			/* If any index is empty, then obviously no match */
@@ -847,10 +905,35 @@ sink_one_match (p11_index *index,
 	return true;
 }
 
+void
+p11_index_hash_template (CK_ATTRIBUTE *match,
+                         int count,
+                         unsigned int *hashes)
+{
+	int i;
+
+	return_if_fail (hashes != NULL);
+
+	if (count < 0)
+		count = p11_attrs_count (match);
+
+	for (i = 0; i < count; i++)
+		hashes[i] = is_indexable (NULL, match[i].type) ? p11_attr_hash (match + i) : 0;
+}
+
 CK_OBJECT_HANDLE
 p11_index_find (p11_index *index,
                 CK_ATTRIBUTE *match,
                 int count)
+{
+	return p11_index_find_hashed (index, match, count, NULL);
+}
+
+CK_OBJECT_HANDLE
+p11_index_find_hashed (p11_index *index,
+                       CK_ATTRIBUTE *match,
+                       int count,
+                       const unsigned int *hashes)
 {
 	CK_OBJECT_HANDLE handle = 0UL;
 
@@ -859,7 +942,7 @@ p11_index_find (p11_index *index,
 	if (count < 0)
 		count = p11_attrs_count (match);
 
-	index_select (index, match, count, sink_one_match, &handle);
+	index_select (index, match, count, hashes, sink_one_match, &handle);
 	return handle;
 }
 
@@ -881,6 +964,15 @@ CK_OBJECT_HANDLE *
 p11_index_find_all (p11_index *index,
                     CK_ATTRIBUTE *match,
                     int count)
+{
+	return p11_index_find_all_hashed (index, match, count, NULL);
+}
+
+CK_OBJECT_HANDLE *
+p11_index_find_all_hashed (p11_index *index,
+                           CK_ATTRIBUTE *match,
+                           int count,
+                           const unsigned int *hashes)
 {
 	index_bucket handles = { NULL, 0 };
 
@@ -889,7 +981,7 @@ p11_index_find_all (p11_index *index,
 	if (count < 0)
 		count = p11_attrs_count (match);
 
-	index_select (index, match, count, sink_if_match, &handles);
+	index_select (index, match, count, hashes, sink_if_match, &handles);
 
 	/* Null terminate */
 	bucket_push (&handles, 0UL);
@@ -915,12 +1007,22 @@ p11_index_snapshot (p11_index *index,
                     CK_ULONG count)
 {
 	index_bucket handles = { NULL, 0 };
+	unsigned int *hashes = NULL;
 
 	return_val_if_fail (index != NULL, NULL);
 
-	index_select (index, attrs, count, sink_any, &handles);
+	/* Both indexes are selected with the same template, hash it once */
+	if (base && count > 0) {
+		hashes = reallocarray (NULL, count, sizeof (unsigned int));
+		return_val_if_fail (hashes != NULL, NULL);
+		p11_index_hash_template (attrs, count, hashes);
+	}
+
+	index_select (index, attrs, count, hashes, sink_any, &handles);
 	if (base)
-		index_select (base, attrs, count, sink_any, &handles);
+		index_select (base, attrs, count, hashes, sink_any, &handles);
+
+	free (hashes);
 
 	/* Null terminate */
 	bucket_push (&handles, 0UL);
@@ -119,6 +119,25 @@ CK_OBJECT_HANDLE * p11_index_find_all    (p11_index *index,
                                           CK_ATTRIBUTE *match,
                                           int count);
 
+/*
+ * Callers that look up the same template repeatedly can hash it once
+ * with p11_index_hash_template() and pass the result to the _hashed
+ * variants. @hashes has one entry per attribute in @match.
+ */
+void               p11_index_hash_template   (CK_ATTRIBUTE *match,
+                                              int count,
+                                              unsigned int *hashes);
+
+CK_OBJECT_HANDLE   p11_index_find_hashed     (p11_index *index,
+                                              CK_ATTRIBUTE *match,
+                                              int count,
+                                              const unsigned int *hashes);
+
+CK_OBJECT_HANDLE * p11_index_find_all_hashed (p11_index *index,
+                                              CK_ATTRIBUTE *match,
+                                              int count,
+                                              const unsigned int *hashes);
+
 CK_OBJECT_HANDLE * p11_index_snapshot    (p11_index *index,
                                           p11_index *base,
                                           CK_ATTRIBUTE *attrs,
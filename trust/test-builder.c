@@ -154,6 +154,8 @@ test_build_certificate (void)
 		{ CKA_CERTIFICATE_CATEGORY, &certificate_authority, sizeof (certificate_authority) },
 		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
 		{ CKA_CHECK_VALUE, "\xad\x7c\x3f", 3 },
+		{ CKA_X_CERT_SHA256_HASH, "\x4e\xdd\xe9\xe5\x5c\xa4\x53\xb3\x88\x88\x7c\xaa\x25\xd5\xc5\xc5"
+		                          "\xbc\xcf\x28\x91\xd7\x3b\x87\x49\x58\x08\x29\x3d\x5f\xac\x83\xc8", 32 },
 		{ CKA_START_DATE, "20110523", 8 },
 		{ CKA_END_DATE, "20210520", 8, },
 		{ CKA_SUBJECT, (void *)test_cacert3_ca_subject, sizeof (test_cacert3_ca_subject) },
@@ -1216,6 +1218,50 @@ test_create_but_loadable (void)
 	p11_attrs_free (attrs);
 }
 
+static void
+test_create_fingerprint (void)
+{
+	unsigned char fingerprint[P11_DIGEST_SHA256_LEN];
+
+	CK_ATTRIBUTE input[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_CERTIFICATE_TYPE, &x509, sizeof (x509) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_X_CERT_SHA256_HASH, fingerprint, sizeof (fingerprint) },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE *extra;
+	CK_RV rv;
+
+	p11_digest_sha256 (fingerprint, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), NULL);
+
+	p11_message_quiet ();
+
+	/* Callers never get to set the fingerprint, even a correct one */
+	extra = NULL;
+	rv = p11_builder_build (test.builder, test.index, NULL, input, &extra);
+	assert_num_eq (CKR_ATTRIBUTE_READ_ONLY, rv);
+	assert_ptr_eq (NULL, extra);
+
+	/* When loading it must match the certificate */
+	p11_index_load (test.index);
+
+	rv = p11_builder_build (test.builder, test.index, NULL, input, &extra);
+	assert_num_eq (CKR_OK, rv);
+	p11_attrs_free (extra);
+
+	fingerprint[0] ^= 0xff;
+	extra = NULL;
+	rv = p11_builder_build (test.builder, test.index, NULL, input, &extra);
+	assert_num_eq (CKR_ATTRIBUTE_VALUE_INVALID, rv);
+	assert_ptr_eq (NULL, extra);
+
+	p11_index_finish (test.index);
+
+	p11_message_loud ();
+}
+
 static void
 test_create_unsupported (void)
 {
@@ -2290,6 +2336,7 @@ main (int argc,
 
 	p11_test (test_create_not_settable, "/builder/create_not_settable");
 	p11_test (test_create_but_loadable, "/builder/create_but_loadable");
+	p11_test (test_create_fingerprint, "/builder/create_fingerprint");
 	p11_test (test_create_unsupported, "/builder/create_unsupported");
 	p11_test (test_create_generated, "/builder/create_generated");
 	p11_test (test_create_bad_attribute, "/builder/create_bad_attribute");
@@ -93,6 +93,151 @@ test_sha1_long (void)
 	free (input);
 }
 
+const char *sha256_input[] = {
+	"",
+	"abc",
+	"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	NULL
+};
+
+const char *sha256_checksum[] = {
+	"\xe3\xb0\xc4\x42\x98\xfc\x1c\x14\x9a\xfb\xf4\xc8\x99\x6f\xb9\x24"
+	"\x27\xae\x41\xe4\x64\x9b\x93\x4c\xa4\x95\x99\x1b\x78\x52\xb8\x55",
+	"\xba\x78\x16\xbf\x8f\x01\xcf\xea\x41\x41\x40\xde\x5d\xae\x22\x23"
+	"\xb0\x03\x61\xa3\x96\x17\x7a\x9c\xb4\x10\xff\x61\xf2\x00\x15\xad",
+	"\x24\x8d\x6a\x61\xd2\x06\x38\xb8\xe5\xc0\x26\x93\x0c\x3e\x60\x39"
+	"\xa3\x3c\xe4\x59\x64\xff\x21\x67\xf6\xec\xed\xd4\x19\xdb\x06\xc1",
+	NULL
+};
+
+static void
+test_sha256 (void)
+{
+	unsigned char checksum[P11_DIGEST_SHA256_LEN];
+	size_t len;
+	int i;
+
+	for (i = 0; sha256_input[i] != NULL; i++) {
+		memset (checksum, 0, sizeof (checksum));
+		len = strlen (sha256_input[i]);
+
+		p11_digest_sha256 (checksum, sha256_input[i], len, NULL);
+		assert (memcmp (sha256_checksum[i], checksum, P11_DIGEST_SHA256_LEN) == 0);
+
+		if (len > 6) {
+			p11_digest_sha256 (checksum, sha256_input[i], 6, sha256_input[i] + 6, len - 6, NULL);
+			assert (memcmp (sha256_checksum[i], checksum, P11_DIGEST_SHA256_LEN) == 0);
+		}
+	}
+}
+
+static void
+test_sha256_long (void)
+{
+	unsigned char checksum[P11_DIGEST_SHA256_LEN];
+	char *expected = "\xcd\xc7\x6e\x5c\x99\x14\xfb\x92\x81\xa1\xc7\xe2\x84\xd7\x3e\x67"
+	                 "\xf1\x80\x9a\x48\xa4\x97\x20\x0e\x04\x6d\x39\xcc\xc7\x11\x2c\xd0";
+	char *input;
+
+	input = malloc (1000000);
+	assert (input != NULL);
+	memset (input, 'a', 1000000);
+
+	p11_digest_sha256 (checksum, input, 1000000, NULL);
+	assert (memcmp (expected, checksum, P11_DIGEST_SHA256_LEN) == 0);
+
+	/* Same again, fed in uneven pieces */
+	p11_digest_sha256 (checksum, input, 1, input + 1, 63, input + 64, 65,
+	                   input + 129, 1000000 - 129, NULL);
+	assert (memcmp (expected, checksum, P11_DIGEST_SHA256_LEN) == 0);
+
+	free (input);
+}
+
+static void
+setup_transforms (void *which)
+{
+	if (!p11_digest_transforms (*(int *)which))
+		assert_skip ("not supported on this machine", NULL);
+}
+
+static void
+teardown_transforms (void *which)
+{
+	p11_digest_transforms (P11_DIGEST_DEFAULT);
+}
+
+static void
+test_sha1_vectors (void *which)
+{
+	test_sha1 ();
+	test_sha1_long ();
+}
+
+static void
+test_sha256_vectors (void *which)
+{
+	test_sha256 ();
+	test_sha256_long ();
+}
+
+static uint32_t
+xorshift (uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/*
+ * Digests random inputs of up to a few dozen blocks with the portable
+ * transform, and again in two pieces with the one being tested.
+ */
+static void
+check_transforms (void (* digest) (unsigned char *, const void *, size_t, ...),
+                  size_t hash_len,
+                  int which)
+{
+	unsigned char expected[P11_DIGEST_SHA256_LEN];
+	unsigned char checksum[P11_DIGEST_SHA256_LEN];
+	unsigned char data[4096];
+	uint32_t state = 0x2545f491;
+	size_t split;
+	size_t len;
+	size_t j;
+	int i;
+
+	assert (hash_len <= sizeof (checksum));
+
+	for (i = 0; i < 500; i++) {
+		len = xorshift (&state) % sizeof (data);
+		for (j = 0; j < len; j++)
+			data[j] = xorshift (&state);
+		split = xorshift (&state) % (len + 1);
+
+		p11_digest_transforms (P11_DIGEST_PORTABLE);
+		digest (expected, data, len, NULL);
+
+		p11_digest_transforms (which);
+		digest (checksum, data, split, data + split, len - split, NULL);
+
+		assert (memcmp (expected, checksum, hash_len) == 0);
+	}
+}
+
+static void
+test_sha1_transforms (void *which)
+{
+	check_transforms (p11_digest_sha1, P11_DIGEST_SHA1_LEN, *(int *)which);
+}
+
+static void
+test_sha256_transforms (void *which)
+{
+	check_transforms (p11_digest_sha256, P11_DIGEST_SHA256_LEN, *(int *)which);
+}
+
 const char *md5_input[] = {
 	"",
 	"a",
@@ -136,8 +281,21 @@ int
 main (int argc,
       char *argv[])
 {
+	static int portable = P11_DIGEST_PORTABLE;
+	static int accelerated = P11_DIGEST_ACCELERATED;
+
 	p11_test (test_sha1, "/digest/sha1");
 	p11_test (test_sha1_long, "/digest/sha1-long");
+	p11_test (test_sha256, "/digest/sha256");
+	p11_test (test_sha256_long, "/digest/sha256-long");
 	p11_test (test_md5, "/digest/md5");
+
+	p11_fixture (setup_transforms, teardown_transforms);
+	p11_testx (test_sha1_vectors, &portable, "/digest/sha1-portable");
+	p11_testx (test_sha1_vectors, &accelerated, "/digest/sha1-accelerated");
+	p11_testx (test_sha1_transforms, &accelerated, "/digest/sha1-transforms");
+	p11_testx (test_sha256_vectors, &portable, "/digest/sha256-portable");
+	p11_testx (test_sha256_vectors, &accelerated, "/digest/sha256-accelerated");
+	p11_testx (test_sha256_transforms, &accelerated, "/digest/sha256-transforms");
 	return p11_test_run (argc, argv);
 }
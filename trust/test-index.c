@@ -512,6 +512,86 @@ test_find_all (void)
 	assert (!handles_are (NULL, 0UL));
 }
 
+static void
+test_find_hashed (void)
+{
+	CK_ATTRIBUTE first[] = {
+		{ CKA_LABEL, "odd", 3 },
+		{ CKA_VALUE, "one", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE second[] = {
+		{ CKA_LABEL, "even", 4 },
+		{ CKA_VALUE, "two", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_LABEL, "odd", 3 },
+		{ CKA_VALUE, "one", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE extra = { CKA_APPLICATION, "test", 4 };
+	CK_ATTRIBUTE change = { CKA_LABEL, "even", 4 };
+
+	CK_OBJECT_HANDLE *check;
+	CK_OBJECT_HANDLE one;
+	CK_OBJECT_HANDLE two;
+	CK_OBJECT_HANDLE handle;
+	unsigned int hashes[2];
+	p11_array *array;
+	CK_RV rv;
+
+	p11_index_add (test.index, first, 2, &one);
+	p11_index_add (test.index, second, 2, &two);
+
+	p11_index_hash_template (match, -1, hashes);
+
+	handle = p11_index_find_hashed (test.index, match, -1, hashes);
+	assert_num_eq (one, handle);
+
+	check = p11_index_find_all_hashed (test.index, match + 1, 1, hashes + 1);
+	assert (handles_are (check, one, 0UL));
+	free (check);
+
+	/* The value keeps its cached hash, and is still found after the update */
+	rv = p11_index_update (test.index, one, p11_attrs_build (NULL, &change, NULL));
+	assert_num_eq (CKR_OK, rv);
+
+	check = p11_index_find_all_hashed (test.index, match + 1, 1, hashes + 1);
+	assert (handles_are (check, one, 0UL));
+	free (check);
+
+	handle = p11_index_find_hashed (test.index, match, -1, hashes);
+	assert_num_eq (0, handle);
+
+	/* The replacement is a new object, hashed anew */
+	rv = p11_index_replace (test.index, one, p11_attrs_buildn (NULL, first, 2));
+	assert_num_eq (CKR_OK, rv);
+
+	handle = p11_index_find_hashed (test.index, match, -1, hashes);
+	assert_num_cmp (handle, !=, 0);
+	assert_num_cmp (handle, !=, one);
+	one = handle;
+
+	/* Replaced by its label, the object keeps its handle and is still found */
+	array = p11_array_new (p11_attrs_free);
+	p11_array_push (array, p11_attrs_build (NULL, &first[0], &first[1], &extra, NULL));
+	rv = p11_index_replace_all (test.index, match + 1, CKA_LABEL, array);
+	assert_num_eq (CKR_OK, rv);
+	p11_array_free (array);
+
+	handle = p11_index_find_hashed (test.index, match, -1, hashes);
+	assert_num_eq (one, handle);
+	assert_ptr_not_null (p11_attrs_find (p11_index_lookup (test.index, one), CKA_APPLICATION));
+
+	check = p11_index_find_all_hashed (test.index, match + 1, 1, hashes + 1);
+	assert (handles_are (check, one, 0UL));
+	free (check);
+}
+
 static void
 test_find_realloc (void)
 {
@@ -1127,6 +1207,7 @@ main (int argc,
 	p11_test (test_update, "/index/update");
 	p11_test (test_find, "/index/find");
 	p11_test (test_find_all, "/index/find_all");
+	p11_test (test_find_hashed, "/index/find_hashed");
 	p11_test (test_find_realloc, "/index/find_realloc");
 	p11_test (test_replace_all, "/index/replace_all");
 
@@ -1076,6 +1076,59 @@ test_find_serial_der_decoded (void)
 	assert_num_eq (CKR_OK, rv);
 }
 
+static void
+test_find_sha256_hash (void)
+{
+	CK_OBJECT_CLASS klass = CKO_CERTIFICATE;
+	CK_CERTIFICATE_TYPE x509 = CKC_X_509;
+	unsigned char fingerprint[P11_DIGEST_SHA256_LEN];
+
+	CK_ATTRIBUTE object[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_CERTIFICATE_TYPE, &x509, sizeof (x509) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_X_CERT_SHA256_HASH, fingerprint, sizeof (fingerprint) },
+		{ CKA_INVALID }
+	};
+
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE handle;
+	CK_OBJECT_HANDLE check;
+	CK_ULONG count;
+	CK_RV rv;
+
+	p11_digest_sha256 (fingerprint, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), NULL);
+
+	rv = test.module->C_OpenSession (test.slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert_num_eq (CKR_OK, rv);
+
+	rv = test.module->C_CreateObject (session, object, 3, &handle);
+	assert_num_eq (CKR_OK, rv);
+
+	rv = test.module->C_FindObjectsInit (session, match, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = test.module->C_FindObjects (session, &check, 1, &count);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, count);
+	assert_num_eq (handle, check);
+	rv = test.module->C_FindObjectsFinal (session);
+	assert_num_eq (CKR_OK, rv);
+
+	/* A different fingerprint finds nothing */
+	fingerprint[0] ^= 0xff;
+	rv = test.module->C_FindObjectsInit (session, match, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = test.module->C_FindObjects (session, &check, 1, &count);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (0, count);
+	rv = test.module->C_FindObjectsFinal (session);
+	assert_num_eq (CKR_OK, rv);
+}
+
 static void
 test_find_serial_der_mismatch (void)
 {
@@ -1391,6 +1444,7 @@ main (int argc,
 	p11_test (test_session_setattr, "/module/session_setattr");
 	p11_test (test_find_serial_der_decoded, "/module/find_serial_der_decoded");
 	p11_test (test_find_serial_der_mismatch, "/module/find_serial_der_mismatch");
+	p11_test (test_find_sha256_hash, "/module/find_sha256_hash");
 	p11_test (test_login_logout, "/module/login_logout");
 
 	p11_fixture (setup_writable, teardown);